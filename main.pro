@@ -65,7 +65,7 @@ CONFIG *= ordered debug_and_release
 }
 
 !CONFIG(no-server) {
-  SUBDIRS *= src/murmur
+  SUBDIRS *= src/murmur src/murmur_render
 }
 
 DIST=LICENSE INSTALL README README.Linux CHANGES
@@ -0,0 +1,94 @@
+#!/usr/bin/env python
+# -*- coding: utf-8
+#
+# Stub authenticator for measuring login throughput. Every user is accepted
+# after an artificial delay, and the number of authentications answered per
+# second is printed. Pair it with a client load generator and compare the
+# results for different authconcurrency settings in murmur.ini.
+#
+# Usage: stubauth.py [delay in ms] [Ice proxy of Meta]
+
+import Ice, sys, time, threading
+Ice.loadSlice('', ['-I' + Ice.getSliceDir(), 'Murmur.ice'])
+import Murmur
+
+class Counter:
+    def __init__(self):
+      self.lock = threading.Lock()
+      self.count = 0
+      self.ids = {}
+
+    def add(self, name):
+      self.lock.acquire()
+      self.count += 1
+      if not self.ids.has_key(name):
+        self.ids[name] = len(self.ids) + 1
+      id = self.ids[name]
+      self.lock.release()
+      return id
+
+    def take(self):
+      self.lock.acquire()
+      count = self.count
+      self.count = 0
+      self.lock.release()
+      return count
+
+class StubAuthenticatorI(Murmur.ServerAuthenticator):
+    def __init__(self, delay, counter):
+      self.delay = delay
+      self.counter = counter
+
+    def authenticate(self, name, pw, certlist, certhash, strong, current=None):
+      if (self.delay > 0):
+        time.sleep(self.delay)
+      # Offset ids so they never clash with local registrations.
+      return (1000000000 + self.counter.add(name), name, ("stub",))
+
+    def getInfo(self, id, current=None):
+      return (False, {})
+
+    def nameToId(self, name, current=None):
+      return -2
+
+    def idToName(self, id, current=None):
+      return None
+
+    def idToTexture(self, id, current=None):
+      return []
+
+if __name__ == "__main__":
+    delay = 0.05
+    if (len(sys.argv) > 1):
+      delay = float(sys.argv[1]) / 1000.0
+    proxy = 'Meta:tcp -h 127.0.0.1 -p 6502'
+    if (len(sys.argv) > 2):
+      proxy = sys.argv[2]
+
+    # Enough dispatch threads that the delay does not serialize requests.
+    props = Ice.createProperties()
+    props.setProperty('Ice.ThreadPool.Server.Size', '64')
+    props.setProperty('Ice.ThreadPool.Server.SizeMax', '64')
+    data = Ice.InitializationData()
+    data.properties = props
+    ice = Ice.initialize(data)
+
+    meta = Murmur.MetaPrx.checkedCast(ice.stringToProxy(proxy))
+
+    adapter = ice.createObjectAdapterWithEndpoints("Callback.Client", "tcp -h 127.0.0.1")
+    adapter.activate()
+
+    counter = Counter()
+    for server in meta.getBootedServers():
+      auth = Murmur.ServerAuthenticatorPrx.uncheckedCast(adapter.addWithUUID(StubAuthenticatorI(delay, counter)))
+      server.setAuthenticator(auth)
+
+    print 'Answering with %d ms delay (press CTRL-C to abort)' % (delay * 1000)
+    try:
+      while True:
+        time.sleep(1)
+        print '%d authentications/s' % counter.take()
+    except KeyboardInterrupt:
+      print 'CTRL-C caught, aborting'
+
+    ice.shutdown()
@@ -36,6 +36,7 @@
 #include "User.h"
 
 #ifdef MURMUR
+#include "ACLCache.h"
 #include "ServerUser.h"
 #endif
 
@@ -72,15 +73,12 @@ QFlags<ChanACL::Perm> ChanACL::effectivePermissions(ServerUser *p, Channel *chan
 	}
 
 	Permissions granted = 0;
+	int generation = 0;
 
 	if (cache) {
-		QHash<Channel *, Permissions> *h = cache->value(p);
-		if (h)
-			granted = h->value(chan);
-	}
-
-	if (granted & Cached) {
-		return granted;
+		generation = cache->generation(p);
+		if (cache->lookup(p, chan->iId, generation, granted))
+			return granted;
 	}
 
 	QStack<Channel *> chanstack;
@@ -145,12 +143,8 @@ QFlags<ChanACL::Perm> ChanACL::effectivePermissions(ServerUser *p, Channel *chan
 			granted |= Kick|Ban|Register|SelfRegister;
 	}
 
-	if (cache) {
-		if (! cache->contains(p))
-			cache->insert(p, new QHash<Channel *, Permissions>);
-
-		cache->value(p)->insert(chan, granted | Cached);
-	}
+	if (cache)
+		cache->store(p, chan->iId, generation, granted);
 
 	return granted;
 }
@@ -34,6 +34,7 @@
 #include <QtCore/QHash>
 #include <QtCore/QObject>
 
+class ACLCache;
 class Channel;
 class User;
 class ServerUser;
@@ -69,9 +70,6 @@ class ChanACL : public QObject {
 
 		Q_DECLARE_FLAGS(Permissions, Perm)
 
-		typedef QHash<Channel *, Permissions> ChanCache;
-		typedef QHash<User *, ChanCache * > ACLCache;
-
 		Channel *c;
 		bool bApplyHere;
 		bool bApplySubs;
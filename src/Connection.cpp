@@ -41,6 +41,10 @@
 #include "Message.h"
 #include "Mumble.pb.h"
 
+#ifdef MURMUR
+#include "Metrics.h"
+#endif
+
 
 #ifdef Q_OS_WIN
 HANDLE Connection::hQoS = NULL;
@@ -155,6 +159,11 @@ void Connection::socketRead() {
 		iPacketLength = -1;
 		iAvailable -= iPacketLength;
 
+#ifdef MURMUR
+		Metrics::count(Metrics::TcpMessages);
+		Metrics::count(Metrics::TcpBytes, qbaBuffer.size());
+#endif
+
 		emit message(uiType, qbaBuffer);
 	}
 }
@@ -217,6 +226,10 @@ void Connection::forceFlush() {
 	setsockopt(qtsSocket->socketDescriptor(), IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char *>(&nodelay), sizeof(nodelay));
 }
 
+qint64 Connection::bytesToWrite() const {
+	return qtsSocket->bytesToWrite();
+}
+
 void Connection::disconnectSocket(bool force) {
 	if (qtsSocket->state() == QAbstractSocket::UnconnectedState) {
 		emit connectionClosed(QAbstractSocket::UnknownSocketError, QString());
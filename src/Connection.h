@@ -89,6 +89,7 @@ class Connection : public QObject {
 		void sendMessage(const QByteArray &qbaMsg);
 		void disconnectSocket(bool force=false);
 		void forceFlush();
+		qint64 bytesToWrite() const;
 		int activityTime() const;
 		void resetActivityTime();
 
@@ -70,7 +70,7 @@
 
 class MessageHandler {
 	public:
-		enum UDPMessageType { UDPVoiceCELTAlpha, UDPPing, UDPVoiceSpeex, UDPVoiceCELTBeta, UDPVoiceOpus };
+		enum UDPMessageType { UDPVoiceCELTAlpha, UDPPing, UDPVoiceSpeex, UDPVoiceCELTBeta, UDPVoiceOpus, UDPVoiceOpusTier };
 
 #define MUMBLE_MH_MSG(x) x,
 		enum MessageType {
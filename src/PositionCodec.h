@@ -0,0 +1,172 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_POSITIONCODEC_H_
+#define MUMBLE_POSITIONCODEC_H_
+
+#include "PacketDataStream.h"
+
+/*
+ * Compact encoding of the position at the end of voice packets, used instead
+ * of three raw floats when both ends announced support for it.
+ *
+ * Positions are quantized to centimeters. A keyframe (header byte 0x80 | id)
+ * carries the absolute position, other frames (header byte id) the difference
+ * to keyframe id. All values are zigzag encoded varints, so a talker standing
+ * still costs four bytes per packet. Deltas are against the last keyframe
+ * rather than the last frame, so a lost packet never corrupts later ones; a
+ * lost keyframe leaves the position unknown until the next one.
+ */
+
+class PositionEncoder {
+	private:
+		Q_DISABLE_COPY(PositionEncoder)
+	protected:
+		int iKey[3];
+		unsigned int uiKeyId;
+		unsigned int uiFrames;
+		bool bKey;
+	public:
+		// Frames between keyframes, and the largest delta worth sending.
+		static const unsigned int uiKeyInterval = 32;
+		static const int iMaxDelta = 8191;
+
+		static int quantize(float v) {
+			if (!(v == v))
+				return 0;
+			if (v > 1.0e7f)
+				v = 1.0e7f;
+			else if (v < -1.0e7f)
+				v = -1.0e7f;
+			return (v >= 0.0f) ? static_cast<int>(v * 100.0f + 0.5f) : static_cast<int>(v * 100.0f - 0.5f);
+		}
+
+		static unsigned int zigzag(int v) {
+			return (static_cast<unsigned int>(v) << 1) ^ static_cast<unsigned int>(v >> 31);
+		}
+
+		static void encodeKey(PacketDataStream &pds, unsigned int id, const int *q) {
+			pds.append(0x80 | (id & 0x7f));
+			for (int i=0;i<3;++i)
+				pds << zigzag(q[i]);
+		}
+
+		PositionEncoder() : uiKeyId(0), uiFrames(0), bKey(false) {
+			iKey[0] = iKey[1] = iKey[2] = 0;
+		}
+
+		// Makes the next frame a keyframe, e.g. at the start of a transmission.
+		void reset() {
+			bKey = false;
+		}
+
+		void encode(PacketDataStream &pds, const float *pos) {
+			int q[3] = { quantize(pos[0]), quantize(pos[1]), quantize(pos[2]) };
+			int d[3] = { q[0] - iKey[0], q[1] - iKey[1], q[2] - iKey[2] };
+
+			bool key = ! bKey || (uiFrames >= uiKeyInterval);
+			for (int i=0;i<3;++i)
+				if ((d[i] > iMaxDelta) || (d[i] < -iMaxDelta))
+					key = true;
+
+			if (key) {
+				uiKeyId = (uiKeyId + 1) & 0x7f;
+				iKey[0] = q[0];
+				iKey[1] = q[1];
+				iKey[2] = q[2];
+				uiFrames = 0;
+				bKey = true;
+				encodeKey(pds, uiKeyId, q);
+			} else {
+				++uiFrames;
+				pds.append(uiKeyId);
+				for (int i=0;i<3;++i)
+					pds << zigzag(d[i]);
+			}
+		}
+};
+
+class PositionDecoder {
+	private:
+		Q_DISABLE_COPY(PositionDecoder)
+	protected:
+		int iKey[3];
+		unsigned int uiKeyId;
+		bool bKey;
+	public:
+		static int unzigzag(unsigned int v) {
+			return static_cast<int>(v >> 1) ^ -static_cast<int>(v & 1);
+		}
+
+		PositionDecoder() : uiKeyId(0), bKey(false) {
+			iKey[0] = iKey[1] = iKey[2] = 0;
+		}
+
+		void reset() {
+			bKey = false;
+		}
+
+		// Reads one position. Returns false if the stream is invalid or the
+		// frame refers to a keyframe that never arrived.
+		bool decode(PacketDataStream &pds, float *pos) {
+			int q[3];
+			if (! decodeQuantized(pds, q))
+				return false;
+			for (int i=0;i<3;++i)
+				pos[i] = static_cast<float>(q[i]) / 100.0f;
+			return true;
+		}
+
+		// As above, but yields the quantized position.
+		bool decodeQuantized(PacketDataStream &pds, int *q) {
+			unsigned int head = pds.next8();
+			unsigned int v[3];
+			pds >> v[0];
+			pds >> v[1];
+			pds >> v[2];
+			if (! pds.isValid())
+				return false;
+
+			if (head & 0x80) {
+				uiKeyId = head & 0x7f;
+				bKey = true;
+				for (int i=0;i<3;++i)
+					iKey[i] = unzigzag(v[i]);
+			} else if (! bKey || (head != uiKeyId)) {
+				return false;
+			}
+
+			for (int i=0;i<3;++i)
+				q[i] = (head & 0x80) ? iKey[i] : iKey[i] + unzigzag(v[i]);
+			return true;
+		}
+};
+
+#endif
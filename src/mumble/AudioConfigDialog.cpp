@@ -128,6 +128,8 @@ void AudioInputDialog::load(const Settings &r) {
 	loadCheckBox(qcbPushWindow, r.bShowPTTButtonWindow);
 	loadCheckBox(qcbPushClick, r.bTxAudioCue);
 	loadSlider(qsQuality, r.iQuality);
+	loadCheckBox(qcbOpusFEC, r.bOpusFEC);
+	loadCheckBox(qcbOpusDTX, r.bOpusDTX);
 	if (r.iNoiseSuppress != 0)
 		loadSlider(qsNoise, - r.iNoiseSuppress);
 	else
@@ -148,6 +150,8 @@ void AudioInputDialog::load(const Settings &r) {
 
 void AudioInputDialog::save() const {
 	s.iQuality = qsQuality->value();
+	s.bOpusFEC = qcbOpusFEC->isChecked();
+	s.bOpusDTX = qcbOpusDTX->isChecked();
 	s.iNoiseSuppress = (qsNoise->value() == 14) ? 0 : - qsNoise->value();
 	s.iMinLoudness = 18000 - qsAmp->value() + 2000;
 	s.iVoiceHold = qsTransmitHold->value();
@@ -189,6 +193,8 @@ bool AudioInputDialog::expert(bool b) {
 	qliFrames->setVisible(b);
 	qsFrames->setVisible(b);
 	qlFrames->setVisible(b);
+	qcbOpusFEC->setVisible(b);
+	qcbOpusDTX->setVisible(b);
 	qswTransmit->setVisible(b);
 	qliIdle->setVisible(b);
 	qsbIdle->setVisible(b);
@@ -462,6 +468,7 @@ void AudioOutputDialog::load(const Settings &r) {
 	loadSlider(qsMaxDistVolume, iroundf(r.fAudioMaxDistVolume * 100.0f + 0.5f));
 	loadSlider(qsBloom, iroundf(r.fAudioBloom * 100.0f + 0.5f));
 	loadCheckBox(qcbHeadphones, r.bPositionalHeadphone);
+	loadCheckBox(qcbBinaural, r.bPositionalBinaural);
 	loadCheckBox(qcbPositional, r.bPositionalAudio);
 
 	qsOtherVolume->setEnabled(r.bAttenuateOthersOnTalk || r.bAttenuateOthers);
@@ -485,6 +492,7 @@ void AudioOutputDialog::save() const {
 	s.fAudioBloom = static_cast<float>(qsBloom->value()) / 100.0f;
 	s.bPositionalAudio = qcbPositional->isChecked();
 	s.bPositionalHeadphone = qcbHeadphones->isChecked();
+	s.bPositionalBinaural = qcbBinaural->isChecked();
 	s.bExclusiveOutput = qcbExclusive->isChecked();
 
 
@@ -112,6 +112,22 @@ AudioInput::AudioInput() : opusBuffer(g.s.iFramesPerPacket * (SAMPLE_RATE / 100)
 #ifdef USE_OPUS
 	opusState = opus_encoder_create(SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP, NULL);
 	opus_encoder_ctl(opusState, OPUS_SET_VBR(0)); // CBR
+
+	foreach(const QVariant &v, g.s.qlOpusTiers) {
+		int quality = v.toInt();
+		if ((quality < 6000) || (quality >= g.s.iQuality) || (qlOpusTierStates.count() >= 3))
+			continue;
+
+		OpusEncoder *oe = opus_encoder_create(SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP, NULL);
+		if (! oe)
+			continue;
+		opus_encoder_ctl(oe, OPUS_SET_VBR(0));
+		opus_encoder_ctl(oe, OPUS_SET_BITRATE(quality));
+
+		qlOpusTierStates << oe;
+		qlOpusTierQuality << quality;
+		qWarning("AudioInput: Opus tier %d at %d bits/s", qlOpusTierStates.count(), quality);
+	}
 #endif
 
 	qWarning("AudioInput: %d bits/s, %d hz, %d sample", iAudioQuality, iSampleRate, iFrameSize);
@@ -166,6 +182,9 @@ AudioInput::~AudioInput() {
 #ifdef USE_OPUS
 	if (opusState)
 		opus_encoder_destroy(opusState);
+
+	foreach(OpusEncoder *oe, qlOpusTierStates)
+		opus_encoder_destroy(oe);
 #endif
 
 	if (ceEncoder) {
@@ -666,6 +685,7 @@ bool AudioInput::selectCodec() {
 	if (umtType != previousType) {
 		iBufferedFrames = 0;
 		qlFrames.clear();
+		qlTierFrames.clear();
 		opusBuffer.clear();
 	}
 
@@ -680,6 +700,19 @@ int AudioInput::encodeOpusFrame(short *source, int size, unsigned char *buffer)
 
 	opus_encoder_ctl(opusState, OPUS_SET_BITRATE(iAudioQuality));
 
+	int loss = 0;
+	if (g.s.bOpusFEC) {
+		ServerHandlerPtr sh = g.sh;
+		if (sh)
+			loss = sh->iUplinkLoss;
+	}
+	opus_encoder_ctl(opusState, OPUS_SET_INBAND_FEC(loss > 0 ? 1 : 0));
+	opus_encoder_ctl(opusState, OPUS_SET_PACKET_LOSS_PERC(loss));
+
+	// Frames inside the voice hold window are usually near silent; let the
+	// encoder collapse them instead of padding them out to the CBR rate.
+	opus_encoder_ctl(opusState, OPUS_SET_DTX((g.s.bOpusDTX && (iHoldFrames > 0)) ? 1 : 0));
+
 	len = opus_encode(opusState, source, size, buffer, 512);
 	const int tenMsFrameCount = (size / iFrameSize);
 	iBitrate = (len * 100 * 8) / tenMsFrameCount;
@@ -687,6 +720,58 @@ int AudioInput::encodeOpusFrame(short *source, int size, unsigned char *buffer)
 	return len;
 }
 
+/**
+ * Checks whether the lower quality Opus tiers should be sent alongside the
+ * regular stream. Tiers are only useful to a server that says in ServerSync
+ * that it can pick between them, and are dropped entirely if they would push
+ * us over the server's bandwidth limit.
+ */
+bool AudioInput::transmitOpusTiers() const {
+	if (qlOpusTierStates.isEmpty() || (g.s.lmLoopMode != Settings::None))
+		return false;
+
+	ServerHandlerPtr sh = g.sh;
+	if (! sh || ! sh->bOpusTiers)
+		return false;
+
+	if (g.iMaxBandwidth == -1)
+		return true;
+
+	int bw = getNetworkBandwidth(iAudioQuality, iAudioFrames);
+	foreach(int quality, qlOpusTierQuality) {
+		if (quality >= iAudioQuality)
+			return false;
+		// Each tier repeats the whole packet overhead, plus one byte for the tier index.
+		bw += getNetworkBandwidth(quality, iAudioFrames) + (800 / iAudioFrames);
+	}
+
+	return (bw <= g.iMaxBandwidth);
+}
+
+void AudioInput::encodeOpusTiers(short *source, int size) {
+	qlTierFrames.clear();
+#ifdef USE_OPUS
+	if (! transmitOpusTiers())
+		return;
+
+	unsigned char buffer[512];
+	foreach(OpusEncoder *oe, qlOpusTierStates) {
+		if (!bPreviousVoice)
+			opus_encoder_ctl(oe, OPUS_RESET_STATE, NULL);
+		opus_encoder_ctl(oe, OPUS_SET_DTX((g.s.bOpusDTX && (iHoldFrames > 0)) ? 1 : 0));
+
+		int len = opus_encode(oe, source, size, buffer, 512);
+		if (len > 0)
+			qlTierFrames << QByteArray(reinterpret_cast<const char *>(buffer), len);
+		else
+			qlTierFrames << QByteArray();
+	}
+#else
+	Q_UNUSED(source);
+	Q_UNUSED(size);
+#endif
+}
+
 int AudioInput::encodeCELTFrame(short *psSource, unsigned char *buffer) {
 	int len = 0;
 	if (!cCodec)
@@ -869,6 +954,8 @@ void AudioInput::encodeAudioFrame() {
 			}
 
 			len = encodeOpusFrame(&opusBuffer[0], iBufferedFrames * iFrameSize, buffer);
+			if (len > 0)
+				encodeOpusTiers(&opusBuffer[0], iBufferedFrames * iFrameSize);
 			opusBuffer.clear();
 			if (len <= 0) {
 				iBitrate = 0;
@@ -950,15 +1037,58 @@ void AudioInput::flushCheck(const QByteArray &frame, bool terminator) {
 		}
 	}
 
-	if (g.s.bTransmitPosition && g.p && ! g.bCenterPosition && g.p->fetch()) {
-		pds << g.p->fPosition[0];
-		pds << g.p->fPosition[1];
-		pds << g.p->fPosition[2];
+	// Encode the position once; the tiers below carry the same one.
+	char posbuff[32];
+	PacketDataStream ppos(posbuff, sizeof(posbuff));
+	Plugins::PositionalData pd;
+	bool position = g.s.bTransmitPosition && g.p && ! g.bCenterPosition && g.p->positionalData(pd);
+	if (position) {
+		ServerHandlerPtr sh = g.sh;
+		if (sh && sh->bCompactPosition) {
+			peEncoder.encode(ppos, pd.fPosition);
+		} else {
+			ppos << pd.fPosition[0];
+			ppos << pd.fPosition[1];
+			ppos << pd.fPosition[2];
+		}
+		pds.append(posbuff, ppos.size());
 	}
+	if (terminator)
+		peEncoder.reset();
 
 	sendAudioFrame(data, pds);
 
 	Q_ASSERT(qlFrames.isEmpty());
+
+	// Lower quality tiers of the same frame. These carry the tier index in front of
+	// the regular Opus payload, and the server forwards at most one tier of each
+	// frame to every listener, rewritten as a plain Opus packet.
+	if ((umtType == MessageHandler::UDPVoiceOpus) && ! qlTierFrames.isEmpty()) {
+		ServerHandlerPtr sh = g.sh;
+		for (int i = 0; sh && (i < qlTierFrames.count()); ++i) {
+			const QByteArray &qba = qlTierFrames.at(i);
+			if (qba.isEmpty())
+				continue;
+
+			data[0] = static_cast<unsigned char>((flags & 0x1f) | (MessageHandler::UDPVoiceOpusTier << 5));
+
+			PacketDataStream tpds(data + 1, 1023);
+			tpds << i + 1;
+			tpds << iFrameCounter - frames;
+
+			int size = qba.size();
+			if (terminator)
+				size |= 1 << 13;
+			tpds << size;
+			tpds.append(qba.constData(), qba.size());
+
+			if (position)
+				tpds.append(posbuff, ppos.size());
+
+			sh->sendMessage(data, tpds.size() + 1);
+		}
+		qlTierFrames.clear();
+	}
 }
 
 bool AudioInput::isAlive() const {
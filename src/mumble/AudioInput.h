@@ -44,6 +44,7 @@
 #include "Settings.h"
 #include "Timer.h"
 #include "Message.h"
+#include "PositionCodec.h"
 
 class AudioInput;
 class CELTCodec;
@@ -99,6 +100,14 @@ class AudioInput : public QThread {
 		OpusEncoder *opusState;
 		bool selectCodec();
 		int encodeOpusFrame(short *source, int size, unsigned char *buffer);
+
+		// Additional Opus encoders for the lower quality tiers, one
+		// persistent state per configured bitrate.
+		QList<OpusEncoder *> qlOpusTierStates;
+		QList<int> qlOpusTierQuality;
+		QList<QByteArray> qlTierFrames;
+		bool transmitOpusTiers() const;
+		void encodeOpusTiers(short *source, int size);
 		int encodeSpeexFrame(short *pSource, unsigned char *buffer);
 		int encodeCELTFrame(short *pSource, unsigned char *buffer);
 	protected:
@@ -148,6 +157,7 @@ class AudioInput : public QThread {
 		int iBufferedFrames;
 
 		QList<QByteArray> qlFrames;
+		PositionEncoder peEncoder;
 		void flushCheck(const QByteArray &, bool terminator);
 
 		void initializeMixer();
@@ -124,40 +124,18 @@ AudioOutput::~AudioOutput() {
 	delete [] bSpeakerPositional;
 }
 
-// Here's the theory.
-// We support sound "bloom"ing. That is, if sound comes directly from the left, if it is sufficiently
-// close, we'll hear it full intensity from the left side, and "bloom" intensity from the right side.
+Spatializer::Params AudioOutput::spatialParams() {
+	Spatializer::Params p;
+	p.fMinDistance = g.s.fAudioMinDistance;
+	p.fMaxDistance = g.s.fAudioMaxDistance;
+	p.fMaxDistVolume = g.s.fAudioMaxDistVolume;
+	p.fBloom = g.s.fAudioBloom;
+	p.bBinaural = g.s.bPositionalBinaural;
+	return p;
+}
 
 float AudioOutput::calcGain(float dotproduct, float distance) {
-
-	float dotfactor = (dotproduct + 1.0f) / 2.0f;
-	float att;
-
-
-	// No distance attenuation
-	if (g.s.fAudioMaxDistVolume > 0.99f) {
-		att = qMin(1.0f, dotfactor + g.s.fAudioBloom);
-	} else if (distance < g.s.fAudioMinDistance) {
-		float bloomfac = g.s.fAudioBloom * (1.0f - distance/g.s.fAudioMinDistance);
-
-		att = qMin(1.0f, bloomfac + dotfactor);
-	} else {
-		float datt;
-
-		if (distance >= g.s.fAudioMaxDistance) {
-			datt = g.s.fAudioMaxDistVolume;
-		} else {
-			float mvol = g.s.fAudioMaxDistVolume;
-			if (mvol < 0.01f)
-				mvol = 0.01f;
-
-			float drel = (distance-g.s.fAudioMinDistance) / (g.s.fAudioMaxDistance - g.s.fAudioMinDistance);
-			datt = powf(10.0f, log10f(mvol) * drel);
-		}
-
-		att = datt * dotfactor;
-	}
-	return att;
+	return Spatializer::gain(spatialParams(), dotproduct, distance);
 }
 
 void AudioOutput::wipe() {
@@ -351,6 +329,7 @@ void AudioOutput::initializeMixer(const unsigned int *chanmasks, bool forceheadp
 			}
 		}
 	}
+	spSpatializer.setSpeakers(iChannels, fSpeakers, bSpeakerPositional, g.s.bPositionalHeadphone || forceheadphone, iMixerFreq);
 	iSampleSize = static_cast<int>(iChannels * ((eSampleFormat == SampleFloat) ? sizeof(float) : sizeof(short)));
 	qWarning("AudioOutput: Initialized %d channel %d hz mixer", iChannels, iMixerFreq);
 }
@@ -387,7 +366,6 @@ bool AudioOutput::mix(void *outbuff, unsigned int nsamp) {
 	}
 
 	if (! qlMix.isEmpty()) {
-		STACKVAR(float, speaker, iChannels*3);
 		STACKVAR(float, svol, iChannels);
 
 		STACKVAR(float, fOutput, iChannels * nsamp);
@@ -397,77 +375,63 @@ bool AudioOutput::mix(void *outbuff, unsigned int nsamp) {
 		memset(output, 0, sizeof(float) * nsamp * iChannels);
 
 		boost::shared_array<float> recbuff;
-		if (recorder) {
-			recbuff = boost::shared_array<float>(new float[nsamp]);
-			memset(recbuff.get(), 0, sizeof(float) * nsamp);
-		}
+		if (recorder)
+			recbuff = recorder->getBuffer(nsamp);
 
 		for (unsigned int i=0;i<iChannels;++i)
 			svol[i] = mul * fSpeakerVolume[i];
 
-		if (g.s.bPositionalAudio && (iChannels > 1) && g.p->fetch() && (g.bPosTest || g.p->fCameraPosition[0] != 0 || g.p->fCameraPosition[1] != 0 || g.p->fCameraPosition[2] != 0)) {
-
-			float front[3] = { g.p->fCameraFront[0], g.p->fCameraFront[1], g.p->fCameraFront[2] };
-			float top[3] = { g.p->fCameraTop[0], g.p->fCameraTop[1], g.p->fCameraTop[2] };
-
-			// Front vector is dominant; if it's zero we presume all is zero.
-
-			float flen = sqrtf(front[0]*front[0]+front[1]*front[1]+front[2]*front[2]);
-
-			if (flen > 0.0f) {
-				front[0] *= (1.0f / flen);
-				front[1] *= (1.0f / flen);
-				front[2] *= (1.0f / flen);
+		Plugins::PositionalData pd;
+		if (g.s.bPositionalAudio && (iChannels > 1) && g.p->positionalData(pd, true) && (g.bPosTest || pd.fCameraPosition[0] != 0 || pd.fCameraPosition[1] != 0 || pd.fCameraPosition[2] != 0)) {
+			spSpatializer.setListener(pd.fCameraPosition, pd.fCameraFront, pd.fCameraTop, spatialParams());
+			validListener = true;
+		}
 
-				float tlen = sqrtf(top[0]*top[0]+top[1]*top[1]+top[2]*top[2]);
+		const unsigned int generation = spSpatializer.generation();
+		const bool binaural = validListener && spSpatializer.binaural();
+
+		if (validListener) {
+			// Gather the sources that moved, or all of them if the listener
+			// changed, and recalculate their gains in one batch.
+			QVarLengthArray<AudioOutputUser *, 64> qvlStale;
+			foreach(AudioOutputUser *aop, qlMix) {
+				if ((aop->fPos[0] == 0.0f) && (aop->fPos[1] == 0.0f) && (aop->fPos[2] == 0.0f))
+					continue;
+				if (aop->pfGain && (aop->uiGainGeneration == generation) && (aop->fGainPos[0] == aop->fPos[0]) && (aop->fGainPos[1] == aop->fPos[1]) && (aop->fGainPos[2] == aop->fPos[2]))
+					continue;
+				qvlStale.append(aop);
+			}
 
-				if (tlen > 0.0f) {
-					top[0] *= (1.0f / tlen);
-					top[1] *= (1.0f / tlen);
-					top[2] *= (1.0f / tlen);
-				} else {
-					top[0] = 0.0f;
-					top[1] = 1.0f;
-					top[2] = 0.0f;
+			const unsigned int nstale = static_cast<unsigned int>(qvlStale.count());
+			if (nstale) {
+				STACKVAR(float, px, nstale);
+				STACKVAR(float, py, nstale);
+				STACKVAR(float, pz, nstale);
+				STACKVAR(float, delays, nstale);
+				STACKVAR(float, gains, nstale * nchan);
+
+				for (unsigned int i=0;i<nstale;++i) {
+					px[i] = qvlStale[i]->fPos[0];
+					py[i] = qvlStale[i]->fPos[1];
+					pz[i] = qvlStale[i]->fPos[2];
+					delays[i] = 0.0f;
 				}
 
-				if (std::abs<float>(front[0] * top[0] + front[1] * top[1] + front[2] * top[2]) > 0.01f) {
-					// Not perpendicular. Assume Y up and rotate 90 degrees.
-
-					float azimuth = 0.0f;
-					if ((front[0] != 0.0f) || (front[2] != 0.0f))
-						azimuth = atan2f(front[2], front[0]);
-					float inclination = acosf(front[1]) - static_cast<float>(M_PI) / 2.0f;
+				spSpatializer.compute(nstale, px, py, pz, gains, delays);
 
-					top[0] = sinf(inclination)*cosf(azimuth);
-					top[1] = cosf(inclination);
-					top[2] = sinf(inclination)*sinf(azimuth);
+				for (unsigned int i=0;i<nstale;++i) {
+					AudioOutputUser *aop = qvlStale[i];
+					if (! aop->pfGain)
+						aop->pfGain = new float[nchan];
+					for (unsigned int s=0;s<nchan;++s)
+						aop->pfGain[s] = gains[s * nstale + i];
+					aop->fGainDelay = delays[i];
+					aop->fGainPos[0] = aop->fPos[0];
+					aop->fGainPos[1] = aop->fPos[1];
+					aop->fGainPos[2] = aop->fPos[2];
+					aop->uiGainGeneration = generation;
 				}
-			} else {
-				front[0] = 0.0f;
-				front[1] = 0.0f;
-				front[2] = 1.0f;
-
-				top[0] = 0.0f;
-				top[1] = 1.0f;
-				top[2] = 0.0f;
 			}
-
-			// Calculate right vector as front X top
-			float right[3] = {top[1]*front[2] - top[2]*front[1], top[2]*front[0] - top[0]*front[2], top[0]*front[1] - top[1] * front[0] };
-
-			/*
-						qWarning("Front: %f %f %f", front[0], front[1], front[2]);
-						qWarning("Top: %f %f %f", top[0], top[1], top[2]);
-						qWarning("Right: %f %f %f", right[0], right[1], right[2]);
-			*/
-			// Rotate speakers to match orientation
-			for (unsigned int i=0;i<iChannels;++i) {
-				speaker[3*i+0] = fSpeakers[3*i+0] * right[0] + fSpeakers[3*i+1] * top[0] + fSpeakers[3*i+2] * front[0];
-				speaker[3*i+1] = fSpeakers[3*i+0] * right[1] + fSpeakers[3*i+1] * top[1] + fSpeakers[3*i+2] * front[1];
-				speaker[3*i+2] = fSpeakers[3*i+0] * right[2] + fSpeakers[3*i+1] * top[2] + fSpeakers[3*i+2] * front[2];
-			}
-			validListener = true;
 		}
 
 		foreach(AudioOutputUser *aop, qlMix) {
@@ -500,8 +464,7 @@ bool AudioOutput::mix(void *outbuff, unsigned int nsamp) {
 							// this should be unreachable
 							Q_ASSERT(false);
 						}
-						recbuff = boost::shared_array<float>(new float[nsamp]);
-						memset(recbuff.get(), 0, sizeof(float) * nsamp);
+						recbuff = recorder->getBuffer(nsamp);
 					}
 
 					// Don't add the local audio to the real output
@@ -512,36 +475,41 @@ bool AudioOutput::mix(void *outbuff, unsigned int nsamp) {
 			}
 
 			if (validListener && ((aop->fPos[0] != 0.0f) || (aop->fPos[1] != 0.0f) || (aop->fPos[2] != 0.0f))) {
-				float dir[3] = { aop->fPos[0] - g.p->fCameraPosition[0], aop->fPos[1] - g.p->fCameraPosition[1], aop->fPos[2] - g.p->fCameraPosition[2] };
-				float len = sqrtf(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
-				if (len > 0.0f) {
-					dir[0] /= len;
-					dir[1] /= len;
-					dir[2] /= len;
-				}
-				/*
-								qWarning("Voice pos: %f %f %f", aop->fPos[0], aop->fPos[1], aop->fPos[2]);
-								qWarning("Voice dir: %f %f %f", dir[0], dir[1], dir[2]);
-				*/
 				if (! aop->pfVolume) {
 					aop->pfVolume = new float[nchan];
 					for (unsigned int s=0;s<nchan;++s)
 						aop->pfVolume[s] = -1.0;
 				}
+
+				float delay = 0.0f;
+				if (binaural) {
+					if (! aop->pfHistory) {
+						aop->pfHistory = new float[Spatializer::iHistory];
+						memset(aop->pfHistory, 0, sizeof(float) * Spatializer::iHistory);
+					}
+					delay = qBound(aop->fDelay - Spatializer::fDelaySlew, aop->fGainDelay, aop->fDelay + Spatializer::fDelaySlew);
+				}
+
 				for (unsigned int s=0;s<nchan;++s) {
-					const float dot = bSpeakerPositional[s] ? dir[0] * speaker[s*3+0] + dir[1] * speaker[s*3+1] + dir[2] * speaker[s*3+2] : 1.0f;
-					const float str = svol[s] * calcGain(dot, len) * volumeAdjustment;
+					const float str = svol[s] * aop->pfGain[s] * volumeAdjustment;
 					float * RESTRICT o = output + s;
 					const float old = (aop->pfVolume[s] >= 0.0f) ? aop->pfVolume[s] : str;
 					const float inc = (str - old) / static_cast<float>(nsamp);
 					aop->pfVolume[s] = str;
-					/*
-										qWarning("%d: Pos %f %f %f : Dot %f Len %f Str %f", s, speaker[s*3+0], speaker[s*3+1], speaker[s*3+2], dot, len, str);
-					*/
-					if ((old >= 0.00000001f) || (str >= 0.00000001f))
+
+					if ((old < 0.00000001f) && (str < 0.00000001f))
+						continue;
+
+					const float olddelay = binaural ? spSpatializer.channelDelay(s, aop->fDelay) : 0.0f;
+					const float newdelay = binaural ? spSpatializer.channelDelay(s, delay) : 0.0f;
+
+					if ((olddelay > 0.0f) || (newdelay > 0.0f))
+						Spatializer::mixDelayed(o, nchan, pfBuffer, aop->pfHistory, nsamp, olddelay, newdelay, old, str);
+					else
 						for (unsigned int i=0;i<nsamp;++i)
 							o[i*nchan] += pfBuffer[i] * (old + inc*static_cast<float>(i));
 				}
+				aop->fDelay = delay;
 			} else {
 				for (unsigned int s=0;s<nchan;++s) {
 					const float str = svol[s] * volumeAdjustment;
@@ -549,7 +517,11 @@ bool AudioOutput::mix(void *outbuff, unsigned int nsamp) {
 					for (unsigned int i=0;i<nsamp;++i)
 						o[i*nchan] += pfBuffer[i] * str;
 				}
+				aop->fDelay = 0.0f;
 			}
+
+			if (aop->pfHistory)
+				Spatializer::updateHistory(aop->pfHistory, pfBuffer, nsamp);
 		}
 
 		if (recorder && recorder->getMixDown()) {
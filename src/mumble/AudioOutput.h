@@ -65,6 +65,7 @@
 
 #include "Audio.h"
 #include "Message.h"
+#include "Spatializer.h"
 
 class AudioOutput;
 class ClientUser;
@@ -102,6 +103,8 @@ class AudioOutput : public QThread {
 		float *fSpeakers;
 		float *fSpeakerVolume;
 		bool *bSpeakerPositional;
+		Spatializer spSpatializer;
+		static Spatializer::Params spatialParams();
 	protected:
 		enum { SampleShort, SampleFloat } eSampleFormat;
 		volatile bool bRunning;
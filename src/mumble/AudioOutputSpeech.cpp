@@ -38,6 +38,8 @@
 #include "ClientUser.h"
 #include "Global.h"
 #include "PacketDataStream.h"
+#include "PlayoutBuffer.h"
+#include "ServerHandler.h"
 
 #ifdef USE_OPUS
 #include "opus.h"
@@ -102,6 +104,12 @@ AudioOutputSpeech::AudioOutputSpeech(ClientUser *user, unsigned int freq, Messag
 	int margin = g.s.iJitterBufferSize * iFrameSize;
 	jitter_buffer_ctl(jbJitter, JITTER_BUFFER_SET_MARGIN, &margin);
 
+	pbPlayout = NULL;
+#ifdef USE_OPUS
+	if (umtType == MessageHandler::UDPVoiceOpus)
+		pbPlayout = new PlayoutBuffer(&p->psPlayout, g.s.iJitterBufferSize, g.s.iJitterPercentile);
+#endif
+
 	fFadeIn = new float[iFrameSize];
 	fFadeOut = new float[iFrameSize];
 
@@ -126,6 +134,7 @@ AudioOutputSpeech::~AudioOutputSpeech() {
 		speex_resampler_destroy(srs);
 
 	jitter_buffer_destroy(jbJitter);
+	delete pbPlayout;
 
 	delete [] fFadeIn;
 	delete [] fFadeOut;
@@ -198,7 +207,101 @@ void AudioOutputSpeech::addFrameToBuffer(const QByteArray &qbaPacket, unsigned i
 		}
 #endif
 
-		jitter_buffer_put(jbJitter, &jbp);
+		if (pbPlayout)
+			pbPlayout->put(qbaPacket, iSeq, samples / iFrameSize);
+		else
+			jitter_buffer_put(jbJitter, &jbp);
+	}
+}
+
+int AudioOutputSpeech::decodePlayout(float *pOut, bool &nextalive) {
+	QByteArray qba;
+	unsigned int frames = 1;
+	bool starting;
+	PlayoutBuffer::Action action;
+
+	{
+		QMutexLocker lock(&qmJitter);
+		starting = ! pbPlayout->isPlaying();
+		action = pbPlayout->get(qba, frames);
+	}
+
+	if (action == PlayoutBuffer::Wait) {
+		memset(pOut, 0, iFrameSize * sizeof(float));
+		if (++iMissCount > 50)
+			nextalive = false;
+		return iFrameSize;
+	}
+
+	QByteArray payload;
+	if (action != PlayoutBuffer::Conceal) {
+		PacketDataStream pds(qba.constData(), qba.size());
+
+		unsigned char flags = static_cast<unsigned char>(pds.next());
+		int size;
+		pds >> size;
+		payload = pds.dataBlock(size & 0x1fff);
+
+		if (action == PlayoutBuffer::Play) {
+			ucFlags = flags;
+			bHasTerminator = size & 0x2000;
+
+			readPosition(pds);
+		}
+	}
+
+	int decodedSamples = -1;
+#ifdef USE_OPUS
+	if (action == PlayoutBuffer::Play)
+		decodedSamples = opus_decode_float(opusState, reinterpret_cast<const unsigned char *>(payload.constData()), payload.size(), pOut, iAudioBufferSize, 0);
+	else if (action == PlayoutBuffer::Recover)
+		decodedSamples = opus_decode_float(opusState, reinterpret_cast<const unsigned char *>(payload.constData()), payload.size(), pOut, frames * iFrameSize, 1);
+	else
+		decodedSamples = opus_decode_float(opusState, NULL, 0, pOut, iFrameSize, 0);
+#endif
+	if (decodedSamples <= 0) {
+		memset(pOut, 0, iFrameSize * sizeof(float));
+		decodedSamples = iFrameSize;
+	}
+
+	if (action == PlayoutBuffer::Conceal) {
+		if (++iMissCount > 10)
+			nextalive = false;
+	} else {
+		iMissCount = 0;
+		if ((action == PlayoutBuffer::Play) && bHasTerminator)
+			nextalive = false;
+	}
+
+	if (! nextalive) {
+		for (unsigned int i=0;i<iFrameSize;++i)
+			pOut[i] *= fFadeOut[i];
+	} else if (starting) {
+		for (unsigned int i=0;i<iFrameSize;++i)
+			pOut[i] *= fFadeIn[i];
+	}
+
+	return decodedSamples;
+}
+
+/**
+ * Reads the position at the end of a voice packet, if any. A compact
+ * position that refers to a keyframe we never got leaves the last known
+ * position in place.
+ */
+void AudioOutputSpeech::readPosition(PacketDataStream &pds) {
+	if (! pds.left()) {
+		fPos[0] = fPos[1] = fPos[2] = 0.0f;
+		return;
+	}
+
+	ServerHandlerPtr sh = g.sh;
+	if (sh && sh->bCompactPosition) {
+		pdPosition.decode(pds, fPos);
+	} else {
+		pds >> fPos[0];
+		pds >> fPos[1];
+		pds >> fPos[2];
 	}
 }
 
@@ -223,6 +326,12 @@ bool AudioOutputSpeech::needSamples(unsigned int snum) {
 
 		if (! bLastAlive) {
 			memset(pOut, 0, iFrameSize * sizeof(float));
+		} else if (pbPlayout) {
+			if (p == &LoopUser::lpLoopy) {
+				LoopUser::lpLoopy.fetchFrames();
+			}
+
+			decodedSamples = decodePlayout(pOut, nextalive);
 		} else {
 			if (p == &LoopUser::lpLoopy) {
 				LoopUser::lpLoopy.fetchFrames();
@@ -277,13 +386,7 @@ bool AudioOutputSpeech::needSamples(unsigned int snum) {
 						} while ((header & 0x80) && pds.isValid());
 					}
 
-					if (pds.left()) {
-						pds >> fPos[0];
-						pds >> fPos[1];
-						pds >> fPos[2];
-					} else {
-						fPos[0] = fPos[1] = fPos[2] = 0.0f;
-					}
+					readPosition(pds);
 
 					if (p) {
 						float a = static_cast<float>(avail);
@@ -42,9 +42,11 @@
 
 #include "AudioOutputUser.h"
 #include "Message.h"
+#include "PositionCodec.h"
 
 class CELTCodec;
 class ClientUser;
+class PlayoutBuffer;
 struct OpusDecoder;
 
 class AudioOutputSpeech : public AudioOutputUser {
@@ -74,6 +76,10 @@ class AudioOutputSpeech : public AudioOutputUser {
 		JitterBuffer *jbJitter;
 		int iMissCount;
 
+		// Used instead of jbJitter for Opus.
+		PlayoutBuffer *pbPlayout;
+		int decodePlayout(float *pOut, bool &nextalive);
+
 		CELTCodec *cCodec;
 		CELTDecoder *cdDecoder;
 
@@ -85,6 +91,9 @@ class AudioOutputSpeech : public AudioOutputUser {
 		QList<QByteArray> qlFrames;
 
 		unsigned char ucFlags;
+
+		PositionDecoder pdPosition;
+		void readPosition(PacketDataStream &pds);
 	public:
 		MessageHandler::UDPMessageType umtType;
 		int iMissedFrames;
@@ -38,11 +38,19 @@ AudioOutputUser::AudioOutputUser(const QString& name) : qsName(name) {
 	pfBuffer = NULL;
 	pfVolume = NULL;
 	fPos[0]=fPos[1]=fPos[2]=0.0;
+	pfGain = NULL;
+	fGainPos[0]=fGainPos[1]=fGainPos[2]=0.0;
+	fGainDelay = 0.0f;
+	uiGainGeneration = 0;
+	fDelay = 0.0f;
+	pfHistory = NULL;
 }
 
 AudioOutputUser::~AudioOutputUser() {
 	delete [] pfBuffer;
 	delete [] pfVolume;
+	delete [] pfGain;
+	delete [] pfHistory;
 }
 
 void AudioOutputUser::resizeBuffer(unsigned int newsize) {
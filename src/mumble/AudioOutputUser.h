@@ -48,6 +48,17 @@ class AudioOutputUser : public QObject {
 		float *pfBuffer;
 		float *pfVolume;
 		float fPos[3];
+
+		// Spatial gains per speaker, valid while fPos and the spatializer
+		// generation match what they were computed for.
+		float *pfGain;
+		float fGainPos[3];
+		float fGainDelay;
+		unsigned int uiGainGeneration;
+		// Interaural delay currently applied, and the input history it reads from.
+		float fDelay;
+		float *pfHistory;
+
 		virtual bool needSamples(unsigned int snum) = 0;
 };
 
@@ -33,6 +33,7 @@
 #include "AudioStats.h"
 
 #include "AudioInput.h"
+#include "ClientUser.h"
 #include "Global.h"
 #include "smallft.h"
 
@@ -322,9 +323,41 @@ AudioStats::AudioStats(QWidget *p) : QDialog(p) {
 AudioStats::~AudioStats() {
 }
 
+void AudioStats::updatePlayout() {
+	QMap<QString, PlayoutSummary> stats;
+	{
+		QReadLocker lock(&ClientUser::c_qrwlUsers);
+		foreach(ClientUser *cu, ClientUser::c_qmUsers) {
+			PlayoutSummary ps = cu->psPlayout.summary();
+			if (ps.uiJitter || ps.fDelay > 0.0f)
+				stats.insert(cu->qsName, ps);
+		}
+	}
+
+	while (qtwPlayout->topLevelItemCount() > stats.count())
+		delete qtwPlayout->takeTopLevelItem(qtwPlayout->topLevelItemCount() - 1);
+	while (qtwPlayout->topLevelItemCount() < stats.count())
+		qtwPlayout->addTopLevelItem(new QTreeWidgetItem());
+
+	int row = 0;
+	QMap<QString, PlayoutSummary>::const_iterator i;
+	for (i = stats.constBegin(); i != stats.constEnd(); ++i, ++row) {
+		const PlayoutSummary &ps = i.value();
+		QTreeWidgetItem *item = qtwPlayout->topLevelItem(row);
+		item->setText(0, i.key());
+		item->setText(1, tr("%1 ms").arg(ps.fDelay, 0, 'f', 0));
+		item->setText(2, tr("%1 ms").arg(ps.uiJitter / 1000));
+		item->setText(3, QString::number(ps.uiLate));
+		item->setText(4, QString::number(ps.uiConcealed));
+		item->setText(5, QString::number(ps.uiRecovered));
+	}
+}
+
 void AudioStats::on_Tick_timeout() {
 	AudioInputPtr ai = g.ai;
 
+	updatePlayout();
+
 	if (ai.get() == NULL || ! ai->sppPreprocess)
 		return;
 
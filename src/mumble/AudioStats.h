@@ -89,6 +89,7 @@ class AudioStats : public QDialog, public Ui::AudioStats {
 	public:
 		AudioStats(QWidget *parent);
 		~AudioStats();
+		void updatePlayout();
 	public slots:
 		void on_Tick_timeout();
 };
@@ -36,6 +36,7 @@
 #include "User.h"
 #include "Timer.h"
 #include "Settings.h"
+#include "PlayoutBuffer.h"
 
 class ClientUser : public QObject, public User {
 	private:
@@ -55,6 +56,7 @@ class ClientUser : public QObject, public User {
 
 		float fPowerMin, fPowerMax;
 		float fAverageAvailable;
+		PlayoutStats psPlayout;
 
 #ifdef REPORT_JITTER
 		QMutex qmTiming;
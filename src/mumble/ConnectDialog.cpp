@@ -42,6 +42,7 @@
 #include "Database.h"
 #include "Global.h"
 #include "ServerHandler.h"
+#include "TreeSort.h"
 #include "WebFetch.h"
 
 QMap<QString, QIcon> ServerItem::qmIcons;
@@ -49,6 +50,11 @@ QList<PublicInfo> ConnectDialog::qlPublicServers;
 QString ConnectDialog::qsUserCountry, ConnectDialog::qsUserCountryCode, ConnectDialog::qsUserContinentCode;
 Timer ConnectDialog::tPublicServers;
 
+// Number of hostname lookups kept in flight at once.
+static const int iDNSParallel = 16;
+// Upper bound on ping queue entries examined per tick, so large collapsed lists stay cheap.
+static const int iPingScanLimit = 512;
+
 
 PingStats::PingStats() {
 	init();
@@ -162,6 +168,7 @@ void ServerView::fixupName(ServerItem *si) {
 	} while (found);
 
 	si->qsName = cmpname;
+	si->qsSortName.clear();
 }
 
 bool ServerView::dropMimeData(QTreeWidgetItem *, int, const QMimeData *mime, Qt::DropAction) {
@@ -448,7 +455,10 @@ QVariant ServerItem::data(int column, int role) const {
 				case 0:
 					return qsName;
 				case 1:
-					return (dPing > 0.0) ? QString::number(uiPing) : QVariant();
+					// Until the first reply arrives, show the ping remembered from the last session.
+					if (dPing > 0.0)
+						return QString::number(uiPing);
+					return uiPingSort ? QString::number(uiPingSort) : QVariant();
 				case 2:
 					return uiUsers ? QString::fromLatin1("%1/%2").arg(uiUsers).arg(uiMaxUsers) : QVariant();
 			}
@@ -522,7 +532,7 @@ void ServerItem::hideCheck() {
 
 	if (! bParent && (itType == PublicType)) {
 		if (g.s.ssFilter == Settings::ShowReachable)
-			hide = (dPing == 0.0);
+			hide = (dPing == 0.0) && (uiPingSort == 0);
 		else if (g.s.ssFilter == Settings::ShowPopulated)
 			hide = (uiUsers == 0);
 	}
@@ -530,10 +540,22 @@ void ServerItem::hideCheck() {
 		if (hide)
 			siParent->removeChild(this);
 		else
-			siParent->addChild(this);
+			siParent->insertChild(TreeSort::insertIndex(siParent, this, siParent->sortOrder()), this);
 	}
 }
 
+Qt::SortOrder ServerItem::sortOrder() const {
+	const QTreeWidget *w = treeWidget();
+	return w ? w->header()->sortIndicatorOrder() : Qt::AscendingOrder;
+}
+
+// Sorting is disabled on the view, so items whose sort key may have changed move themselves.
+void ServerItem::resort() {
+	QTreeWidget *w = treeWidget();
+	if (w && (w->sortColumn() > 0))
+		TreeSort::reposition(this, sortOrder());
+}
+
 void ServerItem::setDatas(double elapsed, quint32 users, quint32 maxusers) {
 	if (elapsed == 0.0) {
 		emitDataChanged();
@@ -549,6 +571,7 @@ void ServerItem::setDatas(double elapsed, quint32 users, quint32 maxusers) {
 	uiRecv = static_cast<quint32>(boost::accumulators::count(* asQuantile));
 
 	bool changed = (ping != uiPing) || (users != uiUsers) || (maxusers != uiMaxUsers);
+	const quint32 oldsort = uiPingSort;
 
 	uiUsers = users;
 	uiMaxUsers = maxusers;
@@ -562,6 +585,8 @@ void ServerItem::setDatas(double elapsed, quint32 users, quint32 maxusers) {
 
 	if (changed)
 		emitDataChanged();
+	if (changed || (uiPingSort != oldsort))
+		resort();
 }
 
 FavoriteServer ServerItem::toFavoriteServer() const {
@@ -686,13 +711,11 @@ bool ServerItem::operator <(const QTreeWidgetItem &o) const {
 	}
 
 	if (column == 0) {
-		QString a = qsName.toLower();
-		QString b = other.qsName.toLower();
-
-		QRegExp re(QLatin1String("[^0-9a-z]"));
-		a.remove(re);
-		b.remove(re);
-		return a < b;
+		if (qsSortName.isEmpty())
+			qsSortName = qsName.toLower().remove(QRegExp(QLatin1String("[^0-9a-z]")));
+		if (other.qsSortName.isEmpty())
+			other.qsSortName = other.qsName.toLower().remove(QRegExp(QLatin1String("[^0-9a-z]")));
+		return qsSortName < other.qsSortName;
 	} else if (column == 1) {
 		quint32 a = uiPingSort ? uiPingSort : UINT_MAX;
 		quint32 b = other.uiPingSort ? other.uiPingSort : UINT_MAX;
@@ -800,16 +823,21 @@ ConnectDialog::ConnectDialog(QWidget *p, bool autoconnect) : QDialog(p), bAutoCo
 	connect(qpbEdit, SIGNAL(clicked()), qaFavoriteEdit, SIGNAL(triggered()));
 	qdbbButtonBox->addButton(qpbEdit, QDialogButtonBox::ActionRole);
 	
+	// Sorting is handled by OnSortChanged and ServerItem::resort, as letting QTreeWidget
+	// re-sort the whole tree on every insertion doesn't scale to the public list.
 	qtwServers->sortItems(1, Qt::AscendingOrder);
+	qtwServers->header()->setSortIndicatorShown(true);
 
 #if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
 	qtwServers->header()->setSectionResizeMode(0, QHeaderView::Stretch);
 	qtwServers->header()->setSectionResizeMode(1, QHeaderView::ResizeToContents);
 	qtwServers->header()->setSectionResizeMode(2, QHeaderView::ResizeToContents);
+	qtwServers->header()->setSectionsClickable(true);
 #else
 	qtwServers->header()->setResizeMode(0, QHeaderView::Stretch);
 	qtwServers->header()->setResizeMode(1, QHeaderView::ResizeToContents);
 	qtwServers->header()->setResizeMode(2, QHeaderView::ResizeToContents);
+	qtwServers->header()->setClickable(true);
 #endif
 
 	connect(qtwServers->header(), SIGNAL(sortIndicatorChanged(int, Qt::SortOrder)), this, SLOT(OnSortChanged(int, Qt::SortOrder)));
@@ -882,6 +910,7 @@ ConnectDialog::ConnectDialog(QWidget *p, bool autoconnect) : QDialog(p), bAutoCo
 		qtwServers->siPublic->setExpanded(true);
 
 	iPingIndex = -1;
+	dPingBudget = 0.0;
 	qtPingTick->start(50);
 
 	new QShortcut(QKeySequence(QKeySequence::Copy), this, SLOT(on_qaFavoriteCopy_triggered()));
@@ -891,6 +920,9 @@ ConnectDialog::ConnectDialog(QWidget *p, bool autoconnect) : QDialog(p), bAutoCo
 	bLastFound = false;
 
 	qmPingCache = Database::getPingCache();
+	foreach(ServerItem *si, qlItems)
+		if (! si->uiPingSort)
+			si->uiPingSort = qmPingCache.value(QPair<QString, unsigned short>(si->qsHostname, si->usPort));
 
 	if (! g.s.qbaConnectDialogGeometry.isEmpty())
 		restoreGeometry(g.s.qbaConnectDialogGeometry);
@@ -902,8 +934,8 @@ ConnectDialog::~ConnectDialog() {
 	ServerItem::qmIcons.clear();
 
 	QList<FavoriteServer> ql;
-	qmPingCache.clear();
 
+	// Servers that weren't pinged this time keep their previous entry.
 	foreach(ServerItem *si, qlItems) {
 		if (si->uiPing)
 			qmPingCache.insert(QPair<QString, unsigned short>(si->qsHostname, si->usPort), si->uiPing);
@@ -945,13 +977,16 @@ void ConnectDialog::accept() {
 	QDialog::accept();
 }
 
-void ConnectDialog::OnSortChanged(int logicalIndex, Qt::SortOrder) {
-	if (logicalIndex == 2)
+void ConnectDialog::OnSortChanged(int logicalIndex, Qt::SortOrder order) {
+	if (logicalIndex == 1)
 		foreach(ServerItem *si, qlItems)
 			if (si->uiPing && (si->uiPing != si->uiPingSort)) {
 				si->uiPingSort = si->uiPing;
 				si->setDatas();
 			}
+
+	// Sort the model directly; QTreeWidget::sortItems would set the indicator and signal us again.
+	qtwServers->model()->sort(logicalIndex, order);
 }
 
 void ConnectDialog::on_qaFavoriteAdd_triggered() {
@@ -1028,6 +1063,7 @@ void ConnectDialog::on_qaFavoriteEdit_triggered() {
 	if (cde->exec() == QDialog::Accepted) {
 
 		si->qsName = cde->qsName;
+		si->qsSortName.clear();
 		si->qsUsername = cde->qsUsername;
 		si->qsPassword = cde->qsPassword;
 		if ((cde->qsHostname != host) || (cde->usPort != si->usPort)) {
@@ -1050,6 +1086,8 @@ void ConnectDialog::on_qaFavoriteEdit_triggered() {
 			startDns(si);
 		}
 		si->setDatas();
+		if (qtwServers->sortColumn() == 0)
+			TreeSort::reposition(si, si->sortOrder());
 	}
 	delete cde;
 }
@@ -1236,23 +1274,28 @@ void ConnectDialog::fillList() {
 	QList<QTreeWidgetItem *> ql;
 	QList<QTreeWidgetItem *> qlNew;
 
+	QHash<QPair<QString, unsigned short>, QList<ServerItem *> > qhKnown;
+	foreach(ServerItem *si, qlItems)
+		qhKnown[QPair<QString, unsigned short>(si->qsHostname, si->usPort)] << si;
+
 	foreach(const PublicInfo &pi, qlPublicServers) {
 		bool found = false;
-		foreach(ServerItem *si, qlItems) {
-			if ((pi.qsIp == si->qsHostname) && (pi.usPort == si->usPort)) {
-				si->qsCountry = pi.qsCountry;
-				si->qsCountryCode = pi.qsCountryCode;
-				si->qsContinentCode = pi.qsContinentCode;
-				si->qsUrl = pi.quUrl.toString();
-				si->bCA = pi.bCA;
-				si->setDatas();
-
-				if (si->itType == ServerItem::PublicType)
-					found = true;
-			}
+		foreach(ServerItem *si, qhKnown.value(QPair<QString, unsigned short>(pi.qsIp, pi.usPort))) {
+			si->qsCountry = pi.qsCountry;
+			si->qsCountryCode = pi.qsCountryCode;
+			si->qsContinentCode = pi.qsContinentCode;
+			si->qsUrl = pi.quUrl.toString();
+			si->bCA = pi.bCA;
+			si->setDatas();
+
+			if (si->itType == ServerItem::PublicType)
+				found = true;
+		}
+		if (! found) {
+			ServerItem *si = new ServerItem(pi);
+			si->uiPingSort = qmPingCache.value(QPair<QString, unsigned short>(si->qsHostname, si->usPort));
+			ql << si;
 		}
-		if (! found)
-			ql << new ServerItem(pi);
 	}
 
 	while (! ql.isEmpty()) {
@@ -1287,19 +1330,28 @@ void ConnectDialog::timeTick() {
 		}
 	}
 
-	// Start DNS Lookup of first unknown hostname
+	// Keep up to iDNSParallel lookups of unknown hostnames in flight
+	QStringList qslStart;
 	foreach(const QString &host, qlDNSLookup) {
-		if (qsDNSActive.contains(host))
-			continue;
+		if (qsDNSActive.count() + qslStart.count() >= iDNSParallel)
+			break;
+		if (! qsDNSActive.contains(host))
+			qslStart << host;
+	}
 
+	foreach(const QString &host, qslStart) {
 		qlDNSLookup.removeAll(host);
 		qlDNSLookup.append(host);
 
 		qsDNSActive.insert(host);
 		QHostInfo::lookupHost(host, this, SLOT(lookedUp(QHostInfo)));
-		break;
 	}
 
+	// Refill the ping budget. Only a tenth of a second worth of packets may accumulate,
+	// so a stalled event loop doesn't turn into a burst.
+	const double rate = static_cast<double>(qMax(g.s.iPingRate, 1));
+	dPingBudget = qMin(dPingBudget + static_cast<double>(tPingBudget.restart()) * rate / 1000000.0, qMax(rate / 10.0, 4.0));
+
 	ServerItem *current = static_cast<ServerItem *>(qtwServers->currentItem());
 	ServerItem *hover = static_cast<ServerItem *>(qtwServers->itemAt(qtwServers->viewport()->mapFromGlobal(QCursor::pos())));
 
@@ -1322,38 +1374,91 @@ void ConnectDialog::timeTick() {
 		}
 	}
 
-	if (!si) {
-		if (qlItems.isEmpty())
-			return;
+	// The selected and hovered servers are pinged regardless of the budget, but still pay for it.
+	if (si) {
+		if (si == current)
+			tCurrent.restart();
+		if (si == hover)
+			tHover.restart();
+
+		foreach(const QHostAddress &host, si->qlAddresses) {
+			sendPing(host, si->usPort);
+			dPingBudget -= 1.0;
+		}
+	}
 
-		bool expanded;
+	// Spend the rest of the budget walking the ping queue, skipping addresses whose
+	// items are all in collapsed branches. A full round is started at most once a second.
+	int scanned = 0;
+	while ((dPingBudget >= 1.0) && (scanned < qMin(qlPingQueue.count(), iPingScanLimit))) {
+		++scanned;
+		++iPingIndex;
+		if (iPingIndex >= qlPingQueue.count()) {
+			if (! tRestart.isElapsed(1000000ULL))
+				break;
+			iPingIndex = 0;
+		}
 
-		do {
-			++iPingIndex;
-			if (iPingIndex >= qlItems.count()) {
-				if (tRestart.isElapsed(1000000ULL))
-					iPingIndex = 0;
-				else
-					return;
-			}
-			si = qlItems.at(iPingIndex);
+		const qpAddress &addr = qlPingQueue.at(iPingIndex);
+		QHash<qpAddress, PingTarget>::const_iterator i = qhPingTargets.constFind(addr);
+		if ((i == qhPingTargets.constEnd()) || ! isPingVisible(i.value()))
+			continue;
 
-			ServerItem *p = si->siParent;
-			expanded = true;
-			while (p && expanded) {
-				expanded = expanded && p->isExpanded();
-				p = p->siParent;
-			}
-		} while (si->qlAddresses.isEmpty() || ! expanded);
+		sendPing(addr.first, addr.second);
+		dPingBudget -= 1.0;
+	}
+}
+
+void ConnectDialog::addPingTarget(const qpAddress &addr, ServerItem *si) {
+	QHash<qpAddress, PingTarget>::iterator i = qhPingTargets.find(addr);
+	if (i == qhPingTargets.end()) {
+		PingTarget pt;
+		pt.uiRand = (static_cast<quint64>(qrand()) << 32) | static_cast<quint64>(qrand());
+		pt.iQueue = qlPingQueue.count();
+		i = qhPingTargets.insert(addr, pt);
+		qlPingQueue.append(addr);
 	}
+	i.value().qsItems.insert(si);
+}
 
-	if (si == current)
-		tCurrent.restart();
-	if (si == hover)
-		tHover.restart();
+void ConnectDialog::removePingTarget(const qpAddress &addr, ServerItem *si) {
+	QHash<qpAddress, PingTarget>::iterator i = qhPingTargets.find(addr);
+	if (i == qhPingTargets.end())
+		return;
 
-	foreach(const QHostAddress &host, si->qlAddresses)
-		sendPing(host, si->usPort);
+	i.value().qsItems.remove(si);
+	if (! i.value().qsItems.isEmpty())
+		return;
+
+	// Fill the hole with the last address rather than shifting the queue down. If
+	// the hole is behind the ping cursor, the moved address waits one extra round.
+	const int idx = i.value().iQueue;
+	qhPingTargets.erase(i);
+
+	const int last = qlPingQueue.count() - 1;
+	if (idx != last) {
+		const qpAddress moved = qlPingQueue.at(last);
+		qhPingTargets[moved].iQueue = idx;
+		qlPingQueue[idx] = moved;
+	}
+	qlPingQueue.removeLast();
+
+	if (idx == iPingIndex)
+		--iPingIndex;
+}
+
+bool ConnectDialog::isPingVisible(const PingTarget &pt) const {
+	foreach(ServerItem *si, pt.qsItems) {
+		bool expanded = true;
+		ServerItem *p = si->siParent;
+		while (p && expanded) {
+			expanded = p->isExpanded();
+			p = p->siParent;
+		}
+		if (expanded)
+			return true;
+	}
+	return false;
 }
 
 
@@ -1371,10 +1476,12 @@ void ConnectDialog::startDns(ServerItem *si) {
 	if (qtwServers->currentItem() == si)
 		qdbbButtonBox->button(QDialogButtonBox::Ok)->setEnabled(! si->qlAddresses.isEmpty());
 
+	if (! si->uiPingSort)
+		si->uiPingSort = qmPingCache.value(QPair<QString, unsigned short>(si->qsHostname, si->usPort));
+
 	if (! si->qlAddresses.isEmpty()) {
-		foreach(const QHostAddress &qha, si->qlAddresses) {
-			qhPings[qpAddress(qha, si->usPort)].insert(si);
-		}
+		foreach(const QHostAddress &qha, si->qlAddresses)
+			addPingTarget(qpAddress(qha, si->usPort), si);
 		return;
 	}
 
@@ -1398,16 +1505,8 @@ void ConnectDialog::startDns(ServerItem *si) {
 }
 
 void ConnectDialog::stopDns(ServerItem *si) {
-	foreach(const QHostAddress &qha, si->qlAddresses) {
-		qpAddress addr(qha, si->usPort);
-		if (qhPings.contains(addr)) {
-			qhPings[addr].remove(si);
-			if (qhPings[addr].isEmpty()) {
-				qhPings.remove(addr);
-				qhPingRand.remove(addr);
-			}
-		}
-	}
+	foreach(const QHostAddress &qha, si->qlAddresses)
+		removePingTarget(qpAddress(qha, si->usPort), si);
 
 	QString host = si->qsHostname.toLower();
 
@@ -1437,7 +1536,7 @@ void ConnectDialog::lookedUp(QHostInfo info) {
 		foreach(const QHostAddress &qha, info.addresses()) {
 			qpAddress addr(qha, si->usPort);
 			qs.insert(addr);
-			qhPings[addr].insert(si);
+			addPingTarget(addr, si);
 		}
 
 		if (si == qtwServers->currentItem()) {
@@ -1457,18 +1556,12 @@ void ConnectDialog::lookedUp(QHostInfo info) {
 void ConnectDialog::sendPing(const QHostAddress &host, unsigned short port) {
 	char blob[16];
 
-	qpAddress addr(host, port);
-
-	quint64 uiRand;
-	if (qhPingRand.contains(addr)) {
-		uiRand = qhPingRand.value(addr);
-	} else {
-		uiRand = (static_cast<quint64>(qrand()) << 32) | static_cast<quint64>(qrand());
-		qhPingRand.insert(addr, uiRand);
-	}
+	QHash<qpAddress, PingTarget>::iterator i = qhPingTargets.find(qpAddress(host, port));
+	if (i == qhPingTargets.end())
+		return;
 
 	memset(blob, 0, sizeof(blob));
-	* reinterpret_cast<quint64 *>(blob+8) = tPing.elapsed() ^ uiRand;
+	* reinterpret_cast<quint64 *>(blob+8) = tPing.elapsed() ^ i.value().uiRand;
 
 	if (bIPv4 && host.protocol() == QAbstractSocket::IPv4Protocol)
 		qusSocket4->writeDatagram(blob+4, 12, host, port);
@@ -1477,9 +1570,7 @@ void ConnectDialog::sendPing(const QHostAddress &host, unsigned short port) {
 	else
 		return;
 
-	const QSet<ServerItem *> &qs = qhPings.value(addr);
-
-	foreach(ServerItem *si, qs)
+	foreach(ServerItem *si, i.value().qsItems)
 		++ si->uiSent;
 }
 
@@ -1496,22 +1587,19 @@ void ConnectDialog::udpReply() {
 			if (host.scopeId() == QLatin1String("0"))
 				host.setScopeId(QLatin1String(""));
 
-			qpAddress address(host, port);
-			if (qhPings.contains(address)) {
+			QHash<qpAddress, PingTarget>::const_iterator i = qhPingTargets.constFind(qpAddress(host, port));
+			if (i != qhPingTargets.constEnd()) {
 				quint32 *ping = reinterpret_cast<quint32 *>(blob+4);
 				quint64 *ts = reinterpret_cast<quint64 *>(blob+8);
 
-				quint64 elapsed = tPing.elapsed() - (*ts ^ qhPingRand.value(address));
+				quint64 elapsed = tPing.elapsed() - (*ts ^ i.value().uiRand);
 
-				foreach(ServerItem *si, qhPings.value(address)) {
+				foreach(ServerItem *si, i.value().qsItems) {
 					si->uiVersion = qFromBigEndian(ping[0]);
 					quint32 users = qFromBigEndian(ping[3]);
 					quint32 maxusers = qFromBigEndian(ping[4]);
 					si->uiBandwidth = qFromBigEndian(ping[5]);
 
-					if (! si->uiPingSort)
-						si->uiPingSort = qmPingCache.value(QPair<QString, unsigned short>(si->qsHostname, si->usPort));
-
 					si->setDatas(static_cast<double>(elapsed), users, maxusers);
 					si->hideCheck();
 				}
@@ -138,6 +138,8 @@ class ServerItem : public QTreeWidgetItem, public PingStats {
 		QList<ServerItem *> qlChildren;
 
 		QString qsName;
+		// Lowercase alphanumeric form of qsName used for sorting; recomputed when cleared.
+		mutable QString qsSortName;
 
 		QString qsHostname;
 		unsigned short usPort;
@@ -178,6 +180,8 @@ class ServerItem : public QTreeWidgetItem, public PingStats {
 
 		void setDatas(double ping = 0.0, quint32 users = 0, quint32 maxusers = 0);
 		bool operator< (const QTreeWidgetItem &) const;
+		Qt::SortOrder sortOrder() const;
+		void resort();
 
 		QVariant data(int column, int role) const;
 
@@ -232,8 +236,17 @@ class ConnectDialog : public QDialog, public Ui::ConnectDialog {
 		QHash<QString, QSet<ServerItem *> > qhDNSWait;
 		QHash<QString, QList<QHostAddress> > qhDNSCache;
 
-		QHash<qpAddress, quint64> qhPingRand;
-		QHash<qpAddress, QSet<ServerItem *> > qhPings;
+		// One entry per distinct address being pinged, shared by all items resolving to it.
+		struct PingTarget {
+			quint64 uiRand;
+			// Position in qlPingQueue.
+			int iQueue;
+			QSet<ServerItem *> qsItems;
+		};
+
+		QHash<qpAddress, PingTarget> qhPingTargets;
+		// Round-robin order of qhPingTargets.
+		QList<qpAddress> qlPingQueue;
 
 		QMap<QPair<QString, unsigned short>, unsigned int> qmPingCache;
 
@@ -241,11 +254,18 @@ class ConnectDialog : public QDialog, public Ui::ConnectDialog {
 		bool bIPv6;
 		int iPingIndex;
 
+		// Token bucket limiting outgoing pings to Settings::iPingRate packets per second.
+		Timer tPingBudget;
+		double dPingBudget;
+
 		bool bLastFound;
 
 		QMap<QString, QIcon> qmIcons;
 
 		void sendPing(const QHostAddress &, unsigned short port);
+		void addPingTarget(const qpAddress &, ServerItem *);
+		void removePingTarget(const qpAddress &, ServerItem *);
+		bool isPingVisible(const PingTarget &) const;
 
 		void initList();
 		void fillList();
@@ -60,6 +60,226 @@ static bool execQueryAndLogFailure(QSqlQuery &query, const QString &queryString)
 	return true;
 }
 
+// Memory budget for decoded blobs (textures and comments), in bytes.
+#define BLOB_CACHE_BUDGET (32 * 1024 * 1024)
+// Pending rows that trigger a write without waiting for the batch window.
+#define BLOB_BATCH 256
+// How long the writer lets a burst of updates accumulate, in milliseconds.
+#define BLOB_BATCH_WINDOW 2000
+
+/**
+ * Writes blobs and their `seen` timestamps to the database from a
+ * background thread. Updates are collected and written in a single
+ * transaction per batch, using a connection owned by the writer thread.
+ */
+class BlobWriter : public QThread {
+	private:
+		Q_DISABLE_COPY(BlobWriter)
+	protected:
+		QString qsDatabase;
+		QMutex qmQueue;
+		QWaitCondition qwcQueue;
+		QHash<QByteArray, QByteArray> qhInsert;
+		QHash<QByteArray, QByteArray> qhWriting;
+		QSet<QByteArray> qsSeen;
+		bool bStop;
+
+		int pendingCount() const;
+		void write(QSqlDatabase &db, const QHash<QByteArray, QByteArray> &insert, const QSet<QByteArray> &seen);
+	public:
+		unsigned int uiRows;
+		unsigned int uiTransactions;
+
+		BlobWriter(const QString &database);
+		~BlobWriter();
+		void stop();
+		void insert(const QByteArray &hash, const QByteArray &data);
+		void seen(const QByteArray &hash);
+		QByteArray pending(const QByteArray &hash);
+		void run();
+};
+
+BlobWriter::BlobWriter(const QString &database) : QThread(), qsDatabase(database) {
+	bStop = false;
+	uiRows = uiTransactions = 0;
+	start(QThread::LowPriority);
+}
+
+BlobWriter::~BlobWriter() {
+	stop();
+}
+
+void BlobWriter::stop() {
+	{
+		QMutexLocker lock(&qmQueue);
+		bStop = true;
+		qwcQueue.wakeAll();
+	}
+	wait();
+}
+
+int BlobWriter::pendingCount() const {
+	return qhInsert.count() + qsSeen.count();
+}
+
+void BlobWriter::insert(const QByteArray &hash, const QByteArray &data) {
+	QMutexLocker lock(&qmQueue);
+	bool wake = (pendingCount() == 0);
+	qhInsert.insert(hash, data);
+	qsSeen.remove(hash);
+	if (wake || (pendingCount() >= BLOB_BATCH))
+		qwcQueue.wakeAll();
+}
+
+void BlobWriter::seen(const QByteArray &hash) {
+	QMutexLocker lock(&qmQueue);
+	if (qhInsert.contains(hash) || qsSeen.contains(hash))
+		return;
+	bool wake = (pendingCount() == 0);
+	qsSeen.insert(hash);
+	if (wake || (pendingCount() >= BLOB_BATCH))
+		qwcQueue.wakeAll();
+}
+
+QByteArray BlobWriter::pending(const QByteArray &hash) {
+	QMutexLocker lock(&qmQueue);
+	QByteArray qba = qhInsert.value(hash);
+	if (qba.isEmpty())
+		qba = qhWriting.value(hash);
+	return qba;
+}
+
+void BlobWriter::write(QSqlDatabase &db, const QHash<QByteArray, QByteArray> &insert, const QSet<QByteArray> &seen) {
+	db.transaction();
+
+	QSqlQuery query(db);
+
+	if (! insert.isEmpty()) {
+		query.prepare(QLatin1String("REPLACE INTO `blobs` (`hash`, `data`, `seen`) VALUES (?, ?, datetime('now'))"));
+		QHash<QByteArray, QByteArray>::const_iterator i;
+		for (i = insert.constBegin(); i != insert.constEnd(); ++i) {
+			query.addBindValue(i.key());
+			query.addBindValue(i.value());
+			execQueryAndLogFailure(query);
+		}
+	}
+
+	if (! seen.isEmpty()) {
+		query.prepare(QLatin1String("UPDATE `blobs` SET `seen` = datetime('now') WHERE `hash` = ?"));
+		foreach(const QByteArray &hash, seen) {
+			query.addBindValue(hash);
+			execQueryAndLogFailure(query);
+		}
+	}
+
+	if (! db.commit()) {
+		qWarning() << "BlobWriter: Commit failed" << db.lastError().text();
+		db.rollback();
+	}
+
+	uiRows += insert.count() + seen.count();
+	++uiTransactions;
+}
+
+void BlobWriter::run() {
+	const QString connection = QLatin1String("blobwriter");
+	{
+		QSqlDatabase db = QSqlDatabase::addDatabase(QLatin1String("QSQLITE"), connection);
+		db.setDatabaseName(qsDatabase);
+		db.setConnectOptions(QLatin1String("QSQLITE_BUSY_TIMEOUT=5000"));
+		bool ok = db.open();
+		if (! ok)
+			qWarning() << "BlobWriter: Failed to open database" << db.lastError().text();
+
+		qmQueue.lock();
+		forever {
+			while ((pendingCount() == 0) && ! bStop)
+				qwcQueue.wait(&qmQueue);
+
+			if (! bStop && (pendingCount() < BLOB_BATCH))
+				qwcQueue.wait(&qmQueue, BLOB_BATCH_WINDOW);
+
+			bool stop = bStop;
+			QSet<QByteArray> seen = qsSeen;
+			qhWriting = qhInsert;
+			qhInsert.clear();
+			qsSeen.clear();
+			qmQueue.unlock();
+
+			if (ok && (! qhWriting.isEmpty() || ! seen.isEmpty()))
+				write(db, qhWriting, seen);
+
+			qmQueue.lock();
+			qhWriting.clear();
+			if (stop && (pendingCount() == 0))
+				break;
+		}
+		qmQueue.unlock();
+
+		db.close();
+	}
+	QSqlDatabase::removeDatabase(connection);
+}
+
+/**
+ * Bounded LRU cache of blobs keyed by hash, in front of the `blobs` table.
+ * Lookups that hit never touch the database on the calling thread; the
+ * `seen` refresh and new blobs are handed to a BlobWriter.
+ */
+class BlobCache {
+	private:
+		Q_DISABLE_COPY(BlobCache)
+	protected:
+		QMutex qmCache;
+		QCache<QByteArray, QByteArray> qcBlobs;
+	public:
+		BlobWriter bwWriter;
+		unsigned int uiHits;
+		unsigned int uiMisses;
+
+		BlobCache(const QString &database);
+		~BlobCache();
+		bool find(const QByteArray &hash, QByteArray &data);
+		void insert(const QByteArray &hash, const QByteArray &data);
+};
+
+static BlobCache *bcBlobs = NULL;
+
+BlobCache::BlobCache(const QString &database) : qcBlobs(BLOB_CACHE_BUDGET), bwWriter(database) {
+	uiHits = uiMisses = 0;
+}
+
+BlobCache::~BlobCache() {
+	bwWriter.stop();
+
+	unsigned int total = uiHits + uiMisses;
+	qWarning("Database: Blob cache %u hits, %u misses (%.1f%% hit rate), %u rows written in %u transactions",
+	         uiHits, uiMisses, total ? (100.0 * uiHits) / total : 0.0, bwWriter.uiRows, bwWriter.uiTransactions);
+}
+
+bool BlobCache::find(const QByteArray &hash, QByteArray &data) {
+	QMutexLocker lock(&qmCache);
+
+	QByteArray *qba = qcBlobs.object(hash);
+	if (qba)
+		data = *qba;
+	else
+		data = bwWriter.pending(hash);
+
+	if (data.isEmpty()) {
+		++uiMisses;
+		return false;
+	}
+
+	++uiHits;
+	bwWriter.seen(hash);
+	return true;
+}
+
+void BlobCache::insert(const QByteArray &hash, const QByteArray &data) {
+	QMutexLocker lock(&qmCache);
+	qcBlobs.insert(hash, new QByteArray(data), data.size());
+}
 
 Database::Database() {
 	QSqlDatabase db = QSqlDatabase::addDatabase(QLatin1String("QSQLITE"));
@@ -189,9 +409,14 @@ Database::Database() {
 	execQueryAndLogFailure(query, QLatin1String("SELECT sqlite_version()"));
 	while (query.next())
 		qWarning() << "Database SQLite:" << query.value(0).toString();
+
+	bcBlobs = new BlobCache(db.databaseName());
 }
 
 Database::~Database() {
+	delete bcBlobs;
+	bcBlobs = NULL;
+
 	QSqlQuery query;
 	execQueryAndLogFailure(query, QLatin1String("PRAGMA journal_mode = DELETE"));
 	execQueryAndLogFailure(query, QLatin1String("VACUUM"));
@@ -373,17 +598,27 @@ void Database::setSeenComment(const QString &hash, const QByteArray &commenthash
 }
 
 QByteArray Database::blob(const QByteArray &hash) {
+	QByteArray qba;
+
+	if (bcBlobs && bcBlobs->find(hash, qba))
+		return qba;
+
 	QSqlQuery query;
 
 	query.prepare(QLatin1String("SELECT `data` FROM `blobs` WHERE `hash` = ?"));
 	query.addBindValue(hash);
 	execQueryAndLogFailure(query);
 	if (query.next()) {
-		QByteArray qba = query.value(0).toByteArray();
+		qba = query.value(0).toByteArray();
 
-		query.prepare(QLatin1String("UPDATE `blobs` SET `seen` = datetime('now') WHERE `hash` = ?"));
-		query.addBindValue(hash);
-		execQueryAndLogFailure(query);
+		if (bcBlobs) {
+			bcBlobs->insert(hash, qba);
+			bcBlobs->bwWriter.seen(hash);
+		} else {
+			query.prepare(QLatin1String("UPDATE `blobs` SET `seen` = datetime('now') WHERE `hash` = ?"));
+			query.addBindValue(hash);
+			execQueryAndLogFailure(query);
+		}
 
 		return qba;
 	}
@@ -394,6 +629,12 @@ void Database::setBlob(const QByteArray &hash, const QByteArray &data) {
 	if (hash.isEmpty() || data.isEmpty())
 		return;
 
+	if (bcBlobs) {
+		bcBlobs->insert(hash, data);
+		bcBlobs->bwWriter.insert(hash, data);
+		return;
+	}
+
 	QSqlQuery query;
 
 	query.prepare(QLatin1String("REPLACE INTO `blobs` (`hash`, `data`, `seen`) VALUES (?, ?, datetime('now'))"));
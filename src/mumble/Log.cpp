@@ -202,6 +202,17 @@ Log::Log(QObject *p) : QObject(p) {
 	tts->setVolume(g.s.iTTSVolume);
 	uiLastId = 0;
 	qdDate = QDate::currentDate();
+
+	// Laying out text off the GUI thread needs thread safe font handling.
+	lrRenderer = NULL;
+	if (QFontDatabase::supportsThreadedFontRendering()) {
+		lrRenderer = new LogRenderer(this);
+		connect(lrRenderer, SIGNAL(rendered()), this, SLOT(rendered()), Qt::QueuedConnection);
+	}
+}
+
+Log::~Log() {
+	delete lrRenderer;
 }
 
 const char *Log::msgNames[] = {
@@ -352,14 +363,11 @@ QString Log::imageToImg(QImage img) {
 	return QString();
 }
 
-QString Log::validHtml(const QString &html, bool allowReplacement, QTextCursor *tc) {
-	QDesktopWidget dw;
-	ValidDocument qtd(allowReplacement);
+bool Log::sanitize(ValidDocument &qtd, const QString &html, const QRectF &qr, const QString &css) {
 	bool valid = false;
 
-	QRectF qr = dw.availableGeometry(dw.screenNumber(g.mw));
 	qtd.setTextWidth(qr.width() / 2);
-	qtd.setDefaultStyleSheet(qApp->styleSheet());
+	qtd.setDefaultStyleSheet(css);
 
 	qtd.setHtml(html);
 	valid = qtd.isValid();
@@ -397,14 +405,25 @@ QString Log::validHtml(const QString &html, bool allowReplacement, QTextCursor *
 		qtd.adjustSize();
 		s = qtd.size();
 
-		if ((s.width() > qr.width()) || (s.height() > qr.height())) {
-			QString errorMessage = tr("[[ Text object too large to display ]]");
-			if (tc) {
-				tc->insertText(errorMessage);
-				return QString();
-			} else {
-				return errorMessage;
-			}
+		if ((s.width() > qr.width()) || (s.height() > qr.height()))
+			return false;
+	}
+	return true;
+}
+
+QString Log::validHtml(const QString &html, bool allowReplacement, QTextCursor *tc) {
+	QDesktopWidget dw;
+	ValidDocument qtd(allowReplacement);
+
+	QRectF qr = dw.availableGeometry(dw.screenNumber(g.mw));
+
+	if (! sanitize(qtd, html, qr, qApp->styleSheet())) {
+		QString errorMessage = tr("[[ Text object too large to display ]]");
+		if (tc) {
+			tc->insertText(errorMessage);
+			return QString();
+		} else {
+			return errorMessage;
 		}
 	}
 
@@ -418,9 +437,43 @@ QString Log::validHtml(const QString &html, bool allowReplacement, QTextCursor *
 	}
 }
 
-void Log::log(MsgType mt, const QString &console, const QString &terse, bool ownMessage) {
-	QDateTime dt = QDateTime::currentDateTime();
+// Prepares an entry for display. Only touches the entry itself, so it is
+// safe to call from the LogRenderer thread.
+void Log::render(Entry &e) {
+	e.qsPlain = QTextDocumentFragment::fromHtml(e.qsConsole).toPlainText();
+	e.bTooLarge = false;
 
+	if (! e.bConsole)
+		return;
+
+	ValidDocument qtd(true);
+	if (! sanitize(qtd, e.qsConsole, e.qrBounds, e.qsStyleSheet)) {
+		e.bTooLarge = true;
+		return;
+	}
+
+	QTextCursor tc(&qtd);
+	tc.movePosition(QTextCursor::End, QTextCursor::KeepAnchor);
+	e.qtdfMessage = tc.selection();
+
+	// Inline images were decoded while laying out; hand them over so the
+	// log document doesn't decode them again on the GUI thread.
+	for (QTextBlock qtb = qtd.begin(); qtb != qtd.end(); qtb = qtb.next()) {
+		for (QTextBlock::iterator qtbi = qtb.begin(); qtbi != qtb.end(); ++qtbi) {
+			QTextCharFormat qcf = qtbi.fragment().charFormat();
+			if (! qcf.isImageFormat())
+				continue;
+			QUrl url(qcf.toImageFormat().name());
+			if (url.scheme() != QLatin1String("data"))
+				continue;
+			QVariant v = qtd.resource(QTextDocument::ImageResource, url);
+			if (v.isValid())
+				e.qlResources << QPair<QUrl, QVariant>(url, v);
+		}
+	}
+}
+
+void Log::log(MsgType mt, const QString &console, const QString &terse, bool ownMessage) {
 	int ignore = qmIgnore.value(mt);
 	if (ignore) {
 		ignore--;
@@ -428,19 +481,65 @@ void Log::log(MsgType mt, const QString &console, const QString &terse, bool own
 		return;
 	}
 
-	QString plain = QTextDocumentFragment::fromHtml(console).toPlainText();
+	Entry e;
+	e.mt = mt;
+	e.qsConsole = console;
+	e.qsTerse = terse;
+	e.bOwnMessage = ownMessage;
+	e.bConsole = g.s.qmMessages.value(mt) & Settings::LogConsole;
+	e.qdtTime = QDateTime::currentDateTime();
+	e.bTooLarge = false;
+	e.uiGeneration = 0;
+
+	if (e.bConsole) {
+		QDesktopWidget dw;
+		e.qrBounds = dw.availableGeometry(dw.screenNumber(g.mw));
+		e.qsStyleSheet = qApp->styleSheet();
+	}
 
-	quint32 flags = g.s.qmMessages.value(mt);
+	if (lrRenderer) {
+		lrRenderer->enqueue(e);
+		return;
+	}
 
-	// Message output on console
-	if ((flags & Settings::LogConsole)) {
-		QTextCursor tc = g.mw->qteLog->textCursor();
+	render(e);
+	display(QList<Entry>() << e);
+}
 
-		LogTextBrowser *tlog = g.mw->qteLog;
-		const int oldscrollvalue = tlog->getLogScroll();
-		const bool scroll = (oldscrollvalue == tlog->getLogScrollMaximum());
+void Log::rendered() {
+	QList<Entry> entries = lrRenderer->takeRendered();
+	if (! entries.isEmpty())
+		display(entries);
+}
 
-		tc.movePosition(QTextCursor::End);
+/**
+ * Empties the log view. Messages still being rendered were logged before
+ * the clear, so they are dropped rather than shown in the emptied log.
+ */
+void Log::clear() {
+	if (lrRenderer)
+		lrRenderer->clear();
+	g.mw->qteLog->clear();
+}
+
+void Log::display(const QList<Entry> &entries) {
+	LogTextBrowser *tlog = g.mw->qteLog;
+	const int oldscrollvalue = tlog->getLogScroll();
+	const bool scroll = (oldscrollvalue == tlog->getLogScrollMaximum());
+	bool inserted = false;
+	bool own = false;
+
+	QTextCursor tc = tlog->textCursor();
+	tc.movePosition(QTextCursor::End);
+
+	// Everything from this batch goes in as one edit, so the document is
+	// laid out once rather than once per message.
+	tc.beginEditBlock();
+	foreach(const Entry &e, entries) {
+		if (! e.bConsole)
+			continue;
+
+		const QDateTime &dt = e.qdtTime;
 
 		if (qdDate != dt.date()) {
 			qdDate = dt.date();
@@ -449,32 +548,77 @@ void Log::log(MsgType mt, const QString &console, const QString &terse, bool own
 			tc.movePosition(QTextCursor::End);
 		}
 
-		if (plain.contains(QRegExp(QLatin1String("[\\r\\n]")))) {
+		if (e.qsPlain.contains(QRegExp(QLatin1String("[\\r\\n]")))) {
 			QTextFrameFormat qttf;
 			qttf.setBorder(1);
 			qttf.setPadding(2);
 			qttf.setBorderStyle(QTextFrameFormat::BorderStyle_Solid);
 			tc.insertFrame(qttf);
-		} else if (! g.mw->qteLog->document()->isEmpty()) {
+		} else if (! tlog->document()->isEmpty()) {
 			tc.insertBlock();
 		}
 		tc.insertHtml(Log::msgColor(QString::fromLatin1("[%1] ").arg(dt.time().toString(Qt::DefaultLocaleShortDate)), Log::Time));
-		validHtml(console, true, &tc);
+
+		if (e.bTooLarge) {
+			tc.insertText(tr("[[ Text object too large to display ]]"));
+		} else {
+			typedef QPair<QUrl, QVariant> Resource;
+			foreach(const Resource &r, e.qlResources)
+				tlog->document()->addResource(QTextDocument::ImageResource, r.first, r.second);
+			tc.insertFragment(e.qtdfMessage);
+		}
 		tc.movePosition(QTextCursor::End);
-		g.mw->qteLog->setTextCursor(tc);
 
-		if (scroll || ownMessage)
+		inserted = true;
+		own = own || e.bOwnMessage;
+	}
+	tc.endEditBlock();
+
+	if (inserted) {
+		trim();
+
+		tc.movePosition(QTextCursor::End);
+		tlog->setTextCursor(tc);
+
+		if (scroll || own)
 			tlog->scrollLogToBottom();
 		else
 			tlog->setLogScroll(oldscrollvalue);
 	}
 
-	if (!g.s.bTTSMessageReadBack && ownMessage)
+	foreach(const Entry &e, entries)
+		notify(e);
+}
+
+// Drops the oldest blocks once the log grows past the configured limit.
+// Trimming is done in chunks, as removing from the top shifts the layout
+// of everything below it.
+void Log::trim() {
+	const int max = g.s.iMaxLogBlocks;
+	if (max <= 0)
+		return;
+
+	QTextDocument *doc = g.mw->qteLog->document();
+	if (doc->blockCount() <= max + max / 10)
+		return;
+
+	QTextCursor tc(doc);
+	tc.movePosition(QTextCursor::Start);
+	tc.movePosition(QTextCursor::NextBlock, QTextCursor::KeepAnchor, doc->blockCount() - max);
+	tc.removeSelectedText();
+}
+
+void Log::notify(const Entry &e) {
+	const MsgType mt = e.mt;
+	QString plain = e.qsPlain;
+	quint32 flags = g.s.qmMessages.value(mt);
+
+	if (!g.s.bTTSMessageReadBack && e.bOwnMessage)
 		return;
 
 	// Message notification with balloon tooltips
 	if ((flags & Settings::LogBalloon) && !(g.mw->isActiveWindow() && g.mw->qdwLog->isVisible()))
-		postNotification(mt, console, plain);
+		postNotification(mt, e.qsConsole, plain);
 
 	// Don't make any noise if we are self deafened
 	if (g.s.bDeaf)
@@ -530,8 +674,8 @@ void Log::log(MsgType mt, const QString &console, const QString &terse, bool own
 	// TTS threshold limiter.
 	if (plain.length() <= g.s.iTTSThreshold)
 		tts->say(plain);
-	else if ((! terse.isEmpty()) && (terse.length() <= g.s.iTTSThreshold))
-		tts->say(terse);
+	else if ((! e.qsTerse.isEmpty()) && (e.qsTerse.length() <= g.s.iTTSThreshold))
+		tts->say(e.qsTerse);
 }
 
 // Post a notification using the MainWindow's QSystemTrayIcon.
@@ -631,3 +775,66 @@ void LogDocument::finished() {
 
 	rep->deleteLater();
 }
+
+LogRenderer::LogRenderer(QObject *p) : QThread(p) {
+	uiGeneration = 0;
+	bStop = false;
+	start(QThread::LowPriority);
+}
+
+LogRenderer::~LogRenderer() {
+	{
+		QMutexLocker lock(&qmQueue);
+		bStop = true;
+		qwcQueue.wakeAll();
+	}
+	wait();
+}
+
+void LogRenderer::enqueue(const Log::Entry &e) {
+	QMutexLocker lock(&qmQueue);
+	qlPending << e;
+	qlPending.last().uiGeneration = uiGeneration;
+	qwcQueue.wakeAll();
+}
+
+void LogRenderer::clear() {
+	QMutexLocker lock(&qmQueue);
+	++uiGeneration;
+	qlPending.clear();
+	qlDone.clear();
+}
+
+QList<Log::Entry> LogRenderer::takeRendered() {
+	QMutexLocker lock(&qmQueue);
+	QList<Log::Entry> entries;
+	// The entry being rendered during a clear() still lands in qlDone.
+	foreach(const Log::Entry &e, qlDone)
+		if (e.uiGeneration == uiGeneration)
+			entries << e;
+	qlDone.clear();
+	return entries;
+}
+
+void LogRenderer::run() {
+	QMutexLocker lock(&qmQueue);
+	while (! bStop) {
+		if (qlPending.isEmpty()) {
+			qwcQueue.wait(&qmQueue);
+			continue;
+		}
+
+		Log::Entry e = qlPending.takeFirst();
+		lock.unlock();
+
+		Log::render(e);
+
+		lock.relock();
+		// Only the first finished entry needs to wake the GUI thread; the
+		// rest are picked up by the same Log::rendered() call.
+		bool notify = qlDone.isEmpty();
+		qlDone << e;
+		if (notify)
+			emit rendered();
+	}
+}
@@ -33,8 +33,12 @@
 #define MUMBLE_MUMBLE_LOG_H_
 
 #include <QtCore/QDate>
+#include <QtCore/QMutex>
+#include <QtCore/QThread>
+#include <QtCore/QWaitCondition>
 #include <QtGui/QTextCursor>
 #include <QtGui/QTextDocument>
+#include <QtGui/QTextDocumentFragment>
 
 #include "ConfigDialog.h"
 #include "ui_Log.h"
@@ -64,6 +68,8 @@ class LogConfig : public ConfigWidget, public Ui::LogConfig {
 
 class ClientUser;
 class Channel;
+class LogRenderer;
+class ValidDocument;
 
 class Log : public QObject {
 		friend class LogConfig;
@@ -75,6 +81,27 @@ class Log : public QObject {
 		enum LogColorType { Time, Server, Privilege, Source, Target };
 		static const MsgType firstMsgType = DebugInfo;
 		static const MsgType lastMsgType = TextMessage;
+
+		// A message on its way to the log, and the parts of it that are
+		// prepared off the GUI thread.
+		struct Entry {
+			MsgType mt;
+			QString qsConsole;
+			QString qsTerse;
+			bool bOwnMessage;
+			bool bConsole;
+			QDateTime qdtTime;
+			QRectF qrBounds;
+			QString qsStyleSheet;
+
+			QString qsPlain;
+			bool bTooLarge;
+			QTextDocumentFragment qtdfMessage;
+			QList<QPair<QUrl, QVariant> > qlResources;
+
+			// Log::clear() calls seen when this was queued for rendering.
+			unsigned int uiGeneration;
+		};
 	protected:
 		QHash<MsgType, int> qmIgnore;
 		static const char *msgNames[];
@@ -82,11 +109,17 @@ class Log : public QObject {
 		TextToSpeech *tts;
 		unsigned int uiLastId;
 		QDate qdDate;
+		LogRenderer *lrRenderer;
 		static const QStringList allowedSchemes();
+		static bool sanitize(ValidDocument &qtd, const QString &html, const QRectF &bounds, const QString &css);
+		void display(const QList<Entry> &entries);
+		void notify(const Entry &e);
+		void trim();
 		void postNotification(MsgType mt, const QString &console, const QString &plain);
 		void postQtNotification(MsgType mt, const QString &plain);
 	public:
 		Log(QObject *p = NULL);
+		~Log();
 		QString msgName(MsgType t) const;
 		void setIgnore(MsgType t, int ignore = 1 << 30);
 		void clearIgnore();
@@ -96,8 +129,36 @@ class Log : public QObject {
 		static QString msgColor(const QString &text, LogColorType t);
 		static QString formatClientUser(ClientUser *cu, LogColorType t);
 		static QString formatChannel(::Channel *c);
+		static void render(Entry &e);
 	public slots:
 		void log(MsgType t, const QString &console, const QString &terse=QString(), bool ownMessage = false);
+		void rendered();
+		void clear();
+};
+
+// Sanitizes and lays out log messages on a worker thread, so large
+// messages (inline images in particular) don't stall the GUI. Finished
+// entries are picked up by Log::rendered() in batches.
+class LogRenderer : public QThread {
+	private:
+		Q_OBJECT
+		Q_DISABLE_COPY(LogRenderer)
+	protected:
+		QMutex qmQueue;
+		QWaitCondition qwcQueue;
+		QList<Log::Entry> qlPending;
+		QList<Log::Entry> qlDone;
+		unsigned int uiGeneration;
+		bool bStop;
+	public:
+		LogRenderer(QObject *p = NULL);
+		~LogRenderer();
+		void enqueue(const Log::Entry &e);
+		void clear();
+		QList<Log::Entry> takeRendered();
+		void run();
+	signals:
+		void rendered();
 };
 
 class ValidDocument : public QTextDocument {
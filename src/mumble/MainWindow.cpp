@@ -588,7 +588,7 @@ void MainWindow::on_qteLog_customContextMenuRequested(const QPoint &mpos) {
 	QPoint contentPosition = QPoint(QApplication::isRightToLeft() ? (qteLog->horizontalScrollBar()->maximum() - qteLog->horizontalScrollBar()->value()) : qteLog->horizontalScrollBar()->value(), qteLog->verticalScrollBar()->value());
 	QMenu *menu = qteLog->createStandardContextMenu(mpos + contentPosition);
 	menu->addSeparator();
-	menu->addAction(tr("Clear"), qteLog, SLOT(clear(void)));
+	menu->addAction(tr("Clear"), g.l, SLOT(clear(void)));
 	menu->exec(qteLog->mapToGlobal(mpos));
 	delete menu;
 }
@@ -2393,6 +2393,10 @@ void MainWindow::serverConnected() {
 
 	qtvUsers->setRowHidden(0, QModelIndex(), false);
 
+	// Collect the initial channel and user state, and show it all at once
+	// when ServerSync arrives.
+	pmModel->beginBatch();
+
 	g.bAllowHTML = true;
 	g.uiMessageLength = 5000;
 	g.uiImageLength = 131072;
@@ -0,0 +1,257 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "mumble_pch.hpp"
+
+#include "PlayoutBuffer.h"
+
+// Number of transit samples the jitter percentile is computed over,
+// roughly five seconds of 20ms packets.
+#define JITTER_WINDOW 250
+// Upper bound for the adaptive delay, in microseconds.
+#define JITTER_MAX_DELAY 500000ULL
+// Length of one sequence step, in microseconds.
+#define FRAME_USEC 10000LL
+// A sequence number this many frames below the highest one seen means
+// the sender restarted its counter rather than a reordered packet.
+#define SEQUENCE_RESTART 100
+
+JitterEstimator::JitterEstimator() {
+	qvTransit.resize(JITTER_WINDOW);
+	iPercentile = 95;
+	reset();
+}
+
+void JitterEstimator::reset() {
+	iNext = 0;
+	iCount = 0;
+	iSinceUpdate = 0;
+	iMinTransit = 0;
+	uiDelay = 0;
+}
+
+void JitterEstimator::setPercentile(int percentile) {
+	iPercentile = qBound(50, percentile, 100);
+}
+
+void JitterEstimator::addTransit(qint64 transit) {
+	qvTransit[iNext] = transit;
+	iNext = (iNext + 1) % JITTER_WINDOW;
+	if (iCount < JITTER_WINDOW)
+		++iCount;
+
+	// The minimum only ever needs to move down immediately; raising it is
+	// left to the periodic full update so a single early packet can't
+	// inflate the delay for long.
+	if ((iCount == 1) || (transit < iMinTransit))
+		iMinTransit = transit;
+
+	if ((++iSinceUpdate >= 10) || (iCount < 10))
+		update();
+}
+
+void JitterEstimator::update() {
+	iSinceUpdate = 0;
+
+	QVector<qint64> sorted(iCount);
+	for (int i = 0; i < iCount; ++i)
+		sorted[i] = qvTransit[i];
+
+	qint64 *b = sorted.data();
+	qint64 *e = b + iCount;
+	iMinTransit = *std::min_element(b, e);
+
+	qint64 *nth = b + qMin(iCount - 1, (iCount * iPercentile) / 100);
+	std::nth_element(b, nth, e);
+
+	uiDelay = qMin(static_cast<quint64>(*nth - iMinTransit), JITTER_MAX_DELAY);
+}
+
+qint64 JitterEstimator::minTransit() const {
+	return iMinTransit;
+}
+
+quint64 JitterEstimator::delay() const {
+	return uiDelay;
+}
+
+PlayoutStats::PlayoutStats() {
+	uiLate = uiConcealed = uiRecovered = uiDropped = 0;
+	fDelay = 0.0f;
+}
+
+PlayoutSummary PlayoutStats::summary() const {
+	QMutexLocker lock(&qmStats);
+
+	PlayoutSummary s;
+	s.uiJitter = jeTransit.delay();
+	s.uiLate = uiLate;
+	s.uiConcealed = uiConcealed;
+	s.uiRecovered = uiRecovered;
+	s.fDelay = fDelay;
+	return s;
+}
+
+/**
+ * Starts a new playout stream for a speaker. The transit history is
+ * discarded: it is only comparable within one run of sequence numbers,
+ * and the clock offset it encodes goes stale between streams.
+ */
+PlayoutBuffer::PlayoutBuffer(PlayoutStats *stats, unsigned int minframes, int percentile) {
+	psStats = stats;
+	uiMinDelay = minframes * FRAME_USEC;
+	uiNext = 0;
+	uiHighest = 0;
+	bPlaying = false;
+
+	QMutexLocker lock(&psStats->qmStats);
+	psStats->jeTransit.setPercentile(percentile);
+	psStats->jeTransit.reset();
+}
+
+bool PlayoutBuffer::isPlaying() const {
+	return bPlaying;
+}
+
+quint64 PlayoutBuffer::target() const {
+	return qMax(uiMinDelay, psStats->jeTransit.delay());
+}
+
+// How far behind its earliest possible playout time the given sequence
+// is at time now, based on the fastest transit seen recently.
+qint64 PlayoutBuffer::lateness(unsigned int seq, quint64 now) const {
+	return static_cast<qint64>(now) - static_cast<qint64>(seq) * FRAME_USEC - psStats->jeTransit.minTransit();
+}
+
+void PlayoutBuffer::put(const QByteArray &packet, unsigned int seq, unsigned int frames) {
+	QMutexLocker lock(&psStats->qmStats);
+	quint64 now = psStats->tClock.elapsed();
+
+	if (seq + SEQUENCE_RESTART < uiHighest) {
+		// The sender started counting again, so neither the buffered
+		// packets nor the transit history line up with this one.
+		psStats->jeTransit.reset();
+		qmPackets.clear();
+		bPlaying = false;
+		uiHighest = seq;
+	} else {
+		uiHighest = qMax(uiHighest, seq);
+	}
+
+	psStats->jeTransit.addTransit(static_cast<qint64>(now) - static_cast<qint64>(seq) * FRAME_USEC);
+
+	if (bPlaying && (seq + frames <= uiNext)) {
+		++psStats->uiLate;
+		return;
+	}
+
+	if (qmPackets.contains(seq))
+		return;
+
+	Entry e;
+	e.qbaPacket = packet;
+	e.uiFrames = qMax(frames, 1U);
+	e.uiArrival = now;
+	qmPackets.insert(seq, e);
+}
+
+PlayoutBuffer::Action PlayoutBuffer::get(QByteArray &packet, unsigned int &frames) {
+	QMutexLocker lock(&psStats->qmStats);
+	quint64 now = psStats->tClock.elapsed();
+	qint64 want = static_cast<qint64>(target());
+
+	frames = 1;
+
+	if (! bPlaying) {
+		if (qmPackets.isEmpty())
+			return Wait;
+		QMap<unsigned int, Entry>::const_iterator i = qmPackets.constBegin();
+		if (lateness(i.key(), now) < want)
+			return Wait;
+		bPlaying = true;
+		uiNext = i.key();
+	}
+
+	// Give back latency accumulated from underruns or clock drift, but only
+	// while there is enough buffered to not cause an underrun right away.
+	if ((qmPackets.count() > 1) && (lateness(uiNext, now) > want + 3 * FRAME_USEC)) {
+		QMap<unsigned int, Entry>::iterator i = qmPackets.begin();
+		if (i.key() == uiNext) {
+			uiNext += i.value().uiFrames;
+			qmPackets.erase(i);
+			++psStats->uiDropped;
+		}
+	}
+
+	if (qmPackets.isEmpty()) {
+		// Nothing newer has arrived; hold the cursor so a late packet can
+		// still be played, at the cost of extra delay.
+		++psStats->uiConcealed;
+		return Conceal;
+	}
+
+	QMap<unsigned int, Entry>::iterator i = qmPackets.begin();
+	while ((i != qmPackets.end()) && (i.key() < uiNext)) {
+		++psStats->uiLate;
+		i = qmPackets.erase(i);
+	}
+	if (i == qmPackets.end()) {
+		++psStats->uiConcealed;
+		return Conceal;
+	}
+
+	if (i.key() == uiNext) {
+		const Entry &e = i.value();
+		float d = static_cast<float>(now - e.uiArrival) / 1000.0f;
+		psStats->fDelay = psStats->fDelay * 0.9f + d * 0.1f;
+
+		packet = e.qbaPacket;
+		frames = e.uiFrames;
+		uiNext += e.uiFrames;
+		qmPackets.erase(i);
+		return Play;
+	}
+
+	// A later packet is already here, so the one we want is lost. Opus
+	// carries in-band FEC for the preceding frame, which covers gaps up to
+	// the longest packet we send.
+	unsigned int gap = i.key() - uiNext;
+	if (gap <= 6) {
+		packet = i.value().qbaPacket;
+		frames = gap;
+		uiNext += gap;
+		++psStats->uiRecovered;
+		return Recover;
+	}
+
+	++uiNext;
+	++psStats->uiConcealed;
+	return Conceal;
+}
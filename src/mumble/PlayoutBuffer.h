@@ -0,0 +1,122 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_MUMBLE_PLAYOUTBUFFER_H_
+#define MUMBLE_MUMBLE_PLAYOUTBUFFER_H_
+
+#include <QtCore/QByteArray>
+#include <QtCore/QMap>
+#include <QtCore/QMutex>
+#include <QtCore/QVector>
+
+#include "Timer.h"
+
+// Tracks the transit time (arrival minus send time as implied by the
+// sequence number) of incoming voice packets and derives the playout
+// delay needed to absorb a given percentile of the observed jitter.
+class JitterEstimator {
+	protected:
+		QVector<qint64> qvTransit;
+		int iNext;
+		int iCount;
+		int iSinceUpdate;
+		int iPercentile;
+		qint64 iMinTransit;
+		quint64 uiDelay;
+
+		void update();
+	public:
+		JitterEstimator();
+		void reset();
+		void setPercentile(int percentile);
+		void addTransit(qint64 transit);
+		qint64 minTransit() const;
+		quint64 delay() const;
+};
+
+// Copy of the PlayoutStats shown in the audio statistics dialog.
+struct PlayoutSummary {
+	quint64 uiJitter;
+	unsigned int uiLate;
+	unsigned int uiConcealed;
+	unsigned int uiRecovered;
+	float fDelay;
+};
+
+// Per speaker playout statistics. Lives in ClientUser so the counters
+// can still be shown after the speaker stops. Written by the audio
+// threads and read by the GUI, so everything but tClock is guarded by
+// qmStats.
+struct PlayoutStats {
+	mutable QMutex qmStats;
+	Timer tClock;
+	JitterEstimator jeTransit;
+	unsigned int uiLate;
+	unsigned int uiConcealed;
+	unsigned int uiRecovered;
+	unsigned int uiDropped;
+	float fDelay;
+	PlayoutStats();
+	PlayoutSummary summary() const;
+};
+
+// Adaptive playout buffer for Opus. Packets are keyed by sequence number
+// (in 10ms frames) and released once the head of the talk burst has been
+// delayed by the jitter target. Gaps are reported to the caller so it can
+// decode them from the FEC data of the following packet.
+class PlayoutBuffer {
+	private:
+		Q_DISABLE_COPY(PlayoutBuffer)
+	public:
+		enum Action { Wait, Play, Recover, Conceal };
+	protected:
+		struct Entry {
+			QByteArray qbaPacket;
+			unsigned int uiFrames;
+			quint64 uiArrival;
+		};
+
+		PlayoutStats *psStats;
+		QMap<unsigned int, Entry> qmPackets;
+		quint64 uiMinDelay;
+		unsigned int uiNext;
+		unsigned int uiHighest;
+		bool bPlaying;
+
+		qint64 lateness(unsigned int seq, quint64 now) const;
+	public:
+		PlayoutBuffer(PlayoutStats *stats, unsigned int minframes, int percentile);
+		void put(const QByteArray &packet, unsigned int seq, unsigned int frames);
+		Action get(QByteArray &packet, unsigned int &frames);
+		bool isPlaying() const;
+		quint64 target() const;
+};
+
+#endif
@@ -205,6 +205,30 @@ void PluginConfig::on_qtwPlugins_currentItemChanged(QTreeWidgetItem *current, QT
 	}
 }
 
+PluginFetcher::PluginFetcher(Plugins *plugins) : QThread(), p(plugins) {
+	bRunning = true;
+}
+
+void PluginFetcher::stop() {
+	QMutexLocker lock(&qmSleep);
+	bRunning = false;
+	qwcSleep.wakeAll();
+}
+
+void PluginFetcher::run() {
+	QMutexLocker lock(&qmSleep);
+
+	while (bRunning) {
+		lock.unlock();
+		p->fetch();
+		p->publish();
+		lock.relock();
+
+		if (bRunning)
+			qwcSleep.wait(&qmSleep, static_cast<unsigned long>(1000 / qBound(1, g.s.iPositionalRate, 1000)));
+	}
+}
+
 Plugins::Plugins(QObject *p) : QObject(p) {
 	QTimer *timer=new QTimer(this);
 	timer->setObjectName(QLatin1String("Timer"));
@@ -213,7 +237,9 @@ Plugins::Plugins(QObject *p) : QObject(p) {
 	bValid = false;
 	iPluginTry = 0;
 	for (int i=0;i<3;i++)
-		fPosition[i]=fFront[i]=fTop[i]= 0.0;
+		fPosition[i]=fFront[i]=fTop[i]=fCameraPosition[i]=fCameraFront[i]=fCameraTop[i]= 0.0;
+	memset(&pdPrevious, 0, sizeof(pdPrevious));
+	memset(&pdCurrent, 0, sizeof(pdCurrent));
 	QMetaObject::connectSlotsByName(this);
 
 #ifdef QT_NO_DEBUG
@@ -257,9 +283,16 @@ Plugins::Plugins(QObject *p) : QObject(p) {
 
 	AdjustTokenPrivileges(hToken, FALSE, &tp, sizeof(TOKEN_PRIVILEGES), &tpPrevious, &cbPrevious);
 #endif
+
+	pfFetcher = new PluginFetcher(this);
+	pfFetcher->start(QThread::HighPriority);
 }
 
 Plugins::~Plugins() {
+	pfFetcher->stop();
+	pfFetcher->wait();
+	delete pfFetcher;
+
 	clearPlugins();
 
 #ifdef Q_OS_WIN
@@ -395,9 +428,72 @@ bool Plugins::fetch() {
 	return bValid;
 }
 
-void Plugins::on_Timer_timeout() {
-	fetch();
+/**
+ * Makes the result of the last fetch() available to positionalData().
+ * Must only be called from the fetcher thread, which is the only writer.
+ */
+void Plugins::publish() {
+	PositionalData pd;
+	pd.bValid = bValid;
+	pd.uiTime = tTime.elapsed();
+	for (int i=0;i<3;++i) {
+		pd.fPosition[i] = fPosition[i];
+		pd.fFront[i] = fFront[i];
+		pd.fTop[i] = fTop[i];
+		pd.fCameraPosition[i] = fCameraPosition[i];
+		pd.fCameraFront[i] = fCameraFront[i];
+		pd.fCameraTop[i] = fCameraTop[i];
+	}
 
+	qaiSequence.fetchAndAddOrdered(1);
+	pdPrevious = pdCurrent;
+	pdCurrent = pd;
+	qaiSequence.fetchAndAddOrdered(1);
+}
+
+/**
+ * Reads the latest positional data without taking any locks, which makes
+ * it safe to call from the audio callbacks.
+ *
+ * With interpolate set, the result lags one fetch interval behind and is
+ * blended between the last two fetches according to the current time, so
+ * movement stays smooth even if the game is polled less often than audio
+ * is mixed.
+ */
+bool Plugins::positionalData(PositionalData &pd, bool interpolate) {
+	PositionalData prev, cur;
+	int seq;
+
+	forever {
+		seq = qaiSequence.fetchAndAddOrdered(0);
+		if (seq & 1)
+			continue;
+		prev = pdPrevious;
+		cur = pdCurrent;
+		if (qaiSequence.fetchAndAddOrdered(0) == seq)
+			break;
+	}
+
+	pd = cur;
+	if (! cur.bValid || ! interpolate || ! prev.bValid || (cur.uiTime <= prev.uiTime))
+		return pd.bValid;
+
+	const quint64 now = tTime.elapsed();
+	const float t = qMin(1.0f, static_cast<float>(now - cur.uiTime) / static_cast<float>(cur.uiTime - prev.uiTime));
+	const float s = 1.0f - t;
+
+	for (int i=0;i<3;++i) {
+		pd.fPosition[i] = prev.fPosition[i] * s + cur.fPosition[i] * t;
+		pd.fFront[i] = prev.fFront[i] * s + cur.fFront[i] * t;
+		pd.fTop[i] = prev.fTop[i] * s + cur.fTop[i] * t;
+		pd.fCameraPosition[i] = prev.fCameraPosition[i] * s + cur.fCameraPosition[i] * t;
+		pd.fCameraFront[i] = prev.fCameraFront[i] * s + cur.fCameraFront[i] * t;
+		pd.fCameraTop[i] = prev.fCameraTop[i] * s + cur.fCameraTop[i] * t;
+	}
+	return true;
+}
+
+void Plugins::on_Timer_timeout() {
 	QReadLocker lock(&qrwlPlugins);
 
 	if (prevlocked) {
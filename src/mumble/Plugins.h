@@ -31,15 +31,19 @@
 #ifndef MUMBLE_MUMBLE_PLUGINS_H_
 #define MUMBLE_MUMBLE_PLUGINS_H_
 
+#include <QtCore/QAtomicInt>
 #include <QtCore/QObject>
 #include <QtCore/QMutex>
 #include <QtCore/QReadWriteLock>
+#include <QtCore/QThread>
 #include <QtCore/QUrl>
+#include <QtCore/QWaitCondition>
 #ifdef Q_OS_WIN
 #include <windows.h>
 #endif
 
 #include "ConfigDialog.h"
+#include "Timer.h"
 
 #include "ui_Plugins.h"
 
@@ -66,12 +70,46 @@ class PluginConfig : public ConfigWidget, public Ui::PluginConfig {
 		void on_qtwPlugins_currentItemChanged(QTreeWidgetItem *, QTreeWidgetItem *);
 };
 
+class Plugins;
+
+// Polls the linked plugin at g.s.iPositionalRate, so that reading game
+// memory never happens on the audio threads.
+class PluginFetcher : public QThread {
+	private:
+		Q_OBJECT
+		Q_DISABLE_COPY(PluginFetcher)
+	protected:
+		Plugins *p;
+		volatile bool bRunning;
+		QMutex qmSleep;
+		QWaitCondition qwcSleep;
+	public:
+		PluginFetcher(Plugins *plugins);
+		void run();
+		void stop();
+};
+
 class Plugins : public QObject {
 		friend class PluginConfig;
+		friend class PluginFetcher;
 	private:
 		Q_OBJECT
 		Q_DISABLE_COPY(Plugins)
+	public:
+		struct PositionalData {
+			bool bValid;
+			quint64 uiTime;
+			float fPosition[3], fFront[3], fTop[3];
+			float fCameraPosition[3], fCameraFront[3], fCameraTop[3];
+		};
 	protected:
+		// Last two fetches, published by the fetcher thread under a
+		// sequence lock: readers retry while the sequence is odd or changed.
+		QAtomicInt qaiSequence;
+		PositionalData pdPrevious, pdCurrent;
+		Timer tTime;
+		PluginFetcher *pfFetcher;
+		void publish();
 		QReadWriteLock qrwlPlugins;
 		QMutex qmPluginStrings;
 		QList<PluginInfo *> qlPlugins;
@@ -92,11 +130,13 @@ class Plugins : public QObject {
 		std::wstring swsIdentity, swsIdentitySent;
 		bool bValid;
 		bool bUnlink;
+		// Only touched by fetch(); other threads use positionalData().
 		float fPosition[3], fFront[3], fTop[3];
 		float fCameraPosition[3], fCameraFront[3], fCameraTop[3];
 
 		Plugins(QObject *p = NULL);
 		~Plugins();
+		bool positionalData(PositionalData &pd, bool interpolate = false);
 	public slots:
 		void on_Timer_timeout();
 		void rescanPlugins();
@@ -90,8 +90,12 @@ ServerHandler::ServerHandler() {
 	bStrong = false;
 	usPort = 0;
 	bUdp = true;
+	uiConnectionId = 0;
 	tConnectionTimeoutTimer = NULL;
 	uiVersion = 0;
+	bCompactPosition = false;
+	bOpusTiers = false;
+	iUplinkLoss = 0;
 
 	// For some strange reason, on Win32, we have to call supportsSsl before the cipher list is ready.
 	qWarning("OpenSSL Support: %d (%s)", QSslSocket::supportsSsl(), SSLeay_version(SSLEAY_VERSION));
@@ -179,6 +183,12 @@ void ServerHandler::udpReady() {
 			continue;
 		}
 
+		// The server knows our address now.
+		{
+			QMutexLocker qml(&qmUdp);
+			uiConnectionId = 0;
+		}
+
 		PacketDataStream pds(buffer + 1, buflen-5);
 
 		MessageHandler::UDPMessageType msgType = static_cast<MessageHandler::UDPMessageType>((buffer[0] >> 5) & 0x7);
@@ -220,7 +230,7 @@ void ServerHandler::handleVoicePacket(unsigned int msgFlags, PacketDataStream &p
 }
 
 void ServerHandler::sendMessage(const char *data, int len, bool force) {
-	STACKVAR(unsigned char, crypto, len+4);
+	STACKVAR(unsigned char, crypto, len+8);
 
 	QMutexLocker qml(&qmUdp);
 
@@ -242,11 +252,26 @@ void ServerHandler::sendMessage(const char *data, int len, bool force) {
 
 		QApplication::postEvent(this, new ServerHandlerMessageEvent(qba, MessageHandler::UDPTunnel, true));
 	} else {
-		connection->csCrypt.encrypt(reinterpret_cast<const unsigned char *>(data), crypto, len);
-		qusUdp->writeDatagram(reinterpret_cast<const char *>(crypto), len + 4, qhaRemote, usPort);
+		int hintlen = 0;
+		if (uiConnectionId) {
+			qToBigEndian<quint32>(uiConnectionId, crypto);
+			hintlen = 4;
+		}
+		connection->csCrypt.encrypt(reinterpret_cast<const unsigned char *>(data), crypto + hintlen, len);
+		qusUdp->writeDatagram(reinterpret_cast<const char *>(crypto), len + 4 + hintlen, qhaRemote, usPort);
 	}
 }
 
+/**
+ * Sets the connection id the server sent with the UDP key, or 0 if it
+ * didn't send one. It goes in front of our UDP packets so the server can find
+ * us without trying the key of everyone else behind the same NAT.
+ */
+void ServerHandler::setConnectionId(quint32 id) {
+	QMutexLocker qml(&qmUdp);
+	uiConnectionId = id;
+}
+
 void ServerHandler::sendProtoMessage(const ::google::protobuf::Message &msg, unsigned int msgType) {
 	QByteArray qba;
 
@@ -311,6 +336,9 @@ void ServerHandler::run() {
 	accUDP = accTCP = accClean;
 
 	uiVersion = 0;
+	bCompactPosition = false;
+	bOpusTiers = false;
+	iUplinkLoss = 0;
 	qsRelease = QString();
 	qsOS = QString();
 	qsOSVersion = QString();
@@ -461,6 +489,16 @@ void ServerHandler::message(unsigned int msgType, const QByteArray &qbaMsg) {
 			if (!connection) return;
 
 			CryptState &cs = connection->csCrypt;
+
+			// The counters are cumulative; only the change since the last
+			// ping says anything about current conditions.
+			if ((msg.good() >= cs.uiRemoteGood) && (msg.lost() >= cs.uiRemoteLost)) {
+				unsigned int good = msg.good() - cs.uiRemoteGood;
+				unsigned int lost = msg.lost() - cs.uiRemoteLost;
+				if (good + lost > 0)
+					iUplinkLoss = (iUplinkLoss * 3 + static_cast<int>((lost * 100) / (good + lost))) / 4;
+			}
+
 			cs.uiRemoteGood = msg.good();
 			cs.uiRemoteLate = msg.late();
 			cs.uiRemoteLost = msg.lost();
@@ -585,6 +623,7 @@ void ServerHandler::serverConnectionConnected() {
 #else
 	mpa.set_opus(false);
 #endif
+	mpa.set_position_compact(true);
 	sendMessage(mpa);
 
 	{
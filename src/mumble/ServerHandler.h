@@ -94,6 +94,9 @@ class ServerHandler : public QThread {
 		QHostAddress qhaRemote;
 		QUdpSocket *qusUdp;
 		QMutex qmUdp;
+		// Sent in front of UDP packets until the server answers over UDP.
+		// Protected by qmUdp.
+		quint32 uiConnectionId;
 
 		void handleVoicePacket(unsigned int msgFlags, PacketDataStream &pds, MessageHandler::UDPMessageType type);
 	public:
@@ -107,6 +110,12 @@ class ServerHandler : public QThread {
 		boost::shared_ptr<VoiceRecorder> recorder;
 
 		unsigned int uiVersion;
+		// Positions in voice packets use PositionCodec instead of raw floats.
+		volatile bool bCompactPosition;
+		// Server relays lower quality Opus tiers; see AudioInput::transmitOpusTiers().
+		volatile bool bOpusTiers;
+		// Smoothed percentage of our UDP packets the server reports as lost.
+		volatile int iUplinkLoss;
 		QString qsRelease;
 		QString qsOS;
 		QString qsOSVersion;
@@ -122,6 +131,7 @@ class ServerHandler : public QThread {
 
 		void sendProtoMessage(const ::google::protobuf::Message &msg, unsigned int msgType);
 		void sendMessage(const char *data, int len, bool force = false);
+		void setConnectionId(quint32 id);
 
 #define MUMBLE_MH_MSG(x) void sendMessage(const MumbleProto:: x &msg) { sendProtoMessage(msg, MessageHandler:: x); }
 		MUMBLE_MH_ALL
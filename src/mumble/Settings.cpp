@@ -261,6 +261,8 @@ Settings::Settings() {
 	iTTSVolume = 75;
 	iTTSThreshold = 250;
 	iQuality = 40000;
+	bOpusFEC = false;
+	bOpusDTX = true;
 	fVolume = 1.0f;
 	fOtherVolume = 0.5f;
 	bAttenuateOthersOnTalk = false;
@@ -269,6 +271,7 @@ Settings::Settings() {
 	iVoiceHold = 50;
 	iJitterBufferSize = 1;
 	iFramesPerPacket = 2;
+	iJitterPercentile = 95;
 	iNoiseSuppress = -30;
 
 	// Idle auto actions
@@ -346,6 +349,8 @@ Settings::Settings() {
 
 	bPositionalAudio = true;
 	bPositionalHeadphone = false;
+	bPositionalBinaural = false;
+	iPositionalRate = 100;
 	fAudioMinDistance = 1.0f;
 	fAudioMaxDistance = 15.0f;
 	fAudioMaxDistVolume = 0.80f;
@@ -364,10 +369,12 @@ Settings::Settings() {
 	bAutoConnect = false;
 	ptProxyType = NoProxy;
 	usProxyPort = 0;
+	iPingRate = 100;
 
 	iMaxImageSize = ciDefaultMaxImageSize;
 	iMaxImageWidth = 1024; // Allow 1024x1024 resolution
 	iMaxImageHeight = 1024;
+	iMaxLogBlocks = 5000;
 	bSuppressIdentity = false;
 
 	// Accessibility
@@ -558,6 +565,8 @@ void Settings::load(QSettings* settings_ptr) {
 	SAVELOAD(qsTxAudioCueOn, "audio/pushclickon");
 	SAVELOAD(qsTxAudioCueOff, "audio/pushclickoff");
 	SAVELOAD(iQuality, "audio/quality");
+	SAVELOAD(bOpusFEC, "audio/opusfec");
+	SAVELOAD(bOpusDTX, "audio/opusdtx");
 	SAVELOAD(iMinLoudness, "audio/loudness");
 	SAVELOAD(fVolume, "audio/volume");
 	SAVELOAD(fOtherVolume, "audio/othervolume");
@@ -584,6 +593,8 @@ void Settings::load(QSettings* settings_ptr) {
 	SAVELOAD(bExclusiveOutput, "audio/exclusiveoutput");
 	SAVELOAD(bPositionalAudio, "audio/positional");
 	SAVELOAD(bPositionalHeadphone, "audio/headphone");
+	SAVELOAD(bPositionalBinaural, "audio/binaural");
+	SAVELOAD(iPositionalRate, "audio/positionalrate");
 	SAVELOAD(qsAudioInput, "audio/input");
 	SAVELOAD(qsAudioOutput, "audio/output");
 	SAVELOAD(bWhisperFriends, "audio/whisperfriends");
@@ -591,6 +602,8 @@ void Settings::load(QSettings* settings_ptr) {
 
 	SAVELOAD(iJitterBufferSize, "net/jitterbuffer");
 	SAVELOAD(iFramesPerPacket, "net/framesperpacket");
+	SAVELOAD(iJitterPercentile, "net/jitterpercentile");
+	SAVELOAD(qlOpusTiers, "net/opustiers");
 
 	SAVELOAD(qsASIOclass, "asio/class");
 	SAVELOAD(qlASIOmic, "asio/mic");
@@ -636,7 +649,9 @@ void Settings::load(QSettings* settings_ptr) {
 	SAVELOAD(iMaxImageSize, "net/maximagesize");
 	SAVELOAD(iMaxImageWidth, "net/maximagewidth");
 	SAVELOAD(iMaxImageHeight, "net/maximageheight");
+	SAVELOAD(iMaxLogBlocks, "ui/maxlogblocks");
 	SAVELOAD(qsRegionalHost, "net/region");
+	SAVELOAD(iPingRate, "net/pingrate");
 
 	SAVELOAD(bExpert, "ui/expert");
 	SAVELOAD(qsLanguage, "ui/language");
@@ -847,6 +862,8 @@ void Settings::save() {
 	SAVELOAD(qsTxAudioCueOn, "audio/pushclickon");
 	SAVELOAD(qsTxAudioCueOff, "audio/pushclickoff");
 	SAVELOAD(iQuality, "audio/quality");
+	SAVELOAD(bOpusFEC, "audio/opusfec");
+	SAVELOAD(bOpusDTX, "audio/opusdtx");
 	SAVELOAD(iMinLoudness, "audio/loudness");
 	SAVELOAD(fVolume, "audio/volume");
 	SAVELOAD(fOtherVolume, "audio/othervolume");
@@ -873,6 +890,8 @@ void Settings::save() {
 	SAVELOAD(bExclusiveOutput, "audio/exclusiveoutput");
 	SAVELOAD(bPositionalAudio, "audio/positional");
 	SAVELOAD(bPositionalHeadphone, "audio/headphone");
+	SAVELOAD(bPositionalBinaural, "audio/binaural");
+	SAVELOAD(iPositionalRate, "audio/positionalrate");
 	SAVELOAD(qsAudioInput, "audio/input");
 	SAVELOAD(qsAudioOutput, "audio/output");
 	SAVELOAD(bWhisperFriends, "audio/whisperfriends");
@@ -880,6 +899,8 @@ void Settings::save() {
 
 	SAVELOAD(iJitterBufferSize, "net/jitterbuffer");
 	SAVELOAD(iFramesPerPacket, "net/framesperpacket");
+	SAVELOAD(iJitterPercentile, "net/jitterpercentile");
+	SAVELOAD(qlOpusTiers, "net/opustiers");
 
 	SAVELOAD(qsASIOclass, "asio/class");
 	SAVELOAD(qlASIOmic, "asio/mic");
@@ -924,7 +945,9 @@ void Settings::save() {
 	SAVELOAD(iMaxImageSize, "net/maximagesize");
 	SAVELOAD(iMaxImageWidth, "net/maximagewidth");
 	SAVELOAD(iMaxImageHeight, "net/maximageheight");
+	SAVELOAD(iMaxLogBlocks, "ui/maxlogblocks");
 	SAVELOAD(qsRegionalHost, "net/region");
+	SAVELOAD(iPingRate, "net/pingrate");
 
 	SAVELOAD(bExpert, "ui/expert");
 	SAVELOAD(qsLanguage, "ui/language");
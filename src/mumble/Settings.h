@@ -189,6 +189,7 @@ struct Settings {
 	bool bTTSMessageReadBack;
 	int iTTSVolume, iTTSThreshold;
 	int iQuality, iMinLoudness, iVoiceHold, iJitterBufferSize;
+	bool bOpusFEC, bOpusDTX;
 	int iNoiseSuppress;
 
 	// Idle auto actions
@@ -198,6 +199,8 @@ struct Settings {
 	VADSource vsVAD;
 	float fVADmin, fVADmax;
 	int iFramesPerPacket;
+	int iJitterPercentile;
+	QList<QVariant> qlOpusTiers;
 	QString qsAudioInput, qsAudioOutput;
 	float fVolume;
 	float fOtherVolume;
@@ -221,6 +224,8 @@ struct Settings {
 	bool bEchoMulti;
 	bool bPositionalAudio;
 	bool bPositionalHeadphone;
+	bool bPositionalBinaural;
+	int iPositionalRate;
 	float fAudioMinDistance, fAudioMaxDistance, fAudioMaxDistVolume, fAudioBloom;
 	QMap<QString, bool> qmPositionalAudioPlugins;
 
@@ -286,11 +291,13 @@ struct Settings {
 	QString qsProxyHost, qsProxyUsername, qsProxyPassword;
 	unsigned short usProxyPort;
 	QString qsRegionalHost;
+	int iPingRate;
 
 	static const int ciDefaultMaxImageSize = 50 * 1024; // Restrict to 50KiB as a default
 	int iMaxImageSize;
 	int iMaxImageWidth;
 	int iMaxImageHeight;
+	int iMaxLogBlocks;
 	KeyPair kpCertificate;
 	bool bSuppressIdentity;
 
@@ -0,0 +1,392 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _USE_MATH_DEFINES
+#include <QtCore/QtGlobal>
+
+#include <cmath>
+#include <cstring>
+
+#include "Spatializer.h"
+
+// Head radius over speed of sound, for Woodworth's ITD approximation.
+static const float fHeadDelay = 0.0875f / 343.0f;
+// Level difference between the ears for a source directly to the side, in dB.
+static const float fMaxLevelDifference = 10.0f;
+
+const float Spatializer::fDelaySlew = 2.0f;
+
+Spatializer::Params::Params() {
+	fMinDistance = 1.0f;
+	fMaxDistance = 15.0f;
+	fMaxDistVolume = 0.80f;
+	fBloom = 0.5f;
+	bBinaural = false;
+}
+
+bool Spatializer::Params::operator ==(const Params &other) const {
+	return (fMinDistance == other.fMinDistance) && (fMaxDistance == other.fMaxDistance) && (fMaxDistVolume == other.fMaxDistVolume) && (fBloom == other.fBloom) && (bBinaural == other.bBinaural);
+}
+
+Spatializer::Spatializer() {
+	iChannels = 0;
+	bHeadphone = false;
+	fSpeakers = NULL;
+	bSpeakerPositional = NULL;
+	fRotated = NULL;
+	memset(fListener, 0, sizeof(fListener));
+	memset(fRight, 0, sizeof(fRight));
+	uiGeneration = 0;
+	fDelayScale = 0.0f;
+	uiScratch = 0;
+	pfScratch = NULL;
+}
+
+Spatializer::~Spatializer() {
+	delete [] fSpeakers;
+	delete [] bSpeakerPositional;
+	delete [] fRotated;
+	delete [] pfScratch;
+}
+
+void Spatializer::setSpeakers(unsigned int channels, const float *speakers, const bool *positional, bool headphone, unsigned int samplerate) {
+	delete [] fSpeakers;
+	delete [] bSpeakerPositional;
+	delete [] fRotated;
+
+	iChannels = channels;
+	bHeadphone = headphone;
+	fSpeakers = new float[channels * 3];
+	bSpeakerPositional = new bool[channels];
+	fRotated = new float[channels * 3];
+
+	memcpy(fSpeakers, speakers, sizeof(float) * channels * 3);
+	memcpy(bSpeakerPositional, positional, sizeof(bool) * channels);
+	memcpy(fRotated, speakers, sizeof(float) * channels * 3);
+
+	fDelayScale = qMin(fHeadDelay * static_cast<float>(samplerate), static_cast<float>(iMaxDelay - 1) / (static_cast<float>(M_PI) / 2.0f + 1.0f));
+
+	++uiGeneration;
+}
+
+/**
+ * Sets up the listener from the camera of the positional audio plugin.
+ * The speakers are only re-rotated, and the generation only bumped, if the
+ * camera or the parameters actually changed since the last call; callers
+ * can use generation() to tell if cached source gains are still valid.
+ */
+void Spatializer::setListener(const float *position, const float *front, const float *top, const Params &p) {
+	float listener[9] = { position[0], position[1], position[2], front[0], front[1], front[2], top[0], top[1], top[2] };
+
+	if ((memcmp(listener, fListener, sizeof(listener)) == 0) && (p == pParams))
+		return;
+
+	memcpy(fListener, listener, sizeof(listener));
+	pParams = p;
+	++uiGeneration;
+
+	float f[3] = { front[0], front[1], front[2] };
+	float t[3] = { top[0], top[1], top[2] };
+
+	// Front vector is dominant; if it's zero we presume all is zero.
+
+	float flen = sqrtf(f[0]*f[0]+f[1]*f[1]+f[2]*f[2]);
+
+	if (flen > 0.0f) {
+		f[0] *= (1.0f / flen);
+		f[1] *= (1.0f / flen);
+		f[2] *= (1.0f / flen);
+
+		float tlen = sqrtf(t[0]*t[0]+t[1]*t[1]+t[2]*t[2]);
+
+		if (tlen > 0.0f) {
+			t[0] *= (1.0f / tlen);
+			t[1] *= (1.0f / tlen);
+			t[2] *= (1.0f / tlen);
+		} else {
+			t[0] = 0.0f;
+			t[1] = 1.0f;
+			t[2] = 0.0f;
+		}
+
+		if (fabsf(f[0] * t[0] + f[1] * t[1] + f[2] * t[2]) > 0.01f) {
+			// Not perpendicular. Assume Y up and rotate 90 degrees.
+
+			float azimuth = 0.0f;
+			if ((f[0] != 0.0f) || (f[2] != 0.0f))
+				azimuth = atan2f(f[2], f[0]);
+			float inclination = acosf(f[1]) - static_cast<float>(M_PI) / 2.0f;
+
+			t[0] = sinf(inclination)*cosf(azimuth);
+			t[1] = cosf(inclination);
+			t[2] = sinf(inclination)*sinf(azimuth);
+		}
+	} else {
+		f[0] = 0.0f;
+		f[1] = 0.0f;
+		f[2] = 1.0f;
+
+		t[0] = 0.0f;
+		t[1] = 1.0f;
+		t[2] = 0.0f;
+	}
+
+	// Calculate right vector as front X top
+	fRight[0] = t[1]*f[2] - t[2]*f[1];
+	fRight[1] = t[2]*f[0] - t[0]*f[2];
+	fRight[2] = t[0]*f[1] - t[1]*f[0];
+
+	// Rotate speakers to match orientation
+	for (unsigned int i=0;i<iChannels;++i) {
+		const float *s = &fSpeakers[3*i];
+		fRotated[3*i+0] = s[0] * fRight[0] + s[1] * t[0] + s[2] * f[0];
+		fRotated[3*i+1] = s[0] * fRight[1] + s[1] * t[1] + s[2] * f[1];
+		fRotated[3*i+2] = s[0] * fRight[2] + s[1] * t[2] + s[2] * f[2];
+	}
+}
+
+unsigned int Spatializer::generation() const {
+	return uiGeneration;
+}
+
+bool Spatializer::binaural() const {
+	return bHeadphone && pParams.bBinaural;
+}
+
+const float *Spatializer::rotatedSpeakers() const {
+	return fRotated;
+}
+
+/**
+ * Computes the gain of every speaker for a batch of sources at the given
+ * world positions. Gains are the same as gain() evaluated per source and
+ * speaker (unless the binaural model is active), but the distance
+ * attenuation is only calculated once per source.
+ *
+ * If delays is non-NULL and the binaural model is active, it receives the
+ * interaural delay per source in samples; positive values mean the source
+ * is to the right, so the left ear hears it late.
+ */
+void Spatializer::compute(unsigned int count, const float *x, const float *y, const float *z, float *gains, float *delays) {
+	if (count == 0)
+		return;
+
+	if (uiScratch < count) {
+		delete [] pfScratch;
+		uiScratch = count;
+		pfScratch = new float[uiScratch * 7];
+	}
+
+	float * RESTRICT dx = pfScratch;
+	float * RESTRICT dy = dx + count;
+	float * RESTRICT dz = dy + count;
+	float * RESTRICT dist = dz + count;
+	float * RESTRICT mul = dist + count;
+	float * RESTRICT add = mul + count;
+	float * RESTRICT lateral = add + count;
+
+	const float lx = fListener[0];
+	const float ly = fListener[1];
+	const float lz = fListener[2];
+
+	// Direction and distance to each source.
+	for (unsigned int i=0;i<count;++i) {
+		const float ax = x[i] - lx;
+		const float ay = y[i] - ly;
+		const float az = z[i] - lz;
+		const float d = sqrtf(ax * ax + ay * ay + az * az);
+		const float inv = (d > 0.0f) ? (1.0f / d) : 0.0f;
+		dx[i] = ax * inv;
+		dy[i] = ay * inv;
+		dz[i] = az * inv;
+		dist[i] = d;
+	}
+
+	// Distance attenuation, expressed as gain = min(1, mul * direction + add).
+	if (pParams.fMaxDistVolume > 0.99f) {
+		for (unsigned int i=0;i<count;++i) {
+			mul[i] = 1.0f;
+			add[i] = pParams.fBloom;
+		}
+	} else {
+		const float mvol = qMax(pParams.fMaxDistVolume, 0.01f);
+		const float lmvol = log10f(mvol);
+		const float range = pParams.fMaxDistance - pParams.fMinDistance;
+		for (unsigned int i=0;i<count;++i) {
+			const float d = dist[i];
+			if (d < pParams.fMinDistance) {
+				mul[i] = 1.0f;
+				add[i] = pParams.fBloom * (1.0f - d / pParams.fMinDistance);
+			} else {
+				mul[i] = (d >= pParams.fMaxDistance) ? pParams.fMaxDistVolume : powf(10.0f, lmvol * (d - pParams.fMinDistance) / range);
+				add[i] = 0.0f;
+			}
+		}
+	}
+
+	const bool bin = binaural();
+
+	if (bin) {
+		const float rx = fRight[0];
+		const float ry = fRight[1];
+		const float rz = fRight[2];
+		for (unsigned int i=0;i<count;++i)
+			lateral[i] = qBound(-1.0f, dx[i] * rx + dy[i] * ry + dz[i] * rz, 1.0f);
+
+		if (delays)
+			for (unsigned int i=0;i<count;++i)
+				delays[i] = fDelayScale * (asinf(lateral[i]) + lateral[i]);
+	}
+
+	const float ild = -fMaxLevelDifference / 20.0f * static_cast<float>(M_LN10);
+
+	for (unsigned int c=0;c<iChannels;++c) {
+		float * RESTRICT g = gains + c * count;
+		const float side = fSpeakers[3*c+0];
+
+		if (! bSpeakerPositional[c]) {
+			for (unsigned int i=0;i<count;++i)
+				g[i] = qMin(1.0f, mul[i] + add[i]);
+		} else if (bin && (side != 0.0f)) {
+			// Near ear goes from half to full level as the source moves to
+			// the side, the far ear additionally gets the head shadow.
+			const float sgn = (side > 0.0f) ? 1.0f : -1.0f;
+			for (unsigned int i=0;i<count;++i) {
+				const float s = lateral[i] * sgn;
+				const float a = fabsf(s);
+				const float nearlevel = 0.5f + 0.5f * a;
+				const float level = (s >= 0.0f) ? nearlevel : nearlevel * expf(ild * a);
+				g[i] = qMin(1.0f, mul[i] * level + add[i]);
+			}
+		} else {
+			const float sx = fRotated[3*c+0];
+			const float sy = fRotated[3*c+1];
+			const float sz = fRotated[3*c+2];
+			for (unsigned int i=0;i<count;++i) {
+				const float dot = dx[i] * sx + dy[i] * sy + dz[i] * sz;
+				g[i] = qMin(1.0f, mul[i] * (dot + 1.0f) * 0.5f + add[i]);
+			}
+		}
+	}
+}
+
+/**
+ * Returns how late the given speaker channel should play a source with the
+ * given interaural delay. Only the ear facing away from the source is delayed.
+ */
+float Spatializer::channelDelay(unsigned int channel, float delay) const {
+	const float side = fSpeakers[3*channel+0];
+	if (side * delay < 0.0f)
+		return fabsf(delay);
+	return 0.0f;
+}
+
+// Here's the theory.
+// We support sound "bloom"ing. That is, if sound comes directly from the left, if it is sufficiently
+// close, we'll hear it full intensity from the left side, and "bloom" intensity from the right side.
+
+float Spatializer::gain(const Params &p, float dotproduct, float distance) {
+
+	float dotfactor = (dotproduct + 1.0f) / 2.0f;
+	float att;
+
+
+	// No distance attenuation
+	if (p.fMaxDistVolume > 0.99f) {
+		att = qMin(1.0f, dotfactor + p.fBloom);
+	} else if (distance < p.fMinDistance) {
+		float bloomfac = p.fBloom * (1.0f - distance/p.fMinDistance);
+
+		att = qMin(1.0f, bloomfac + dotfactor);
+	} else {
+		float datt;
+
+		if (distance >= p.fMaxDistance) {
+			datt = p.fMaxDistVolume;
+		} else {
+			float mvol = p.fMaxDistVolume;
+			if (mvol < 0.01f)
+				mvol = 0.01f;
+
+			float drel = (distance-p.fMinDistance) / (p.fMaxDistance - p.fMinDistance);
+			datt = powf(10.0f, log10f(mvol) * drel);
+		}
+
+		att = datt * dotfactor;
+	}
+	return att;
+}
+
+/**
+ * Mixes input into output while moving the delay from delay to newdelay and
+ * the volume from vol to newvol over the period. Fractional delays are
+ * linearly interpolated; samples before the start of input are taken from
+ * history, which holds the last iHistory samples of the previous period.
+ */
+void Spatializer::mixDelayed(float *output, unsigned int stride, const float *input, const float *history, unsigned int nsamp, float delay, float newdelay, float vol, float newvol) {
+	float * RESTRICT o = output;
+	const float * RESTRICT in = input;
+	const float * RESTRICT hist = history + iHistory;
+
+	const float dinc = (newdelay - delay) / static_cast<float>(nsamp);
+	const float vinc = (newvol - vol) / static_cast<float>(nsamp);
+
+	// Only the first few samples can reach back into the history.
+	const unsigned int head = qMin(nsamp, static_cast<unsigned int>(qMax(delay, newdelay)) + 2);
+
+	for (unsigned int i=0;i<head;++i) {
+		const float pos = static_cast<float>(i) - (delay + dinc * static_cast<float>(i));
+		const float fl = floorf(pos);
+		const int ip = static_cast<int>(fl);
+		const float frac = pos - fl;
+
+		const float a = (ip >= 0) ? in[ip] : hist[ip];
+		const float b = (frac > 0.0f) ? ((ip + 1 >= 0) ? in[ip + 1] : hist[ip + 1]) : a;
+
+		o[i*stride] += (a + (b - a) * frac) * (vol + vinc * static_cast<float>(i));
+	}
+
+	for (unsigned int i=head;i<nsamp;++i) {
+		const float pos = static_cast<float>(i) - (delay + dinc * static_cast<float>(i));
+		const int ip = static_cast<int>(pos);
+		const float frac = pos - static_cast<float>(ip);
+
+		o[i*stride] += (in[ip] + (in[ip + 1] - in[ip]) * frac) * (vol + vinc * static_cast<float>(i));
+	}
+}
+
+void Spatializer::updateHistory(float *history, const float *input, unsigned int nsamp) {
+	if (nsamp >= iHistory) {
+		memcpy(history, input + nsamp - iHistory, sizeof(float) * iHistory);
+	} else {
+		memmove(history, history + nsamp, sizeof(float) * (iHistory - nsamp));
+		memcpy(history + iHistory - nsamp, input, sizeof(float) * nsamp);
+	}
+}
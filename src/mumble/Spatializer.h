@@ -0,0 +1,99 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_MUMBLE_SPATIALIZER_H_
+#define MUMBLE_MUMBLE_SPATIALIZER_H_
+
+#include <QtCore/QtGlobal>
+
+// Listener-relative gain computation for positional audio.
+//
+// Sources are handed over as separate x/y/z arrays and processed in tight
+// loops without cross-iteration dependencies, so the compiler can vectorize
+// the per-source and per-speaker math. Gains are written speaker-major:
+// gains[channel * count + source].
+//
+// For headphones, an optional "HRTF-lite" model replaces plain dot product
+// panning with a level difference (ILD) and a time difference (ITD) between
+// the ears.
+class Spatializer {
+	private:
+		Q_DISABLE_COPY(Spatializer)
+	public:
+		struct Params {
+			float fMinDistance;
+			float fMaxDistance;
+			float fMaxDistVolume;
+			float fBloom;
+			bool bBinaural;
+
+			Params();
+			bool operator ==(const Params &other) const;
+		};
+
+		// Longest interaural delay in samples, and the history needed to apply it.
+		static const unsigned int iMaxDelay = 64;
+		static const unsigned int iHistory = iMaxDelay + 2;
+		// Most the interaural delay may move per mixed period, in samples.
+		static const float fDelaySlew;
+	protected:
+		unsigned int iChannels;
+		bool bHeadphone;
+		float *fSpeakers;
+		bool *bSpeakerPositional;
+		// Speakers rotated into world space.
+		float *fRotated;
+		float fListener[9];
+		float fRight[3];
+		Params pParams;
+		unsigned int uiGeneration;
+		float fDelayScale;
+
+		unsigned int uiScratch;
+		float *pfScratch;
+	public:
+		Spatializer();
+		~Spatializer();
+
+		void setSpeakers(unsigned int channels, const float *speakers, const bool *positional, bool headphone, unsigned int samplerate);
+		void setListener(const float *position, const float *front, const float *top, const Params &p);
+		unsigned int generation() const;
+		bool binaural() const;
+		const float *rotatedSpeakers() const;
+
+		void compute(unsigned int count, const float *x, const float *y, const float *z, float *gains, float *delays);
+		float channelDelay(unsigned int channel, float delay) const;
+
+		static float gain(const Params &p, float dotproduct, float distance);
+		static void mixDelayed(float *output, unsigned int stride, const float *input, const float *history, unsigned int nsamp, float delay, float newdelay, float vol, float newvol);
+		static void updateHistory(float *history, const float *input, unsigned int nsamp);
+};
+
+#endif
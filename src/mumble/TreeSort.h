@@ -0,0 +1,115 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_MUMBLE_TREESORT_H_
+#define MUMBLE_MUMBLE_TREESORT_H_
+
+#include <QtCore/QtGlobal>
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+# include <QtWidgets/QTreeWidget>
+#else
+# include <QtGui/QTreeWidget>
+#endif
+
+// Incremental ordering for QTreeWidgets that have sorting disabled.
+//
+// With sorting enabled, QTreeWidget schedules a sort of the whole tree
+// whenever an item is inserted, which becomes the dominant cost once a
+// tree holds tens of thousands of frequently updated items. These helpers
+// keep one sibling list ordered by the items' operator< instead, using the
+// same ascending/descending convention as QTreeWidget::sortItems.
+
+namespace TreeSort {
+
+// Index among p's children at which item belongs, after any equal items.
+template <class T>
+int insertIndex(const QTreeWidgetItem *p, const T *item, Qt::SortOrder order) {
+	int lo = 0;
+	int hi = p->childCount();
+	while (lo < hi) {
+		const int mid = (lo + hi) / 2;
+		const T *other = static_cast<const T *>(p->child(mid));
+		const bool after = (order == Qt::AscendingOrder) ? ! (*item < *other) : ! (*other < *item);
+		if (after)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Whether the child at idx is correctly ordered against its neighbours.
+template <class T>
+bool inPlace(const QTreeWidgetItem *p, int idx, Qt::SortOrder order) {
+	const T *item = static_cast<const T *>(p->child(idx));
+	if (idx > 0) {
+		const T *prev = static_cast<const T *>(p->child(idx - 1));
+		if ((order == Qt::AscendingOrder) ? (*item < *prev) : (*prev < *item))
+			return false;
+	}
+	if (idx + 1 < p->childCount()) {
+		const T *next = static_cast<const T *>(p->child(idx + 1));
+		if ((order == Qt::AscendingOrder) ? (*next < *item) : (*item < *next))
+			return false;
+	}
+	return true;
+}
+
+// Moves item to its sorted position among its siblings, preserving the
+// current item and selection. Returns false if nothing had to move.
+template <class T>
+bool reposition(T *item, Qt::SortOrder order) {
+	QTreeWidgetItem *p = item->parent();
+	QTreeWidget *w = item->treeWidget();
+	if (! p || ! w)
+		return false;
+
+	const int idx = p->indexOfChild(item);
+	if (inPlace<T>(p, idx, order))
+		return false;
+
+	const bool current = (w->currentItem() == item);
+	const bool selected = item->isSelected();
+	const bool blocked = w->blockSignals(true);
+
+	p->takeChild(idx);
+	p->insertChild(insertIndex<T>(p, item, order), item);
+
+	if (current)
+		w->setCurrentItem(item);
+	item->setSelected(selected);
+
+	w->blockSignals(blocked);
+	return true;
+}
+
+}
+
+#endif
@@ -242,6 +242,7 @@ UserModel::UserModel(QObject *p) : QAbstractItemModel(p) {
 	uiSessionComment = 0;
 	iChannelDescription = -1;
 	bClicked = false;
+	bBatch = false;
 
 	miRoot = new ModelItem(Channel::get(0));
 }
@@ -710,6 +711,23 @@ ModelItem *UserModel::moveItem(ModelItem *oldparent, ModelItem *newparent, Model
 	int oldrow = oldparent->qlChildren.indexOf(item);
 	int newrow = -1;
 
+	if (bBatch) {
+		// The view doesn't track rows during a batch, so there are no
+		// persistent indexes or selections to carry over. Order is
+		// restored by endBatch().
+		oldparent->qlChildren.removeAt(oldrow);
+		item->parent = newparent;
+		newparent->qlChildren << item;
+
+		if (item->cChan) {
+			oldparent->cChan->removeChannel(item->cChan);
+			newparent->cChan->addChannel(item->cChan);
+		} else {
+			newparent->cChan->addClientUser(item->pUser);
+		}
+		return item;
+	}
+
 	if (item->cChan)
 		newrow = newparent->insertIndex(item->cChan);
 	else
@@ -842,7 +860,7 @@ void UserModel::recheckLinks() {
 
 	foreach(Channel *c, changed) {
 		QModelIndex idx = index(c);
-		emit dataChanged(idx, idx);
+		rowChanged(idx);
 		bChanged = true;
 	}
 	if (bChanged)
@@ -863,19 +881,25 @@ ClientUser *UserModel::addUser(unsigned int id, const QString &name) {
 
 	item->parent = citem;
 
-	int row = citem->insertIndex(p);
+	if (bBatch) {
+		citem->qlChildren << item;
+		c->addClientUser(p);
+	} else {
+		int row = citem->insertIndex(p);
 
-	beginInsertRows(index(citem), row, row);
-	citem->qlChildren.insert(row, item);
-	c->addClientUser(p);
-	endInsertRows();
+		beginInsertRows(index(citem), row, row);
+		citem->qlChildren.insert(row, item);
+		c->addClientUser(p);
+		endInsertRows();
+	}
 
 	while (citem) {
 		citem->iUsers++;
 		citem = citem->parent;
 	}
 
-	updateOverlay();
+	if (! bBatch)
+		updateOverlay();
 
 	return p;
 }
@@ -889,10 +913,12 @@ void UserModel::removeUser(ClientUser *p) {
 
 	int row = citem->qlChildren.indexOf(item);
 
-	beginRemoveRows(index(citem), row, row);
+	if (! bBatch)
+		beginRemoveRows(index(citem), row, row);
 	c->removeUser(p);
 	citem->qlChildren.removeAt(row);
-	endRemoveRows();
+	if (! bBatch)
+		endRemoveRows();
 
 	p->cChannel = NULL;
 
@@ -925,11 +951,6 @@ void UserModel::moveUser(ClientUser *p, Channel *np) {
 
 	item = moveItem(opi, pi, item);
 
-	if (p->uiSession == g.uiSession) {
-		ensureSelfVisible();
-		recheckLinks();
-	}
-
 	while (opi) {
 		opi->iUsers--;
 		opi = opi->parent;
@@ -939,6 +960,14 @@ void UserModel::moveUser(ClientUser *p, Channel *np) {
 		pi = pi->parent;
 	}
 
+	if (bBatch)
+		return;
+
+	if (p->uiSession == g.uiSession) {
+		ensureSelfVisible();
+		recheckLinks();
+	}
+
 	if (g.s.ceExpand == Settings::ChannelsWithUsers) {
 		expandAll(np);
 		collapseEmpty(oc);
@@ -961,7 +990,7 @@ void UserModel::renameUser(ClientUser *p, const QString &name) {
 void UserModel::setUserId(ClientUser *p, int id) {
 	p->iId = id;
 	QModelIndex idx = index(p, 0);
-	emit dataChanged(idx, idx);
+	rowChanged(idx);
 }
 
 void UserModel::setHash(ClientUser *p, const QString &hash) {
@@ -975,7 +1004,7 @@ void UserModel::setHash(ClientUser *p, const QString &hash) {
 void UserModel::setFriendName(ClientUser *p, const QString &name) {
 	p->qsFriendName = name;
 	QModelIndex idx = index(p, 0);
-	emit dataChanged(idx, idx);
+	rowChanged(idx);
 }
 
 void UserModel::setComment(ClientUser *cu, const QString &comment) {
@@ -1017,7 +1046,7 @@ void UserModel::setComment(ClientUser *cu, const QString &comment) {
 
 		if (oldstate != newstate) {
 			QModelIndex idx = index(cu, 0);
-			emit dataChanged(idx, idx);
+			rowChanged(idx);
 		}
 	}
 }
@@ -1036,7 +1065,7 @@ void UserModel::setCommentHash(ClientUser *cu, const QByteArray &hash) {
 
 		if (oldstate != newstate) {
 			QModelIndex idx = index(cu, 0);
-			emit dataChanged(idx, idx);
+			rowChanged(idx);
 		}
 	}
 }
@@ -1073,7 +1102,7 @@ void UserModel::setComment(Channel *c, const QString &comment) {
 
 		if (oldstate != newstate) {
 			QModelIndex idx = index(c, 0);
-			emit dataChanged(idx, idx);
+			rowChanged(idx);
 		}
 	}
 }
@@ -1092,7 +1121,7 @@ void UserModel::setCommentHash(Channel *c, const QByteArray &hash) {
 
 		if (oldstate != newstate) {
 			QModelIndex idx = index(c, 0);
-			emit dataChanged(idx, idx);
+			rowChanged(idx);
 		}
 	}
 }
@@ -1106,7 +1135,7 @@ void UserModel::seenComment(const QModelIndex &idx) {
 
 	item->bCommentSeen = true;
 
-	emit dataChanged(idx, idx);
+	rowChanged(idx);
 
 	if (item->pUser)
 		Database::setSeenComment(item->hash(), item->pUser->qbaCommentHash);
@@ -1119,7 +1148,7 @@ void UserModel::renameChannel(Channel *c, const QString &name) {
 
 	if (c->iId == 0) {
 		QModelIndex idx = index(c);
-		emit dataChanged(idx, idx);
+		rowChanged(idx);
 	} else {
 		Channel *pc = c->cParent;
 		ModelItem *pi = ModelItem::c_qhChannels.value(pc);
@@ -1134,7 +1163,7 @@ void UserModel::repositionChannel(Channel *c, const int position) {
 
 	if (c->iId == 0) {
 		QModelIndex idx = index(c);
-		emit dataChanged(idx, idx);
+		rowChanged(idx);
 	} else {
 		Channel *pc = c->cParent;
 		ModelItem *pi = ModelItem::c_qhChannels.value(pc);
@@ -1155,6 +1184,12 @@ Channel *UserModel::addChannel(int id, Channel *p, const QString &name) {
 
 	item->parent = citem;
 
+	if (bBatch) {
+		p->addChannel(c);
+		citem->qlChildren << item;
+		return c;
+	}
+
 	int row = citem->insertIndex(c);
 
 	beginInsertRows(index(citem), row, row);
@@ -1189,11 +1224,13 @@ void UserModel::removeChannel(Channel *c) {
 
 	int row = citem->rowOf(c);
 
-	beginRemoveRows(index(citem), row, row);
+	if (! bBatch)
+		beginRemoveRows(index(citem), row, row);
 	p->removeChannel(c);
 	citem->qlChildren.removeAt(row);
 	qsLinked.remove(c);
-	endRemoveRows();
+	if (! bBatch)
+		endRemoveRows();
 
 	Channel::remove(c);
 
@@ -1217,6 +1254,9 @@ void UserModel::moveChannel(Channel *c, Channel *p) {
 		pi = pi->parent;
 	}
 
+	if (bBatch)
+		return;
+
 	ensureSelfVisible();
 
 	if (g.s.ceExpand == Settings::ChannelsWithUsers) {
@@ -1245,6 +1285,8 @@ void UserModel::removeAll() {
 	ModelItem *item = miRoot;
 	ModelItem *i;
 
+	endBatch();
+
 	uiSessionComment = 0;
 	iChannelDescription = -1;
 	bClicked = false;
@@ -1261,6 +1303,86 @@ void UserModel::removeAll() {
 	updateOverlay();
 }
 
+static bool channelItemLessThan(const ModelItem *a, const ModelItem *b) {
+	return Channel::lessThan(a->cChan, b->cChan);
+}
+
+static bool userItemLessThan(const ModelItem *a, const ModelItem *b) {
+	return User::lessThan(a->pUser, b->pUser);
+}
+
+void UserModel::sortChildren(ModelItem *item) {
+	QList<ModelItem *> channels, users;
+
+	foreach(ModelItem *mi, item->qlChildren) {
+		if (mi->cChan) {
+			channels << mi;
+			sortChildren(mi);
+		} else {
+			users << mi;
+		}
+	}
+
+	qStableSort(channels.begin(), channels.end(), channelItemLessThan);
+	qStableSort(users.begin(), users.end(), userItemLessThan);
+
+	item->qlChildren = ModelItem::bUsersTop ? (users + channels) : (channels + users);
+}
+
+/**
+ * Starts collecting structural changes without notifying views. Adding,
+ * moving and removing users and channels skips the per-row signals and
+ * sorting, and endBatch() publishes the result as a single model reset.
+ * Meant for the initial state sync, where the model starts out empty and
+ * thousands of ChannelState and UserState messages arrive back to back.
+ */
+void UserModel::beginBatch() {
+	if (bBatch)
+		return;
+
+	beginResetModel();
+	bBatch = true;
+}
+
+void UserModel::endBatch() {
+	if (! bBatch)
+		return;
+
+	bBatch = false;
+	sortChildren(miRoot);
+	endResetModel();
+
+	// The view forgot its expansion state in the reset.
+	QTreeView *v = g.mw->qtvUsers;
+	v->setExpanded(index(miRoot), true);
+	if (g.s.ceExpand == Settings::AllChannels) {
+		v->expandAll();
+	} else if (g.s.ceExpand == Settings::ChannelsWithUsers) {
+		foreach(ModelItem *mi, ModelItem::c_qhChannels) {
+			if (mi->iUsers > 0)
+				v->setExpanded(index(mi), true);
+		}
+	}
+
+	ensureSelfVisible();
+	recheckLinks();
+	updateOverlay();
+}
+
+bool UserModel::inBatch() const {
+	return bBatch;
+}
+
+/**
+ * Tells views that a single row needs repainting. While batching, the view is
+ * inside beginResetModel() across event loop iterations and must not see
+ * per-row signals; endBatch() refreshes every row anyway.
+ */
+void UserModel::rowChanged(const QModelIndex &idx) {
+	if (! bBatch)
+		emit dataChanged(idx, idx);
+}
+
 ClientUser *UserModel::getUser(const QModelIndex &idx) const {
 	if (! idx.isValid())
 		return NULL;
@@ -1308,14 +1430,14 @@ void UserModel::userTalkingChanged() {
 	if (!p)
 		return;
 	QModelIndex idx = index(p);
-	emit dataChanged(idx, idx);
+	rowChanged(idx);
 	updateOverlay();
 }
 
 void UserModel::userMuteDeafChanged() {
 	ClientUser *p=static_cast<ClientUser *>(sender());
 	QModelIndex idx = index(p);
-	emit dataChanged(idx, idx);
+	rowChanged(idx);
 
 	updateOverlay();
 }
@@ -1330,7 +1452,7 @@ void UserModel::toggleChannelFiltered(Channel *c) {
 		idx = index(c);
 	}
 
-	emit dataChanged(idx, idx);
+	rowChanged(idx);
 
 	updateOverlay();
 }
@@ -101,9 +101,12 @@ class UserModel : public QAbstractItemModel {
 		QMap<QString, ClientUser *> qmHashes;
 
 		bool bClicked;
+		bool bBatch;
 
+		void sortChildren(ModelItem *item);
 		void recursiveClone(const ModelItem *old, ModelItem *item, QModelIndexList &from, QModelIndexList &to);
 		ModelItem *moveItem(ModelItem *oldparent, ModelItem *newparent, ModelItem *item);
+		void rowChanged(const QModelIndex &idx);
 
 		QString stringIndex(const QModelIndex &index) const;
 	public:
@@ -159,6 +162,10 @@ class UserModel : public QAbstractItemModel {
 
 		void removeAll();
 
+		void beginBatch();
+		void endBatch();
+		bool inBatch() const;
+
 		void expandAll(Channel *c);
 		void collapseEmpty(Channel *c);
 
@@ -41,6 +41,137 @@
 
 #include "../Timer.h"
 
+// Upper bound on buffers queued or being encoded across all tracks; about 30 seconds
+// of 10 ms buffers for 50 speakers. Anything beyond that is dropped and accounted for.
+static const int iMaxQueued = 16384;
+
+// Number of released buffers the pool keeps around for reuse.
+static const int iMaxPooled = 1024;
+
+// Interval in microseconds at which workers flush their files to disk.
+static const quint64 uiFlushInterval = 5000000ULL;
+
+class VoiceRecorder::BufferPool {
+	public:
+		QMutex qmLock;
+		QList<float *> qlFree;
+		int iSamples;
+
+		BufferPool() : iSamples(0) {
+		}
+
+		~BufferPool() {
+			foreach(float *f, qlFree)
+				delete [] f;
+		}
+};
+
+/**
+ * Deleter for pooled buffers. Puts the memory back on the free list instead of
+ * freeing it, unless the pool has since switched to a different buffer size.
+ */
+struct VoiceRecorder::BufferRelease {
+	boost::shared_ptr<BufferPool> bpPool;
+	int iSamples;
+
+	BufferRelease(boost::shared_ptr<BufferPool> pool, int samples) : bpPool(pool), iSamples(samples) {
+	}
+
+	void operator()(float *f) const {
+		{
+			QMutexLocker l(&bpPool->qmLock);
+			if ((iSamples == bpPool->iSamples) && (bpPool->qlFree.count() < iMaxPooled)) {
+				bpPool->qlFree.append(f);
+				return;
+			}
+		}
+		delete [] f;
+	}
+};
+
+class VoiceRecorder::RecordWorker : public QThread {
+	private:
+		Q_DISABLE_COPY(RecordWorker)
+	public:
+		VoiceRecorder *vrRecorder;
+
+		// Protects |qlQueue| and |bStop|.
+		QMutex qmLock;
+		QWaitCondition qwcWake;
+		QList< boost::shared_ptr<RecordBuffer> > qlQueue;
+		bool bStop;
+
+		// Recording state of the tracks owned by this worker, only touched from its thread.
+		QHash< int, boost::shared_ptr<RecordInfo> > qhRecordInfo;
+
+		RecordWorker(VoiceRecorder *vr) : vrRecorder(vr), bStop(false) {
+		}
+
+		void add(const QList< boost::shared_ptr<RecordBuffer> > &ql);
+		void stop();
+		void run();
+};
+
+void VoiceRecorder::RecordWorker::add(const QList< boost::shared_ptr<RecordBuffer> > &ql) {
+	QMutexLocker l(&qmLock);
+	qlQueue += ql;
+	qwcWake.wakeAll();
+}
+
+void VoiceRecorder::RecordWorker::stop() {
+	QMutexLocker l(&qmLock);
+	bStop = true;
+	qwcWake.wakeAll();
+}
+
+void VoiceRecorder::RecordWorker::run() {
+	float silence[1024];
+	memset(silence, 0, sizeof(silence));
+
+	Timer tFlush;
+	bool failed = false;
+
+	forever {
+		QList< boost::shared_ptr<RecordBuffer> > ql;
+		{
+			QMutexLocker l(&qmLock);
+			if (qlQueue.isEmpty() && ! bStop)
+				qwcWake.wait(&qmLock, static_cast<unsigned long>(uiFlushInterval / 1000ULL));
+			ql = qlQueue;
+			qlQueue.clear();
+			if (ql.isEmpty() && bStop)
+				break;
+		}
+
+		// Pending buffers are still written after a stop, so the end of the recording isn't lost.
+		foreach(boost::shared_ptr<RecordBuffer> rb, ql) {
+			if (failed)
+				break;
+
+			int index = vrRecorder->bMixDown ? 0 : rb->cuUser->uiSession;
+			boost::shared_ptr<RecordInfo> &ri = qhRecordInfo[index];
+			if (! ri)
+				ri = boost::make_shared<RecordInfo>();
+
+			failed = ! vrRecorder->writeBuffer(ri.get(), rb, silence);
+		}
+
+		if (! ql.isEmpty()) {
+			QMutexLocker l(&vrRecorder->qmBufferLock);
+			vrRecorder->iQueued -= ql.count();
+		}
+
+		if (tFlush.isElapsed(uiFlushInterval)) {
+			foreach(boost::shared_ptr<RecordInfo> ri, qhRecordInfo)
+				if (ri->sf)
+					sf_write_sync(ri->sf);
+		}
+	}
+
+	// Closes all files of this worker.
+	qhRecordInfo.clear();
+}
+
 VoiceRecorder::RecordBuffer::RecordBuffer(const ClientUser *cu,
         boost::shared_array<float> buffer, int samples, quint64 timestamp) :
 		cuUser(cu), fBuffer(buffer), iSamples(samples), uiTimestamp(timestamp) {
@@ -56,7 +187,8 @@ VoiceRecorder::RecordInfo::~RecordInfo() {
 	}
 }
 
-VoiceRecorder::VoiceRecorder(QObject *p) : QThread(p), recordUser(new RecordUser()),
+VoiceRecorder::VoiceRecorder(QObject *p) : QThread(p), bpPool(new BufferPool()), iQueued(0),
+		uiDroppedBuffers(0), uiDroppedSamples(0), recordUser(new RecordUser()),
 		tTimestamp(new Timer()), iSampleRate(0), bRecording(false), bMixDown(false),
 		fmFormat(VoiceRecorderFormat::WAV), qdtRecordingStart(QDateTime::currentDateTime()) {
 }
@@ -235,122 +367,196 @@ void VoiceRecorder::run() {
 	if (g.sh && g.sh->uiVersion < 0201003)
 		return;
 
-	bRecording = true;
+	sfiFormat = sfinfo;
+
+	// Each track is encoded by a single worker, so its buffers stay in order while
+	// different tracks are encoded in parallel.
+	const int workers = bMixDown ? 1 : qBound(1, QThread::idealThreadCount(), 8);
+	for (int i = 0; i < workers; ++i) {
+		RecordWorker *rw = new RecordWorker(this);
+		rw->start();
+		qlWorkers << rw;
+	}
+
+	{
+		QMutexLocker l(&qmBufferLock);
+		bRecording = true;
+	}
 	emit recording_started();
+
 	forever {
-		// Sleep until there is new data for us to process.
-		qmSleepLock.lock();
-		qwcSleep.wait(&qmSleepLock);
+		{
+			// Sleep until there is new data for us to process.
+			QMutexLocker l(&qmBufferLock);
+			if (qlRecordBuffer.isEmpty() && bRecording)
+				qwcSleep.wait(&qmBufferLock);
+		}
+
+		dispatch();
 
-		if (!bRecording || (g.sh && g.sh->uiVersion < 0201003)) {
-			qmSleepLock.unlock();
+		if (!bRecording || (g.sh && g.sh->uiVersion < 0201003))
 			break;
-		}
+	}
 
-		while (!qlRecordBuffer.isEmpty()) {
-			boost::shared_ptr<RecordBuffer> rb;
-			{
-				QMutexLocker l(&qmBufferLock);
-				rb = qlRecordBuffer.takeFirst();
-			}
+	// Hand over whatever arrived since, then let the workers finish and close their files.
+	dispatch();
+	foreach(RecordWorker *rw, qlWorkers) {
+		rw->stop();
+		rw->wait();
+		delete rw;
+	}
+	qlWorkers.clear();
 
-			// Use 0 as the |index| if multi channel recording is disabled.
-			int index = bMixDown ? 0 : rb->cuUser->uiSession;
-			Q_ASSERT(qhRecordInfo.contains(index));
-
-			// Create the file for this RecordInfo instance if it's not yet open.
-			boost::shared_ptr<RecordInfo> ri = qhRecordInfo.value(index);
-			if (!ri->sf) {
-				QString filename = expandTemplateVariables(qsFileName, rb);
-
-				// Try to find a unique filename.
-				{
-					int cnt = 1;
-					QString nf(filename);
-					QFileInfo tfi(filename);
-					while (QFile::exists(nf)) {
-						nf = tfi.path() + QLatin1Char('/') + tfi.completeBaseName() + QString(QLatin1String(" (%1).")).arg(cnt) +  tfi.suffix();
-						++cnt;
-					}
-					filename = nf;
-				}
-				qWarning() << "Recorder opens file" << filename;
-				QFileInfo fi(filename);
-
-				// Create the target path.
-				if (!QDir().mkpath(fi.absolutePath())) {
-					qWarning() << "Failed to create target directory: " << fi.absolutePath();
-					bRecording = false;
-					emit error(CreateDirectoryFailed, tr("Recorder failed to create directory '%1'").arg(fi.absolutePath()));
-					emit recording_stopped();
-					return;
-				}
+	{
+		QMutexLocker l(&qmBufferLock);
+		bRecording = false;
+		if (uiDroppedBuffers)
+			qWarning() << "VoiceRecorder: dropped" << uiDroppedBuffers << "buffers (" << uiDroppedSamples << "samples) because encoding fell behind";
+	}
 
-#ifdef Q_OS_WIN
-				// This is needed for unicode filenames on Windows.
-				ri->sf = sf_wchar_open(filename.toStdWString().c_str(), SFM_WRITE, &sfinfo);
-#else
-				ri->sf = sf_open(qPrintable(filename), SFM_WRITE, &sfinfo);
-#endif
-				if (ri->sf == NULL) {
-					qWarning() << "Failed to open file for recorder: "<< sf_strerror(NULL);
-					bRecording = false;
-					emit error(CreateFileFailed, tr("Recorder failed to open file '%1'").arg(filename));
-					emit recording_stopped();
-					return;
-				}
+	emit recording_stopped();
+	qWarning() << "VoiceRecorder: recording stopped";
+}
 
-				// Store the username in the title attribute of the file (if supported by the format).
-				if (rb->cuUser)
-					sf_set_string(ri->sf, SF_STR_TITLE, qPrintable(rb->cuUser->qsName));
-			}
+void VoiceRecorder::dispatch() {
+	QList< boost::shared_ptr<RecordBuffer> > ql;
+	{
+		QMutexLocker l(&qmBufferLock);
+		ql = qlRecordBuffer;
+		qlRecordBuffer.clear();
+	}
+
+	if (ql.isEmpty() || qlWorkers.isEmpty())
+		return;
 
-			// Calculate the difference between the time of the current buffer and the time where we last wrote audio data for that user.
-			// Writes silence if the number of |missingSamples| is larger than a threshold of 100ms (to account for processing delay).
-			qint64 missingSamples = ((rb->uiTimestamp - ri->uiLastPosition) * iSampleRate) / 1000000 - rb->iSamples;
-			if (missingSamples > iSampleRate / 10) {
-				// Write |missingSamples| samples of silence.
-				boost::scoped_array<float> buffer(new float[1024]);
-				memset(buffer.get(), 0, sizeof(float) * 1024);
-				qint64 rest = missingSamples;
-				for (; rest > 1024; rest -= 1024)
-					sf_write_float(ri->sf, buffer.get(), 1024);
-
-				if (rest > 0)
-					sf_write_float(ri->sf, buffer.get(), rest);
+	QVector< QList< boost::shared_ptr<RecordBuffer> > > qvBatches(qlWorkers.count());
+	foreach(boost::shared_ptr<RecordBuffer> rb, ql) {
+		// Use 0 as the |index| if multi channel recording is disabled.
+		int index = bMixDown ? 0 : rb->cuUser->uiSession;
+		qvBatches[index % qlWorkers.count()] << rb;
+	}
+
+	for (int i = 0; i < qlWorkers.count(); ++i)
+		if (! qvBatches.at(i).isEmpty())
+			qlWorkers.at(i)->add(qvBatches.at(i));
+}
+
+bool VoiceRecorder::writeBuffer(RecordInfo *ri, boost::shared_ptr<RecordBuffer> rb, const float *silence) {
+	// Create the file for this RecordInfo instance if it's not yet open.
+	if (!ri->sf) {
+		QString filename = expandTemplateVariables(qsFileName, rb);
+
+		QMutexLocker l(&qmOpenLock);
+
+		// Try to find a unique filename.
+		{
+			int cnt = 1;
+			QString nf(filename);
+			QFileInfo tfi(filename);
+			while (QFile::exists(nf)) {
+				nf = tfi.path() + QLatin1Char('/') + tfi.completeBaseName() + QString(QLatin1String(" (%1).")).arg(cnt) +  tfi.suffix();
+				++cnt;
 			}
+			filename = nf;
+		}
+		qWarning() << "Recorder opens file" << filename;
+		QFileInfo fi(filename);
+
+		// Create the target path.
+		if (!QDir().mkpath(fi.absolutePath())) {
+			qWarning() << "Failed to create target directory: " << fi.absolutePath();
+			emit error(CreateDirectoryFailed, tr("Recorder failed to create directory '%1'").arg(fi.absolutePath()));
+			stop();
+			return false;
+		}
 
-			// Write the audio buffer and update the timestamp in |ri|.
-			sf_write_float(ri->sf, rb->fBuffer.get(), rb->iSamples);
-			ri->uiLastPosition = rb->uiTimestamp;
+		SF_INFO sfinfo = sfiFormat;
+#ifdef Q_OS_WIN
+		// This is needed for unicode filenames on Windows.
+		ri->sf = sf_wchar_open(filename.toStdWString().c_str(), SFM_WRITE, &sfinfo);
+#else
+		ri->sf = sf_open(qPrintable(filename), SFM_WRITE, &sfinfo);
+#endif
+		if (ri->sf == NULL) {
+			qWarning() << "Failed to open file for recorder: "<< sf_strerror(NULL);
+			emit error(CreateFileFailed, tr("Recorder failed to open file '%1'").arg(filename));
+			stop();
+			return false;
 		}
 
-		qmSleepLock.unlock();
+		// Store the username in the title attribute of the file (if supported by the format).
+		if (rb->cuUser)
+			sf_set_string(ri->sf, SF_STR_TITLE, qPrintable(rb->cuUser->qsName));
 	}
-	bRecording = false;
-	emit recording_stopped();
-	qWarning() << "VoiceRecorder: recording stopped";
+
+	// Calculate the difference between the time of the current buffer and the time where we last wrote audio data for that user.
+	// Writes silence if the number of |missingSamples| is larger than a threshold of 100ms (to account for processing delay).
+	// This also covers buffers dropped by addBuffer, keeping the track in sync.
+	qint64 missingSamples = ((rb->uiTimestamp - ri->uiLastPosition) * iSampleRate) / 1000000 - rb->iSamples;
+	if (missingSamples > iSampleRate / 10) {
+		// Write |missingSamples| samples of silence.
+		qint64 rest = missingSamples;
+		for (; rest > 1024; rest -= 1024)
+			sf_write_float(ri->sf, silence, 1024);
+
+		if (rest > 0)
+			sf_write_float(ri->sf, silence, rest);
+	}
+
+	// Write the audio buffer and update the timestamp in |ri|.
+	sf_write_float(ri->sf, rb->fBuffer.get(), rb->iSamples);
+	ri->uiLastPosition = rb->uiTimestamp;
+
+	return true;
 }
 
 void VoiceRecorder::stop() {
 	// Tell the main loop to terminate and wake up the sleep lock.
-	bRecording = false;
+	{
+		QMutexLocker l(&qmBufferLock);
+		bRecording = false;
+	}
 	qwcSleep.wakeAll();
 }
 
+boost::shared_array<float> VoiceRecorder::getBuffer(int samples) {
+	float *buffer = NULL;
+	{
+		QMutexLocker l(&bpPool->qmLock);
+		if (samples != bpPool->iSamples) {
+			// The mixer's buffer size changed; the old buffers are of no further use.
+			foreach(float *f, bpPool->qlFree)
+				delete [] f;
+			bpPool->qlFree.clear();
+			bpPool->iSamples = samples;
+		} else if (! bpPool->qlFree.isEmpty()) {
+			buffer = bpPool->qlFree.takeLast();
+		}
+	}
+
+	if (! buffer)
+		buffer = new float[samples];
+	memset(buffer, 0, sizeof(float) * samples);
+
+	return boost::shared_array<float>(buffer, BufferRelease(bpPool, samples));
+}
+
 void VoiceRecorder::addBuffer(const ClientUser *cu, boost::shared_array<float> buffer, int samples) {
 	Q_ASSERT(!bMixDown || cu == NULL);
 
-	// Create a new RecordInfo object if this is a new user.
-	int index = bMixDown ? 0 : cu->uiSession;
-	if (!qhRecordInfo.contains(index)) {
-		boost::shared_ptr<RecordInfo> ri = boost::make_shared<RecordInfo>();
-		qhRecordInfo.insert(index, ri);
-	}
-
 	{
-		// Save the buffer in |qlRecordBuffer|.
 		QMutexLocker l(&qmBufferLock);
+
+		// Drop the buffer if the encoders are too far behind. The gap is filled with silence
+		// when the track catches up, so the recording stays in sync.
+		if (iQueued >= iMaxQueued) {
+			++uiDroppedBuffers;
+			uiDroppedSamples += samples;
+			return;
+		}
+
+		// Save the buffer in |qlRecordBuffer|.
+		++iQueued;
 		boost::shared_ptr<RecordBuffer> rb = boost::make_shared<RecordBuffer>(cu, buffer, samples, tTimestamp->elapsed());
 		qlRecordBuffer << rb;
 	}
@@ -45,6 +45,7 @@
 #include <sndfile.h>
 #include <QtCore/QDateTime>
 #include <QtCore/QHash>
+#include <QtCore/QList>
 #include <QtCore/QMutex>
 #include <QtCore/QObject>
 #include <QtCore/QThread>
@@ -108,25 +109,45 @@ class VoiceRecorder : public QThread {
 			quint64 uiLastPosition;
 		};
 
-		// Hash which maps the |uiSession| of all users for which we have to keep a recording state to the corresponding RecordInfo object.
-		QHash< int, boost::shared_ptr<RecordInfo> > qhRecordInfo;
+		// Free list of sample buffers handed out by getBuffer(), shared with the buffers' deleters.
+		class BufferPool;
+		struct BufferRelease;
+		boost::shared_ptr<BufferPool> bpPool;
 
-		// List containing all unprocessed RecordBuffer objects.
+		// Encoder thread owning the files of a subset of the tracks.
+		class RecordWorker;
+		friend class RecordWorker;
+
+		// The encoder pool. Track |index| is always written by worker |index % count|.
+		QList<RecordWorker *> qlWorkers;
+
+		// List containing all RecordBuffer objects not yet handed to a worker.
 		QList< boost::shared_ptr<RecordBuffer> > qlRecordBuffer;
 
+		// Number of buffers queued or being encoded, bounded by iMaxQueued.
+		int iQueued;
+
+		// Number of buffers and samples dropped because the encoders fell behind.
+		quint64 uiDroppedBuffers, uiDroppedSamples;
+
 		// The user which is used to record local audio.
 		boost::scoped_ptr<RecordUser> recordUser;
 
 		// High precision timer for buffer timestamps.
 		boost::scoped_ptr<Timer> tTimestamp;
 
-		// Protects the buffer list |qlRecordBuffer|.
+		// Protects |qlRecordBuffer|, the queue accounting and |bRecording|.
 		QMutex qmBufferLock;
 
-		// Wait condition and mutex to block until there is new data.
-		QMutex qmSleepLock;
+		// Wait condition to block until there is new data.
 		QWaitCondition qwcSleep;
 
+		// Serializes picking a unique filename and creating the file across workers.
+		QMutex qmOpenLock;
+
+		// The libsndfile format of all tracks.
+		SF_INFO sfiFormat;
+
 		// The current sample rate of the recorder.
 		int iSampleRate;
 
@@ -152,6 +173,12 @@ class VoiceRecorder : public QThread {
 		// Expands the template variables in |path| using the information contained in |rb|.
 		QString expandTemplateVariables(const QString &path, boost::shared_ptr<RecordBuffer> rb) const;
 
+		// Writes |rb| to the track |ri|, creating its file first if needed. Called from the workers.
+		bool writeBuffer(RecordInfo *ri, boost::shared_ptr<RecordBuffer> rb, const float *silence);
+
+		// Hands all pending buffers to their workers.
+		void dispatch();
+
 	public:
 		// Error enum
 		enum Error { Unspecified, CreateDirectoryFailed, CreateFileFailed, InvalidSampleRate };
@@ -166,7 +193,11 @@ class VoiceRecorder : public QThread {
 		// Stops the main loop.
 		void stop();
 
+		// Returns a zeroed buffer for |samples| audio samples, recycled through the recorder's pool.
+		boost::shared_array<float> getBuffer(int samples);
+
 		// Adds an audio buffer which contains |samples| audio samples to the recorder.
+		// The buffer is dropped and accounted for if the encoders are too far behind.
 		void addBuffer(const ClientUser *cu, boost::shared_array<float> buffer, int samples);
 
 		// Sets the sample rate of the recorder. The sample rate can't change while the recoder is active.
@@ -0,0 +1,110 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "murmur_pch.h"
+
+#include "ACLCache.h"
+
+#include "Metrics.h"
+#include "ServerUser.h"
+
+ACLCacheShard::ACLCacheShard() {
+	for (int i=0;i<Slots;++i) {
+		sSlots[i].iChannel = -1;
+		sSlots[i].iGeneration = -1;
+		sSlots[i].uiPermissions = 0;
+	}
+}
+
+ACLCache::ACLCache() {
+}
+
+int ACLCache::generation(ServerUser *u) {
+	return qaiGeneration.fetchAndAddOrdered(0) + u->acsCache.qaiGeneration.fetchAndAddOrdered(0);
+}
+
+/**
+ * Looks up the permissions of u in channel without taking any locks, which
+ * makes it safe to call from the voice thread. The generation comes from
+ * generation(); both counters only grow, so their sum changes with either.
+ */
+bool ACLCache::lookup(ServerUser *u, int channel, int generation, ChanACL::Permissions &perm) {
+	ACLCacheShard &acs = u->acsCache;
+	const ACLCacheShard::Slot &s = acs.sSlots[static_cast<unsigned int>(channel) % ACLCacheShard::Slots];
+	int seq, chan, gen;
+	unsigned int permissions;
+
+	forever {
+		seq = acs.qaiSequence.fetchAndAddOrdered(0);
+		if (seq & 1)
+			continue;
+		chan = s.iChannel;
+		gen = s.iGeneration;
+		permissions = s.uiPermissions;
+		if (acs.qaiSequence.fetchAndAddOrdered(0) == seq)
+			break;
+	}
+
+	if ((chan != channel) || (gen != generation)) {
+		Metrics::count(Metrics::PermCacheMisses);
+		return false;
+	}
+
+	Metrics::count(Metrics::PermCacheHits);
+	perm = static_cast<ChanACL::Permissions>(permissions);
+	return true;
+}
+
+void ACLCache::store(ServerUser *u, int channel, int generation, ChanACL::Permissions perm) {
+	ACLCacheShard &acs = u->acsCache;
+	ACLCacheShard::Slot &s = acs.sSlots[static_cast<unsigned int>(channel) % ACLCacheShard::Slots];
+
+	QMutexLocker qml(&qmStripes[u->uiSession % Stripes]);
+
+	// Computed from an ACL that has changed since; don't evict a current slot for it.
+	if (generation != this->generation(u))
+		return;
+
+	acs.qaiSequence.fetchAndAddOrdered(1);
+	s.iChannel = channel;
+	s.iGeneration = generation;
+	s.uiPermissions = static_cast<unsigned int>(perm);
+	acs.qaiSequence.fetchAndAddOrdered(1);
+}
+
+void ACLCache::clear() {
+	qaiGeneration.fetchAndAddOrdered(1);
+	Metrics::count(Metrics::PermCacheInvalidations);
+}
+
+void ACLCache::clear(ServerUser *u) {
+	u->acsCache.qaiGeneration.fetchAndAddOrdered(1);
+	Metrics::count(Metrics::PermCacheInvalidations);
+}
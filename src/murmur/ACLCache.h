@@ -0,0 +1,88 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_MURMUR_ACLCACHE_H_
+#define MUMBLE_MURMUR_ACLCACHE_H_
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QMutex>
+
+#include "ACL.h"
+
+class ServerUser;
+
+// One user's part of the permission cache. It lives in ServerUser, so it
+// goes away with the connection, and is a small direct mapped table
+// indexed by channel id. Readers never lock: they copy a slot between two
+// reads of qaiSequence and retry if a writer bumped it in between. A slot
+// only counts while the generation it was computed in is current.
+class ACLCacheShard {
+	private:
+		Q_DISABLE_COPY(ACLCacheShard)
+	public:
+		enum { Slots = 128 };
+		struct Slot {
+			int iChannel;
+			int iGeneration;
+			unsigned int uiPermissions;
+		};
+		Slot sSlots[Slots];
+		// Odd while a slot is being written.
+		QAtomicInt qaiSequence;
+		// Bumped to invalidate only this user.
+		QAtomicInt qaiGeneration;
+
+		ACLCacheShard();
+};
+
+// Server wide half of the permission cache. Writers to a shard serialize
+// on one of a few mutexes picked by session, so the voice thread and the
+// main thread only meet if they fill the same stripe at the same time.
+// Invalidating never frees anything; clear() bumps the server generation
+// and clear(u) the user's, and every slot filled before turns into a miss.
+class ACLCache {
+	private:
+		Q_DISABLE_COPY(ACLCache)
+	protected:
+		enum { Stripes = 16 };
+		QMutex qmStripes[Stripes];
+		QAtomicInt qaiGeneration;
+	public:
+		ACLCache();
+		// Read before computing and passed to store(), so a result that
+		// was invalidated while being computed is never stored.
+		int generation(ServerUser *u);
+		bool lookup(ServerUser *u, int channel, int generation, ChanACL::Permissions &perm);
+		void store(ServerUser *u, int channel, int generation, ChanACL::Permissions perm);
+		void clear();
+		void clear(ServerUser *u);
+};
+
+#endif
@@ -0,0 +1,220 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "murmur_pch.h"
+
+#include "Message.h"
+#include "Server.h"
+#include "ServerUser.h"
+
+bool Server::hasAsyncAuthenticator() {
+	return receivers(SIGNAL(authenticateAsyncSig(unsigned int, const QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &))) > 0;
+}
+
+/**
+ * Starts authenticating a user with an asynchronous authenticator. The user is
+ * held in the Authenticating state until the reply arrives in authenticateReply.
+ * At most iAuthConcurrency requests are outstanding, the rest wait in line.
+ *
+ * @return false if no asynchronous authenticator is connected, in which case the
+ *         caller authenticates synchronously.
+ */
+bool Server::beginAuthenticate(ServerUser *u, const MumbleProto::Authenticate &msg) {
+	if (! hasAsyncAuthenticator())
+		return false;
+
+	if (++uiAuthTicket == 0)
+		++uiAuthTicket;
+
+	PendingAuth pa;
+	pa.uiTicket = uiAuthTicket;
+	pa.uiSession = u->uiSession;
+	pa.msg = msg;
+	pa.bInFlight = false;
+
+	QByteArray key = u->qsName.toLower().toUtf8();
+	key.append('\0');
+	key.append(msg.password().data(), static_cast<int>(msg.password().size()));
+	key.append('\0');
+	key.append(u->qsHash.toLatin1());
+	key.append(u->bVerified ? '1' : '0');
+	pa.qbaCacheKey = sha1(key);
+
+	u->uiAuthTicket = pa.uiTicket;
+	u->sState = ServerUser::Authenticating;
+
+	if (qhAuthCache.contains(pa.qbaCacheKey)) {
+		const CachedAuth ca = qhAuthCache.value(pa.qbaCacheKey);
+		if (ca.uiExpires > tUptime.elapsed()) {
+			completeAuthenticate(pa, ca.iId, ca.qsName, ca.qslGroups);
+			return true;
+		}
+		qhAuthCache.remove(pa.qbaCacheKey);
+	}
+
+	qhPendingAuth.insert(pa.uiTicket, pa);
+	qqAuthQueue.enqueue(pa.uiTicket);
+
+	if (! qtAuthTimeout->isActive())
+		qtAuthTimeout->start(1000);
+
+	dispatchAuthenticate();
+	return true;
+}
+
+void Server::dispatchAuthenticate() {
+	while ((iAuthInFlight < iAuthConcurrency) && ! qqAuthQueue.isEmpty()) {
+		unsigned int ticket = qqAuthQueue.dequeue();
+		if (! qhPendingAuth.contains(ticket))
+			continue;
+
+		PendingAuth &pa = qhPendingAuth[ticket];
+		ServerUser *u = qhUsers.value(pa.uiSession);
+		if (! u || (u->uiAuthTicket != ticket)) {
+			// Disconnected while waiting in line.
+			qhPendingAuth.remove(ticket);
+			continue;
+		}
+
+		if (! hasAsyncAuthenticator()) {
+			// The authenticator went away while this login was queued, so
+			// fall back to the local database like a failed synchronous call.
+			const PendingAuth done = qhPendingAuth.take(ticket);
+			completeAuthenticate(done, -2, QString(), QStringList());
+			continue;
+		}
+
+		pa.bInFlight = true;
+		++iAuthInFlight;
+
+		// The slot may reply before returning, so pa must not be used after this.
+		emit authenticateAsyncSig(ticket, u->qsName, u->uiSession, u->peerCertificateChain(), u->qsHash, u->bVerified, u8(pa.msg.password()));
+	}
+
+	if (qhPendingAuth.isEmpty())
+		qtAuthTimeout->stop();
+}
+
+/**
+ * Called on the main thread with the answer of an asynchronous authenticator.
+ * Replies for logins that already timed out are ignored.
+ */
+void Server::authenticateReply(unsigned int ticket, int res, const QString &name, const QStringList &groups) {
+	if (! qhPendingAuth.contains(ticket) || ! qhPendingAuth.value(ticket).bInFlight)
+		return;
+
+	const PendingAuth pa = qhPendingAuth.take(ticket);
+	--iAuthInFlight;
+
+	// -3 is a temporary failure and is worth retrying right away.
+	if (res != -3) {
+		int ttl = (res == -1) ? iAuthNegativeTTL : iAuthCacheTTL;
+		if (ttl > 0) {
+			CachedAuth ca;
+			ca.iId = res;
+			ca.qsName = name;
+			ca.qslGroups = groups;
+			ca.uiExpires = tUptime.elapsed() + ttl * 1000000ULL;
+			qhAuthCache.insert(pa.qbaCacheKey, ca);
+		}
+	}
+
+	completeAuthenticate(pa, res, name, groups);
+	dispatchAuthenticate();
+}
+
+void Server::completeAuthenticate(const PendingAuth &pa, int res, const QString &name, const QStringList &groups) {
+	ServerUser *u = qhUsers.value(pa.uiSession);
+	if (! u || (u->uiAuthTicket != pa.uiTicket) || (u->sState != ServerUser::Authenticating))
+		return;
+
+	u->sState = ServerUser::Connected;
+
+	int id;
+	if (res == -2) {
+		id = authenticateLocal(u->qsName, u8(pa.msg.password()), u->qslEmail, u->qsHash, u->bVerified);
+	} else {
+		if ((res >= 0) && ! name.isEmpty())
+			u->qsName = name;
+		if ((res >= 0) && ! groups.isEmpty())
+			setTempGroups(res, u->uiSession, NULL, groups);
+		id = authenticateExternal(res, u->qsName);
+	}
+
+	finishAuthenticate(u, pa.msg, id);
+}
+
+/**
+ * Rejects logins the authenticator has not answered within iAuthTimeout seconds.
+ * The outstanding request no longer counts against iAuthConcurrency, so a hung
+ * authenticator cannot stall logins for longer than the timeout.
+ */
+void Server::checkAuthTimeout() {
+	const quint64 timeout = iAuthTimeout * 1000000ULL;
+
+	QList<unsigned int> qlExpired;
+	QHash<unsigned int, PendingAuth>::const_iterator i;
+	for (i = qhPendingAuth.constBegin(); i != qhPendingAuth.constEnd(); ++i)
+		if (i.value().tQueued.elapsed() > timeout)
+			qlExpired << i.key();
+
+	foreach(unsigned int ticket, qlExpired) {
+		if (! qhPendingAuth.contains(ticket))
+			continue;
+
+		const PendingAuth pa = qhPendingAuth.take(ticket);
+		if (pa.bInFlight)
+			--iAuthInFlight;
+
+		ServerUser *u = qhUsers.value(pa.uiSession);
+		if (u && (u->uiAuthTicket == ticket))
+			log(u, QString("Authenticator did not answer within %1 seconds").arg(iAuthTimeout));
+
+		completeAuthenticate(pa, -3, QString(), QStringList());
+	}
+
+	dispatchAuthenticate();
+}
+
+void Server::pruneAuthCache() {
+	const quint64 now = tUptime.elapsed();
+
+	QHash<QByteArray, CachedAuth>::iterator i = qhAuthCache.begin();
+	while (i != qhAuthCache.end()) {
+		if (i.value().uiExpires <= now)
+			i = qhAuthCache.erase(i);
+		else
+			++i;
+	}
+}
+
+void Server::clearAuthCache() {
+	qhAuthCache.clear();
+}
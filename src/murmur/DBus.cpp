@@ -291,6 +291,40 @@ void MurmurDBus::setTextureSlot(int &res, int id, const QByteArray &texture) {
 void MurmurDBus::authenticateSlot(int &res, QString &uname, int sessionId, const QList<QSslCertificate> &, const QString &, bool, const QString &pw) {
 	QDBusInterface remoteApp(qsAuthService,qsAuthPath,QString(),qdbc);
 	QDBusMessage msg = remoteApp.call(bReentrant ? QDBus::BlockWithGui : QDBus::Block, "authenticate",uname,pw);
+
+	QStringList groups;
+	if (! authenticateResult(msg, res, uname, groups))
+		return;
+	if (! groups.isEmpty())
+		server->setTempGroups(res, sessionId, NULL, groups);
+}
+
+void MurmurDBus::authenticateAsyncSlot(unsigned int ticket, const QString &uname, int, const QList<QSslCertificate> &, const QString &, bool, const QString &pw) {
+	QDBusInterface remoteApp(qsAuthService,qsAuthPath,QString(),qdbc);
+	QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(remoteApp.asyncCall("authenticate",uname,pw), this);
+	watcher->setProperty("ticket", ticket);
+	watcher->setProperty("uname", uname);
+	connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher *)), this, SLOT(authenticateFinished(QDBusPendingCallWatcher *)));
+}
+
+void MurmurDBus::authenticateFinished(QDBusPendingCallWatcher *watcher) {
+	watcher->deleteLater();
+
+	int res = -2;
+	QString uname = watcher->property("uname").toString();
+	QStringList groups;
+
+	authenticateResult(watcher->reply(), res, uname, groups);
+	server->authenticateReply(watcher->property("ticket").toUInt(), res, uname, groups);
+}
+
+/**
+ * Decodes the reply to the authenticate method of a DBus authenticator.
+ * Drops the authenticator if the call itself failed.
+ *
+ * @return false if the call failed.
+ */
+bool MurmurDBus::authenticateResult(const QDBusMessage &msg, int &res, QString &uname, QStringList &groups) {
 	QDBusError err = msg;
 	if (! err.isValid()) {
 		QString newname;
@@ -306,7 +340,7 @@ void MurmurDBus::authenticateSlot(int &res, QString &uname, int sessionId, const
 			}
 		}
 		if (ok && (msg.arguments().count() >= 3)) {
-			server->setTempGroups(uid, sessionId, NULL, msg.arguments().at(2).toStringList());
+			groups = msg.arguments().at(2).toStringList();
 		}
 		if (ok) {
 			server->log(QString("DBus Authenticate success for %1: %2").arg(uname).arg(uid));
@@ -314,9 +348,11 @@ void MurmurDBus::authenticateSlot(int &res, QString &uname, int sessionId, const
 		} else {
 			server->log(QString("DBus Autenticator failed authenticate for %1: Invalid return type").arg(uname));
 		}
+		return true;
 	} else {
 		server->log(QString("DBus Authenticator failed authenticate for %1: %2").arg(uname).arg(err.message()));
 		removeAuthenticator();
+		return false;
 	}
 }
 
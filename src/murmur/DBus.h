@@ -34,6 +34,7 @@
 
 #include <QtDBus/QDBusAbstractAdaptor>
 #include <QtDBus/QDBusConnection>
+#include <QtDBus/QDBusPendingCallWatcher>
 
 #include "ACL.h"
 #include "Channel.h"
@@ -139,6 +140,9 @@ class MurmurDBus : public QDBusAbstractAdaptor {
 		QString qsAuthService;
 		QString qsAuthPath;
 		void removeAuthenticator();
+		bool authenticateResult(const QDBusMessage &msg, int &res, QString &uname, QStringList &groups);
+	protected slots:
+		void authenticateFinished(QDBusPendingCallWatcher *watcher);
 	public:
 		static QDBusConnection qdbc;
 
@@ -147,6 +151,7 @@ class MurmurDBus : public QDBusAbstractAdaptor {
 	public slots:
 		// These have the result ref as the first parameter, so won't be converted to DBus
 		void authenticateSlot(int &res, QString &uname, int sessionId, const QList<QSslCertificate> &certs, const QString &certhash, bool strong, const QString &pw);
+		void authenticateAsyncSlot(unsigned int ticket, const QString &uname, int sessionId, const QList<QSslCertificate> &certs, const QString &certhash, bool strong, const QString &pw);
 		void registerUserSlot(int &res, const QMap<int, QString> &);
 		void unregisterUserSlot(int &res, int id);
 		void getRegisteredUsersSlot(const QString &filter, QMap<int, QString> &res);
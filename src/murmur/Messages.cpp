@@ -102,26 +102,35 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 		for (int i=0;i<msg.tokens_size();++i)
 			qsl << u8(msg.tokens(i));
 		{
-			QMutexLocker qml(&qmCache);
+			QWriteLocker wl(&qrwlUsers);
 			uSource->qslAccessTokens = qsl;
 		}
 		clearACLCache(uSource);
 	}
 	MSG_SETUP(ServerUser::Connected);
 
-	Channel *root = qhChannels.value(0);
-	Channel *c;
-
 	uSource->qsName = u8(msg.username());
 
-	bool ok = false;
-	bool nameok = validateUserName(uSource->qsName);
-	QString pw = u8(msg.password());
+	// An asynchronous authenticator answers later, and the login continues
+	// from authenticateReply instead.
+	if (beginAuthenticate(uSource, msg))
+		return;
 
 	// Fetch ID and stored username.
 	// Since this may call DBus, which may recall our dbus messages, this function needs
 	// to support re-entrancy, and also to support the fact that sessions may go away.
-	int id = authenticate(uSource->qsName, pw, uSource->uiSession, uSource->qslEmail, uSource->qsHash, uSource->bVerified, uSource->peerCertificateChain());
+	int id = authenticate(uSource->qsName, u8(msg.password()), uSource->uiSession, uSource->qslEmail, uSource->qsHash, uSource->bVerified, uSource->peerCertificateChain());
+
+	finishAuthenticate(uSource, msg, id);
+}
+
+void Server::finishAuthenticate(ServerUser *uSource, const MumbleProto::Authenticate &msg, int id) {
+	Channel *root = qhChannels.value(0);
+	Channel *c;
+
+	bool ok = false;
+	bool nameok = validateUserName(uSource->qsName);
+	QString pw = u8(msg.password());
 
 	uSource->iId = id >= 0 ? id : -1;
 
@@ -201,6 +210,7 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 	mpcrypt.set_key(std::string(reinterpret_cast<const char *>(uSource->csCrypt.raw_key), AES_BLOCK_SIZE));
 	mpcrypt.set_server_nonce(std::string(reinterpret_cast<const char *>(uSource->csCrypt.encrypt_iv), AES_BLOCK_SIZE));
 	mpcrypt.set_client_nonce(std::string(reinterpret_cast<const char *>(uSource->csCrypt.decrypt_iv), AES_BLOCK_SIZE));
+	mpcrypt.set_connection_id(newConnectionId(uSource));
 	sendMessage(uSource, mpcrypt);
 
 	bool fake_celt_support = false;
@@ -212,6 +222,7 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 		fake_celt_support = true;
 	}
 	uSource->bOpus = msg.opus();
+	uSource->bCompactPosition = msg.position_compact();
 	recheckCodecVersions(uSource);
 
 	MumbleProto::CodecVersion mpcv;
@@ -375,13 +386,13 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 	if (! qsWelcomeText.isEmpty())
 		mpss.set_welcome_text(u8(qsWelcomeText));
 	mpss.set_max_bandwidth(iMaxBandwidth);
+	mpss.set_position_compact(uSource->bCompactPosition);
+	mpss.set_opus_tiers(true);
 
 	if (uSource->iId == 0) {
 		mpss.set_permissions(ChanACL::All);
 	} else {
-		QMutexLocker qml(&qmCache);
-		ChanACL::hasPermission(uSource, root, ChanACL::Enter, &acCache);
-		mpss.set_permissions(acCache.value(uSource)->value(root));
+		mpss.set_permissions(ChanACL::effectivePermissions(uSource, root, &acCache) | ChanACL::Cached);
 	}
 
 	sendMessage(uSource, mpss);
@@ -613,7 +624,7 @@ void Server::msgUserState(ServerUser *uSource, MumbleProto::UserState &msg) {
 	}
 
 	if (msg.has_plugin_context()) {
-		uSource->ssContext = msg.plugin_context();
+		setContext(uSource, msg.plugin_context());
 		// Make sure to clear this from the packet so we don't broadcast it
 		msg.clear_plugin_context();
 	}
@@ -1068,7 +1079,6 @@ void Server::msgChannelRemove(ServerUser *uSource, MumbleProto::ChannelRemove &m
 
 void Server::msgTextMessage(ServerUser *uSource, MumbleProto::TextMessage &msg) {
 	MSG_SETUP(ServerUser::Authenticated);
-	QMutexLocker qml(&qmCache);
 
 	TextMessage tm; // for signal userTextMessage
 
@@ -1374,6 +1384,8 @@ void Server::msgPing(ServerUser *uSource, MumbleProto::Ping &msg) {
 	uSource->dTCPPingVar = msg.tcp_ping_var();
 	uSource->uiTCPPackets = msg.tcp_packets();
 
+	uSource->updateLinkQuality();
+
 	quint64 ts = msg.timestamp();
 
 	msg.Clear();
@@ -1622,6 +1634,11 @@ void Server::msgUserStats(ServerUser*uSource, MumbleProto::UserStats &msg) {
 		msg.set_address(pDstServerUser->haAddress.toStdString());
 	}
 
+	if (local) {
+		msg.set_tcp_voice_queue(pDstServerUser->vqTcp.depth());
+		msg.set_tcp_voice_dropped(pDstServerUser->vqTcp.uiDroppedTotal);
+	}
+
 	if (local)
 		msg.set_bandwidth(bwr.bandwidth());
 	msg.set_onlinesecs(bwr.onlineSeconds());
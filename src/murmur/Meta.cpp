@@ -70,6 +70,7 @@ MetaParams::MetaParams() {
 	bSendVersion = true;
 	bBonjour = true;
 	bAllowPing = true;
+	iPingLimit = 20;
 	bCertRequired = false;
 
 	iBanTries = 10;
@@ -84,6 +85,18 @@ MetaParams::MetaParams() {
 
 	iChannelNestingLimit = 10;
 
+	iTcpVoiceBudget = 250;
+
+	iAuthConcurrency = 16;
+	iAuthTimeout = 10;
+	iAuthCacheTTL = 0;
+	iAuthNegativeTTL = 10;
+
+	iIceCallbackQueue = 1000;
+
+	qhaMetrics = QHostAddress(QHostAddress::LocalHost);
+	usMetricsPort = 0;
+
 	qrUserName = QRegExp(QLatin1String("[-=\\w\\[\\]\\{\\}\\(\\)\\@\\|\\.]+"));
 	qrChannelName = QRegExp(QLatin1String("[ \\-=\\w\\#\\[\\]\\{\\}\\(\\)\\@\\|]+"));
 
@@ -119,6 +132,17 @@ T MetaParams::typeCheckedFromSettings(const QString &name, const T &defaultValue
 	return cfgVariable.value<T>();
 }
 
+int MetaParams::positiveFromSettings(const QString &name, int defaultValue) {
+	int value = typeCheckedFromSettings(name, defaultValue);
+
+	if (value <= 0) {
+		qCritical() << "Configuration variable" << name << "must be greater than 0. Set to default value of" << defaultValue << ".";
+		return defaultValue;
+	}
+
+	return value;
+}
+
 void MetaParams::read(QString fname) {
 	if (fname.isEmpty()) {
 		QStringList datapaths;
@@ -284,6 +308,12 @@ void MetaParams::read(QString fname) {
 	qsIceSecretRead = typeCheckedFromSettings("icesecret", qsIceSecretRead);
 	qsIceSecretRead = typeCheckedFromSettings("icesecretread", qsIceSecretRead);
 	qsIceSecretWrite = typeCheckedFromSettings("icesecretwrite", qsIceSecretRead);
+	iIceCallbackQueue = typeCheckedFromSettings("icecallbackqueue", iIceCallbackQueue);
+
+	QString qsMetricsHost = qsSettings->value("metricshost", QString()).toString();
+	if (! qsMetricsHost.isEmpty() && ! qhaMetrics.setAddress(qsMetricsHost))
+		qCritical("Failed to parse metricshost %s", qPrintable(qsMetricsHost));
+	usMetricsPort = static_cast<unsigned short>(typeCheckedFromSettings("metricsport", static_cast<uint>(usMetricsPort)));
 
 	iLogDays = typeCheckedFromSettings("logdays", iLogDays);
 
@@ -319,6 +349,15 @@ void MetaParams::read(QString fname) {
 
 	iChannelNestingLimit = typeCheckedFromSettings("channelnestinglimit", iChannelNestingLimit);
 
+	iTcpVoiceBudget = positiveFromSettings("tcpvoicebudget", iTcpVoiceBudget);
+
+	iAuthConcurrency = positiveFromSettings("authconcurrency", iAuthConcurrency);
+	iAuthTimeout = positiveFromSettings("authtimeout", iAuthTimeout);
+	iAuthCacheTTL = typeCheckedFromSettings("authcachettl", iAuthCacheTTL);
+	iAuthNegativeTTL = typeCheckedFromSettings("authnegativettl", iAuthNegativeTTL);
+
+	qsRecordPath = typeCheckedFromSettings("recordpath", qsRecordPath);
+
 #ifdef Q_OS_UNIX
 	qsName = qsSettings->value("uname").toString();
 	if (geteuid() == 0) {
@@ -351,6 +390,7 @@ void MetaParams::read(QString fname) {
 	}
 	bSendVersion = typeCheckedFromSettings("sendversion", bSendVersion);
 	bAllowPing = typeCheckedFromSettings("allowping", bAllowPing);
+	iPingLimit = typeCheckedFromSettings("pinglimit", iPingLimit);
 
 	QString qsSSLCert = qsSettings->value("sslCert").toString();
 	QString qsSSLKey = qsSettings->value("sslKey").toString();
@@ -479,6 +519,12 @@ void MetaParams::read(QString fname) {
 	qmConfig.insert(QLatin1String("suggestpushtotalk"), qvSuggestPushToTalk.isNull() ? QString() : qvSuggestPushToTalk.toString());
 	qmConfig.insert(QLatin1String("opusthreshold"), QString::number(iOpusThreshold));
 	qmConfig.insert(QLatin1String("channelnestinglimit"), QString::number(iChannelNestingLimit));
+	qmConfig.insert(QLatin1String("tcpvoicebudget"), QString::number(iTcpVoiceBudget));
+	qmConfig.insert(QLatin1String("authconcurrency"), QString::number(iAuthConcurrency));
+	qmConfig.insert(QLatin1String("authtimeout"), QString::number(iAuthTimeout));
+	qmConfig.insert(QLatin1String("authcachettl"), QString::number(iAuthCacheTTL));
+	qmConfig.insert(QLatin1String("authnegativettl"), QString::number(iAuthNegativeTTL));
+	qmConfig.insert(QLatin1String("recordpath"), qsRecordPath);
 }
 
 Meta::Meta() {
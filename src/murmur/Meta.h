@@ -63,6 +63,12 @@ public:
 	int iMaxImageMessageLength;
 	int iOpusThreshold;
 	int iChannelNestingLimit;
+	int iTcpVoiceBudget;
+	int iAuthConcurrency;
+	int iAuthTimeout;
+	int iAuthCacheTTL;
+	int iAuthNegativeTTL;
+	QString qsRecordPath;
 	bool bAllowHTML;
 	QString qsPassword;
 	QString qsWelcomeText;
@@ -86,6 +92,7 @@ public:
 	int iObfuscate;
 	bool bSendVersion;
 	bool bAllowPing;
+	int iPingLimit;
 
 	QString qsDBus;
 	QString qsDBusService;
@@ -93,6 +100,10 @@ public:
 	QString qsPid;
 	QString qsIceEndpoint;
 	QString qsIceSecretRead, qsIceSecretWrite;
+	int iIceCallbackQueue;
+
+	QHostAddress qhaMetrics;
+	unsigned short usMetricsPort;
 
 	QString qsRegName;
 	QString qsRegPassword;
@@ -129,6 +140,7 @@ public:
 private:
 		template <class T>
 		T typeCheckedFromSettings(const QString &name, const T &variable);
+		int positiveFromSettings(const QString &name, int variable);
 };
 
 class Meta : public QObject {
@@ -0,0 +1,260 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "murmur_pch.h"
+
+#include "Metrics.h"
+
+#include "Meta.h"
+#include "Server.h"
+
+struct MetricsShard {
+	quint64 uiCounters[Metrics::CounterCount];
+	quint64 uiBuckets[Metrics::HistogramCount][Metrics::iBuckets];
+	quint64 uiSum[Metrics::HistogramCount];
+
+	MetricsShard() {
+		memset(this, 0, sizeof(*this));
+	};
+
+	void add(const MetricsShard &other) {
+		for (int i=0;i<Metrics::CounterCount;++i)
+			uiCounters[i] += other.uiCounters[i];
+		for (int h=0;h<Metrics::HistogramCount;++h) {
+			for (int i=0;i<Metrics::iBuckets;++i)
+				uiBuckets[h][i] += other.uiBuckets[h][i];
+			uiSum[h] += other.uiSum[h];
+		}
+	};
+};
+
+// Owned by QThreadStorage. When the thread exits, the counts of its shard are
+// folded into msRetired so totals never go backwards.
+class MetricsShardRef {
+	public:
+		MetricsShard *msShard;
+		MetricsShardRef();
+		~MetricsShardRef();
+};
+
+// Never freed, as thread storage of the main thread may be cleaned up after
+// static destructors have run.
+static QMutex *qmShards = new QMutex();
+static QList<MetricsShard *> *qlShards = new QList<MetricsShard *>();
+static MetricsShard *msRetired = new MetricsShard();
+static QThreadStorage<MetricsShardRef *> qtsShard;
+
+MetricsShardRef::MetricsShardRef() {
+	msShard = new MetricsShard();
+	QMutexLocker qml(qmShards);
+	qlShards->append(msShard);
+}
+
+MetricsShardRef::~MetricsShardRef() {
+	QMutexLocker qml(qmShards);
+	qlShards->removeAll(msShard);
+	msRetired->add(*msShard);
+	delete msShard;
+}
+
+static inline MetricsShard *localShard() {
+	MetricsShardRef *ref = qtsShard.localData();
+	if (! ref) {
+		ref = new MetricsShardRef();
+		qtsShard.setLocalData(ref);
+	}
+	return ref->msShard;
+}
+
+struct MetricsDesc {
+	const char *name;
+	const char *help;
+};
+
+static const MetricsDesc mdCounters[Metrics::CounterCount] = {
+	{ "murmur_udp_packets_received_total", "UDP packets received." },
+	{ "murmur_udp_bytes_received_total", "UDP bytes received." },
+	{ "murmur_udp_decrypt_failures_total", "UDP packets that could not be decrypted." },
+	{ "murmur_udp_peer_hints_total", "New UDP peers found by the connection id in front of their packet." },
+	{ "murmur_udp_peer_trials_total", "Decryption attempts to find the user behind a new UDP peer." },
+	{ "murmur_udp_pings_total", "UDP pings answered." },
+	{ "murmur_udp_pings_limited_total", "UDP pings dropped by the rate limit." },
+	{ "murmur_voice_packets_sent_total", "Voice packets sent to listeners, over UDP or tunneled through TCP." },
+	{ "murmur_voice_bytes_sent_total", "Voice payload bytes sent to listeners." },
+	{ "murmur_tcp_messages_received_total", "Control channel messages received." },
+	{ "murmur_tcp_bytes_received_total", "Control channel payload bytes received." },
+	{ "murmur_tls_handshakes_total", "Completed TLS handshakes." },
+	{ "murmur_db_queries_total", "Database queries executed." },
+	{ "murmur_db_errors_total", "Database queries that failed." },
+	{ "murmur_acl_cache_hits_total", "Permission checks answered from the ACL cache." },
+	{ "murmur_acl_cache_misses_total", "Permission checks that had to evaluate the ACLs." },
+	{ "murmur_acl_cache_invalidations_total", "Times the ACL cache of one user or the whole server was invalidated." }
+};
+
+static const MetricsDesc mdHistograms[Metrics::HistogramCount] = {
+	{ "murmur_process_msg_seconds", "Time to relay one voice packet." },
+	{ "murmur_users_lock_wait_seconds", "Time the UDP thread waited for the user list lock." },
+	{ "murmur_db_query_seconds", "Time to execute one database query." },
+	{ "murmur_tls_handshake_seconds", "Time from accepting a connection to completing its TLS handshake." }
+};
+
+void Metrics::count(Counter c, quint64 v) {
+	localShard()->uiCounters[c] += v;
+}
+
+void Metrics::record(Histogram h, quint64 usec) {
+	MetricsShard *ms = localShard();
+	++ms->uiBuckets[h][bucket(usec)];
+	ms->uiSum[h] += usec;
+}
+
+int Metrics::bucket(quint64 usec) {
+	if (usec < static_cast<quint64>(iLinearBuckets))
+		return static_cast<int>(usec);
+	if (usec >> (iMaxMagnitude + 1))
+		return iBuckets - 1;
+
+	int magnitude = 4;
+	while (usec >> (magnitude + 1))
+		++magnitude;
+
+	const int sub = static_cast<int>(usec >> (magnitude - 3)) & (iSubBuckets - 1);
+	return iLinearBuckets + (magnitude - 4) * iSubBuckets + sub;
+}
+
+static QString seconds(quint64 usec) {
+	return QString::number(static_cast<double>(usec) / 1000000.0, 'g', 12);
+}
+
+QString Metrics::prometheus() {
+	MetricsShard total;
+	{
+		QMutexLocker qml(qmShards);
+		total.add(*msRetired);
+		foreach(const MetricsShard *ms, *qlShards)
+			total.add(*ms);
+	}
+
+	QString out;
+	QTextStream ts(&out);
+
+	for (int i=0;i<CounterCount;++i) {
+		ts << "# HELP " << mdCounters[i].name << " " << mdCounters[i].help << "\n";
+		ts << "# TYPE " << mdCounters[i].name << " counter\n";
+		ts << mdCounters[i].name << " " << total.uiCounters[i] << "\n";
+	}
+
+	// Buckets are exported at powers of two from 16us to about a minute,
+	// which fall on boundaries of the internal buckets.
+	for (int h=0;h<HistogramCount;++h) {
+		const char *name = mdHistograms[h].name;
+		ts << "# HELP " << name << " " << mdHistograms[h].help << "\n";
+		ts << "# TYPE " << name << " histogram\n";
+
+		quint64 cumulative = 0;
+		int i = 0;
+		for (int magnitude = 4; magnitude <= 26; ++magnitude) {
+			const int limit = iLinearBuckets + (magnitude - 4) * iSubBuckets;
+			for (; i < limit; ++i)
+				cumulative += total.uiBuckets[h][i];
+			ts << name << "_bucket{le=\"" << seconds(1ULL << magnitude) << "\"} " << cumulative << "\n";
+		}
+		for (; i < iBuckets; ++i)
+			cumulative += total.uiBuckets[h][i];
+		ts << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+		ts << name << "_sum " << seconds(total.uiSum[h]) << "\n";
+		ts << name << "_count " << cumulative << "\n";
+	}
+
+	ts << "# HELP murmur_users Users connected to a virtual server.\n";
+	ts << "# TYPE murmur_users gauge\n";
+	foreach(const Server *s, meta->qhServers)
+		ts << "murmur_users{server=\"" << s->iServerNum << "\"} " << s->qhUsers.count() << "\n";
+
+	ts.flush();
+	return out;
+}
+
+MetricsServer::MetricsServer(const QHostAddress &address, quint16 port, QObject *p) : QTcpServer(p) {
+	connect(this, SIGNAL(newConnection()), this, SLOT(newClient()));
+	if (! listen(address, port))
+		qCritical("Metrics: Failed to bind to %s:%d: %s", qPrintable(address.toString()), port, qPrintable(errorString()));
+	else
+		qWarning("Metrics: Listening on %s:%d", qPrintable(address.toString()), port);
+}
+
+void MetricsServer::newClient() {
+	while (hasPendingConnections()) {
+		QTcpSocket *sock = nextPendingConnection();
+		qhRequests.insert(sock, QByteArray());
+		connect(sock, SIGNAL(readyRead()), this, SLOT(clientRead()));
+		connect(sock, SIGNAL(disconnected()), this, SLOT(clientDisconnected()));
+	}
+}
+
+void MetricsServer::clientRead() {
+	QTcpSocket *sock = qobject_cast<QTcpSocket *>(sender());
+	if (! sock || ! qhRequests.contains(sock))
+		return;
+
+	QByteArray &qba = qhRequests[sock];
+	qba.append(sock->readAll());
+
+	if (qba.size() > 8192) {
+		qhRequests.remove(sock);
+		sock->abort();
+		sock->deleteLater();
+		return;
+	}
+
+	if (! qba.contains("\r\n\r\n") && ! qba.contains("\n\n"))
+		return;
+
+	QByteArray response;
+	if (qba.startsWith("GET ")) {
+		const QByteArray body = Metrics::prometheus().toUtf8();
+		response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + QByteArray::number(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+	} else {
+		response = "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+	}
+
+	qhRequests.remove(sock);
+	disconnect(sock, SIGNAL(readyRead()), this, SLOT(clientRead()));
+	sock->write(response);
+	sock->disconnectFromHost();
+}
+
+void MetricsServer::clientDisconnected() {
+	QTcpSocket *sock = qobject_cast<QTcpSocket *>(sender());
+	if (! sock)
+		return;
+	qhRequests.remove(sock);
+	sock->deleteLater();
+}
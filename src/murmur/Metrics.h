@@ -0,0 +1,97 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_MURMUR_METRICS_H_
+#define MUMBLE_MURMUR_METRICS_H_
+
+#include <QtCore/QHash>
+#include <QtCore/QString>
+#include <QtNetwork/QHostAddress>
+#include <QtNetwork/QTcpServer>
+
+#include "Timer.h"
+
+class QTcpSocket;
+
+// Process wide counters and latency histograms for the hot paths.
+//
+// Every thread updates its own shard with plain, unlocked writes; the
+// exporter sums the shards of all threads. A value read while it is being
+// updated may lag by one increment. Histograms bucket microseconds
+// log-linearly: exact below 16us, and in eight steps per power of two
+// above, so any recorded value is within 12.5% of its bucket.
+class Metrics {
+	public:
+		enum Counter { UdpPackets, UdpBytes, DecryptFailures, UdpPeerHints, UdpPeerTrials, UdpPings, UdpPingsLimited, VoicePacketsSent, VoiceBytesSent, TcpMessages, TcpBytes, TlsHandshakes, DbQueries, DbErrors, PermCacheHits, PermCacheMisses, PermCacheInvalidations, CounterCount };
+		enum Histogram { ProcessMsgTime, UsersLockWait, DbQueryTime, TlsHandshakeTime, HistogramCount };
+
+		static const int iLinearBuckets = 16;
+		static const int iSubBuckets = 8;
+		static const int iMaxMagnitude = 35;
+		static const int iBuckets = iLinearBuckets + (iMaxMagnitude - 3) * iSubBuckets;
+
+		static void count(Counter c, quint64 v = 1);
+		static void record(Histogram h, quint64 usec);
+		static int bucket(quint64 usec);
+
+		// Prometheus text format. Also reports per-server gauges, so only
+		// call it from the main thread.
+		static QString prometheus();
+};
+
+// Records the time until it goes out of scope.
+class MetricsTimer {
+	protected:
+		Metrics::Histogram hHistogram;
+		Timer tStart;
+	public:
+		MetricsTimer(Metrics::Histogram h) : hHistogram(h) { };
+		~MetricsTimer() {
+			Metrics::record(hHistogram, tStart.elapsed());
+		};
+};
+
+// Minimal HTTP listener answering every GET with Metrics::prometheus(), for
+// a local Prometheus scraper. Runs on the main thread.
+class MetricsServer : public QTcpServer {
+	private:
+		Q_OBJECT
+		Q_DISABLE_COPY(MetricsServer)
+	protected:
+		QHash<QTcpSocket *, QByteArray> qhRequests;
+	public:
+		MetricsServer(const QHostAddress &address, quint16 port, QObject *p = NULL);
+	protected slots:
+		void newClient();
+		void clientRead();
+		void clientDisconnected();
+};
+
+#endif
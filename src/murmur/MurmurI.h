@@ -61,6 +61,13 @@ namespace Murmur {
 			virtual void getTree_async(const ::Murmur::AMD_Server_getTreePtr&,
 			                           const Ice::Current&);
 
+			virtual void getSnapshot_async(const ::Murmur::AMD_Server_getSnapshotPtr&,
+			                               const Ice::Current&);
+
+			virtual void getChanges_async(const ::Murmur::AMD_Server_getChangesPtr&,
+			                              ::Ice::Long,
+			                              const Ice::Current&);
+
 			virtual void getCertificateList_async(const ::Murmur::AMD_Server_getCertificateListPtr&,
 			                                      ::Ice::Int,
 			                                      const ::Ice::Current&);
@@ -216,6 +223,9 @@ namespace Murmur {
 			virtual void getUptime_async(const ::Murmur::AMD_Meta_getUptimePtr&,
 			                             const Ice::Current&);
 
+			virtual void getMetrics_async(const ::Murmur::AMD_Meta_getMetricsPtr&,
+			                              const Ice::Current&);
+
 			virtual void getSlice_async(const ::Murmur::AMD_Meta_getSlicePtr&,
 			                            const Ice::Current&);
 	};
@@ -39,6 +39,7 @@
 #include "Channel.h"
 #include "Group.h"
 #include "Meta.h"
+#include "Metrics.h"
 #include "MurmurI.h"
 #include "Server.h"
 #include "ServerUser.h"
@@ -202,6 +203,8 @@ class ServerLocator : public virtual Ice::ServantLocator {
 
 MurmurIce::MurmurIce() {
 	count = 0;
+	cdDispatcher = NULL;
+	qtSnapshotRefresh = NULL;
 
 	if (meta->mp.qsIceEndpoint.isEmpty())
 		return;
@@ -243,6 +246,9 @@ MurmurIce::MurmurIce() {
 			qWarning("MurmurIce: Endpoint \"%s\" running", qPrintable(u8(ep->toString())));
 		}
 
+		cdDispatcher = new CallbackDispatcher(meta->mp.iIceCallbackQueue);
+		cdDispatcher->start();
+
 		meta->connectListener(this);
 	} catch (Ice::Exception &e) {
 		qCritical("MurmurIce: Initialization failed: %s", qPrintable(u8(e.ice_name())));
@@ -250,6 +256,10 @@ MurmurIce::MurmurIce() {
 }
 
 MurmurIce::~MurmurIce() {
+	if (cdDispatcher) {
+		cdDispatcher->stop();
+		cdDispatcher->wait();
+	}
 	if (communicator) {
 		communicator->shutdown();
 		communicator->waitForShutdown();
@@ -258,6 +268,279 @@ MurmurIce::~MurmurIce() {
 		qWarning("MurmurIce: Shutdown complete");
 	}
 	iopServer = NULL;
+
+	// Outstanding calls complete in communicator->destroy(), so no
+	// callback can reach the dispatcher after this.
+	delete cdDispatcher;
+	cdDispatcher = NULL;
+
+	qDeleteAll(qmJournals);
+}
+
+// Completion of a oneway notification. Runs on an Ice thread.
+class DispatchCallback : public IceUtil::Shared {
+	protected:
+		CallbackDispatcher *cd;
+		unsigned int uiListener;
+	public:
+		DispatchCallback(CallbackDispatcher *d, unsigned int id) : cd(d), uiListener(id) { };
+
+		void completed(const Ice::AsyncResultPtr &r) {
+			try {
+				r->throwLocalException();
+			} catch (const Ice::Exception &) {
+				cd->failed(uiListener);
+			}
+		}
+
+		void sent(const Ice::AsyncResultPtr &r) {
+			// Calls sent synchronously are handled by CallbackDispatcher::invoke.
+			if (! r->sentSynchronously())
+				cd->sent(uiListener);
+		}
+};
+typedef IceUtil::Handle<DispatchCallback> DispatchCallbackPtr;
+
+CallbackDispatcher::CallbackDispatcher(int maxqueue, QObject *p) : QThread(p) {
+	iMaxQueue = qMax(maxqueue, 1);
+	uiNextListener = 0;
+	uiDropped = 0;
+	bRunning = true;
+}
+
+CallbackDispatcher::~CallbackDispatcher() {
+	stop();
+	wait();
+	qDeleteAll(qhListeners);
+}
+
+void CallbackDispatcher::stop() {
+	QMutexLocker qml(&qmQueue);
+	bRunning = false;
+	qwcQueue.wakeAll();
+}
+
+void CallbackDispatcher::addListener(int server_id, const ::Murmur::ServerCallbackPrx &prx) {
+	QMutexLocker qml(&qmQueue);
+
+	foreach(Listener *l, qhListeners)
+		if ((l->iServerNum == server_id) && (l->prx == prx))
+			return;
+
+	Listener *l = new Listener();
+	l->iServerNum = server_id;
+	l->prx = prx;
+	l->bBusy = false;
+	l->bOverflow = false;
+	l->uiDropped = 0;
+
+	if (++uiNextListener == 0)
+		++uiNextListener;
+	qhListeners.insert(uiNextListener, l);
+}
+
+void CallbackDispatcher::removeListener(int server_id, const ::Murmur::ServerCallbackPrx &prx) {
+	QMutexLocker qml(&qmQueue);
+
+	QHash<unsigned int, Listener *>::iterator i = qhListeners.begin();
+	while (i != qhListeners.end()) {
+		Listener *l = i.value();
+		if ((l->iServerNum == server_id) && (l->prx == prx)) {
+			delete l;
+			i = qhListeners.erase(i);
+		} else {
+			++i;
+		}
+	}
+}
+
+void CallbackDispatcher::removeServer(int server_id) {
+	QMutexLocker qml(&qmQueue);
+
+	QHash<unsigned int, Listener *>::iterator i = qhListeners.begin();
+	while (i != qhListeners.end()) {
+		Listener *l = i.value();
+		if (l->iServerNum == server_id) {
+			delete l;
+			i = qhListeners.erase(i);
+		} else {
+			++i;
+		}
+	}
+}
+
+/**
+ * Queues an event for all listeners of a server. Called on the main thread and
+ * never waits on a listener; at worst it drops the oldest event of a full queue.
+ */
+void CallbackDispatcher::post(const ::Server *server, const CallbackEvent &ev) {
+	QStringList qslOverflow;
+
+	{
+		QMutexLocker qml(&qmQueue);
+
+		foreach(Listener *l, qhListeners) {
+			if (l->iServerNum != server->iServerNum)
+				continue;
+
+			// A new state or a removal supersedes a state change still waiting.
+			QHash<int, QLinkedList<CallbackEvent>::iterator> *index = NULL;
+			int key = 0;
+			switch (ev.tType) {
+				case CallbackEvent::UserStateChanged:
+				case CallbackEvent::UserDisconnected:
+					index = &l->qhUserState;
+					key = ev.mpUser.session;
+					break;
+				case CallbackEvent::ChannelStateChanged:
+				case CallbackEvent::ChannelRemoved:
+					index = &l->qhChannelState;
+					key = ev.mpChannel.id;
+					break;
+				default:
+					break;
+			}
+			if (index && index->contains(key))
+				l->qllEvents.erase(index->take(key));
+
+			if (l->qllEvents.count() >= iMaxQueue) {
+				const CallbackEvent &old = l->qllEvents.first();
+				if (old.tType == CallbackEvent::UserStateChanged)
+					l->qhUserState.remove(old.mpUser.session);
+				else if (old.tType == CallbackEvent::ChannelStateChanged)
+					l->qhChannelState.remove(old.mpChannel.id);
+				l->qllEvents.removeFirst();
+
+				++l->uiDropped;
+				++uiDropped;
+				if (! l->bOverflow) {
+					l->bOverflow = true;
+					qslOverflow << QString::fromLatin1("Ice ServerCallback %1 is not keeping up, dropping events (%2 so far)").arg(QString::fromStdString(l->prx->ice_toString())).arg(l->uiDropped);
+				}
+			}
+
+			QLinkedList<CallbackEvent>::iterator it = l->qllEvents.insert(l->qllEvents.end(), ev);
+			if (ev.tType == CallbackEvent::UserStateChanged)
+				l->qhUserState.insert(key, it);
+			else if (ev.tType == CallbackEvent::ChannelStateChanged)
+				l->qhChannelState.insert(key, it);
+		}
+
+		qwcQueue.wakeAll();
+	}
+
+	foreach(const QString &msg, qslOverflow)
+		server->log(msg);
+}
+
+quint64 CallbackDispatcher::dropped() {
+	QMutexLocker qml(&qmQueue);
+	return uiDropped;
+}
+
+void CallbackDispatcher::sent(unsigned int id) {
+	QMutexLocker qml(&qmQueue);
+
+	Listener *l = qhListeners.value(id);
+	if (l) {
+		l->bBusy = false;
+		qwcQueue.wakeAll();
+	}
+}
+
+void CallbackDispatcher::failed(unsigned int id) {
+	Listener *l;
+	{
+		QMutexLocker qml(&qmQueue);
+		l = qhListeners.take(id);
+	}
+	if (! l)
+		return;
+
+	// Removal from MurmurIce has to happen on the main thread.
+	QCoreApplication::instance()->postEvent(mi, new ExecEvent(boost::bind(&MurmurIce::callbackFailed, mi, l->iServerNum, l->prx)));
+	delete l;
+}
+
+void CallbackDispatcher::invoke(unsigned int id, const ::Murmur::ServerCallbackPrx &prx, const CallbackEvent &ev) {
+	DispatchCallbackPtr cb = new DispatchCallback(this, id);
+	Ice::CallbackPtr icb = Ice::newCallback(cb, &DispatchCallback::completed, &DispatchCallback::sent);
+
+	try {
+		Ice::AsyncResultPtr r;
+		switch (ev.tType) {
+			case CallbackEvent::UserConnected:
+				r = prx->begin_userConnected(ev.mpUser, icb);
+				break;
+			case CallbackEvent::UserDisconnected:
+				r = prx->begin_userDisconnected(ev.mpUser, icb);
+				break;
+			case CallbackEvent::UserStateChanged:
+				r = prx->begin_userStateChanged(ev.mpUser, icb);
+				break;
+			case CallbackEvent::UserTextMessage:
+				r = prx->begin_userTextMessage(ev.mpUser, ev.mpMessage, icb);
+				break;
+			case CallbackEvent::ChannelCreated:
+				r = prx->begin_channelCreated(ev.mpChannel, icb);
+				break;
+			case CallbackEvent::ChannelRemoved:
+				r = prx->begin_channelRemoved(ev.mpChannel, icb);
+				break;
+			case CallbackEvent::ChannelStateChanged:
+				r = prx->begin_channelStateChanged(ev.mpChannel, icb);
+				break;
+		}
+		if (r->sentSynchronously())
+			sent(id);
+	} catch (const Ice::Exception &) {
+		failed(id);
+	}
+}
+
+void CallbackDispatcher::run() {
+	QMutexLocker qml(&qmQueue);
+
+	while (bRunning) {
+		QList<unsigned int> qlIds;
+		QList< ::Murmur::ServerCallbackPrx> qlProxies;
+		QList<CallbackEvent> qlEvents;
+
+		// One event per listener and round, and none for a listener whose
+		// previous call has not left yet. That is what keeps a slow listener
+		// from building up anything but its own bounded queue.
+		QHash<unsigned int, Listener *>::const_iterator i;
+		for (i = qhListeners.constBegin(); i != qhListeners.constEnd(); ++i) {
+			Listener *l = i.value();
+			if (l->bBusy || l->qllEvents.isEmpty())
+				continue;
+
+			const CallbackEvent &ev = l->qllEvents.first();
+			if (ev.tType == CallbackEvent::UserStateChanged)
+				l->qhUserState.remove(ev.mpUser.session);
+			else if (ev.tType == CallbackEvent::ChannelStateChanged)
+				l->qhChannelState.remove(ev.mpChannel.id);
+
+			qlIds << i.key();
+			qlProxies << l->prx;
+			qlEvents << ev;
+
+			l->qllEvents.removeFirst();
+			if (l->qllEvents.isEmpty())
+				l->bOverflow = false;
+			l->bBusy = true;
+		}
+
+		if (qlIds.isEmpty()) {
+			qwcQueue.wait(&qmQueue);
+			continue;
+		}
+
+		qml.unlock();
+		for (int j=0;j<qlIds.count();++j)
+			invoke(qlIds.at(j), qlProxies.at(j), qlEvents.at(j));
+		qml.relock();
+	}
 }
 
 void MurmurIce::customEvent(QEvent *evt) {
@@ -283,6 +566,12 @@ void MurmurIce::badAuthenticator(::Server *server) {
 	removeServerUpdatingAuthenticator(server);
 }
 
+void MurmurIce::callbackFailed(int server_id, const ::Murmur::ServerCallbackPrx &prx) {
+	::Server *server = meta->qhServers.value(server_id);
+	if (server)
+		badServerProxy(prx, server);
+}
+
 void MurmurIce::addMetaCallback(const ::Murmur::MetaCallbackPrx& prx) {
 	if (!qlMetaCallbacks.contains(prx)) {
 		qWarning("Added Ice MetaCallback %s", qPrintable(QString::fromStdString(communicator->proxyToString(prx))));
@@ -302,12 +591,14 @@ void MurmurIce::addServerCallback(const ::Server* server, const ::Murmur::Server
 	if (!cbList.contains(prx)) {
 		server->log(QString("Added Ice ServerCallback %1").arg(QString::fromStdString(communicator->proxyToString(prx))));
 		cbList.append(prx);
+		cdDispatcher->addListener(server->iServerNum, prx);
 	}
 }
 
 void MurmurIce::removeServerCallback(const ::Server* server, const ::Murmur::ServerCallbackPrx& prx) {
 	if (qmServerCallbacks[server->iServerNum].removeAll(prx)) {
 		server->log(QString("Removed Ice ServerCallback %1").arg(QString::fromStdString(communicator->proxyToString(prx))));
+		cdDispatcher->removeListener(server->iServerNum, prx);
 	}
 }
 
@@ -315,6 +606,7 @@ void MurmurIce::removeServerCallbacks(const ::Server* server) {
 	if (qmServerCallbacks.contains(server->iServerNum)) {
 		server->log(QString("Removed all Ice ServerCallbacks"));
 		qmServerCallbacks.remove(server->iServerNum);
+		cdDispatcher->removeServer(server->iServerNum);
 	}
 }
 
@@ -400,6 +692,16 @@ void MurmurIce::started(::Server *s) {
 
 void MurmurIce::stopped(::Server *s) {
 	removeServerCallbacks(s);
+	delete qmJournals.take(s->iServerNum);
+
+	// The server is deleted after this returns; wait for any read call
+	// still using it through the snapshot.
+	{
+		QWriteLocker wl(&qrwlSnapshots);
+		qmSnapshots.remove(s->iServerNum);
+	}
+	qmSnapshotWork.remove(s->iServerNum);
+	qsSnapshotDirty.remove(s->iServerNum);
 	removeServerAuthenticator(s);
 	removeServerUpdatingAuthenticator(s);
 
@@ -417,24 +719,238 @@ void MurmurIce::stopped(::Server *s) {
 	}
 }
 
-void MurmurIce::userConnected(const ::User *p) {
-	::Server *s = qobject_cast< ::Server *> (sender());
+ChangeJournal::ChangeJournal() {
+	// Start from the current time, so a version from before a restart of the
+	// server or of murmur is never mistaken for a current one.
+	iVersion = static_cast< ::Ice::Long>(QDateTime::currentDateTime().toTime_t()) << 20;
+}
+
+void ChangeJournal::record(const CallbackEvent &ev) {
+	::Murmur::Change c;
+
+	switch (ev.tType) {
+		case CallbackEvent::UserConnected:
+			c.type = ::Murmur::ChangeUserConnected;
+			break;
+		case CallbackEvent::UserDisconnected:
+			c.type = ::Murmur::ChangeUserDisconnected;
+			break;
+		case CallbackEvent::UserStateChanged:
+			c.type = ::Murmur::ChangeUserState;
+			break;
+		case CallbackEvent::ChannelCreated:
+			c.type = ::Murmur::ChangeChannelCreated;
+			break;
+		case CallbackEvent::ChannelRemoved:
+			c.type = ::Murmur::ChangeChannelRemoved;
+			break;
+		case CallbackEvent::ChannelStateChanged:
+			c.type = ::Murmur::ChangeChannelState;
+			break;
+		default:
+			return;
+	}
+
+	c.version = ++iVersion;
+	c.usr = ev.mpUser;
+	c.chan = ev.mpChannel;
+
+	qqChanges.enqueue(c);
+	while (qqChanges.count() > iMaxChanges)
+		qqChanges.dequeue();
+}
+
+bool ChangeJournal::changesSince(::Ice::Long since, ::Murmur::ChangeList &changes) const {
+	if ((since > iVersion) || (since < iVersion - qqChanges.count()))
+		return false;
+
+	const int missing = static_cast<int>(iVersion - since);
+	changes.reserve(missing);
+	for (int i=qqChanges.count() - missing;i<qqChanges.count();++i)
+		changes.push_back(qqChanges.at(i));
+	return true;
+}
+
+ChangeJournal *MurmurIce::journal(const ::Server *server) {
+	ChangeJournal *cj = qmJournals.value(server->iServerNum);
+	if (! cj) {
+		cj = new ChangeJournal();
+		qmJournals.insert(server->iServerNum, cj);
+
+		// The snapshot is current as of the journal's first version.
+		if (qmSnapshotWork.contains(server->iServerNum)) {
+			qmSnapshotWork[server->iServerNum].iVersion = cj->iVersion;
+			qsSnapshotDirty.insert(server->iServerNum);
+			publishSnapshots();
+		}
+	}
+	return cj;
+}
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
+bool MurmurIce::hasEventListeners(const ::Server *server) const {
+	return qmJournals.contains(server->iServerNum) || qmSnapshotWork.contains(server->iServerNum) || ! qmServerCallbacks.value(server->iServerNum).isEmpty();
+}
 
-	if (qmList.isEmpty())
+void MurmurIce::publishEvent(const ::Server *server, const CallbackEvent &ev) {
+	ChangeJournal *cj = qmJournals.value(server->iServerNum);
+	if (cj)
+		cj->record(ev);
+	if (qmSnapshotWork.contains(server->iServerNum))
+		updateSnapshot(server, ev);
+	if (! qmServerCallbacks.value(server->iServerNum).isEmpty())
+		cdDispatcher->post(server, ev);
+}
+
+ServerSnapshotPtr MurmurIce::snapshot(int server_id) const {
+	QReadLocker rl(&qrwlSnapshots);
+	return qmSnapshots.value(server_id);
+}
+
+/**
+ * Starts keeping a snapshot of server for read calls, and publishes the
+ * first one right away. Called on the main thread by the first read call
+ * that found none.
+ */
+void MurmurIce::activateSnapshot(::Server *server) {
+	if (qmSnapshotWork.contains(server->iServerNum))
 		return;
 
-	::Murmur::User mp;
-	userToUser(p, mp);
+	ServerSnapshot &ss = qmSnapshotWork[server->iServerNum];
+	ss.server = server;
+	ss.tUptime = server->tUptime;
 
-	foreach(const ::Murmur::ServerCallbackPrx &prx, qmList) {
-		try {
-			prx->userConnected(mp);
-		} catch (...) {
-			badServerProxy(prx, s);
+	const ChangeJournal *cj = qmJournals.value(server->iServerNum);
+	if (cj)
+		ss.iVersion = cj->iVersion;
+
+	foreach(const ::User *p, server->qhUsers) {
+		if (static_cast<const ServerUser *>(p)->sState != ::ServerUser::Authenticated)
+			continue;
+		::Murmur::User *mp = new ::Murmur::User();
+		userToUser(p, *mp);
+		ss.qhUsers.insert(p->uiSession, QSharedPointer<const ::Murmur::User>(mp));
+	}
+	foreach(const ::Channel *c, server->qhChannels) {
+		::Murmur::Channel *mc = new ::Murmur::Channel();
+		channelToChannel(c, *mc);
+		ss.qhChannels.insert(c->iId, QSharedPointer<const ::Murmur::Channel>(mc));
+	}
+
+	if (! qtSnapshotRefresh) {
+		qtSnapshotRefresh = new QTimer(this);
+		connect(qtSnapshotRefresh, SIGNAL(timeout()), this, SLOT(refreshSnapshots()));
+		qtSnapshotRefresh->start(1000);
+	}
+
+	qsSnapshotDirty.insert(server->iServerNum);
+	publishSnapshots();
+}
+
+void MurmurIce::updateSnapshot(const ::Server *server, const CallbackEvent &ev) {
+	ServerSnapshot &ss = qmSnapshotWork[server->iServerNum];
+
+	switch (ev.tType) {
+		case CallbackEvent::UserConnected:
+		case CallbackEvent::UserStateChanged:
+			ss.qhUsers.insert(ev.mpUser.session, QSharedPointer<const ::Murmur::User>(new ::Murmur::User(ev.mpUser)));
+			break;
+		case CallbackEvent::UserDisconnected:
+			ss.qhUsers.remove(ev.mpUser.session);
+			break;
+		case CallbackEvent::ChannelCreated:
+		case CallbackEvent::ChannelStateChanged:
+			ss.qhChannels.insert(ev.mpChannel.id, QSharedPointer<const ::Murmur::Channel>(new ::Murmur::Channel(ev.mpChannel)));
+			break;
+		case CallbackEvent::ChannelRemoved:
+			ss.qhChannels.remove(ev.mpChannel.id);
+			break;
+		default:
+			return;
+	}
+
+	// publishEvent() records the change in the journal first.
+	const ChangeJournal *cj = qmJournals.value(server->iServerNum);
+	if (cj)
+		ss.iVersion = cj->iVersion;
+
+	const bool queued = ! qsSnapshotDirty.isEmpty();
+	qsSnapshotDirty.insert(server->iServerNum);
+
+	if (! queued)
+		QMetaObject::invokeMethod(this, "publishSnapshots", Qt::QueuedConnection);
+}
+
+/**
+ * Publishes the working copy of every server changed since the last call.
+ * Changes made while handling one message are coalesced into a single
+ * snapshot.
+ */
+void MurmurIce::publishSnapshots() {
+	foreach(int server_id, qsSnapshotDirty) {
+		ServerSnapshotPtr ssp(new ServerSnapshot(qmSnapshotWork.value(server_id)));
+		QWriteLocker wl(&qrwlSnapshots);
+		qmSnapshots.insert(server_id, ssp);
+	}
+	qsSnapshotDirty.clear();
+}
+
+/**
+ * Online time, idle time and bandwidth change without a state change being
+ * signalled, so users are converted again once a second.
+ */
+void MurmurIce::refreshSnapshots() {
+	QMap<int, ServerSnapshot>::iterator i;
+	for (i = qmSnapshotWork.begin(); i != qmSnapshotWork.end(); ++i) {
+		ServerSnapshot &ss = i.value();
+		foreach(const ::User *p, ss.server->qhUsers) {
+			if (! ss.qhUsers.contains(p->uiSession))
+				continue;
+			::Murmur::User *mp = new ::Murmur::User();
+			userToUser(p, *mp);
+			ss.qhUsers.insert(p->uiSession, QSharedPointer<const ::Murmur::User>(mp));
 		}
+		qsSnapshotDirty.insert(i.key());
+	}
+	publishSnapshots();
+}
+
+/**
+ * Looks up the effective permissions of session in channelid in the
+ * ACL cache without computing them, so it can run on an Ice thread.
+ * Returns false if they are not cached.
+ */
+bool MurmurIce::cachedPermissions(int server_id, int session, int channelid, int &perm) const {
+	QReadLocker rl(&qrwlSnapshots);
+
+	ServerSnapshotPtr ss = qmSnapshots.value(server_id);
+	if (! ss)
+		return false;
+
+	QSharedPointer<const ::Murmur::User> mp = ss->qhUsers.value(session);
+	if (mp && (mp->userid == 0)) {
+		perm = ChanACL::All &~ (ChanACL::Speak | ChanACL::Whisper);
+		return true;
 	}
+
+	if (! mp || ! ss->qhChannels.contains(channelid))
+		return false;
+
+	ChanACL::Permissions perms;
+	if (! ss->server->cachedPermissions(session, channelid, perms))
+		return false;
+	perm = static_cast<int>(perms);
+	return true;
+}
+
+void MurmurIce::userConnected(const ::User *p) {
+	::Server *s = qobject_cast< ::Server *> (sender());
+
+	if (! hasEventListeners(s))
+		return;
+
+	CallbackEvent ev(CallbackEvent::UserConnected);
+	userToUser(p, ev.mpUser);
+	publishEvent(s, ev);
 }
 
 void MurmurIce::userDisconnected(const ::User *p) {
@@ -442,124 +958,68 @@ void MurmurIce::userDisconnected(const ::User *p) {
 
 	qmServerContextCallbacks[s->iServerNum].remove(p->uiSession);
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
-
-	if (qmList.isEmpty())
+	if (! hasEventListeners(s))
 		return;
 
-	::Murmur::User mp;
-	userToUser(p, mp);
-
-	foreach(const ::Murmur::ServerCallbackPrx &prx, qmList) {
-		try {
-			prx->userDisconnected(mp);
-		} catch (...) {
-			badServerProxy(prx, s);
-		}
-	}
+	CallbackEvent ev(CallbackEvent::UserDisconnected);
+	userToUser(p, ev.mpUser);
+	publishEvent(s, ev);
 }
 
 void MurmurIce::userStateChanged(const ::User *p) {
 	::Server *s = qobject_cast< ::Server *> (sender());
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
-
-	if (qmList.isEmpty())
+	if (! hasEventListeners(s))
 		return;
 
-	::Murmur::User mp;
-	userToUser(p, mp);
-
-	foreach(const ::Murmur::ServerCallbackPrx &prx, qmList) {
-		try {
-			prx->userStateChanged(mp);
-		} catch (...) {
-			badServerProxy(prx, s);
-		}
-	}
+	CallbackEvent ev(CallbackEvent::UserStateChanged);
+	userToUser(p, ev.mpUser);
+	publishEvent(s, ev);
 }
 
 void MurmurIce::userTextMessage(const ::User *p, const ::TextMessage &message) {
 	::Server *s = qobject_cast< ::Server *> (sender());
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
-
-	if (qmList.isEmpty())
+	if (qmServerCallbacks[s->iServerNum].isEmpty())
 		return;
 
-	::Murmur::User mp;
-	userToUser(p, mp);
-
-	::Murmur::TextMessage textMessage;
-	textmessageToTextmessage(message, textMessage);
-
-	foreach(const ::Murmur::ServerCallbackPrx &prx, qmList) {
-		try {
-			prx->userTextMessage(mp, textMessage);
-		} catch (...) {
-			badServerProxy(prx, s);
-		}
-	}
+	CallbackEvent ev(CallbackEvent::UserTextMessage);
+	userToUser(p, ev.mpUser);
+	textmessageToTextmessage(message, ev.mpMessage);
+	cdDispatcher->post(s, ev);
 }
 
 void MurmurIce::channelCreated(const ::Channel *c) {
 	::Server *s = qobject_cast< ::Server *> (sender());
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
-
-	if (qmList.isEmpty())
+	if (! hasEventListeners(s))
 		return;
 
-	::Murmur::Channel mc;
-	channelToChannel(c, mc);
-
-	foreach(const ::Murmur::ServerCallbackPrx &prx, qmList) {
-		try {
-			prx->channelCreated(mc);
-		} catch (...) {
-			badServerProxy(prx, s);
-		}
-	}
+	CallbackEvent ev(CallbackEvent::ChannelCreated);
+	channelToChannel(c, ev.mpChannel);
+	publishEvent(s, ev);
 }
 
 void MurmurIce::channelRemoved(const ::Channel *c) {
 	::Server *s = qobject_cast< ::Server *> (sender());
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
-
-	if (qmList.isEmpty())
+	if (! hasEventListeners(s))
 		return;
 
-	::Murmur::Channel mc;
-	channelToChannel(c, mc);
-
-	foreach(const ::Murmur::ServerCallbackPrx &prx, qmList) {
-		try {
-			prx->channelRemoved(mc);
-		} catch (...) {
-			badServerProxy(prx, s);
-		}
-	}
+	CallbackEvent ev(CallbackEvent::ChannelRemoved);
+	channelToChannel(c, ev.mpChannel);
+	publishEvent(s, ev);
 }
 
 void MurmurIce::channelStateChanged(const ::Channel *c) {
 	::Server *s = qobject_cast< ::Server *> (sender());
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
-
-	if (qmList.isEmpty())
+	if (! hasEventListeners(s))
 		return;
 
-	::Murmur::Channel mc;
-	channelToChannel(c, mc);
-
-	foreach(const ::Murmur::ServerCallbackPrx &prx, qmList) {
-		try {
-			prx->channelStateChanged(mc);
-		} catch (...) {
-			badServerProxy(prx, s);
-		}
-	}
+	CallbackEvent ev(CallbackEvent::ChannelStateChanged);
+	channelToChannel(c, ev.mpChannel);
+	publishEvent(s, ev);
 }
 
 void MurmurIce::contextAction(const ::User *pSrc, const QString &action, unsigned int session, int iChannel) {
@@ -635,14 +1095,7 @@ void MurmurIce::nameToIdSlot(int &id, const QString &name) {
 	}
 }
 
-void MurmurIce::authenticateSlot(int &res, QString &uname, int sessionId, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw) {
-	::Server *server = qobject_cast< ::Server *> (sender());
-
-	const ServerAuthenticatorPrx prx = getServerAuthenticator(server);
-	::std::string newname;
-	::Murmur::GroupNameList groups;
-	::Murmur::CertificateList certs;
-
+static void certsToCerts(const QList<QSslCertificate> &certlist, ::Murmur::CertificateList &certs) {
 	certs.resize(certlist.size());
 	for (int i=0;i<certlist.size();++i) {
 		::Murmur::CertificateDer der;
@@ -653,6 +1106,17 @@ void MurmurIce::authenticateSlot(int &res, QString &uname, int sessionId, const
 			der[j] = ptr[j];
 		certs[i] = der;
 	}
+}
+
+void MurmurIce::authenticateSlot(int &res, QString &uname, int sessionId, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw) {
+	::Server *server = qobject_cast< ::Server *> (sender());
+
+	const ServerAuthenticatorPrx prx = getServerAuthenticator(server);
+	::std::string newname;
+	::Murmur::GroupNameList groups;
+	::Murmur::CertificateList certs;
+
+	certsToCerts(certlist, certs);
 
 	try {
 		res = prx->authenticate(u8(uname), u8(pw), certs, u8(certhash), certstrong, newname, groups);
@@ -671,6 +1135,64 @@ void MurmurIce::authenticateSlot(int &res, QString &uname, int sessionId, const
 	}
 }
 
+// Completion of an asynchronous authenticate call. Runs on an Ice client
+// thread, so the result is handed to the main thread before touching the server.
+class AuthenticateCallback : public IceUtil::Shared {
+	protected:
+		int iServerNum;
+		unsigned int uiTicket;
+		ServerAuthenticatorPrx prx;
+	public:
+		AuthenticateCallback(int server_id, unsigned int ticket, const ServerAuthenticatorPrx &p) : iServerNum(server_id), uiTicket(ticket), prx(p) { };
+
+		void response(::Ice::Int res, const ::std::string &newname, const ::Murmur::GroupNameList &groups) {
+			QStringList qsl;
+			foreach(const ::std::string &str, groups) {
+				qsl << u8(str);
+			}
+			QCoreApplication::instance()->postEvent(mi, new ExecEvent(boost::bind(&MurmurIce::authenticateDone, mi, iServerNum, uiTicket, static_cast<int>(res), u8(newname), qsl)));
+		}
+
+		void exception(const ::Ice::Exception &) {
+			QCoreApplication::instance()->postEvent(mi, new ExecEvent(boost::bind(&MurmurIce::authenticateFailed, mi, iServerNum, uiTicket, prx)));
+		}
+};
+typedef IceUtil::Handle<AuthenticateCallback> AuthenticateCallbackPtr;
+
+void MurmurIce::authenticateAsyncSlot(unsigned int ticket, const QString &uname, int, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw) {
+	::Server *server = qobject_cast< ::Server *> (sender());
+
+	const ServerAuthenticatorPrx prx = getServerAuthenticator(server);
+	::Murmur::CertificateList certs;
+
+	certsToCerts(certlist, certs);
+
+	AuthenticateCallbackPtr cb = new AuthenticateCallback(server->iServerNum, ticket, prx);
+	try {
+		prx->begin_authenticate(u8(uname), u8(pw), certs, u8(certhash), certstrong, ::Murmur::newCallback_ServerAuthenticator_authenticate(cb, &AuthenticateCallback::response, &AuthenticateCallback::exception));
+	} catch (...) {
+		badAuthenticator(server);
+		server->authenticateReply(ticket, -2, QString(), QStringList());
+	}
+}
+
+void MurmurIce::authenticateDone(int server_id, unsigned int ticket, int res, const QString &name, const QStringList &groups) {
+	::Server *server = meta->qhServers.value(server_id);
+	if (server)
+		server->authenticateReply(ticket, res, name, groups);
+}
+
+void MurmurIce::authenticateFailed(int server_id, unsigned int ticket, const ::Murmur::ServerAuthenticatorPrx &prx) {
+	::Server *server = meta->qhServers.value(server_id);
+	if (! server)
+		return;
+
+	// Only drop the authenticator if it has not been replaced in the meantime.
+	if (getServerAuthenticator(server) == prx)
+		badAuthenticator(server);
+	server->authenticateReply(ticket, -2, QString(), QStringList());
+}
+
 void MurmurIce::registerUserSlot(int &res, const QMap<int, QString> &info) {
 	::Server *server = qobject_cast< ::Server *> (sender());
 
@@ -816,6 +1338,24 @@ Ice::ObjectPtr ServerLocator::locate(const Ice::Current &, Ice::LocalObjectPtr &
 	::Channel *channel; \
 	NEED_CHANNEL_VAR(channel, channelid);
 
+// Read calls marked DIRECT_ run on the Ice thread and answer from the
+// server snapshot. Until the server has one, the call is retried on the
+// main thread, which publishes it.
+template <class T>
+static void snapshotFallback(const T cb, int server_id, const boost::function<void ()> &retry) {
+	NEED_SERVER;
+	mi->activateSnapshot(server);
+	retry();
+}
+
+#define NEED_SNAPSHOT(type, retry) \
+	ServerSnapshotPtr snapshot = mi->snapshot(server_id); \
+	if (! snapshot) { \
+		ExecEvent *ie = new ExecEvent(boost::bind(&snapshotFallback<type>, cb, server_id, boost::function<void ()>(retry))); \
+		QCoreApplication::instance()->postEvent(mi, ie); \
+		return; \
+	}
+
 void ServerI::ice_ping(const Ice::Current &current) const {
 	// This is executed in the ice thread.
 	int server_id = u8(current.id.name).toInt();
@@ -971,28 +1511,24 @@ static void impl_Server_getLogLen(const ::Murmur::AMD_Server_getLogLenPtr cb, in
 }
 
 #define ACCESS_Server_getUsers_READ
+#define DIRECT_Server_getUsers
 static void impl_Server_getUsers(const ::Murmur::AMD_Server_getUsersPtr cb, int server_id) {
-	NEED_SERVER;
+	NEED_SNAPSHOT(::Murmur::AMD_Server_getUsersPtr, boost::bind(&impl_Server_getUsers, cb, server_id));
 	::Murmur::UserMap pm;
-	foreach(const ::User *p, server->qhUsers) {
-		::Murmur::User mp;
-		if (static_cast<const ServerUser *>(p)->sState == ::ServerUser::Authenticated) {
-			userToUser(p, mp);
-			pm[p->uiSession] = mp;
-		}
-	}
+	QHash<int, QSharedPointer<const ::Murmur::User> >::const_iterator i;
+	for (i = snapshot->qhUsers.constBegin(); i != snapshot->qhUsers.constEnd(); ++i)
+		pm[i.key()] = *i.value();
 	cb->ice_response(pm);
 }
 
 #define ACCESS_Server_getChannels_READ
+#define DIRECT_Server_getChannels
 static void impl_Server_getChannels(const ::Murmur::AMD_Server_getChannelsPtr cb, int server_id) {
-	NEED_SERVER;
+	NEED_SNAPSHOT(::Murmur::AMD_Server_getChannelsPtr, boost::bind(&impl_Server_getChannels, cb, server_id));
 	::Murmur::ChannelMap cm;
-	foreach(const ::Channel *c, server->qhChannels) {
-		::Murmur::Channel mc;
-		channelToChannel(c, mc);
-		cm[c->iId] = mc;
-	}
+	QHash<int, QSharedPointer<const ::Murmur::Channel> >::const_iterator i;
+	for (i = snapshot->qhChannels.constBegin(); i != snapshot->qhChannels.constEnd(); ++i)
+		cm[i.key()] = *i.value();
 	cb->ice_response(cm);
 }
 
@@ -1032,6 +1568,51 @@ static void impl_Server_getTree(const ::Murmur::AMD_Server_getTreePtr cb, int se
 	cb->ice_response(recurseTree(server->qhChannels.value(0)));
 }
 
+static void impl_Server_getSnapshot(const ::Murmur::AMD_Server_getSnapshotPtr cb, int server_id);
+
+// Starts the change journal on the main thread; that also republishes the
+// snapshot with the journal's version.
+static void impl_Server_getSnapshot_journal(const ::Murmur::AMD_Server_getSnapshotPtr cb, int server_id) {
+	NEED_SERVER;
+	mi->activateSnapshot(server);
+	mi->journal(server);
+	impl_Server_getSnapshot(cb, server_id);
+}
+
+#define ACCESS_Server_getSnapshot_READ
+#define DIRECT_Server_getSnapshot
+static void impl_Server_getSnapshot(const ::Murmur::AMD_Server_getSnapshotPtr cb, int server_id) {
+	NEED_SNAPSHOT(::Murmur::AMD_Server_getSnapshotPtr, boost::bind(&impl_Server_getSnapshot, cb, server_id));
+
+	if (snapshot->iVersion < 0) {
+		ExecEvent *ie = new ExecEvent(boost::bind(&impl_Server_getSnapshot_journal, cb, server_id));
+		QCoreApplication::instance()->postEvent(mi, ie);
+		return;
+	}
+
+	::Murmur::UserMap pm;
+	QHash<int, QSharedPointer<const ::Murmur::User> >::const_iterator i;
+	for (i = snapshot->qhUsers.constBegin(); i != snapshot->qhUsers.constEnd(); ++i)
+		pm[i.key()] = *i.value();
+
+	::Murmur::ChannelMap cm;
+	QHash<int, QSharedPointer<const ::Murmur::Channel> >::const_iterator j;
+	for (j = snapshot->qhChannels.constBegin(); j != snapshot->qhChannels.constEnd(); ++j)
+		cm[j.key()] = *j.value();
+
+	cb->ice_response(snapshot->iVersion, pm, cm);
+}
+
+#define ACCESS_Server_getChanges_READ
+static void impl_Server_getChanges(const ::Murmur::AMD_Server_getChangesPtr cb, int server_id, ::Ice::Long since) {
+	NEED_SERVER;
+	const ChangeJournal *cj = mi->journal(server);
+
+	::Murmur::ChangeList changes;
+	bool complete = cj->changesSince(since, changes);
+	cb->ice_response(complete, changes, cj->iVersion);
+}
+
 #define ACCESS_Server_getCertificateList_READ
 static void impl_Server_getCertificateList(const ::Murmur::AMD_Server_getCertificateListPtr cb, int server_id, ::Ice::Int session) {
 	NEED_SERVER;
@@ -1106,14 +1687,31 @@ static void impl_Server_hasPermission(const ::Murmur::AMD_Server_hasPermissionPt
 	cb->ice_response(server->hasPermission(user, channel, static_cast<ChanACL::Perm>(perm)));
 }
 
-#define ACCESS_Server_effectivePermissions_READ
-static void impl_Server_effectivePermissions(const ::Murmur::AMD_Server_effectivePermissionsPtr cb, int server_id, ::Ice::Int session, ::Ice::Int channelid) {
+static void impl_Server_effectivePermissions_compute(const ::Murmur::AMD_Server_effectivePermissionsPtr cb, int server_id, ::Ice::Int session, ::Ice::Int channelid) {
 	NEED_SERVER;
 	NEED_PLAYER;
 	NEED_CHANNEL;
 	cb->ice_response(server->effectivePermissions(user, channel));
 }
 
+#define ACCESS_Server_effectivePermissions_READ
+#define DIRECT_Server_effectivePermissions
+static void impl_Server_effectivePermissions(const ::Murmur::AMD_Server_effectivePermissionsPtr cb, int server_id, ::Ice::Int session, ::Ice::Int channelid) {
+	NEED_SNAPSHOT(::Murmur::AMD_Server_effectivePermissionsPtr, boost::bind(&impl_Server_effectivePermissions, cb, server_id, session, channelid));
+
+	int perm;
+	if (mi->cachedPermissions(server_id, session, channelid, perm)) {
+		cb->ice_response(perm);
+		return;
+	}
+
+	// Computing permissions walks the channel tree, which only the main
+	// thread may do. It also knows users and channels the snapshot does
+	// not have yet, and throws for the ones that really don't exist.
+	ExecEvent *ie = new ExecEvent(boost::bind(&impl_Server_effectivePermissions_compute, cb, server_id, session, channelid));
+	QCoreApplication::instance()->postEvent(mi, ie);
+}
+
 static void impl_Server_addContextCallback(const Murmur::AMD_Server_addContextCallbackPtr cb, int server_id, ::Ice::Int session, const ::std::string& action, const ::std::string& text, const ::Murmur::ServerContextCallbackPrx& cbptr, int ctx) {
 	NEED_SERVER;
 	NEED_PLAYER;
@@ -1181,13 +1779,16 @@ static void impl_Server_removeContextCallback(const Murmur::AMD_Server_removeCon
 }
 
 #define ACCESS_Server_getState_READ
+#define DIRECT_Server_getState
 static void impl_Server_getState(const ::Murmur::AMD_Server_getStatePtr cb, int server_id,  ::Ice::Int session) {
-	NEED_SERVER;
-	NEED_PLAYER;
+	NEED_SNAPSHOT(::Murmur::AMD_Server_getStatePtr, boost::bind(&impl_Server_getState, cb, server_id, session));
 
-	::Murmur::User mp;
-	userToUser(user, mp);
-	cb->ice_response(mp);
+	QSharedPointer<const ::Murmur::User> mp = snapshot->qhUsers.value(session);
+	if (! mp) {
+		cb->ice_exception(::Murmur::InvalidSessionException());
+		return;
+	}
+	cb->ice_response(*mp);
 }
 
 static void impl_Server_setState(const ::Murmur::AMD_Server_setStatePtr cb, int server_id,  const ::Murmur::User& state) {
@@ -1210,13 +1811,16 @@ static void impl_Server_sendMessageChannel(const ::Murmur::AMD_Server_sendMessag
 }
 
 #define ACCESS_Server_getChannelState_READ
+#define DIRECT_Server_getChannelState
 static void impl_Server_getChannelState(const ::Murmur::AMD_Server_getChannelStatePtr cb, int server_id,  ::Ice::Int channelid) {
-	NEED_SERVER;
-	NEED_CHANNEL;
+	NEED_SNAPSHOT(::Murmur::AMD_Server_getChannelStatePtr, boost::bind(&impl_Server_getChannelState, cb, server_id, channelid));
 
-	::Murmur::Channel mc;
-	channelToChannel(channel, mc);
-	cb->ice_response(mc);
+	QSharedPointer<const ::Murmur::Channel> mc = snapshot->qhChannels.value(channelid);
+	if (! mc) {
+		cb->ice_exception(::Murmur::InvalidChannelException());
+		return;
+	}
+	cb->ice_response(*mc);
 }
 
 static void impl_Server_setChannelState(const ::Murmur::AMD_Server_setChannelStatePtr cb, int server_id,  const ::Murmur::Channel& state) {
@@ -1549,9 +2153,10 @@ static void impl_Server_setTexture(const ::Murmur::AMD_Server_setTexturePtr cb,
 }
 
 #define ACCESS_Server_getUptime_READ
+#define DIRECT_Server_getUptime
 static void impl_Server_getUptime(const ::Murmur::AMD_Server_getUptimePtr cb, int server_id) {
-	NEED_SERVER;
-	cb->ice_response(static_cast<int>(server->tUptime.elapsed()/1000000LL));
+	NEED_SNAPSHOT(::Murmur::AMD_Server_getUptimePtr, boost::bind(&impl_Server_getUptime, cb, server_id));
+	cb->ice_response(static_cast<int>(snapshot->tUptime.elapsed()/1000000LL));
 }
 
 static void impl_Server_addUserToGroup(const ::Murmur::AMD_Server_addUserToGroupPtr cb, int server_id, ::Ice::Int channelid,  ::Ice::Int session,  const ::std::string& group) {
@@ -1691,4 +2296,9 @@ static void impl_Meta_getUptime(const ::Murmur::AMD_Meta_getUptimePtr cb, const
 	cb->ice_response(static_cast<int>(meta->tUptime.elapsed()/1000000LL));
 }
 
+#define ACCESS_Meta_getMetrics_READ
+static void impl_Meta_getMetrics(const ::Murmur::AMD_Meta_getMetricsPtr cb, const Ice::ObjectAdapterPtr) {
+	cb->ice_response(u8(Metrics::prometheus()));
+}
+
 #include "MurmurIceWrapper.cpp"
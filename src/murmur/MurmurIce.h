@@ -32,20 +32,117 @@
 #ifndef MUMBLE_MURMUR_MURMURICE_H_
 #define MUMBLE_MURMUR_MURMURICE_H_
 
+#include <QtCore/QHash>
+#include <QtCore/QLinkedList>
 #include <QtCore/QList>
 #include <QtCore/QMap>
 #include <QtCore/QMutex>
 #include <QtCore/QObject>
+#include <QtCore/QQueue>
+#include <QtCore/QReadWriteLock>
+#include <QtCore/QSet>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QStringList>
+#include <QtCore/QThread>
+#include <QtCore/QTimer>
 #include <QtCore/QWaitCondition>
 #include <QtNetwork/QSslCertificate>
 
 #include "MurmurI.h"
+#include "Timer.h"
 
 class Channel;
 class Server;
 class User;
 struct TextMessage;
 
+struct CallbackEvent {
+	enum Type { UserConnected, UserDisconnected, UserStateChanged, UserTextMessage, ChannelCreated, ChannelRemoved, ChannelStateChanged };
+	Type tType;
+	::Murmur::User mpUser;
+	::Murmur::Channel mpChannel;
+	::Murmur::TextMessage mpMessage;
+	CallbackEvent(Type t = UserStateChanged) : tType(t) { };
+};
+
+// Delivers ServerCallback notifications from its own thread with
+// asynchronous oneway calls, so a slow listener never holds up the
+// server. Every listener has a bounded queue. A state change replaces
+// one still queued for the same user or channel. When the queue is full
+// the oldest event is dropped.
+class CallbackDispatcher : public QThread {
+	private:
+		Q_OBJECT
+		Q_DISABLE_COPY(CallbackDispatcher)
+	protected:
+		struct Listener {
+			int iServerNum;
+			::Murmur::ServerCallbackPrx prx;
+			QLinkedList<CallbackEvent> qllEvents;
+			QHash<int, QLinkedList<CallbackEvent>::iterator> qhUserState;
+			QHash<int, QLinkedList<CallbackEvent>::iterator> qhChannelState;
+			// Waiting for the previous call to be written to the network.
+			bool bBusy;
+			bool bOverflow;
+			quint64 uiDropped;
+		};
+		QMutex qmQueue;
+		QWaitCondition qwcQueue;
+		QHash<unsigned int, Listener *> qhListeners;
+		unsigned int uiNextListener;
+		int iMaxQueue;
+		quint64 uiDropped;
+		bool bRunning;
+
+		void invoke(unsigned int id, const ::Murmur::ServerCallbackPrx &prx, const CallbackEvent &ev);
+		void run();
+	public:
+		CallbackDispatcher(int maxqueue, QObject *p = NULL);
+		~CallbackDispatcher();
+		void stop();
+
+		void addListener(int server_id, const ::Murmur::ServerCallbackPrx &prx);
+		void removeListener(int server_id, const ::Murmur::ServerCallbackPrx &prx);
+		void removeServer(int server_id);
+		void post(const ::Server *server, const CallbackEvent &ev);
+		quint64 dropped();
+
+		void sent(unsigned int id);
+		void failed(unsigned int id);
+};
+
+// Recent user and channel changes of one server for Server.getChanges.
+// Only kept for servers a client has asked for changes or a snapshot of.
+class ChangeJournal {
+	public:
+		static const int iMaxChanges = 4096;
+
+		::Ice::Long iVersion;
+		QQueue< ::Murmur::Change> qqChanges;
+
+		ChangeJournal();
+		void record(const CallbackEvent &ev);
+		bool changesSince(::Ice::Long since, ::Murmur::ChangeList &changes) const;
+};
+
+// Immutable copy of the users and channels of one server, used to answer
+// read calls directly on the Ice thread. The main thread keeps a working
+// copy and publishes a new snapshot after changes; entries are shared
+// between snapshots, so publishing only copies the hashes.
+struct ServerSnapshot {
+	// Only dereferenced while holding MurmurIce::qrwlSnapshots.
+	::Server *server;
+	Timer tUptime;
+	// ChangeJournal version this snapshot is at, -1 without a journal.
+	::Ice::Long iVersion;
+	QHash<int, QSharedPointer<const ::Murmur::User> > qhUsers;
+	QHash<int, QSharedPointer<const ::Murmur::Channel> > qhChannels;
+
+	ServerSnapshot() : server(NULL), iVersion(-1) { };
+};
+
+typedef QSharedPointer<const ServerSnapshot> ServerSnapshotPtr;
+
 class MurmurIce : public QObject {
 		friend class MurmurLocker;
 		Q_OBJECT;
@@ -62,6 +159,16 @@ class MurmurIce : public QObject {
 		QMap<int, QMap<int, QMap<QString, ::Murmur::ServerContextCallbackPrx> > > qmServerContextCallbacks;
 		QMap<int, ::Murmur::ServerAuthenticatorPrx> qmServerAuthenticator;
 		QMap<int, ::Murmur::ServerUpdatingAuthenticatorPrx> qmServerUpdatingAuthenticator;
+		CallbackDispatcher *cdDispatcher;
+		QMap<int, ChangeJournal *> qmJournals;
+		mutable QReadWriteLock qrwlSnapshots;
+		QMap<int, ServerSnapshotPtr> qmSnapshots;
+		QMap<int, ServerSnapshot> qmSnapshotWork;
+		QSet<int> qsSnapshotDirty;
+		QTimer *qtSnapshotRefresh;
+		bool hasEventListeners(const ::Server *server) const;
+		void publishEvent(const ::Server *server, const CallbackEvent &ev);
+		void updateSnapshot(const ::Server *server, const CallbackEvent &ev);
 	public:
 		Ice::CommunicatorPtr communicator;
 		Ice::ObjectAdapterPtr adapter;
@@ -83,11 +190,22 @@ class MurmurIce : public QObject {
 		const ::Murmur::ServerUpdatingAuthenticatorPrx getServerUpdatingAuthenticator(const ::Server* server) const;
 		void removeServerUpdatingAuthenticator(const ::Server* server);
 
+		void authenticateDone(int server_id, unsigned int ticket, int res, const QString &name, const QStringList &groups);
+		void authenticateFailed(int server_id, unsigned int ticket, const ::Murmur::ServerAuthenticatorPrx &prx);
+		void callbackFailed(int server_id, const ::Murmur::ServerCallbackPrx &prx);
+
+		ChangeJournal *journal(const ::Server *server);
+
+		ServerSnapshotPtr snapshot(int server_id) const;
+		void activateSnapshot(::Server *server);
+		bool cachedPermissions(int server_id, int session, int channelid, int &perm) const;
+
 	public slots:
 		void started(Server *);
 		void stopped(Server *);
 
 		void authenticateSlot(int &res, QString &uname, int sessionId, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw);
+		void authenticateAsyncSlot(unsigned int ticket, const QString &uname, int sessionId, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw);
 		void registerUserSlot(int &res, const QMap<int, QString> &);
 		void unregisterUserSlot(int &res, int id);
 		void getRegisteredUsersSlot(const QString &filter, QMap<int, QString> &res);
@@ -108,6 +226,9 @@ class MurmurIce : public QObject {
 		void channelRemoved(const Channel *c);
 
 		void contextAction(const User *, const QString &, unsigned int, int);
+
+		void publishSnapshots();
+		void refreshSnapshots();
 };
 #endif
 #endif
@@ -0,0 +1,224 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "murmur_pch.h"
+
+#include "Recorder.h"
+
+#include "PacketDataStream.h"
+#include "RecorderFormat.h"
+#include "Server.h"
+
+// Packet slots in the ring, a power of two so tickets can wrap around. About
+// 4 MB, and still far more than a busy server relays between two drains.
+static const unsigned int uiSlots = 4096;
+
+// How often the writer wakes up to drain the queue, in milliseconds.
+static const unsigned long ulDrainInterval = 50;
+
+// How often track files are flushed to disk, in microseconds.
+static const quint64 uiFlushInterval = 1000000ULL;
+
+struct Recorder::Packet {
+	// Ticket of the relay thread that may fill this slot next; one more than
+	// that once the packet can be written. See record().
+	QAtomicInt qaiSequence;
+	quint64 uiTimestamp;
+	int iChannel;
+	unsigned int uiSession;
+	unsigned int uiType;
+	int iLength;
+	char cData[UDP_PACKET_SIZE];
+};
+
+Recorder::Recorder(int servernum, const QString &path, QObject *p) : QThread(p), qaiHead(0), qaiDropped(0) {
+	iServerNum = servernum;
+	qsPath = path;
+	qdtStart = QDateTime::currentDateTime().toUTC();
+	bRunning = true;
+	uiTail = 0;
+	uiWritten = 0;
+
+	pRing = new Packet[uiSlots];
+	for (unsigned int i = 0; i < uiSlots; ++i)
+		pRing[i].qaiSequence.fetchAndStoreRelaxed(static_cast<int>(i));
+}
+
+Recorder::~Recorder() {
+	stop();
+	wait();
+
+	// Anything recorded after the thread finished is simply discarded.
+	delete [] pRing;
+}
+
+void Recorder::stop() {
+	bRunning = false;
+}
+
+/**
+ * Queues a voice packet for writing. Called from the relay path, so this only
+ * copies the packet into a slot of the preallocated ring; nothing is allocated.
+ *
+ * Each relay thread claims a ticket from qaiHead with a CAS, which gives it the
+ * slot at ticket % uiSlots. The slot's sequence equals the ticket while it is
+ * free, and is set to ticket + 1 once the packet is complete. The recorder
+ * thread then hands it back for the next lap by setting it to ticket + uiSlots.
+ * If the slot is still a lap behind, the writer hasn't caught up and the packet
+ * is dropped.
+ */
+void Recorder::record(int channel, unsigned int session, unsigned int type, const char *data, int len) {
+	if (len > UDP_PACKET_SIZE) {
+		qaiDropped.fetchAndAddRelaxed(1);
+		return;
+	}
+
+	// fetchAndAddRelaxed(0) is used as an atomic load that works with both Qt 4 and 5.
+	unsigned int ticket = static_cast<unsigned int>(qaiHead.fetchAndAddRelaxed(0));
+	Packet *p;
+	forever {
+		p = &pRing[ticket % uiSlots];
+		int diff = static_cast<int>(static_cast<unsigned int>(p->qaiSequence.fetchAndAddAcquire(0)) - ticket);
+		if (diff == 0) {
+			if (qaiHead.testAndSetRelaxed(static_cast<int>(ticket), static_cast<int>(ticket + 1)))
+				break;
+		} else if (diff < 0) {
+			qaiDropped.fetchAndAddRelaxed(1);
+			return;
+		}
+		ticket = static_cast<unsigned int>(qaiHead.fetchAndAddRelaxed(0));
+	}
+
+	p->uiTimestamp = tTimestamp.elapsed();
+	p->iChannel = channel;
+	p->uiSession = session;
+	p->uiType = type;
+	p->iLength = len;
+	memcpy(p->cData, data, len);
+
+	p->qaiSequence.fetchAndStoreRelease(static_cast<int>(ticket + 1));
+}
+
+void Recorder::run() {
+	Timer tFlush;
+
+	while (bRunning) {
+		msleep(ulDrainInterval);
+		drain();
+
+		if (tFlush.isElapsed(uiFlushInterval)) {
+			foreach(const Track &t, qhTracks)
+				if (t.qfFile)
+					t.qfFile->flush();
+		}
+	}
+
+	drain();
+
+	foreach(const Track &t, qhTracks)
+		delete t.qfFile;
+	qhTracks.clear();
+
+	int dropped = qaiDropped.fetchAndAddRelaxed(0);
+	if (dropped)
+		qWarning("Recorder: Server %d dropped %d packets because the disk couldn't keep up", iServerNum, dropped);
+	qWarning("Recorder: Server %d wrote %llu packets", iServerNum, uiWritten);
+}
+
+/**
+ * Writes all completed packets in ticket order, which is arrival order. Stops
+ * at the first slot whose relay thread is still copying; that packet and
+ * everything after it are picked up by the next drain.
+ */
+void Recorder::drain() {
+	forever {
+		Packet *p = &pRing[uiTail % uiSlots];
+		if (static_cast<unsigned int>(p->qaiSequence.fetchAndAddAcquire(0)) != uiTail + 1)
+			break;
+
+		write(p);
+		p->qaiSequence.fetchAndStoreRelease(static_cast<int>(uiTail + uiSlots));
+		++uiTail;
+	}
+}
+
+Recorder::Track &Recorder::track(int channel) {
+	QHash<int, Track>::iterator i = qhTracks.find(channel);
+	if (i != qhTracks.end())
+		return i.value();
+
+	Track t;
+	t.qfFile = NULL;
+	t.uiLast = 0;
+
+	QDir dir(qsPath);
+	QString sub = QString::number(iServerNum);
+	if (dir.mkpath(sub) && dir.cd(sub)) {
+		// Never reuse a file: records only make sense relative to their own header,
+		// so a recording started within the same second gets a new name.
+		QString base = QString::fromLatin1("channel-%1-%2").arg(channel).arg(qdtStart.toString(QLatin1String("yyyyMMdd-hhmmss")));
+		QString name = base + QLatin1String(".mrec");
+		for (int n = 2; dir.exists(name); ++n)
+			name = QString::fromLatin1("%1-%2.mrec").arg(base).arg(n);
+
+		QFile *f = new QFile(dir.absoluteFilePath(name));
+		if (f->open(QIODevice::WriteOnly)) {
+			QDataStream qds(f);
+			qds << uiRecorderMagic << uiRecorderVersion << static_cast<quint32>(iServerNum) << static_cast<qint32>(channel) << static_cast<qint64>(qdtStart.toMSecsSinceEpoch());
+			t.qfFile = f;
+		} else {
+			qWarning("Recorder: Failed to open %s: %s", qPrintable(f->fileName()), qPrintable(f->errorString()));
+			delete f;
+		}
+	}
+
+	// A channel whose file couldn't be opened keeps a NULL file, so we don't retry for every packet.
+	return qhTracks.insert(channel, t).value();
+}
+
+void Recorder::write(const Packet *p) {
+	Track &t = track(p->iChannel);
+	if (! t.qfFile)
+		return;
+
+	// Relay threads may race each other by a few microseconds; never go back in time.
+	quint64 ts = qMax(p->uiTimestamp, t.uiLast);
+
+	char buffer[32];
+	PacketDataStream pds(buffer, sizeof(buffer));
+	pds << (ts - t.uiLast) << p->uiSession;
+	pds.append(p->uiType);
+	pds << p->iLength;
+
+	t.qfFile->write(buffer, pds.size());
+	t.qfFile->write(p->cData, p->iLength);
+	t.uiLast = ts;
+	++uiWritten;
+}
@@ -0,0 +1,95 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MUMBLE_MURMUR_RECORDER_H_
+#define MUMBLE_MURMUR_RECORDER_H_
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QDateTime>
+#include <QtCore/QHash>
+#include <QtCore/QString>
+#include <QtCore/QThread>
+
+#include "Timer.h"
+
+class QFile;
+
+// Server side voice recording.
+//
+// Voice packets are stored exactly as relayed, without decoding, in one
+// container file per channel (see RecorderFormat.h). The murmur-render
+// tool turns containers into Ogg Opus tracks.
+//
+// record() is called from the voice relay path and only copies the packet
+// into a preallocated lock-free ring; the recorder's thread does all file I/O.
+
+class Recorder : public QThread {
+	private:
+		Q_OBJECT
+		Q_DISABLE_COPY(Recorder)
+	protected:
+		struct Packet;
+
+		struct Track {
+			QFile *qfFile;
+			quint64 uiLast;
+		};
+
+		// Fixed ring of packet slots. Filled by any number of relay threads,
+		// emptied in order by the recorder thread.
+		Packet *pRing;
+		// Next slot ticket handed to a relay thread.
+		QAtomicInt qaiHead;
+		QAtomicInt qaiDropped;
+
+		int iServerNum;
+		QString qsPath;
+		QDateTime qdtStart;
+		Timer tTimestamp;
+		volatile bool bRunning;
+
+		// Only touched from the recorder thread.
+		QHash<int, Track> qhTracks;
+		unsigned int uiTail;
+		quint64 uiWritten;
+
+		void drain();
+		void write(const Packet *p);
+		Track &track(int channel);
+	public:
+		Recorder(int servernum, const QString &path, QObject *p = NULL);
+		~Recorder();
+
+		void record(int channel, unsigned int session, unsigned int type, const char *data, int len);
+		void stop();
+		void run();
+};
+
+#endif
@@ -40,7 +40,9 @@
 #include "Channel.h"
 #include "Message.h"
 #include "Meta.h"
+#include "Metrics.h"
 #include "PacketDataStream.h"
+#include "Recorder.h"
 #include "ServerDB.h"
 #include "ServerUser.h"
 
@@ -53,7 +55,7 @@
 #define MAX(a,b) ((a)>(b) ? (a):(b))
 #endif
 
-#define UDP_PACKET_SIZE 1024
+#define UDP_BATCH 32
 
 LogEmitter::LogEmitter(QObject *p) : QObject(p) {
 };
@@ -98,16 +100,29 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 	hNotify = NULL;
 #endif
 	qtTimeout = new QTimer(this);
+	qtAuthTimeout = new QTimer(this);
 
 	iCodecAlpha = iCodecBeta = 0;
 	bPreferAlpha = false;
 	bOpus = true;
 
 	qnamNetwork = NULL;
+	rRecorder = NULL;
+	uiNextContext = 0;
+	uiAuthTicket = 0;
+	iAuthInFlight = 0;
 
 	readParams();
 	initialize();
 
+	// The recorder is read by the voice threads without locking, so it is only set up
+	// here and recordpath changes take effect when the server is restarted.
+	if (! qsRecordPath.isEmpty()) {
+		rRecorder = new Recorder(iServerNum, qsRecordPath);
+		rRecorder->start(QThread::LowPriority);
+		log(QString("Recording voice to %1").arg(qsRecordPath));
+	}
+
 	foreach(const QHostAddress &qha, qlBind) {
 		SslServer *ss = new SslServer(this);
 
@@ -204,13 +219,14 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 	hNotify = CreateEvent(NULL, FALSE, FALSE, NULL);
 #endif
 
-	connect(this, SIGNAL(tcpTransmit(QByteArray, unsigned int)), this, SLOT(tcpTransmitData(QByteArray, unsigned int)), Qt::QueuedConnection);
+	connect(this, SIGNAL(tcpTransmit(unsigned int)), this, SLOT(tcpTransmitData(unsigned int)), Qt::QueuedConnection);
 	connect(this, SIGNAL(reqSync(unsigned int)), this, SLOT(doSync(unsigned int)));
 
 	for (int i=1;i<iMaxUsers*2;++i)
 		qqIds.enqueue(i);
 
 	connect(qtTimeout, SIGNAL(timeout()), this, SLOT(checkTimeout()));
+	connect(qtAuthTimeout, SIGNAL(timeout()), this, SLOT(checkAuthTimeout()));
 
 	getBans();
 	readChannels();
@@ -222,6 +238,7 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 	Meta::getVersion(major, minor, patch, release);
 
 	uiVersionBlob = qToBigEndian(static_cast<quint32>((major<<16) | (minor << 8) | patch));
+	updatePingReply();
 
 	if (bValid) {
 #ifdef USE_BONJOUR
@@ -285,6 +302,9 @@ Server::~Server() {
 
 	stopThread();
 
+	// Voice is no longer relayed, so nothing can call record() anymore.
+	delete rRecorder;
+
 	foreach(QSocketNotifier *qsn, qlUdpNotifier)
 		delete qsn;
 
@@ -328,6 +348,7 @@ void Server::readParams() {
 	qurlRegWeb = Meta::mp.qurlRegWeb;
 	bBonjour = Meta::mp.bBonjour;
 	bAllowPing = Meta::mp.bAllowPing;
+	iPingLimit = Meta::mp.iPingLimit;
 	bCertRequired = Meta::mp.bCertRequired;
 	qrUserName = Meta::mp.qrUserName;
 	qrChannelName = Meta::mp.qrChannelName;
@@ -336,6 +357,12 @@ void Server::readParams() {
 	qvSuggestPushToTalk = Meta::mp.qvSuggestPushToTalk;
 	iOpusThreshold = Meta::mp.iOpusThreshold;
 	iChannelNestingLimit = Meta::mp.iChannelNestingLimit;
+	iTcpVoiceBudget = Meta::mp.iTcpVoiceBudget;
+	iAuthConcurrency = Meta::mp.iAuthConcurrency;
+	iAuthTimeout = Meta::mp.iAuthTimeout;
+	iAuthCacheTTL = Meta::mp.iAuthCacheTTL;
+	iAuthNegativeTTL = Meta::mp.iAuthNegativeTTL;
+	qsRecordPath = Meta::mp.qsRecordPath;
 
 	QString qsHost = getConf("host", QString()).toString();
 	if (! qsHost.isEmpty()) {
@@ -384,6 +411,7 @@ void Server::readParams() {
 	qurlRegWeb = QUrl(getConf("registerurl", qurlRegWeb.toString()).toString());
 	bBonjour = getConf("bonjour", bBonjour).toBool();
 	bAllowPing = getConf("allowping", bAllowPing).toBool();
+	iPingLimit = getConf("pinglimit", iPingLimit).toInt();
 	bCertRequired = getConf("certrequired", bCertRequired).toBool();
 
 	qvSuggestVersion = getConf("suggestversion", qvSuggestVersion);
@@ -402,6 +430,21 @@ void Server::readParams() {
 
 	iChannelNestingLimit = getConf("channelnestinglimit", iChannelNestingLimit).toInt();
 
+	iTcpVoiceBudget = getConf("tcpvoicebudget", iTcpVoiceBudget).toInt();
+	if (iTcpVoiceBudget <= 0)
+		iTcpVoiceBudget = Meta::mp.iTcpVoiceBudget;
+
+	iAuthConcurrency = getConf("authconcurrency", iAuthConcurrency).toInt();
+	if (iAuthConcurrency <= 0)
+		iAuthConcurrency = Meta::mp.iAuthConcurrency;
+	iAuthTimeout = getConf("authtimeout", iAuthTimeout).toInt();
+	if (iAuthTimeout <= 0)
+		iAuthTimeout = Meta::mp.iAuthTimeout;
+	iAuthCacheTTL = getConf("authcachettl", iAuthCacheTTL).toInt();
+	iAuthNegativeTTL = getConf("authnegativettl", iAuthNegativeTTL).toInt();
+
+	qsRecordPath = getConf("recordpath", qsRecordPath).toString();
+
 	qrUserName=QRegExp(getConf("username", qrUserName.pattern()).toString());
 	qrChannelName=QRegExp(getConf("channelname", qrChannelName.pattern()).toString());
 }
@@ -417,6 +460,7 @@ void Server::setLiveConf(const QString &key, const QString &value) {
 		int length = i ? i : Meta::mp.iMaxBandwidth;
 		if (length != iMaxBandwidth) {
 			iMaxBandwidth = length;
+			updatePingReply();
 			MumbleProto::ServerConfig mpsc;
 			mpsc.set_max_bandwidth(length);
 			sendAll(mpsc);
@@ -427,6 +471,7 @@ void Server::setLiveConf(const QString &key, const QString &value) {
 			return;
 
 		iMaxUsers = newmax;
+		updatePingReply();
 		qqIds.clear();
 		for (int id = 1; id < iMaxUsers * 2; ++id)
 			if (!qhUsers.contains(id))
@@ -502,6 +547,8 @@ void Server::setLiveConf(const QString &key, const QString &value) {
 #endif
 	} else if (key == "allowping")
 		bAllowPing = !v.isNull() ? QVariant(v).toBool() : Meta::mp.bAllowPing;
+	else if (key == "pinglimit")
+		iPingLimit = !v.isNull() ? i : Meta::mp.iPingLimit;
 	else if (key == "username")
 		qrUserName=!v.isNull() ? QRegExp(v) : Meta::mp.qrUserName;
 	else if (key == "channelname")
@@ -516,6 +563,19 @@ void Server::setLiveConf(const QString &key, const QString &value) {
 		iOpusThreshold = (i >= 0 && !v.isNull()) ? qBound(0, i, 100) : Meta::mp.iOpusThreshold;
 	else if (key =="channelnestinglimit")
 		iChannelNestingLimit = (i >= 0 && !v.isNull()) ? i : Meta::mp.iChannelNestingLimit;
+	else if (key == "tcpvoicebudget")
+		iTcpVoiceBudget = (i > 0) ? i : Meta::mp.iTcpVoiceBudget;
+	else if (key == "authconcurrency")
+		iAuthConcurrency = (i > 0) ? i : Meta::mp.iAuthConcurrency;
+	else if (key == "authtimeout")
+		iAuthTimeout = (i > 0) ? i : Meta::mp.iAuthTimeout;
+	else if (key == "authcachettl") {
+		iAuthCacheTTL = (i >= 0 && !v.isNull()) ? i : Meta::mp.iAuthCacheTTL;
+		clearAuthCache();
+	} else if (key == "authnegativettl") {
+		iAuthNegativeTTL = (i >= 0 && !v.isNull()) ? i : Meta::mp.iAuthNegativeTTL;
+		clearAuthCache();
+	}
 }
 
 #ifdef USE_BONJOUR
@@ -542,6 +602,69 @@ void Server::customEvent(QEvent *evt) {
 		static_cast<ExecEvent *>(evt)->execute();
 }
 
+PingLimiter::PingLimiter() {
+	uiTotal = 0;
+	for (int i=0;i<PING_LIMIT_BUCKETS;++i)
+		uiSources[i] = 0;
+}
+
+/**
+ * Takes one ping from a bucket that refills at one ping per interval and
+ * holds up to a second's worth. The bucket is kept as the time at which it
+ * will be full again.
+ */
+bool PingLimiter::take(quint64 &full, quint64 now, quint64 interval) {
+	if (full < now)
+		full = now;
+	else if (full - now >= 1000000ULL)
+		return false;
+	full += interval;
+	return true;
+}
+
+bool PingLimiter::allow(const HostAddress &ha, quint64 now, int rate) {
+	if (rate <= 0)
+		return true;
+	if (! take(uiSources[qHash(ha) % PING_LIMIT_BUCKETS], now, 1000000ULL / rate))
+		return false;
+	return take(uiTotal, now, 1000000ULL / PING_LIMIT_TOTAL);
+}
+
+/**
+ * Copies the numbers a UDP ping is answered with into auiPingReply. Called
+ * on the main thread whenever one of them changes; the voice thread reads
+ * them without a lock. The words are updated one by one, so a reply may
+ * briefly mix old and new values, which doesn't matter for a ping.
+ */
+void Server::updatePingReply() {
+	auiPingReply[0] = uiVersionBlob;
+	auiPingReply[1] = qToBigEndian(static_cast<quint32>(qhUsers.count()));
+	auiPingReply[2] = qToBigEndian(static_cast<quint32>(iMaxUsers));
+	auiPingReply[3] = qToBigEndian(static_cast<quint32>(iMaxBandwidth));
+}
+
+/**
+ * Turns a UDP ping into its reply, in place: version, the 8 byte timestamp
+ * as sent, users, max users and max bandwidth. Returns false if the ping
+ * shouldn't be answered, because pings are off or the sender is over its rate.
+ */
+bool Server::answerPing(quint32 *ping, const HostAddress &ha) {
+	if (! bAllowPing)
+		return false;
+
+	if (! plPing.allow(ha, Timer::now(), iPingLimit)) {
+		Metrics::count(Metrics::UdpPingsLimited);
+		return false;
+	}
+	Metrics::count(Metrics::UdpPings);
+
+	ping[0] = auiPingReply[0];
+	ping[3] = auiPingReply[1];
+	ping[4] = auiPingReply[2];
+	ping[5] = auiPingReply[3];
+	return true;
+}
+
 void Server::udpActivated(int socket) {
 	qint32 len;
 	char encrypt[UDP_PACKET_SIZE];
@@ -577,14 +700,9 @@ void Server::udpActivated(int socket) {
 	len=::recvfrom(sock, encrypt, UDP_PACKET_SIZE, 0, reinterpret_cast<struct sockaddr *>(&from), &fromlen);
 #endif
 
-	// Cloned from ::run(), as it's the only UDP data we care about until the thread is started.
+	// Pings are the only UDP data we care about until the thread is started.
 	quint32 *ping = reinterpret_cast<quint32 *>(encrypt);
-	if ((len == 12) && (*ping == 0) && bAllowPing) {
-		ping[0] = uiVersionBlob;
-		ping[3] = qToBigEndian(static_cast<quint32>(qhUsers.count()));
-		ping[4] = qToBigEndian(static_cast<quint32>(iMaxUsers));
-		ping[5] = qToBigEndian(static_cast<quint32>(iMaxBandwidth));
-
+	if ((len == 12) && (*ping == 0) && answerPing(ping, HostAddress(from))) {
 #ifdef Q_OS_LINUX
 		// There will be space for only one header, and the only data we have asked for is the incoming
 		// address. So we can reuse most of the same msg and control data.
@@ -598,19 +716,31 @@ void Server::udpActivated(int socket) {
 
 void Server::run() {
 	qint32 len;
+	char buffer[UDP_PACKET_SIZE];
+#ifdef Q_OS_LINUX
+	// Packets are read in batches. Each keeps its own address and control data,
+	// so the ping replies can go out in one batch, from the address they came to.
+	char encbuff[UDP_BATCH][UDP_PACKET_SIZE+8];
+	sockaddr_storage froms[UDP_BATCH];
+	u_char controldata[UDP_BATCH][CMSG_SPACE(MAX(sizeof(struct in6_pktinfo),sizeof(struct in_pktinfo)))];
+	struct iovec iov[UDP_BATCH];
+	struct mmsghdr msgs[UDP_BATCH];
+	struct mmsghdr replies[UDP_BATCH];
+#else
 #if defined(__LP64__)
 	char encbuff[UDP_PACKET_SIZE+8];
 	char *encrypt = encbuff + 4;
 #else
 	char encrypt[UDP_PACKET_SIZE];
 #endif
-	char buffer[UDP_PACKET_SIZE];
-
 	sockaddr_storage from;
+#endif
 	int nfds = qlUdpSocket.count();
 
 #ifdef Q_OS_UNIX
+#ifndef Q_OS_LINUX
 	socklen_t fromlen;
+#endif
 	STACKVAR(struct pollfd, fds, nfds+1);
 
 	for (int i=0;i<nfds;++i) {
@@ -678,78 +808,119 @@ void Server::run() {
 				SOCKET sock = fds[ret - WAIT_OBJECT_0];
 #endif
 
+#ifdef Q_OS_LINUX
+				// Ping replies of this batch, sent together after it.
+				int nreplies = 0;
+
+				for (int p=0;p<UDP_BATCH;++p) {
+					iov[p].iov_base = encbuff[p] + 4;
+					iov[p].iov_len = UDP_PACKET_SIZE;
+
+					memset(&msgs[p], 0, sizeof(msgs[p]));
+					msgs[p].msg_hdr.msg_name = reinterpret_cast<struct sockaddr *>(&froms[p]);
+					msgs[p].msg_hdr.msg_namelen = sizeof(froms[p]);
+					msgs[p].msg_hdr.msg_iov = &iov[p];
+					msgs[p].msg_hdr.msg_iovlen = 1;
+					msgs[p].msg_hdr.msg_control = controldata[p];
+					msgs[p].msg_hdr.msg_controllen = sizeof(controldata[p]);
+				}
+
+				int count = ::recvmmsg(sock, msgs, UDP_BATCH, MSG_TRUNC | MSG_DONTWAIT, NULL);
+				if (count <= 0)
+					break;
+#else
+				const int count = 1;
 				fromlen = sizeof(from);
 #ifdef Q_OS_WIN
 				len=::recvfrom(sock, encrypt, UDP_PACKET_SIZE, 0, reinterpret_cast<struct sockaddr *>(&from), &fromlen);
-#else
-#ifdef Q_OS_LINUX
-				struct msghdr msg;
-				struct iovec iov[1];
-
-				iov[0].iov_base = encrypt;
-				iov[0].iov_len = UDP_PACKET_SIZE;
-
-				u_char controldata[CMSG_SPACE(MAX(sizeof(struct in6_pktinfo),sizeof(struct in_pktinfo)))];
-
-				memset(&msg, 0, sizeof(msg));
-				msg.msg_name = reinterpret_cast<struct sockaddr *>(&from);
-				msg.msg_namelen = sizeof(from);
-				msg.msg_iov = iov;
-				msg.msg_iovlen = 1;
-				msg.msg_control = controldata;
-				msg.msg_controllen = sizeof(controldata);
-
-				len=static_cast<quint32>(::recvmsg(sock, &msg, MSG_TRUNC));
 #else
 				len=static_cast<qint32>(::recvfrom(sock, encrypt, UDP_PACKET_SIZE, MSG_TRUNC, reinterpret_cast<struct sockaddr *>(&from), &fromlen));
-#endif
 #endif
 				if (len == 0) {
 					break;
 				} else if (len == SOCKET_ERROR) {
 					break;
-				} else if (len < 5) {
-					// 4 bytes crypt header + type + session
-					continue;
-				} else if (len > UDP_PACKET_SIZE) {
-					continue;
 				}
+#endif
 
-				QReadLocker rl(&qrwlUsers);
-
-				quint32 *ping = reinterpret_cast<quint32 *>(encrypt);
+				for (int p=0;p<count;++p) {
+#ifdef Q_OS_LINUX
+					char *encrypt = encbuff[p] + 4;
+					sockaddr_storage &from = froms[p];
+					len = static_cast<qint32>(msgs[p].msg_len);
+#endif
+					if (len < 5) {
+						// 4 bytes crypt header + type + session
+						continue;
+					} else if (len > UDP_PACKET_SIZE) {
+						continue;
+					}
 
-				if ((len == 12) && (*ping == 0) && bAllowPing) {
-					ping[0] = uiVersionBlob;
-					// 1 and 2 will be the timestamp, which we return unmodified.
-					ping[3] = qToBigEndian(static_cast<quint32>(qhUsers.count()));
-					ping[4] = qToBigEndian(static_cast<quint32>(iMaxUsers));
-					ping[5] = qToBigEndian(static_cast<quint32>(iMaxBandwidth));
+					Metrics::count(Metrics::UdpPackets);
+					Metrics::count(Metrics::UdpBytes, len);
 
+					// Pings are answered from the precomputed reply, before and
+					// without the users lock.
+					quint32 *ping = reinterpret_cast<quint32 *>(encrypt);
+					if ((len == 12) && (*ping == 0)) {
+						if (answerPing(ping, HostAddress(from))) {
 #ifdef Q_OS_LINUX
-					iov[0].iov_len = 6 * sizeof(quint32);
-					::sendmsg(sock, &msg, 0);
+							iov[p].iov_len = 6 * sizeof(quint32);
+							replies[nreplies++] = msgs[p];
 #else
-					::sendto(sock, encrypt, 6 * sizeof(quint32), 0, reinterpret_cast<struct sockaddr *>(&from), fromlen);
+							::sendto(sock, encrypt, 6 * sizeof(quint32), 0, reinterpret_cast<struct sockaddr *>(&from), fromlen);
 #endif
-					continue;
-				}
+						}
+						continue;
+					}
 
+					Timer tLock;
+					QReadLocker rl(&qrwlUsers);
+					Metrics::record(Metrics::UsersLockWait, tLock.elapsed());
 
-				quint16 port = (from.ss_family == AF_INET6) ? (reinterpret_cast<sockaddr_in6 *>(&from)->sin6_port) : (reinterpret_cast<sockaddr_in *>(&from)->sin_port);
-				const HostAddress &ha = HostAddress(from);
+					quint16 port = (from.ss_family == AF_INET6) ? (reinterpret_cast<sockaddr_in6 *>(&from)->sin6_port) : (reinterpret_cast<sockaddr_in *>(&from)->sin_port);
+					const HostAddress &ha = HostAddress(from);
 
-				const QPair<HostAddress, quint16> &key = QPair<HostAddress, quint16>(ha, port);
+					const QPair<HostAddress, quint16> &key = QPair<HostAddress, quint16>(ha, port);
 
-				ServerUser *u = qhPeerUsers.value(key);
-				if (u) {
-					if (! checkDecrypt(u, encrypt, buffer, len)) {
-						continue;
-					}
-				} else {
-					// Unknown peer
-					foreach(ServerUser *usr, qhHostUsers.value(ha)) {
-						if (usr->csCrypt.isValid() && checkDecrypt(usr, encrypt, buffer, len)) {
+					// Clients that got a connection id put it in front of their packets
+					// until they hear back from us over UDP, which may be after we already
+					// know their address.
+					const quint32 hint = (len >= 9) ? qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(encrypt)) : 0;
+
+					ServerUser *u = qhPeerUsers.value(key);
+					if (u) {
+						if (hint && (hint == u->uiConnectionId) && u->csCrypt.isValid() && u->csCrypt.decrypt(reinterpret_cast<const unsigned char *>(encrypt + 4), reinterpret_cast<unsigned char *>(buffer), len - 4)) {
+							len -= 4;
+						} else if (! checkDecrypt(u, encrypt, buffer, len)) {
+							Metrics::count(Metrics::DecryptFailures);
+							continue;
+						}
+					} else {
+						// Unknown peer. The connection id names the user directly; without
+						// one every user connected from this address has to be tried.
+						ServerUser *usr = NULL;
+						if (hint) {
+							ServerUser *hinted = qhConnectionIds.value(hint);
+							if (hinted && (hinted->haAddress == ha) && hinted->csCrypt.isValid() && qhHostUsers.value(ha).contains(hinted)
+							        && hinted->csCrypt.decrypt(reinterpret_cast<const unsigned char *>(encrypt + 4), reinterpret_cast<unsigned char *>(buffer), len - 4)) {
+								Metrics::count(Metrics::UdpPeerHints);
+								usr = hinted;
+								len -= 4;
+							}
+						}
+						if (! usr) {
+							foreach(ServerUser *candidate, qhHostUsers.value(ha)) {
+								if (! candidate->csCrypt.isValid())
+									continue;
+								Metrics::count(Metrics::UdpPeerTrials);
+								if (checkDecrypt(candidate, encrypt, buffer, len)) {
+									usr = candidate;
+									break;
+								}
+							}
+						}
+						if (usr) {
 							// Every time we relock, reverify users' existance.
 							// The main thread might delete the user while the lock isn't held.
 							unsigned int uiSession = usr->uiSession;
@@ -765,34 +936,47 @@ void Server::run() {
 								rl.relock();
 								if (! qhUsers.contains(uiSession))
 									u = NULL;
+							} else {
+								qrwlUsers.unlock();
+								rl.relock();
 							}
-							break;
+						}
+						if (! u) {
+							Metrics::count(Metrics::DecryptFailures);
+							continue;
 						}
 					}
-					if (! u) {
-						continue;
+					len -= 4;
+
+					MessageHandler::UDPMessageType msgType = static_cast<MessageHandler::UDPMessageType>((buffer[0] >> 5) & 0x7);
+
+					switch (msgType) {
+						case MessageHandler::UDPVoiceSpeex:
+						case MessageHandler::UDPVoiceCELTAlpha:
+						case MessageHandler::UDPVoiceCELTBeta:
+							if (bOpus)
+								break;
+						case MessageHandler::UDPVoiceOpus:
+						case MessageHandler::UDPVoiceOpusTier: {
+								u->bUdp = true;
+								processMsg(u, buffer, len);
+								break;
+							}
+						case MessageHandler::UDPPing: {
+								QByteArray qba;
+								sendMessage(u, buffer, len, qba, true);
+							}
 					}
 				}
-				len -= 4;
-
-				MessageHandler::UDPMessageType msgType = static_cast<MessageHandler::UDPMessageType>((buffer[0] >> 5) & 0x7);
-
-				switch (msgType) {
-					case MessageHandler::UDPVoiceSpeex:
-					case MessageHandler::UDPVoiceCELTAlpha:
-					case MessageHandler::UDPVoiceCELTBeta:
-						if (bOpus)
-							break;
-					case MessageHandler::UDPVoiceOpus: {
-							u->bUdp = true;
-							processMsg(u, buffer, len);
-							break;
-						}
-					case MessageHandler::UDPPing: {
-							QByteArray qba;
-							sendMessage(u, buffer, len, qba, true);
-						}
+#ifdef Q_OS_LINUX
+				int sent = 0;
+				while (sent < nreplies) {
+					int ret = ::sendmmsg(sock, replies + sent, nreplies - sent, 0);
+					if (ret <= 0)
+						break;
+					sent += ret;
 				}
+#endif
 #ifdef Q_OS_UNIX
 				fds[i].revents = 0;
 #endif
@@ -820,7 +1004,30 @@ bool Server::checkDecrypt(ServerUser *u, const char *encrypt, char *plain, unsig
 	return false;
 }
 
+/**
+ * Gives the user a connection id to send along with a new UDP key. The id
+ * only has to be unique on this server; it doesn't stand in for the key, as
+ * every packet still has to decrypt with the key of the user it names.
+ */
+quint32 Server::newConnectionId(ServerUser *u) {
+	QWriteLocker wl(&qrwlUsers);
+
+	qhConnectionIds.remove(u->uiConnectionId);
+
+	quint32 id;
+	do {
+		RAND_bytes(reinterpret_cast<unsigned char *>(&id), sizeof(id));
+	} while ((id == 0) || qhConnectionIds.contains(id));
+
+	u->uiConnectionId = id;
+	qhConnectionIds.insert(id, u);
+	return id;
+}
+
 void Server::sendMessage(ServerUser *u, const char *data, int len, QByteArray &cache, bool force) {
+	Metrics::count(Metrics::VoicePacketsSent);
+	Metrics::count(Metrics::VoiceBytesSent, len);
+
 	if ((u->bUdp || force) && (u->sUdpSocket != INVALID_SOCKET) && u->csCrypt.isValid()) {
 #if defined(__LP64__)
 		STACKVAR(char, ebuffer, len+4+16);
@@ -883,17 +1090,32 @@ void Server::sendMessage(ServerUser *u, const char *data, int len, QByteArray &c
 #else
 #endif
 	} else {
-		if (cache.isEmpty())
-			cache = QByteArray(data, len);
-		emit tcpTransmit(cache,u->uiSession);
+		// The tunnel header is only built once per packet, and the same buffer is shared
+		// by all TCP listeners of it.
+		if (cache.isEmpty()) {
+			cache.resize(len + 6);
+			unsigned char *uc = reinterpret_cast<unsigned char *>(cache.data());
+			qToBigEndian<quint16>(MessageHandler::UDPTunnel, & uc[0]);
+			qToBigEndian<quint32>(len, & uc[2]);
+			memcpy(uc + 6, data, len);
+		}
+		if (u->vqTcp.push(cache, iTcpVoiceBudget * 1000ULL))
+			emit tcpTransmit(u->uiSession);
 	}
 }
 
 #define SENDTO \
-		if ((!pDst->bDeaf) && (!pDst->bSelfDeaf) && (pDst != u)) { \
-			if ((poslen > 0) && (pDst->ssContext == u->ssContext)) \
-				sendMessage(pDst, buffer, len, qba); \
-			else \
+		if ((!pDst->bDeaf) && (!pDst->bSelfDeaf) && (pDst != u) && (pDst->voiceTierFrom(u) == tier)) { \
+			if ((poslen > 0) && (pDst->uiContext == u->uiContext)) { \
+				if (pDst->bCompactPosition == u->bCompactPosition) { \
+					sendMessage(pDst, buffer, len, qba); \
+				} else if (altlen > 0) { \
+					altbuffer[0] = buffer[0]; \
+					sendMessage(pDst, altbuffer, altlen, qba_alt); \
+				} else { \
+					sendMessage(pDst, buffer, len - poslen, qba_npos); \
+				} \
+			} else \
 				sendMessage(pDst, buffer, len - poslen, qba_npos); \
 		}
 
@@ -901,16 +1123,21 @@ void Server::processMsg(ServerUser *u, const char *data, int len) {
 	if (u->sState != ServerUser::Authenticated || u->bMute || u->bSuppress || u->bSelfMute)
 		return;
 
+	MetricsTimer mt(Metrics::ProcessMsgTime);
+
 	User *p;
 	BandwidthRecord *bw = & u->bwr;
 	Channel *c = u->cChannel;
-	QByteArray qba, qba_npos;
+	QByteArray qba, qba_npos, qba_alt;
 	unsigned int counter;
 	char buffer[UDP_PACKET_SIZE];
+	char altbuffer[UDP_PACKET_SIZE];
+	int altlen = 0;
 	PacketDataStream pdi(data + 1, len - 1);
 	PacketDataStream pds(buffer+1, UDP_PACKET_SIZE-1);
 	unsigned int type = data[0] & 0xe0;
 	unsigned int target = data[0] & 0x1f;
+	unsigned int tier = 0;
 	unsigned int poslen;
 
 	// IP + UDP + Crypt + Data
@@ -922,9 +1149,27 @@ void Server::processMsg(ServerUser *u, const char *data, int len) {
 		return;
 	}
 
+	// Lower quality Opus tiers carry their tier index in front of the regular
+	// voice payload. They are relayed as plain Opus packets, but only to the
+	// listeners that should get this tier instead of the full quality stream.
+	if ((type >> 5) == MessageHandler::UDPVoiceOpusTier) {
+		pdi >> tier;
+		if (! pdi.isValid() || (tier == 0) || (tier >= N_VOICE_TIERS) || (target == 0x1f))
+			return;
+		type = MessageHandler::UDPVoiceOpus << 5;
+	}
+
+	const char *payload = pdi.charPtr();
+	const int payloadlen = pdi.left();
+
 	// Read the sequence number.
 	pdi >> counter;
 
+	if (tier == 0)
+		u->vtOffered.full(counter);
+	else if (! u->vtOffered.offer(tier, counter))
+		return;
+
 	// Skip to the end of the voice data.
 	if ((type >> 5) != MessageHandler::UDPVoiceOpus) {
 		do {
@@ -943,16 +1188,54 @@ void Server::processMsg(ServerUser *u, const char *data, int len) {
 	// Append session id to the new output stream.
 	pds << u->uiSession;
 	// Copy all voice and positional audio data to the output stream.
-	pds.append(data + 1, len - 1);
+	pds.append(payload, payloadlen);
 
 	len = pds.size() + 1;
 
+	// Listeners that don't use the same position encoding as the speaker get
+	// a copy with the position translated. Compact positions are tracked even
+	// if nobody needs them translated right now, as they refer to keyframes.
+	if (poslen > 0) {
+		char posbuff[32];
+		PacketDataStream pin(pdi.charPtr(), poslen);
+		PacketDataStream pout(posbuff, sizeof(posbuff));
+		float pos[3];
+
+		if (u->bCompactPosition) {
+			if (u->pdPosition.decode(pin, pos)) {
+				pout << pos[0];
+				pout << pos[1];
+				pout << pos[2];
+			}
+		} else {
+			pin >> pos[0];
+			pin >> pos[1];
+			pin >> pos[2];
+			if (pin.isValid()) {
+				const int q[3] = { PositionEncoder::quantize(pos[0]), PositionEncoder::quantize(pos[1]), PositionEncoder::quantize(pos[2]) };
+				PositionEncoder::encodeKey(pout, 0, q);
+			}
+		}
+
+		if (pout.size() > 0) {
+			altlen = len - poslen;
+			memcpy(altbuffer, buffer, altlen);
+			memcpy(altbuffer + altlen, posbuff, pout.size());
+			altlen += pout.size();
+		}
+	}
+
 	if (target == 0x1f) { // Server loopback
 		buffer[0] = static_cast<char>(type | 0);
 		sendMessage(u, buffer, len, qba);
 		return;
 	} else if (target == 0) { // Normal speech
 		buffer[0] = static_cast<char>(type | 0);
+
+		// Tiers are reduced quality copies of the same speech; only the full stream is recorded.
+		if (rRecorder && (tier == 0))
+			rRecorder->record(c->iId, u->uiSession, type >> 5, payload, payloadlen);
+
 		foreach(p, c->qlUsers) {
 			ServerUser *pDst = static_cast<ServerUser *>(p);
 			SENDTO;
@@ -962,8 +1245,6 @@ void Server::processMsg(ServerUser *u, const char *data, int len) {
 			QSet<Channel *> chans = c->allLinks();
 			chans.remove(c);
 
-			QMutexLocker qml(&qmCache);
-
 			foreach(Channel *l, chans) {
 				if (ChanACL::hasPermission(u, l, ChanACL::Speak, &acCache)) {
 					foreach(p, l->qlUsers) {
@@ -984,8 +1265,6 @@ void Server::processMsg(ServerUser *u, const char *data, int len) {
 		} else {
 			const WhisperTarget &wt = u->qmTargets.value(target);
 			if (! wt.qlChannels.isEmpty()) {
-				QMutexLocker qml(&qmCache);
-
 				foreach(const WhisperTarget::Channel &wtc, wt.qlChannels) {
 					Channel *wc = qhChannels.value(wtc.iId);
 					if (wc) {
@@ -1049,6 +1328,7 @@ void Server::processMsg(ServerUser *u, const char *data, int len) {
 			if (! direct.isEmpty()) {
 				qba.clear();
 				qba_npos.clear();
+				qba_alt.clear();
 			}
 		}
 		if (! direct.isEmpty()) {
@@ -1134,6 +1414,7 @@ void Server::newClient() {
 			qhUsers.insert(u->uiSession, u);
 			qhHostUsers[ha].insert(u);
 		}
+		updatePingReply();
 
 		connect(u, SIGNAL(connectionClosed(QAbstractSocket::SocketError, const QString &)), this, SLOT(connectionClosed(QAbstractSocket::SocketError, const QString &)));
 		connect(u, SIGNAL(message(unsigned int, const QByteArray &)), this, SLOT(message(unsigned int, const QByteArray &)));
@@ -1155,6 +1436,9 @@ void Server::newClient() {
 
 void Server::encrypted() {
 	ServerUser *uSource = qobject_cast<ServerUser *>(sender());
+
+	Metrics::count(Metrics::TlsHandshakes);
+	Metrics::record(Metrics::TlsHandshakeTime, uSource->tHandshake.elapsed());
 	int major, minor, patch;
 	QString release;
 
@@ -1240,6 +1524,39 @@ void Server::sslError(const QList<QSslError> &errors) {
 		u->disconnectSocket(true);
 }
 
+/**
+ * Changes the plugin context of a user, keeping the interned context ids
+ * up to date. Contexts are reference counted, so ids of contexts nobody
+ * uses anymore are dropped and clients can't grow the table without bound.
+ */
+void Server::setContext(ServerUser *u, const std::string &context) {
+	if (u->uiContext) {
+		QHash<QByteArray, InternedContext>::iterator i = qhContexts.find(QByteArray(u->ssContext.data(), static_cast<int>(u->ssContext.size())));
+		if ((i != qhContexts.end()) && (--i.value().iRefs == 0))
+			qhContexts.erase(i);
+	}
+
+	u->ssContext = context;
+
+	if (context.empty()) {
+		u->uiContext = 0;
+		return;
+	}
+
+	const QByteArray key(context.data(), static_cast<int>(context.size()));
+	QHash<QByteArray, InternedContext>::iterator i = qhContexts.find(key);
+	if (i == qhContexts.end()) {
+		InternedContext ic;
+		do {
+			ic.uiId = ++uiNextContext;
+		} while (ic.uiId == 0);
+		ic.iRefs = 0;
+		i = qhContexts.insert(key, ic);
+	}
+	++i.value().iRefs;
+	u->uiContext = i.value().uiId;
+}
+
 void Server::connectionClosed(QAbstractSocket::SocketError err, const QString &reason) {
 	Connection *c = qobject_cast<Connection *>(sender());
 	if (! c)
@@ -1260,6 +1577,8 @@ void Server::connectionClosed(QAbstractSocket::SocketError err, const QString &r
 		emit userDisconnected(u);
 	}
 
+	setContext(u, std::string());
+
 	Channel *old = u->cChannel;
 
 	{
@@ -1267,6 +1586,7 @@ void Server::connectionClosed(QAbstractSocket::SocketError err, const QString &r
 
 		qhUsers.remove(u->uiSession);
 		qhHostUsers[u->haAddress].remove(u);
+		qhConnectionIds.remove(u->uiConnectionId);
 
 		quint16 port = (u->saiUdpAddress.ss_family == AF_INET6) ? (reinterpret_cast<sockaddr_in6 *>(&u->saiUdpAddress)->sin6_port) : (reinterpret_cast<sockaddr_in *>(&u->saiUdpAddress)->sin_port);
 		const QPair<HostAddress, quint16> &key = QPair<HostAddress, quint16>(u->haAddress, port);
@@ -1275,6 +1595,7 @@ void Server::connectionClosed(QAbstractSocket::SocketError err, const QString &r
 		if (old)
 			old->removeUser(u);
 	}
+	updatePingReply();
 
 	if (old && old->bTemporary && old->qlUsers.isEmpty())
 		QCoreApplication::instance()->postEvent(this, new ExecEvent(boost::bind(&Server::removeChannel, this, old->iId)));
@@ -1322,6 +1643,7 @@ void Server::message(unsigned int uiType, const QByteArray &qbaMsg, ServerUser *
 				if (bOpus)
 					break;
 			case MessageHandler::UDPVoiceOpus:
+			case MessageHandler::UDPVoiceOpusTier:
 				processMsg(u, buffer, l);
 				break;
 			default:
@@ -1373,23 +1695,14 @@ void Server::checkTimeout() {
 	qrwlUsers.unlock();
 	foreach(ServerUser *u, qlClose)
 		u->disconnectSocket(true);
-}
-
-void Server::tcpTransmitData(QByteArray a, unsigned int id) {
-	Connection *c = qhUsers.value(id);
-	if (c) {
-		QByteArray qba;
-		int len = a.size();
 
-		qba.resize(len + 6);
-		unsigned char *uc = reinterpret_cast<unsigned char *>(qba.data());
-		* reinterpret_cast<quint16 *>(& uc[0]) = qToBigEndian(static_cast<quint16>(MessageHandler::UDPTunnel));
-		* reinterpret_cast<quint32 *>(& uc[2]) = qToBigEndian(static_cast<quint32>(len));
-		memcpy(uc + 6, a.constData(), len);
+	pruneAuthCache();
+}
 
-		c->sendMessage(qba);
-		c->forceFlush();
-	}
+void Server::tcpTransmitData(unsigned int id) {
+	ServerUser *u = qhUsers.value(id);
+	if (u)
+		u->drainVoiceQueue();
 }
 
 void Server::doSync(unsigned int id) {
@@ -1471,8 +1784,12 @@ bool Server::unregisterUser(int id) {
 	if (! unregisterUserDB(id))
 		return false;
 
+	// The voice thread evaluates ACLs, so edit them under the write lock,
+	// but store them once it is released to keep disk I/O off voice relay.
+	QList<Channel *> changed;
+
 	{
-		QMutexLocker lock(&qmCache);
+		QWriteLocker wl(&qrwlUsers);
 
 		foreach(Channel *c, qhChannels) {
 			bool write = false;
@@ -1490,10 +1807,13 @@ bool Server::unregisterUser(int id) {
 				write = write || addrem || remrem;
 			}
 			if (write)
-				updateChannel(c);
+				changed << c;
 		}
 	}
 
+	foreach(Channel *c, changed)
+		updateChannel(c);
+
 	foreach(ServerUser *u, qhUsers) {
 		if (u->iId == id) {
 			clearACLCache(u);
@@ -1542,26 +1862,33 @@ void Server::userEnterChannel(User *p, Channel *c, MumbleProto::UserState &mpus)
 }
 
 bool Server::hasPermission(ServerUser *p, Channel *c, QFlags<ChanACL::Perm> perm) {
-	QMutexLocker qml(&qmCache);
 	return ChanACL::hasPermission(p, c, perm, &acCache);
 }
 
 QFlags<ChanACL::Perm> Server::effectivePermissions(ServerUser *p, Channel *c) {
-	QMutexLocker qml(&qmCache);
 	return ChanACL::effectivePermissions(p, c, &acCache);
 }
 
+/**
+ * Looks up permissions already in the ACL cache without computing anything,
+ * so it is safe to call from any thread.
+ */
+bool Server::cachedPermissions(unsigned int session, int channel, ChanACL::Permissions &perm) {
+	QReadLocker rl(&qrwlUsers);
+	ServerUser *u = qhUsers.value(session);
+	if (! u)
+		return false;
+	return acCache.lookup(u, channel, acCache.generation(u), perm);
+}
+
 void Server::sendClientPermission(ServerUser *u, Channel *c, bool forceupdate) {
 	unsigned int perm;
 
 	if (u->iId == 0)
 		return;
 
-	{
-		QMutexLocker qml(&qmCache);
-		ChanACL::hasPermission(u, c, ChanACL::Enter, &acCache);
-		perm = acCache.value(u)->value(c);
-	}
+	// Clients expect the Cached bit on permissions pushed to them.
+	perm = ChanACL::effectivePermissions(u, c, &acCache) | ChanACL::Cached;
 
 	if (forceupdate)
 		u->iLastPermissionCheck = c->iId;
@@ -1577,7 +1904,7 @@ void Server::sendClientPermission(ServerUser *u, Channel *c, bool forceupdate) {
 	}
 }
 
-/* This function is a helper for clearACLCache and assumes qmCache is held.
+/* This function is a helper for clearACLCache.
  * First, check if anything actually changed, or if the list is getting awfully large,
  * because this function is potentially quite expensive.
  * If all the items are still valid; great. If they aren't, send off the last channel
@@ -1593,8 +1920,7 @@ void Server::flushClientPermissionCache(ServerUser *u, MumbleProto::PermissionQu
 		if (! c) {
 			match = false;
 		} else {
-			ChanACL::hasPermission(u, c, ChanACL::Enter, &acCache);
-			unsigned int perm = acCache.value(u)->value(c);
+			unsigned int perm = ChanACL::effectivePermissions(u, c, &acCache) | ChanACL::Cached;
 			if (perm != i.value())
 				match = false;
 		}
@@ -1611,8 +1937,7 @@ void Server::flushClientPermissionCache(ServerUser *u, MumbleProto::PermissionQu
 		u->iLastPermissionCheck = c->iId;
 	}
 
-	ChanACL::hasPermission(u, c, ChanACL::Enter, &acCache);
-	unsigned int perm = acCache.value(u)->value(c);
+	unsigned int perm = ChanACL::effectivePermissions(u, c, &acCache) | ChanACL::Cached;
 	u->qmPermissionSent.insert(c->iId, perm);
 
 	mppq.Clear();
@@ -1626,23 +1951,15 @@ void Server::flushClientPermissionCache(ServerUser *u, MumbleProto::PermissionQu
 void Server::clearACLCache(User *p) {
 	MumbleProto::PermissionQuery mppq;
 
-	{
-		QMutexLocker qml(&qmCache);
-
-		if (p) {
-			ChanACL::ChanCache *h = acCache.take(p);
-			delete h;
-
-			flushClientPermissionCache(static_cast<ServerUser *>(p), mppq);
-		} else {
-			foreach(ChanACL::ChanCache *h, acCache)
-				delete h;
-			acCache.clear();
+	if (p) {
+		acCache.clear(static_cast<ServerUser *>(p));
+		flushClientPermissionCache(static_cast<ServerUser *>(p), mppq);
+	} else {
+		acCache.clear();
 
-			foreach(ServerUser *u, qhUsers)
-				if (u->sState == ServerUser::Authenticated)
-					flushClientPermissionCache(u, mppq);
-		}
+		foreach(ServerUser *u, qhUsers)
+			if (u->sState == ServerUser::Authenticated)
+				flushClientPermissionCache(u, mppq);
 	}
 
 	{
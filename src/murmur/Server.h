@@ -54,6 +54,7 @@
 #endif
 
 #include "ACL.h"
+#include "ACLCache.h"
 #include "Message.h"
 #include "Mumble.pb.h"
 #include "Net.h"
@@ -63,6 +64,7 @@
 class BonjourServer;
 class Channel;
 class PacketDataStream;
+class Recorder;
 class ServerUser;
 class User;
 class QNetworkAccessManager;
@@ -99,6 +101,9 @@ class SslServer : public QTcpServer {
 
 #define EXEC_QEVENT (QEvent::User + 959)
 
+// Largest UDP datagram the server reads, and so the largest voice packet.
+#define UDP_PACKET_SIZE 1024
+
 class ExecEvent : public QEvent {
 		Q_DISABLE_COPY(ExecEvent);
 	protected:
@@ -108,6 +113,24 @@ class ExecEvent : public QEvent {
 		void execute();
 };
 
+#define PING_LIMIT_BUCKETS 4096
+#define PING_LIMIT_TOTAL 10000
+
+// Rate limit for answering UDP pings, per source address and for the whole
+// server, so ping floods can't crowd out voice. Addresses share buckets by
+// hash. Only used by the thread that reads the UDP sockets.
+class PingLimiter {
+	private:
+		Q_DISABLE_COPY(PingLimiter)
+	protected:
+		quint64 uiTotal;
+		quint64 uiSources[PING_LIMIT_BUCKETS];
+		static bool take(quint64 &full, quint64 now, quint64 interval);
+	public:
+		PingLimiter();
+		bool allow(const HostAddress &ha, quint64 now, int rate);
+};
+
 class Server : public QThread {
 	private:
 		Q_OBJECT;
@@ -117,6 +140,9 @@ class Server : public QThread {
 
 		QNetworkAccessManager *qnamNetwork;
 
+		// Server side voice recorder, NULL unless recordpath is set.
+		Recorder *rRecorder;
+
 #ifdef USE_BONJOUR
 		BonjourServer *bsRegistration;
 #endif
@@ -137,6 +163,12 @@ class Server : public QThread {
 		int iMaxTextMessageLength;
 		int iMaxImageMessageLength;
 		int iOpusThreshold;
+		int iTcpVoiceBudget;
+		int iAuthConcurrency;
+		int iAuthTimeout;
+		int iAuthCacheTTL;
+		int iAuthNegativeTTL;
+		QString qsRecordPath;
 		bool bAllowHTML;
 		QString qsPassword;
 		QString qsWelcomeText;
@@ -149,6 +181,8 @@ class Server : public QThread {
 		QUrl qurlRegWeb;
 		bool bBonjour;
 		bool bAllowPing;
+		// Pings answered per second and source address; 0 for no limit.
+		int iPingLimit;
 
 		QRegExp qrUserName;
 		QRegExp qrChannelName;
@@ -201,13 +235,13 @@ class Server : public QThread {
 		void sslError(const QList<QSslError> &);
 		void message(unsigned int, const QByteArray &, ServerUser *cCon = NULL);
 		void checkTimeout();
-		void tcpTransmitData(QByteArray, unsigned int);
+		void tcpTransmitData(unsigned int);
 		void doSync(unsigned int);
 		void encrypted();
 		void udpActivated(int);
 	signals:
 		void reqSync(unsigned int);
-		void tcpTransmit(QByteArray, unsigned int id);
+		void tcpTransmit(unsigned int id);
 	public:
 		int iServerNum;
 		QQueue<int> qqIds;
@@ -222,18 +256,33 @@ class Server : public QThread {
 		QList<SOCKET> qlUdpSocket;
 #endif
 		quint32 uiVersionBlob;
+		// Version, users, max users and bandwidth, in network byte order.
+		volatile quint32 auiPingReply[4];
+		PingLimiter plPing;
+		void updatePingReply();
+		bool answerPing(quint32 *ping, const HostAddress &ha);
 		QList<QSocketNotifier *> qlUdpNotifier;
 
 		QHash<unsigned int, ServerUser *> qhUsers;
 		QHash<QPair<HostAddress, quint16>, ServerUser *> qhPeerUsers;
 		QHash<HostAddress, QSet<ServerUser *> > qhHostUsers;
+		QHash<quint32, ServerUser *> qhConnectionIds;
 		QHash<unsigned int, Channel *> qhChannels;
 		QReadWriteLock qrwlUsers;
-		ChanACL::ACLCache acCache;
-		QMutex qmCache;
+		ACLCache acCache;
 		QHash<int, QString> qhUserNameCache;
 		QHash<QString, int> qhUserIDCache;
 
+		// Plugin contexts in use, interned so the voice relay compares
+		// numbers instead of strings. Id 0 is the empty context.
+		struct InternedContext {
+			unsigned int uiId;
+			int iRefs;
+		};
+		QHash<QByteArray, InternedContext> qhContexts;
+		unsigned int uiNextContext;
+		void setContext(ServerUser *u, const std::string &context);
+
 		QList<Ban> qlBans;
 
 		void processMsg(ServerUser *u, const char *data, int len);
@@ -244,9 +293,11 @@ class Server : public QThread {
 		bool validateUserName(const QString &name);
 
 		bool checkDecrypt(ServerUser *u, const char *encrypted, char *plain, unsigned int cryptlen);
+		quint32 newConnectionId(ServerUser *u);
 
 		bool hasPermission(ServerUser *p, Channel *c, QFlags<ChanACL::Perm> perm);
 		QFlags<ChanACL::Perm> effectivePermissions(ServerUser *p, Channel *c);
+		bool cachedPermissions(unsigned int session, int channel, ChanACL::Permissions &perm);
 		void sendClientPermission(ServerUser *u, Channel *c, bool updatelast = false);
 		void flushClientPermissionCache(ServerUser *u, MumbleProto::PermissionQuery &mpqq);
 		void clearACLCache(User *p = NULL);
@@ -293,12 +344,50 @@ class Server : public QThread {
 		void disconnectListener(QObject *p);
 		void setTempGroups(int userid, int sessionId, Channel *cChannel, const QStringList &groups);
 		void clearTempGroups(User *user, Channel *cChannel = NULL, bool recurse = true);
+
+		// Asynchronous authentication. Implementation in Auth.cpp
+	protected:
+		struct PendingAuth {
+			unsigned int uiTicket;
+			unsigned int uiSession;
+			MumbleProto::Authenticate msg;
+			QByteArray qbaCacheKey;
+			Timer tQueued;
+			bool bInFlight;
+		};
+		struct CachedAuth {
+			int iId;
+			QString qsName;
+			QStringList qslGroups;
+			quint64 uiExpires;
+		};
+		// Keyed by ticket rather than session, so a late reply can never
+		// be applied to a session id that has been reused.
+		QHash<unsigned int, PendingAuth> qhPendingAuth;
+		QQueue<unsigned int> qqAuthQueue;
+		QHash<QByteArray, CachedAuth> qhAuthCache;
+		unsigned int uiAuthTicket;
+		int iAuthInFlight;
+		QTimer *qtAuthTimeout;
+
+		bool hasAsyncAuthenticator();
+		void dispatchAuthenticate();
+		void completeAuthenticate(const PendingAuth &pa, int res, const QString &name, const QStringList &groups);
+		void pruneAuthCache();
+	public:
+		bool beginAuthenticate(ServerUser *u, const MumbleProto::Authenticate &msg);
+		void finishAuthenticate(ServerUser *u, const MumbleProto::Authenticate &msg, int id);
+		void clearAuthCache();
+	public slots:
+		void authenticateReply(unsigned int ticket, int res, const QString &name, const QStringList &groups);
+		void checkAuthTimeout();
 	signals:
 		void registerUserSig(int &, const QMap<int, QString> &);
 		void unregisterUserSig(int &, int);
 		void getRegisteredUsersSig(const QString &, QMap<int, QString > &);
 		void getRegistrationSig(int &, int, QMap<int, QString> &);
 		void authenticateSig(int &, QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &);
+		void authenticateAsyncSig(unsigned int, const QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &);
 		void setInfoSig(int &, int, const QMap<int, QString> &);
 		void setTextureSig(int &, int, const QByteArray &);
 		void idToNameSig(QString &, int);
@@ -322,6 +411,8 @@ class Server : public QThread {
 		// Database / DBus functions. Implementation in ServerDB.cpp
 		void initialize();
 		int authenticate(QString &name, const QString &pw, int sessionId = 0, const QStringList &emails = QStringList(), const QString &certhash = QString(), bool bStrongCert = false, const QList<QSslCertificate> & = QList<QSslCertificate>());
+		int authenticateExternal(int res, const QString &name);
+		int authenticateLocal(QString &name, const QString &pw, const QStringList &emails, const QString &certhash, bool bStrongCert);
 		Channel *addChannel(Channel *c, const QString &name, bool temporary = false, int position = 0);
 		void removeChannelDB(const Channel *c);
 		void readChannels(Channel *p = NULL);
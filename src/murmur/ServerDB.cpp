@@ -38,6 +38,7 @@
 #include "DBus.h"
 #include "Group.h"
 #include "Meta.h"
+#include "Metrics.h"
 #include "Server.h"
 #include "ServerUser.h"
 #include "User.h"
@@ -515,9 +516,16 @@ bool ServerDB::prepare(QSqlQuery &query, const QString &str, bool fatal, bool wa
 bool ServerDB::exec(QSqlQuery &query, const QString &str, bool fatal, bool warn) {
 	if (! str.isEmpty())
 		prepare(query, str, fatal, warn);
-	if (query.exec()) {
+
+	Timer t;
+	const bool ok = query.exec();
+	Metrics::count(Metrics::DbQueries);
+	Metrics::record(Metrics::DbQueryTime, t.elapsed());
+
+	if (ok) {
 		return true;
 	} else {
+		Metrics::count(Metrics::DbErrors);
 
 		if (fatal) {
 			*db = QSqlDatabase();
@@ -532,9 +540,15 @@ bool ServerDB::exec(QSqlQuery &query, const QString &str, bool fatal, bool warn)
 bool ServerDB::execBatch(QSqlQuery &query, const QString &str, bool fatal) {
 	if (! str.isEmpty())
 		prepare(query, str, fatal);
-	if (query.execBatch()) {
+	Timer t;
+	const bool ok = query.execBatch();
+	Metrics::count(Metrics::DbQueries);
+	Metrics::record(Metrics::DbQueryTime, t.elapsed());
+
+	if (ok) {
 		return true;
 	} else {
+		Metrics::count(Metrics::DbErrors);
 
 		if (fatal) {
 			*db = QSqlDatabase();
@@ -848,29 +862,38 @@ int Server::authenticate(QString &name, const QString &pw, int sessionId, const
 
 	emit authenticateSig(res, name, sessionId, certs, certhash, bStrongCert, pw);
 
-	if (res != -2) {
-		// External authentication handled it. Ignore certificate completely.
-		if (res != -1) {
-			TransactionHolder th;
-			QSqlQuery &query = *th.qsqQuery;
+	if (res != -2)
+		return authenticateExternal(res, name);
 
-			int lchan=readLastChannel(res);
-			if (lchan < 0)
-				lchan = 0;
+	return authenticateLocal(name, pw, emails, certhash, bStrongCert);
+}
 
-			SQLPREP("REPLACE INTO `%1users` (`server_id`, `user_id`, `name`, `lastchannel`) VALUES (?,?,?,?)");
-			query.addBindValue(iServerNum);
-			query.addBindValue(res);
-			query.addBindValue(name);
-			query.addBindValue(lchan);
-			SQLEXEC();
-		}
-		if (res >= 0) {
-			qhUserNameCache.remove(res);
-			qhUserIDCache.remove(name);
-		}
-		return res;
+// Records the outcome of an external authenticator. Ignores certificates completely.
+int Server::authenticateExternal(int res, const QString &name) {
+	if (res != -1) {
+		TransactionHolder th;
+		QSqlQuery &query = *th.qsqQuery;
+
+		int lchan=readLastChannel(res);
+		if (lchan < 0)
+			lchan = 0;
+
+		SQLPREP("REPLACE INTO `%1users` (`server_id`, `user_id`, `name`, `lastchannel`) VALUES (?,?,?,?)");
+		query.addBindValue(iServerNum);
+		query.addBindValue(res);
+		query.addBindValue(name);
+		query.addBindValue(lchan);
+		SQLEXEC();
 	}
+	if (res >= 0) {
+		qhUserNameCache.remove(res);
+		qhUserIDCache.remove(name);
+	}
+	return res;
+}
+
+int Server::authenticateLocal(QString &name, const QString &pw, const QStringList &emails, const QString &certhash, bool bStrongCert) {
+	int res = -2;
 
 	TransactionHolder th;
 	QSqlQuery &query = *th.qsqQuery;
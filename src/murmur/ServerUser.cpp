@@ -37,6 +37,8 @@
 
 ServerUser::ServerUser(Server *p, QSslSocket *socket) : Connection(p, socket), User(), s(NULL) {
 	sState = ServerUser::Connected;
+	uiAuthTicket = 0;
+	uiConnectionId = 0;
 	sUdpSocket = INVALID_SOCKET;
 
 	memset(&saiUdpAddress, 0, sizeof(saiUdpAddress));
@@ -52,12 +54,244 @@ ServerUser::ServerUser(Server *p, QSslSocket *socket) : Connection(p, socket), U
 	iLastPermissionCheck = -1;
 	
 	bOpus = false;
+	bCompactPosition = false;
+	uiContext = 0;
+
+	uiWantedTier = 0;
+
+	bTcpNoDelay = false;
+	connect(socket, SIGNAL(encryptedBytesWritten(qint64)), this, SLOT(voiceBytesWritten(qint64)));
+}
+
+VoiceTiers::VoiceTiers() {
+	// Half the sequence space away from the full stream, so no tier is
+	// offered before its first packet.
+	qaiSequence[0].fetchAndStoreRelaxed(0);
+	for (int i=1;i<N_VOICE_TIERS;++i)
+		qaiSequence[i].fetchAndStoreRelaxed(0x40000000);
+}
+
+void VoiceTiers::full(unsigned int sequence) {
+	qaiSequence[0].fetchAndStoreRelaxed(static_cast<int>(sequence));
+}
+
+/**
+ * Records a packet of the given tier. Returns false if it should not be
+ * relayed: when a tier starts, the listeners of that tier got this frame
+ * from the full stream already if its full quality packet came first.
+ */
+bool VoiceTiers::offer(unsigned int tier, unsigned int sequence) {
+	const bool running = offered(tier);
+	qaiSequence[tier].fetchAndStoreRelaxed(static_cast<int>(sequence));
+	if (running)
+		return true;
+
+	const unsigned int latest = static_cast<unsigned int>(qaiSequence[0].fetchAndAddRelaxed(0));
+	return static_cast<int>(sequence - latest) > 0;
+}
+
+bool VoiceTiers::offered(unsigned int tier) const {
+	const unsigned int latest = static_cast<unsigned int>(qaiSequence[0].fetchAndAddRelaxed(0));
+	const unsigned int seen = static_cast<unsigned int>(qaiSequence[tier].fetchAndAddRelaxed(0));
+	// Tier packets may also arrive just ahead of their full quality packet.
+	const int behind = static_cast<int>(latest - seen);
+	return (behind >= -VOICE_TIER_WINDOW) && (behind <= VOICE_TIER_WINDOW);
+}
+
+quint32 VoiceTiers::mask() const {
+	// The full quality stream is always there.
+	quint32 m = 1;
+	for (unsigned int i=1;i<N_VOICE_TIERS;++i)
+		if (offered(i))
+			m |= (1 << i);
+	return m;
+}
+
+unsigned int ServerUser::voiceTierFrom(const ServerUser *speaker) const {
+	// Listeners tunnelling voice through TCP never get the full quality stream
+	// if anything cheaper is available.
+	unsigned int tier = bUdp ? uiWantedTier : qMax(uiWantedTier, 1U);
+	if (tier == 0)
+		return 0;
+
+	quint32 offered = speaker->vtOffered.mask();
+	while ((tier > 0) && !(offered & (1 << tier)))
+		--tier;
+	return tier;
+}
+
+/**
+ * Moves queued voice frames into the socket. Only as much is handed over as
+ * fits below TCP_VOICE_BACKLOG; the rest stays in the queue, where it can still
+ * be dropped once it gets too old, and is picked up again when the socket
+ * reports progress. Called on the main thread only.
+ */
+void ServerUser::drainVoiceQueue() {
+	QList<QByteArray> ql;
+	qint64 pending = bytesToWrite();
+
+	{
+		QMutexLocker l(&vqTcp.qmLock);
+		vqTcp.expire();
+
+		while (! vqTcp.qqFrames.isEmpty() && (pending < TCP_VOICE_BACKLOG)) {
+			const QByteArray &qba = vqTcp.qqFrames.head().qbaData;
+			pending += qba.size();
+			vqTcp.iBytes -= qba.size();
+			ql << qba;
+			vqTcp.qqFrames.dequeue();
+		}
+
+		vqTcp.bScheduled = ! vqTcp.qqFrames.isEmpty();
+
+		lqLink.uiTcpDropped += vqTcp.uiDropped;
+		vqTcp.uiDropped = 0;
+	}
+
+	if (ql.isEmpty())
+		return;
+
+	// Voice is latency sensitive, so don't let Nagle hold it back. This used to be
+	// toggled around every single packet. It stays on afterwards: control messages
+	// are written whole and flushed, so Nagle has nothing to coalesce there.
+	if (! bTcpNoDelay) {
+		qtsSocket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+		bTcpNoDelay = true;
+	}
+
+	foreach(const QByteArray &qba, ql)
+		sendMessage(qba);
+
+	qtsSocket->flush();
+}
+
+void ServerUser::voiceBytesWritten(qint64) {
+	bool queued;
+	{
+		QMutexLocker l(&vqTcp.qmLock);
+		queued = ! vqTcp.qqFrames.isEmpty();
+	}
+	if (queued)
+		drainVoiceQueue();
+}
+
+void ServerUser::updateLinkQuality() {
+	uiWantedTier = lqLink.update(csCrypt, bUdp ? dUDPPingVar : dTCPPingVar, uiWantedTier);
 }
 
 
 ServerUser::operator const QString() const {
 	return QString::fromLatin1("%1:%2(%3)").arg(qsName).arg(uiSession).arg(iId);
 }
+VoiceQueue::VoiceQueue() {
+	iBytes = 0;
+	bScheduled = false;
+	uiBudget = 0;
+	uiDropped = 0;
+	uiDroppedTotal = 0;
+}
+
+/**
+ * Appends a frame, expiring frames beyond the latency budget first.
+ * Returns true if the queue needs a drain to be scheduled on the main thread,
+ * which only happens once until that drain has run. Caller must not hold qmLock.
+ */
+bool VoiceQueue::push(const QByteArray &frame, quint64 budget) {
+	QMutexLocker l(&qmLock);
+
+	uiBudget = budget;
+	expire();
+
+	Frame f;
+	f.qbaData = frame;
+	qqFrames.enqueue(f);
+	iBytes += frame.size();
+
+	if (bScheduled)
+		return false;
+	bScheduled = true;
+	return true;
+}
+
+int VoiceQueue::depth() {
+	QMutexLocker l(&qmLock);
+	return qqFrames.count();
+}
+
+// Assumes qmLock is held.
+void VoiceQueue::expire() {
+	while (! qqFrames.isEmpty() && (qqFrames.head().tQueued.elapsed() > uiBudget)) {
+		iBytes -= qqFrames.head().qbaData.size();
+		qqFrames.dequeue();
+		++uiDropped;
+		++uiDroppedTotal;
+	}
+}
+
+LinkQuality::LinkQuality() {
+	uiGood = uiLate = uiLost = 0;
+	fLoss = 0.0f;
+	fJitter = 0.0f;
+	uiTcpDropped = 0;
+	iStable = 0;
+	bFirst = true;
+}
+
+/**
+ * Updates the estimate with the counters the client reported in its last ping,
+ * and returns the Opus tier the listener should receive from now on.
+ *
+ * Loss and late packets are measured over the interval since the previous ping,
+ * so a long, clean history doesn't hide a link that just got worse. Moving to a
+ * cheaper tier happens immediately, moving back up requires a few clean reports
+ * in a row to avoid flapping between tiers.
+ */
+unsigned int LinkQuality::update(const CryptState &cs, float pingvar, unsigned int tier) {
+	// Counters go backwards when the client reconnects its crypt state.
+	if (bFirst || (cs.uiRemoteGood < uiGood) || (cs.uiRemoteLate < uiLate) || (cs.uiRemoteLost < uiLost)) {
+		uiGood = uiLate = uiLost = 0;
+	}
+
+	unsigned int good = cs.uiRemoteGood - uiGood;
+	unsigned int late = cs.uiRemoteLate - uiLate;
+	unsigned int lost = cs.uiRemoteLost - uiLost;
+	unsigned int total = good + late + lost;
+
+	uiGood = cs.uiRemoteGood;
+	uiLate = cs.uiRemoteLate;
+	uiLost = cs.uiRemoteLost;
+
+	if (total > 0) {
+		float loss = static_cast<float>(late + lost) / static_cast<float>(total);
+		fLoss = bFirst ? loss : (fLoss * 0.7f + loss * 0.3f);
+	}
+
+	float jitter = (pingvar > 0.0f) ? sqrtf(pingvar) : 0.0f;
+	fJitter = bFirst ? jitter : (fJitter * 0.7f + jitter * 0.3f);
+
+	bFirst = false;
+
+	bool congested = (fLoss > 0.08f) || (fJitter > 60.0f) || (uiTcpDropped > 0);
+	bool clear = (fLoss < 0.02f) && (fJitter < 20.0f) && (uiTcpDropped == 0);
+
+	uiTcpDropped = 0;
+
+	if (congested) {
+		iStable = 0;
+		if (tier < N_VOICE_TIERS - 1)
+			++tier;
+	} else if (clear) {
+		if ((++iStable >= 3) && (tier > 0)) {
+			iStable = 0;
+			--tier;
+		}
+	} else {
+		iStable = 0;
+	}
+
+	return tier;
+}
+
 BandwidthRecord::BandwidthRecord() {
 	iRecNum = 0;
 	iSum = 0;
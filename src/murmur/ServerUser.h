@@ -32,6 +32,9 @@
 #ifndef MUMBLE_MURMUR_SERVERUSER_H_
 #define MUMBLE_MURMUR_SERVERUSER_H_
 
+#include <QtCore/QAtomicInt>
+#include <QtCore/QMutex>
+#include <QtCore/QQueue>
 #include <QtCore/QStringList>
 
 #ifdef Q_OS_UNIX
@@ -40,8 +43,10 @@
 #include <winsock2.h>
 #endif
 
+#include "ACLCache.h"
 #include "Connection.h"
 #include "Net.h"
+#include "PositionCodec.h"
 #include "Timer.h"
 #include "User.h"
 
@@ -51,6 +56,21 @@
 
 #define N_BANDWIDTH_SLOTS 360
 
+// Maximum number of Opus quality tiers a speaker may offer, including
+// the full quality stream as tier 0.
+
+#define N_VOICE_TIERS 4
+
+// A tier stops counting as offered once its last packet is more than this
+// many 10ms frames away from the speaker's newest full quality packet.
+
+#define VOICE_TIER_WINDOW 10
+
+// Voice tunnelled through TCP is only handed to the socket while less than
+// this much data is waiting to be written to the client.
+
+#define TCP_VOICE_BACKLOG 16384
+
 struct BandwidthRecord {
 	int iRecNum;
 	int iSum;
@@ -67,6 +87,63 @@ struct BandwidthRecord {
 	int bandwidth() const;
 };
 
+// Per-listener estimate of how much voice traffic the link to a client
+// sustains, fed from the client's ping reports and from TCP backpressure.
+
+struct LinkQuality {
+	unsigned int uiGood, uiLate, uiLost;
+	float fLoss;
+	float fJitter;
+	unsigned int uiTcpDropped;
+	int iStable;
+	bool bFirst;
+
+	LinkQuality();
+	unsigned int update(const CryptState &cs, float pingvar, unsigned int tier);
+};
+
+// Voice packets waiting to be tunnelled through a client's TLS connection.
+// The voice thread appends ready-to-write frames, the main thread drains
+// them into the socket. Frames that waited longer than the latency budget
+// are worthless to the client and are dropped, oldest first.
+
+struct VoiceQueue {
+	struct Frame {
+		QByteArray qbaData;
+		Timer tQueued;
+	};
+
+	QMutex qmLock;
+	QQueue<Frame> qqFrames;
+	int iBytes;
+	bool bScheduled;
+	quint64 uiBudget;
+	unsigned int uiDropped;
+	unsigned int uiDroppedTotal;
+
+	VoiceQueue();
+	bool push(const QByteArray &frame, quint64 budget);
+	int depth();
+	void expire();
+};
+
+// Opus quality tiers a speaker is sending, tracked by the sequence number
+// of the last packet of each, with tier 0 being the full quality stream.
+// Listeners fall back to the full stream within a few frames once the
+// speaker stops sending their tier. Voice is relayed from the UDP thread
+// and from the TCP tunnel, so every sequence is its own atomic; a reader
+// mixing two updates at worst picks the wrong tier for one frame.
+
+struct VoiceTiers {
+	mutable QAtomicInt qaiSequence[N_VOICE_TIERS];
+
+	VoiceTiers();
+	void full(unsigned int sequence);
+	bool offer(unsigned int tier, unsigned int sequence);
+	bool offered(unsigned int tier) const;
+	quint32 mask() const;
+};
+
 struct WhisperTarget {
 	struct Channel {
 		int iId;
@@ -87,8 +164,13 @@ class ServerUser : public Connection, public User {
 	protected:
 		Server *s;
 	public:
-		enum State { Connected, Authenticated };
+		// Authenticating is the window between Authenticate and the reply of an
+		// asynchronous authenticator; only Ping and Version are accepted in it.
+		enum State { Connected, Authenticating, Authenticated };
 		State sState;
+		unsigned int uiAuthTicket;
+		// Started when the connection is accepted, read once TLS is up.
+		Timer tHandshake;
 		operator const QString() const;
 
 		float dUDPPingAvg, dUDPPingVar;
@@ -101,6 +183,8 @@ class ServerUser : public Connection, public User {
 		QString qsOSVersion;
 
 		std::string ssContext;
+		// Interned ssContext; see Server::setContext().
+		unsigned int uiContext;
 		QString qsIdentity;
 
 		bool bVerified;
@@ -108,10 +192,33 @@ class ServerUser : public Connection, public User {
 
 		HostAddress haAddress;
 		bool bUdp;
+		// Handed out with the UDP key, 0 until then. Packets from an address
+		// that isn't known yet may start with it; see Server::run().
+		quint32 uiConnectionId;
 
 		QList<int> qlCodecs;
 		bool bOpus;
 
+		// Positions in voice packets from and to this user use PositionCodec.
+		// The decoder follows what this user sends, for translating it to
+		// listeners that expect raw floats.
+		bool bCompactPosition;
+		PositionDecoder pdPosition;
+
+		// Opus quality tiers offered by this user while speaking, and the
+		// tier this user would like to receive as a listener.
+		VoiceTiers vtOffered;
+		unsigned int uiWantedTier;
+		LinkQuality lqLink;
+		void updateLinkQuality();
+
+		VoiceQueue vqTcp;
+		bool bTcpNoDelay;
+		void drainVoiceQueue();
+		unsigned int voiceTierFrom(const ServerUser *speaker) const;
+
+		// Written with Server::qrwlUsers locked for writing, since the
+		// voice thread reads it to evaluate ACLs.
 		QStringList qslAccessTokens;
 
 		QMap<int, WhisperTarget> qmTargets;
@@ -119,6 +226,8 @@ class ServerUser : public Connection, public User {
 		QMap<int, TargetCache> qmTargetCache;
 		QMap<QString, QString> qmWhisperRedirect;
 
+		// See ACLCache.
+		ACLCacheShard acsCache;
 		int iLastPermissionCheck;
 		QMap<int, unsigned int> qmPermissionSent;
 #ifdef Q_OS_UNIX
@@ -130,6 +239,8 @@ class ServerUser : public Connection, public User {
 		struct sockaddr_storage saiUdpAddress;
 		struct sockaddr_storage saiTcpLocalAddress;
 		ServerUser(Server *parent, QSslSocket *socket);
+	protected slots:
+		void voiceBytesWritten(qint64);
 };
 
 #endif
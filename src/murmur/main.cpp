@@ -38,6 +38,7 @@
 #include "ServerDB.h"
 #include "DBus.h"
 #include "Meta.h"
+#include "Metrics.h"
 #include "Version.h"
 #include "SSL.h"
 
@@ -465,6 +466,9 @@ int main(int argc, char **argv) {
 	IceStart();
 #endif
 
+	if (Meta::mp.usMetricsPort)
+		new MetricsServer(Meta::mp.qhaMetrics, Meta::mp.usMetricsPort, &a);
+
 	meta->getOSInfo();
 
 	int major, minor, patch;
@@ -0,0 +1,355 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * Offline renderer for murmur's server side recordings. Reads the per-channel
+ * containers written by Recorder and writes one Ogg Opus file per speaker,
+ * all aligned to the start of the recording. The packets are copied as they
+ * were sent; nothing is decoded or re-encoded. Pauses in speech are filled
+ * with zero-length Opus frames, which decoders play back as silence.
+ */
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDataStream>
+#include <QtCore/QDateTime>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QHash>
+#include <QtCore/QSet>
+#include <QtCore/QStringList>
+#include <QtCore/QtEndian>
+
+#include "PacketDataStream.h"
+#include "RecorderFormat.h"
+
+// MessageHandler::UDPVoiceOpus
+static const unsigned int uiTypeOpus = 4;
+
+// Gaps longer than this many samples (at 48 kHz) are filled with silence.
+static const quint64 uiGapThreshold = 4800;
+
+static quint32 oggCrc(const unsigned char *data, int len, quint32 crc) {
+	static quint32 table[256];
+	static bool init = false;
+
+	if (! init) {
+		for (quint32 i = 0; i < 256; ++i) {
+			quint32 r = i << 24;
+			for (int j = 0; j < 8; ++j)
+				r = (r & 0x80000000U) ? ((r << 1) ^ 0x04c11db7U) : (r << 1);
+			table[i] = r;
+		}
+		init = true;
+	}
+
+	for (int i = 0; i < len; ++i)
+		crc = (crc << 8) ^ table[((crc >> 24) ^ data[i]) & 0xff];
+	return crc;
+}
+
+// Number of 48 kHz samples in an Opus packet, from its TOC byte.
+static int opusSamples(const unsigned char *d, int len) {
+	static const int silk[4] = { 480, 960, 1920, 2880 };
+
+	if (len < 1)
+		return 0;
+
+	int frames;
+	switch (d[0] & 3) {
+		case 0:
+			frames = 1;
+			break;
+		case 1:
+		case 2:
+			frames = 2;
+			break;
+		default:
+			if (len < 2)
+				return 0;
+			frames = d[1] & 0x3f;
+			break;
+	}
+
+	const int config = d[0] >> 3;
+	int size;
+	if (config < 12)
+		size = silk[config & 3];
+	else if (config < 16)
+		size = (config & 1) ? 960 : 480;
+	else
+		size = 120 << (config & 3);
+
+	return frames * size;
+}
+
+class OggOpusWriter {
+	protected:
+		QFile qfFile;
+		quint32 uiSerial;
+		quint32 uiPageSeq;
+		quint64 uiGranule;
+		QByteArray qbaSegments;
+		QByteArray qbaData;
+		bool bFirst;
+
+		void flushPage(bool eos);
+		void addPacket(const char *data, int len, int samples);
+	public:
+		OggOpusWriter(const QString &fname, quint32 serial, const QString &title);
+		~OggOpusWriter();
+		bool isOpen() const;
+
+		void packet(quint64 usTime, const char *data, int len);
+};
+
+OggOpusWriter::OggOpusWriter(const QString &fname, quint32 serial, const QString &title) : qfFile(fname) {
+	uiSerial = serial;
+	uiPageSeq = 0;
+	uiGranule = 0;
+	bFirst = true;
+
+	if (! qfFile.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		return;
+
+	// Identification header: version 1, mono, no pre-skip, 48 kHz, no gain, mapping family 0.
+	QByteArray head("OpusHead");
+	head.append(static_cast<char>(1));
+	head.append(static_cast<char>(1));
+	head.append(QByteArray(2, 0));
+	char rate[4];
+	qToLittleEndian<quint32>(48000, reinterpret_cast<uchar *>(rate));
+	head.append(rate, 4);
+	head.append(QByteArray(3, 0));
+	addPacket(head.constData(), head.size(), 0);
+	flushPage(false);
+
+	QByteArray vendor("murmur-render");
+	QByteArray comment = QString::fromLatin1("TITLE=%1").arg(title).toUtf8();
+	QByteArray tags("OpusTags");
+	char len[4];
+	qToLittleEndian<quint32>(vendor.size(), reinterpret_cast<uchar *>(len));
+	tags.append(len, 4);
+	tags.append(vendor);
+	qToLittleEndian<quint32>(1, reinterpret_cast<uchar *>(len));
+	tags.append(len, 4);
+	qToLittleEndian<quint32>(comment.size(), reinterpret_cast<uchar *>(len));
+	tags.append(len, 4);
+	tags.append(comment);
+	addPacket(tags.constData(), tags.size(), 0);
+	flushPage(false);
+}
+
+OggOpusWriter::~OggOpusWriter() {
+	if (qfFile.isOpen())
+		flushPage(true);
+}
+
+bool OggOpusWriter::isOpen() const {
+	return qfFile.isOpen();
+}
+
+void OggOpusWriter::addPacket(const char *data, int len, int samples) {
+	// Packets are never split across pages, so make room for the whole lacing.
+	if (qbaSegments.size() + len / 255 + 1 > 255)
+		flushPage(false);
+
+	int left = len;
+	while (left >= 255) {
+		qbaSegments.append(static_cast<char>(255));
+		left -= 255;
+	}
+	qbaSegments.append(static_cast<char>(left));
+	qbaData.append(data, len);
+	uiGranule += samples;
+
+	if (qbaData.size() >= 4096)
+		flushPage(false);
+}
+
+void OggOpusWriter::flushPage(bool eos) {
+	if (qbaSegments.isEmpty() && ! eos)
+		return;
+
+	QByteArray page("OggS");
+	page.append(static_cast<char>(0));
+	page.append(static_cast<char>((bFirst ? 0x02 : 0x00) | (eos ? 0x04 : 0x00)));
+
+	uchar buff[8];
+	qToLittleEndian<quint64>(uiGranule, buff);
+	page.append(reinterpret_cast<const char *>(buff), 8);
+	qToLittleEndian<quint32>(uiSerial, buff);
+	page.append(reinterpret_cast<const char *>(buff), 4);
+	qToLittleEndian<quint32>(uiPageSeq++, buff);
+	page.append(reinterpret_cast<const char *>(buff), 4);
+	page.append(QByteArray(4, 0));
+	page.append(static_cast<char>(qbaSegments.size()));
+	page.append(qbaSegments);
+	page.append(qbaData);
+
+	quint32 crc = oggCrc(reinterpret_cast<const unsigned char *>(page.constData()), page.size(), 0);
+	qToLittleEndian<quint32>(crc, reinterpret_cast<uchar *>(page.data() + 22));
+
+	qfFile.write(page);
+
+	qbaSegments.clear();
+	qbaData.clear();
+	bFirst = false;
+}
+
+void OggOpusWriter::packet(quint64 usTime, const char *data, int len) {
+	const int samples = opusSamples(reinterpret_cast<const unsigned char *>(data), len);
+	if (samples == 0)
+		return;
+
+	// Fill silence up to where this packet belongs, using 20 ms zero-length CELT frames.
+	const quint64 pos = usTime * 48ULL / 1000ULL;
+	if (pos > uiGranule + uiGapThreshold) {
+		const char silence = static_cast<char>(31 << 3);
+		while (uiGranule + 960 <= pos)
+			addPacket(&silence, 1, 960);
+	}
+
+	addPacket(data, len, samples);
+}
+
+static bool render(const QString &fname, const QDir &outdir) {
+	QFile f(fname);
+	if (! f.open(QIODevice::ReadOnly)) {
+		qWarning("%s: %s", qPrintable(fname), qPrintable(f.errorString()));
+		return false;
+	}
+
+	QDataStream qds(&f);
+	quint32 magic, server;
+	quint8 version;
+	qint32 channel;
+	qint64 start;
+	qds >> magic >> version >> server >> channel >> start;
+	if ((qds.status() != QDataStream::Ok) || (magic != uiRecorderMagic) || (version != uiRecorderVersion)) {
+		qWarning("%s: Not a murmur recording", qPrintable(fname));
+		return false;
+	}
+
+	const qint64 offset = f.pos();
+	const qint64 size = f.size() - offset;
+	const char *map = reinterpret_cast<const char *>(f.map(offset, size));
+	QByteArray qbaData;
+	if (! map) {
+		qbaData = f.readAll();
+		map = qbaData.constData();
+	}
+
+	QHash<unsigned int, OggOpusWriter *> qhWriters;
+	const QString base = QFileInfo(fname).completeBaseName();
+	PacketDataStream pds(map, static_cast<int>(size));
+	quint64 ts = 0;
+	unsigned int records = 0, skipped = 0;
+
+	while (pds.left() > 0) {
+		quint64 delta;
+		unsigned int session, len;
+
+		pds >> delta >> session;
+		const unsigned int type = pds.next8();
+		pds >> len;
+		if (! pds.isValid() || (len > pds.left()))
+			break;
+
+		const char *payload = pds.charPtr();
+		pds.skip(len);
+		ts += delta;
+		++records;
+
+		if (type != uiTypeOpus) {
+			++skipped;
+			continue;
+		}
+
+		// Sequence number, then the Opus frame with the terminator flag in its length.
+		PacketDataStream pp(payload, len);
+		unsigned int seq;
+		int opuslen;
+		pp >> seq >> opuslen;
+		opuslen &= 0x1fff;
+		if (! pp.isValid() || (opuslen == 0) || (static_cast<unsigned int>(opuslen) > pp.left()))
+			continue;
+
+		OggOpusWriter *w = qhWriters.value(session);
+		if (! w) {
+			const QString out = outdir.absoluteFilePath(QString::fromLatin1("%1-session%2.opus").arg(base).arg(session));
+			w = new OggOpusWriter(out, qHash(out), QString::fromLatin1("Server %1, channel %2, session %3").arg(server).arg(channel).arg(session));
+			if (! w->isOpen())
+				qWarning("%s: Failed to create", qPrintable(out));
+			qhWriters.insert(session, w);
+		}
+		if (w->isOpen())
+			w->packet(ts, pp.charPtr(), opuslen);
+	}
+
+	if (pds.left() > 0)
+		qWarning("%s: Ignoring %u bytes of truncated data at the end", qPrintable(fname), pds.left());
+	if (skipped)
+		qWarning("%s: Skipped %u non-Opus packets", qPrintable(fname), skipped);
+	qWarning("%s: %u packets from %d speakers, started %s", qPrintable(fname), records, qhWriters.count(), qPrintable(QDateTime::fromMSecsSinceEpoch(start).toUTC().toString(Qt::ISODate)));
+
+	qDeleteAll(qhWriters);
+	return true;
+}
+
+int main(int argc, char **argv) {
+	QCoreApplication a(argc, argv);
+
+	QStringList args = a.arguments();
+	args.removeFirst();
+
+	QDir outdir(QDir::current());
+	if ((args.count() >= 2) && (args.at(0) == QLatin1String("-o"))) {
+		outdir = QDir(args.at(1));
+		args = args.mid(2);
+	}
+
+	if (args.isEmpty()) {
+		qWarning("Usage: murmur-render [-o outdir] recording.mrec ...");
+		return 1;
+	}
+
+	if (! outdir.exists() && ! outdir.mkpath(QLatin1String("."))) {
+		qWarning("Failed to create %s", qPrintable(outdir.absolutePath()));
+		return 1;
+	}
+
+	int failed = 0;
+	foreach(const QString &fname, args)
+		if (! render(fname, outdir))
+			++failed;
+
+	return failed ? 1 : 0;
+}
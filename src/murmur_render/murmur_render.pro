@@ -0,0 +1,11 @@
+include(../../compiler.pri)
+
+TEMPLATE = app
+CONFIG *= qt console warn_on
+CONFIG -= app_bundle
+QT = core
+LANGUAGE = C++
+TARGET = murmur-render
+HEADERS *= ../PacketDataStream.h ../murmur/RecorderFormat.h
+SOURCES *= murmur_render.cpp
+INCLUDEPATH *= .. ../murmur
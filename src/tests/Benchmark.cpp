@@ -1,6 +1,49 @@
 /**
- * Provided a target address spawns a specified number of senders/speakers,
- * UDP-listeners and TCP-listeners.
+ * Voice relay load generator for murmur.
+ *
+ * Simulates many users from a single thread. Control connections are
+ * non-blocking QSslSockets. On Linux the UDP sockets of all users are
+ * watched through one epoll descriptor and read and written in batches with
+ * recvmmsg and sendmmsg. Every voice packet carries the time it was sent, so
+ * each listener measures the relay latency of the server directly.
+ *
+ *   Benchmark <host> <port> [scenarios.ini] [scenario=<name>] [key=value ...]
+ *
+ * Scenario keys, with their defaults:
+ *
+ *   clients=50         number of simulated users
+ *   channels=1         number of channels the users are spread over evenly
+ *   channelsizes=      comma separated channel sizes; overrides the above
+ *   talkers=0.1        fraction of the users of a channel talking at once
+ *   talkspurt=5        seconds until another set of users starts talking
+ *   tcponly=0          fraction of users tunneling voice through TCP
+ *   legacyudp=false    don't put the connection id in front of UDP packets,
+ *                      so the server has to find users by trial decryption
+ *   positional=false   append positional data to voice packets
+ *   whisper=0          fraction of talkers whispering instead of talking
+ *   whispertarget=channel
+ *                      whisper to the next channel, or "users" to whisper
+ *                      to whisperusers random users
+ *   whisperusers=5
+ *   links=false        link channels in pairs (1 and 2, 3 and 4, ...)
+ *   churn=0            users leaving and joining again per second
+ *   frame=20           milliseconds of audio per packet
+ *   payload=60         bytes of audio per packet
+ *   spawnrate=200      connections opened per second
+ *   duration=60        seconds to measure once all users joined
+ *   interval=5         seconds between reports
+ *   password=          SuperUser password; needed to create channels
+ *
+ * The users are put into channels called bench-1, bench-2, ... below the
+ * root channel. Missing channels are created if a SuperUser password is
+ * given; otherwise everyone stays in the root channel. A scenarios file is
+ * an ini file with one group per scenario. Command line keys override it.
+ *
+ * The server needs room for all users (users=) and must not ban the many
+ * connections from a single address (autobanAttempts=0).
+ *
+ * At the end a single RESULT line lists throughput, loss and latency
+ * percentiles, for comparing releases from scripts.
  */
 
 #include <QtCore>
@@ -8,18 +51,21 @@
 
 #ifndef Q_OS_WIN
 #include <unistd.h>
-#endif
-#include <sys/types.h>
-#include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/types.h>
-#ifndef Q_OS_WIN
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
-#include <netinet/ip.h>
-#include <sys/utsname.h>
+#include <arpa/inet.h>
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <sys/epoll.h>
 #endif
 #include <errno.h>
+#include <stdio.h>
 
 #include "PacketDataStream.h"
 #include "Timer.h"
@@ -27,369 +73,1161 @@
 #include "CryptState.h"
 #include "Mumble.pb.h"
 
-class Client : public QThread {
+#ifdef Q_OS_WIN
+#define CLOSESOCKET ::closesocket
+#else
+#define CLOSESOCKET ::close
+#endif
+
+// Packets read or written with one recvmmsg or sendmmsg call.
+#define UDP_BATCH 32
+#define UDP_SIZE 1024
+
+// Microseconds since the benchmark started. Voice packets carry this, and
+// as sender and receiver share the process no clock sync is needed.
+static Timer tEpoch;
+
+class Bench;
+
+struct Scenario {
+	QList<int> qlChannelSizes;
+	double dTalkers;
+	int iTalkSpurt;
+	double dTcpOnly;
+	bool bLegacyUdp;
+	bool bPositional;
+	double dWhisper;
+	bool bWhisperUsers;
+	int iWhisperUsers;
+	bool bLinks;
+	double dChurn;
+	int iFrame;
+	int iPayload;
+	int iSpawnRate;
+	int iDuration;
+	int iInterval;
+	QString qsPassword;
+
+	Scenario(const QMap<QString, QString> &keys);
+	int clients() const;
+};
+
+Scenario::Scenario(const QMap<QString, QString> &keys) {
+	const int nclients = keys.value(QLatin1String("clients"), QLatin1String("50")).toInt();
+	const int nchannels = qMax(1, keys.value(QLatin1String("channels"), QLatin1String("1")).toInt());
+
+	const QString &sizes = keys.value(QLatin1String("channelsizes"));
+	if (! sizes.isEmpty()) {
+		foreach(const QString &size, sizes.split(QLatin1Char(','), QString::SkipEmptyParts))
+			qlChannelSizes << qMax(1, size.trimmed().toInt());
+	} else {
+		for (int i=0;i<nchannels;++i)
+			qlChannelSizes << (nclients / nchannels) + ((i < nclients % nchannels) ? 1 : 0);
+	}
+
+	dTalkers = keys.value(QLatin1String("talkers"), QLatin1String("0.1")).toDouble();
+	iTalkSpurt = qMax(1, keys.value(QLatin1String("talkspurt"), QLatin1String("5")).toInt());
+	dTcpOnly = keys.value(QLatin1String("tcponly"), QLatin1String("0")).toDouble();
+	bLegacyUdp = QVariant(keys.value(QLatin1String("legacyudp"), QLatin1String("false"))).toBool();
+	bPositional = QVariant(keys.value(QLatin1String("positional"), QLatin1String("false"))).toBool();
+	dWhisper = keys.value(QLatin1String("whisper"), QLatin1String("0")).toDouble();
+	bWhisperUsers = (keys.value(QLatin1String("whispertarget"), QLatin1String("channel")) == QLatin1String("users"));
+	iWhisperUsers = qMax(1, keys.value(QLatin1String("whisperusers"), QLatin1String("5")).toInt());
+	bLinks = QVariant(keys.value(QLatin1String("links"), QLatin1String("false"))).toBool();
+	dChurn = keys.value(QLatin1String("churn"), QLatin1String("0")).toDouble();
+	iFrame = qBound(10, keys.value(QLatin1String("frame"), QLatin1String("20")).toInt(), 60);
+	iPayload = qBound(16, keys.value(QLatin1String("payload"), QLatin1String("60")).toInt(), 500);
+	iSpawnRate = qMax(1, keys.value(QLatin1String("spawnrate"), QLatin1String("200")).toInt());
+	iDuration = qMax(1, keys.value(QLatin1String("duration"), QLatin1String("60")).toInt());
+	iInterval = qMax(1, keys.value(QLatin1String("interval"), QLatin1String("5")).toInt());
+	qsPassword = keys.value(QLatin1String("password"));
+}
+
+int Scenario::clients() const {
+	int n = 0;
+	foreach(int size, qlChannelSizes)
+		n += size;
+	return n;
+}
+
+// Latency histogram with log-linear microsecond buckets: exact below 16us,
+// then eight buckets per power of two, so percentiles are within 12.5%.
+class LatencyHistogram {
+	public:
+		static const int iBuckets = 16 + 32 * 8;
+		quint64 uiBuckets[iBuckets];
+		quint64 uiCount;
+		quint64 uiMax;
+
+		LatencyHistogram() {
+			reset();
+		}
+		void reset();
+		void add(quint64 usec);
+		void add(const LatencyHistogram &other);
+		quint64 percentile(double q) const;
+		static int bucket(quint64 usec);
+		static quint64 lowerBound(int bucket);
+};
+
+void LatencyHistogram::reset() {
+	memset(uiBuckets, 0, sizeof(uiBuckets));
+	uiCount = uiMax = 0;
+}
+
+int LatencyHistogram::bucket(quint64 usec) {
+	if (usec < 16)
+		return static_cast<int>(usec);
+	if (usec >> 36)
+		return iBuckets - 1;
+	int magnitude = 4;
+	while (usec >> (magnitude + 1))
+		++magnitude;
+	return 16 + (magnitude - 4) * 8 + (static_cast<int>(usec >> (magnitude - 3)) & 7);
+}
+
+quint64 LatencyHistogram::lowerBound(int b) {
+	if (b < 16)
+		return b;
+	const int magnitude = 4 + (b - 16) / 8;
+	return (1ULL << magnitude) + static_cast<quint64>((b - 16) % 8) * (1ULL << (magnitude - 3));
+}
+
+void LatencyHistogram::add(quint64 usec) {
+	++uiBuckets[bucket(usec)];
+	++uiCount;
+	uiMax = qMax(uiMax, usec);
+}
+
+void LatencyHistogram::add(const LatencyHistogram &other) {
+	for (int i=0;i<iBuckets;++i)
+		uiBuckets[i] += other.uiBuckets[i];
+	uiCount += other.uiCount;
+	uiMax = qMax(uiMax, other.uiMax);
+}
+
+// Midpoint of the bucket holding the q-th quantile.
+quint64 LatencyHistogram::percentile(double q) const {
+	if (uiCount == 0)
+		return 0;
+	const quint64 rank = qMax(1ULL, static_cast<quint64>(q * static_cast<double>(uiCount) + 0.5));
+	quint64 seen = 0;
+	for (int i=0;i<iBuckets;++i) {
+		seen += uiBuckets[i];
+		if (seen >= rank) {
+			if (i < 16)
+				return i;
+			const quint64 lo = lowerBound(i);
+			const quint64 hi = (i + 1 < iBuckets) ? lowerBound(i + 1) : lo * 2;
+			return qMin(uiMax, (lo + hi) / 2);
+		}
+	}
+	return uiMax;
+}
+
+class BenchClient : public QObject {
+	private:
 		Q_OBJECT
+		Q_DISABLE_COPY(BenchClient)
 	public:
-		bool udp;
-		bool sender;
-		struct sockaddr_in srv;
+		enum State { Offline, Connecting, Syncing, Ready };
+
+		Bench *b;
+		int iIndex;
+		int iChannelIndex;
+		bool bControl;
+		bool bTcpOnly;
+		State sState;
 		unsigned int uiSession;
-		CryptState crypt;
-		int rcvd;
-		int socket;
-		int seq;
-		void run();
-		void ping();
-		void sendVoice();
-		int numbytes;
-		int ptype;
-		QSslSocket *ssl;
-		Client(QObject *parent, QHostAddress srvaddr, unsigned short prt, bool send, bool tcponly);
-		void doUdp(const unsigned char *buffer, int size);
+
+		bool bTalking;
+		bool bWhisper;
+		QList<unsigned int> qlWhisperSessions;
+		quint64 uiNextFrame;
+		unsigned int uiSequence;
+
+		QSslSocket *qssSocket;
+		int iPacketLength;
+		unsigned int uiPacketType;
+
+		int sUdp;
+		CryptState *csCrypt;
+		// Put in front of UDP packets until the server answers over UDP.
+		quint32 uiConnectionId;
+		QSocketNotifier *qsnUdp;
+		Timer tPing;
+
+		BenchClient(Bench *bench, int index, int channel, bool control, bool tcponly);
+		~BenchClient();
+
+		void connectToServer();
+		void disconnectFromServer();
 		void sendMessage(const ::google::protobuf::Message &msg, unsigned int msgType);
-		~Client();
+		void sendFrames(int frames);
+		void sendVoiceTarget();
+		void ping();
+		void readUdp();
+		void handleVoice(const unsigned char *data, int len);
+	protected:
+		void openUdp();
+		void closeUdp();
+		void handleMessage(unsigned int type, const QByteArray &qba);
+		int buildFrame(unsigned char *buffer);
 	public slots:
+		void encrypted();
+		void sslErrors(const QList<QSslError> &);
 		void readyRead();
 		void disconnected();
+		void udpReadyRead();
 };
 
-Client::Client(QObject *p, QHostAddress qha, unsigned short prt, bool send, bool tcponly) : QThread(p) {
-	srv.sin_family = AF_INET;
-	srv.sin_addr.s_addr = htonl(qha.toIPv4Address());
-	srv.sin_port = htons(prt);
+class Bench : public QObject {
+	private:
+		Q_OBJECT
+		Q_DISABLE_COPY(Bench)
+	public:
+		enum Phase { Setup, Spawning, Running };
+
+		Scenario s;
+		QHostAddress qhaServer;
+		quint16 usPort;
+		struct sockaddr_storage ssServer;
+		int iServerLen;
+		QString qsPrefix;
+
+		Phase pPhase;
+		BenchClient *bcControl;
+		QList<BenchClient *> qlClients;
+		QHash<unsigned int, BenchClient *> qhSessions;
+		QHash<QString, int> qhChannelIds;
+		QList<int> qlChannels;
+		QVector<int> qvReady;
+		bool bLinked;
+		int iSpawned;
+		double dChurnCredit;
+
+		QTimer qtTick;
+		Timer tPhase, tReport, tTalkSpurt, tSpawn;
+#ifdef Q_OS_LINUX
+		int iEpoll;
+		QSocketNotifier *qsnEpoll;
+#endif
 
-	udp = ! tcponly;
-	sender = send;
+		// Totals for the measurement, and for the current report interval.
+		quint64 uiSent, uiExpected, uiReceived, uiBytes;
+		quint64 uiIntervalSent, uiIntervalExpected, uiIntervalReceived, uiIntervalBytes;
+		quint64 uiJoins, uiLeaves, uiRejects;
+		LatencyHistogram lhInterval, lhTotal;
+
+		Bench(const Scenario &scenario, const QHostAddress &host, quint16 port);
+		~Bench();
+
+		void watchUdp(BenchClient *bc);
+		void unwatchUdp(BenchClient *bc);
+		void clientReady(BenchClient *bc);
+		void clientGone(BenchClient *bc);
+		void controlReady();
+		void channelState(const MumbleProto::ChannelState &msg);
+		void rejected(BenchClient *bc, const QString &reason);
+		void received(quint64 latency, int bytes);
+		int expectedReceivers(const BenchClient *bc) const;
+		int whisperChannel(int channelIndex) const;
+		int linkedChannel(int channelIndex) const;
+	protected:
+		void checkChannels();
+		void startRunning();
+		void pickTalkers();
+		void churn(double seconds);
+		void report();
+		void finish();
+	public slots:
+		void tick();
+		void epollReady();
+};
 
-	ssl = new QSslSocket(this);
+BenchClient::BenchClient(Bench *bench, int index, int channel, bool control, bool tcponly) : QObject(bench) {
+	b = bench;
+	iIndex = index;
+	iChannelIndex = channel;
+	bControl = control;
+	bTcpOnly = tcponly;
+	sState = Offline;
+	uiSession = 0;
+	bTalking = bWhisper = false;
+	uiNextFrame = 0;
+	uiSequence = 0;
+	qssSocket = NULL;
+	iPacketLength = -1;
+	uiPacketType = 0;
+	sUdp = -1;
+	qsnUdp = NULL;
+	csCrypt = new CryptState();
+	uiConnectionId = 0;
+}
 
-	connect(ssl, SIGNAL(readyRead()), this, SLOT(readyRead()));
-	connect(ssl, SIGNAL(disconnected()), this, SLOT(disconnected()));
+BenchClient::~BenchClient() {
+	closeUdp();
+	delete csCrypt;
+}
 
-	ssl->setProtocol(QSsl::TlsV1);
-	ssl->connectToHostEncrypted(qha.toString(), prt);
-	ssl->ignoreSslErrors();
-	if (! ssl->waitForEncrypted())
-		qFatal("Connection failure");
+void BenchClient::connectToServer() {
+	if (qssSocket)
+		qssSocket->deleteLater();
 
-	static int ctr = 1;
+	qssSocket = new QSslSocket(this);
+	iPacketLength = -1;
+	sState = Connecting;
+	delete csCrypt;
+	csCrypt = new CryptState();
+	uiConnectionId = 0;
 
-#ifdef Q_OS_WIN
-	DWORD pid = GetCurrentProcessId();
-	wchar_t buf[64];
-	DWORD bufsize = 64;
-	GetComputerName(buf, &bufsize);
+	connect(qssSocket, SIGNAL(encrypted()), this, SLOT(encrypted()));
+	connect(qssSocket, SIGNAL(sslErrors(const QList<QSslError> &)), this, SLOT(sslErrors(const QList<QSslError> &)));
+	connect(qssSocket, SIGNAL(readyRead()), this, SLOT(readyRead()));
+	connect(qssSocket, SIGNAL(disconnected()), this, SLOT(disconnected()));
 
-	QString name = QString("%1.%2").arg(QString::fromWCharArray(buf)).arg(pid * 1000 + ctr);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+	qssSocket->setProtocol(QSsl::TlsV1_0);
 #else
-	struct utsname uts;
-	uname(&uts);
-
-	QString name = QString("%1.%2").arg(uts.nodename).arg(getpid() * 1000 + ctr);
+	qssSocket->setProtocol(QSsl::TlsV1);
 #endif
+	qssSocket->connectToHostEncrypted(b->qhaServer.toString(), b->usPort);
+}
 
-	ctr++;
+void BenchClient::disconnectFromServer() {
+	closeUdp();
+	if (qssSocket) {
+		qssSocket->disconnect(this);
+		qssSocket->abort();
+		qssSocket->deleteLater();
+		qssSocket = NULL;
+	}
+	if (sState != Offline) {
+		sState = Offline;
+		b->clientGone(this);
+	}
+}
 
-	MumbleProto::Version mpv;
-	mpv.set_release(u8(QLatin1String("1.2.1 Benchmark")));
-	mpv.set_version(0x010203);
+void BenchClient::sslErrors(const QList<QSslError> &) {
+	qssSocket->ignoreSslErrors();
+}
 
+void BenchClient::encrypted() {
+	sState = Syncing;
+
+	MumbleProto::Version mpv;
+	mpv.set_release(u8(QLatin1String("Benchmark")));
+	mpv.set_version(0x010205);
 	sendMessage(mpv, MessageHandler::Version);
 
 	MumbleProto::Authenticate mpa;
-	mpa.set_username(u8(name));
-
+	if (bControl && ! b->s.qsPassword.isEmpty()) {
+		mpa.set_username("SuperUser");
+		mpa.set_password(u8(b->s.qsPassword));
+	} else {
+		mpa.set_username(u8(QString::fromLatin1("%1-%2").arg(b->qsPrefix).arg(bControl ? QString::fromLatin1("control") : QString::number(iIndex))));
+	}
+	mpa.set_opus(true);
 	sendMessage(mpa, MessageHandler::Authenticate);
+}
+
+void BenchClient::sendMessage(const ::google::protobuf::Message &msg, unsigned int msgType) {
+	if (! qssSocket)
+		return;
 
-	if (udp)
-		socket = ::socket(PF_INET, SOCK_DGRAM, 0);
+	QByteArray qba;
+	const int len = msg.ByteSize();
+	qba.resize(len + 6);
+	unsigned char *uc = reinterpret_cast<unsigned char *>(qba.data());
+	qToBigEndian<quint16>(static_cast<quint16>(msgType), & uc[0]);
+	qToBigEndian<quint32>(static_cast<quint32>(len), & uc[2]);
+	msg.SerializeToArray(uc + 6, len);
 
-	seq = 0;
-	rcvd = 0;
-	numbytes = -1;
+	qssSocket->write(qba);
 }
 
-Client::~Client() {
-	terminate();
-	wait();
+void BenchClient::readyRead() {
+	while (qssSocket) {
+		qint64 avail = qssSocket->bytesAvailable();
+		if (iPacketLength == -1) {
+			if (avail < 6)
+				return;
+			unsigned char hdr[6];
+			qssSocket->read(reinterpret_cast<char *>(hdr), 6);
+			uiPacketType = qFromBigEndian<quint16>(& hdr[0]);
+			iPacketLength = qFromBigEndian<quint32>(& hdr[2]);
+			avail -= 6;
+		}
+		if (avail < iPacketLength)
+			return;
+
+		const QByteArray qba = qssSocket->read(iPacketLength);
+		iPacketLength = -1;
+		handleMessage(uiPacketType, qba);
+	}
+}
+
+void BenchClient::handleMessage(unsigned int type, const QByteArray &qba) {
+	switch (type) {
+		case MessageHandler::UDPTunnel:
+			handleVoice(reinterpret_cast<const unsigned char *>(qba.constData()), qba.size());
+			break;
+		case MessageHandler::CryptSetup: {
+				MumbleProto::CryptSetup msg;
+				if (! msg.ParseFromArray(qba.constData(), qba.size()))
+					break;
+				if (msg.has_key() && msg.has_client_nonce() && msg.has_server_nonce()) {
+					const std::string &key = msg.key();
+					const std::string &client_nonce = msg.client_nonce();
+					const std::string &server_nonce = msg.server_nonce();
+					if (key.size() == AES_BLOCK_SIZE && client_nonce.size() == AES_BLOCK_SIZE && server_nonce.size() == AES_BLOCK_SIZE) {
+						csCrypt->setKey(reinterpret_cast<const unsigned char *>(key.data()), reinterpret_cast<const unsigned char *>(client_nonce.data()), reinterpret_cast<const unsigned char *>(server_nonce.data()));
+						uiConnectionId = (msg.has_connection_id() && ! b->s.bLegacyUdp) ? msg.connection_id() : 0;
+					}
+				} else if (msg.has_server_nonce()) {
+					const std::string &server_nonce = msg.server_nonce();
+					if (server_nonce.size() == AES_BLOCK_SIZE) {
+						csCrypt->uiResync++;
+						memcpy(csCrypt->decrypt_iv, server_nonce.data(), AES_BLOCK_SIZE);
+					}
+				} else {
+					MumbleProto::CryptSetup mpcs;
+					mpcs.set_client_nonce(std::string(reinterpret_cast<const char *>(csCrypt->encrypt_iv), AES_BLOCK_SIZE));
+					sendMessage(mpcs, MessageHandler::CryptSetup);
+				}
+				break;
+			}
+		case MessageHandler::ChannelState: {
+				if (! bControl)
+					break;
+				MumbleProto::ChannelState msg;
+				if (msg.ParseFromArray(qba.constData(), qba.size()))
+					b->channelState(msg);
+				break;
+			}
+		case MessageHandler::ServerSync: {
+				MumbleProto::ServerSync msg;
+				if (! msg.ParseFromArray(qba.constData(), qba.size()))
+					break;
+				uiSession = msg.session();
+				sState = Ready;
+				if (! bTcpOnly && ! bControl)
+					openUdp();
+				if (bControl)
+					b->controlReady();
+				else
+					b->clientReady(this);
+				break;
+			}
+		case MessageHandler::Reject: {
+				MumbleProto::Reject msg;
+				msg.ParseFromArray(qba.constData(), qba.size());
+				b->rejected(this, u8(msg.reason()));
+				break;
+			}
+		case MessageHandler::PermissionDenied: {
+				MumbleProto::PermissionDenied msg;
+				if (msg.ParseFromArray(qba.constData(), qba.size()) && bControl)
+					qWarning("Permission denied: %s", msg.reason().c_str());
+				break;
+			}
+		default:
+			break;
+	}
 }
 
-void Client::sendMessage(const ::google::protobuf::Message &msg, unsigned int msgType) {
-	unsigned char uc[4096];
-	int len = msg.ByteSize();
-	Q_ASSERT(len < 4090);
+void BenchClient::disconnected() {
+	disconnectFromServer();
+}
 
-	* reinterpret_cast<quint16 *>(& uc[0]) = qToBigEndian(static_cast<quint16>(msgType));
-	* reinterpret_cast<quint32 *>(& uc[2]) = qToBigEndian(static_cast<quint32>(len));
+void BenchClient::openUdp() {
+	sUdp = static_cast<int>(::socket(b->ssServer.ss_family, SOCK_DGRAM, 0));
+	if (sUdp < 0) {
+		qWarning("Failed to create UDP socket: %d", errno);
+		bTcpOnly = true;
+		return;
+	}
+#ifdef Q_OS_WIN
+	u_long nonblock = 1;
+	::ioctlsocket(sUdp, FIONBIO, &nonblock);
+#else
+	::fcntl(sUdp, F_SETFL, ::fcntl(sUdp, F_GETFL) | O_NONBLOCK);
+#endif
+	::connect(sUdp, reinterpret_cast<const struct sockaddr *>(& b->ssServer), b->iServerLen);
 
-	msg.SerializeToArray(uc + 6, len);
+#ifdef Q_OS_LINUX
+	b->watchUdp(this);
+#else
+	qsnUdp = new QSocketNotifier(sUdp, QSocketNotifier::Read, this);
+	connect(qsnUdp, SIGNAL(activated(int)), this, SLOT(udpReadyRead()));
+#endif
 
-	ssl->write(reinterpret_cast<const char *>(uc), len + 6);
+	// The server learns our UDP address from the first packet it can decrypt.
+	ping();
 }
 
-void Client::ping() {
-	unsigned char buffer[256];
-	buffer[0] = MessageHandler::UDPPing << 5;
-	PacketDataStream pds(buffer + 1, 255);
-	pds << 123;
+void BenchClient::closeUdp() {
+	if (sUdp < 0)
+		return;
+#ifdef Q_OS_LINUX
+	b->unwatchUdp(this);
+#endif
+	delete qsnUdp;
+	qsnUdp = NULL;
+	CLOSESOCKET(sUdp);
+	sUdp = -1;
+}
 
-	doUdp(buffer, pds.size() + 1);
+void BenchClient::ping() {
+	tPing.restart();
 
 	MumbleProto::Ping mpp;
-	mpp.set_timestamp(123);
+	mpp.set_timestamp(tEpoch.elapsed());
 	sendMessage(mpp, MessageHandler::Ping);
+
+	if ((sUdp < 0) || ! csCrypt->isValid())
+		return;
+
+	unsigned char buffer[64];
+	unsigned char crypted[64 + 8];
+	buffer[0] = MessageHandler::UDPPing << 5;
+	PacketDataStream pds(buffer + 1, sizeof(buffer) - 1);
+	pds << tEpoch.elapsed();
+
+	const int len = pds.size() + 1;
+	const int hintlen = uiConnectionId ? 4 : 0;
+	if (hintlen)
+		qToBigEndian<quint32>(uiConnectionId, crypted);
+	csCrypt->encrypt(buffer, crypted + hintlen, len);
+	::send(sUdp, reinterpret_cast<const char *>(crypted), len + 4 + hintlen, 0);
+}
+
+void BenchClient::sendVoiceTarget() {
+	MumbleProto::VoiceTarget mpvt;
+	mpvt.set_id(bWhisper && b->s.bWhisperUsers ? 2 : 1);
+	MumbleProto::VoiceTarget_Target *t = mpvt.add_targets();
+	if (b->s.bWhisperUsers) {
+		foreach(unsigned int session, qlWhisperSessions)
+			t->add_session(session);
+	} else {
+		t->set_channel_id(b->qlChannels.at(b->whisperChannel(iChannelIndex)));
+	}
+	sendMessage(mpvt, MessageHandler::VoiceTarget);
 }
 
-void Client::sendVoice() {
-	unsigned char buffer[1024];
-	int len = 32 + (qrand() & 0x3f);
+int BenchClient::buildFrame(unsigned char *buffer) {
+	unsigned int target = 0;
+	if (bWhisper)
+		target = b->s.bWhisperUsers ? 2 : 1;
+
+	buffer[0] = static_cast<unsigned char>((MessageHandler::UDPVoiceOpus << 5) | target);
+	PacketDataStream pds(buffer + 1, UDP_SIZE - 1);
+	pds << uiSequence;
+	pds << b->s.iPayload;
 
-	// Regular voice, nothing special
-	buffer[0] = 0;
+	const quint64 now = tEpoch.elapsed();
+	pds.append(reinterpret_cast<const char *>(&now), sizeof(now));
+	pds.skip(b->s.iPayload - sizeof(now));
 
-	PacketDataStream ods(buffer + 1, 1024);
-	ods << 1;
-	ods.append(len);
-	ods.skip(len);
+	if (b->s.bPositional)
+		pds << static_cast<float>(iIndex) << 0.0f << static_cast<float>(uiSequence % 100);
 
-	doUdp(buffer, ods.size() + 1);
+	uiSequence += b->s.iFrame / 10;
+	return pds.size() + 1;
 }
 
-void Client::doUdp(const unsigned char *buffer, int size) {
-	if (! udp || ! crypt.isValid())
+void BenchClient::sendFrames(int frames) {
+	unsigned char plain[UDP_BATCH][UDP_SIZE];
+	unsigned char crypted[UDP_BATCH][UDP_SIZE + 8];
+	int lens[UDP_BATCH];
+
+	frames = qMin(frames, UDP_BATCH);
+	for (int i=0;i<frames;++i)
+		lens[i] = buildFrame(plain[i]);
+
+	if ((sUdp < 0) || ! csCrypt->isValid()) {
+		// TCP fallback: voice is tunneled through the control channel.
+		for (int i=0;i<frames;++i) {
+			QByteArray qba;
+			qba.resize(lens[i] + 6);
+			unsigned char *uc = reinterpret_cast<unsigned char *>(qba.data());
+			qToBigEndian<quint16>(MessageHandler::UDPTunnel, & uc[0]);
+			qToBigEndian<quint32>(lens[i], & uc[2]);
+			memcpy(uc + 6, plain[i], lens[i]);
+			qssSocket->write(qba);
+		}
 		return;
+	}
 
-	unsigned char crypted[2048];
+	const int hintlen = uiConnectionId ? 4 : 0;
+	for (int i=0;i<frames;++i) {
+		if (hintlen)
+			qToBigEndian<quint32>(uiConnectionId, crypted[i]);
+		csCrypt->encrypt(plain[i], crypted[i] + hintlen, lens[i]);
+		lens[i] += hintlen;
+	}
 
-	crypt.encrypt(reinterpret_cast<const unsigned char *>(buffer), crypted, size);
-	::sendto(socket, reinterpret_cast<const char *>(crypted), size+4, 0, reinterpret_cast<struct sockaddr *>(&srv), sizeof(srv));
+#ifdef Q_OS_LINUX
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	memset(msgs, 0, sizeof(msgs));
+	for (int i=0;i<frames;++i) {
+		iov[i].iov_base = crypted[i];
+		iov[i].iov_len = lens[i] + 4;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	int done = 0;
+	while (done < frames) {
+		int ret = ::sendmmsg(sUdp, msgs + done, frames - done, 0);
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+#else
+	for (int i=0;i<frames;++i)
+		::send(sUdp, reinterpret_cast<const char *>(crypted[i]), lens[i] + 4, 0);
+#endif
 }
 
+void BenchClient::udpReadyRead() {
+	readUdp();
+}
 
-void Client::run() {
-	unsigned char buffer[1024];
-	struct sockaddr_in addr;
-	socklen_t sz;
-	int len;
+void BenchClient::readUdp() {
+	unsigned char plain[UDP_SIZE];
 
-	if (! udp)
-		return;
+#ifdef Q_OS_LINUX
+	static unsigned char buffers[UDP_BATCH][UDP_SIZE + 4];
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
 
 	forever {
-		sz = sizeof(addr);
-		len = ::recvfrom(socket, reinterpret_cast<char *>(buffer), 1024, 0, reinterpret_cast<struct sockaddr *>(&addr), &sz);
-		if (len <= 0)
-			break;
-		if (len >= 32)
-			rcvd++;
+		memset(msgs, 0, sizeof(msgs));
+		for (int i=0;i<UDP_BATCH;++i) {
+			iov[i].iov_base = buffers[i];
+			iov[i].iov_len = UDP_SIZE + 4;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		int ret = ::recvmmsg(sUdp, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+		if (ret <= 0)
+			return;
+		for (int i=0;i<ret;++i) {
+			const int len = static_cast<int>(msgs[i].msg_len);
+			if ((len > 4) && csCrypt->decrypt(buffers[i], plain, len)) {
+				uiConnectionId = 0;
+				handleVoice(plain, len - 4);
+			}
+		}
+		if (ret < UDP_BATCH)
+			return;
 	}
+#else
+	unsigned char buffer[UDP_SIZE + 4];
+	forever {
+		int len = ::recv(sUdp, reinterpret_cast<char *>(buffer), sizeof(buffer), 0);
+		if (len <= 4)
+			return;
+		if (csCrypt->decrypt(buffer, plain, len)) {
+			uiConnectionId = 0;
+			handleVoice(plain, len - 4);
+		}
+	}
+#endif
 }
 
-void Client::readyRead() {
-	forever {
-		int avail = ssl->bytesAvailable();
-		if (numbytes == -1) {
-			if (avail < 6)
-				break;
-			unsigned char b[6];
-			ssl->read(reinterpret_cast<char *>(b), 6);
+void BenchClient::handleVoice(const unsigned char *data, int len) {
+	if (len < 2)
+		return;
+	if (((data[0] >> 5) & 0x7) != MessageHandler::UDPVoiceOpus)
+		return;
 
-			ptype = qFromBigEndian(* reinterpret_cast<quint16 *>(& b[0]));
-			numbytes = qFromBigEndian(* reinterpret_cast<quint32 *>(& b[2]));
+	PacketDataStream pds(data + 1, len - 1);
+	unsigned int session, sequence;
+	quint64 size;
+	pds >> session >> sequence >> size;
+	size &= 0x1fff;
 
-			avail = ssl->bytesAvailable();
-		}
-		if ((numbytes >= 0) && (avail >= numbytes)) {
-			int want = numbytes;
-			numbytes = -1;
-			unsigned char buff[65536];
-			Q_ASSERT(want < 65536);
-			ssl->read(reinterpret_cast<char *>(buff), want);
-
-
-			avail = ssl->bytesAvailable();
-
-			switch (ptype) {
-				case MessageHandler::CryptSetup: {
-						MumbleProto::CryptSetup msg;
-						if (! msg.ParseFromArray(buff, want))
-							qFatal("Failed parse crypt");
-
-						if (msg.has_key() && msg.has_client_nonce() && msg.has_server_nonce()) {
-							const std::string &key = msg.key();
-							const std::string &client_nonce = msg.client_nonce();
-							const std::string &server_nonce = msg.server_nonce();
-							if (key.size() == AES_BLOCK_SIZE && client_nonce.size() == AES_BLOCK_SIZE && server_nonce.size() == AES_BLOCK_SIZE)
-								crypt.setKey(reinterpret_cast<const unsigned char *>(key.data()), reinterpret_cast<const unsigned char *>(client_nonce.data()), reinterpret_cast<const unsigned char *>(server_nonce.data()));
-						} else if (msg.has_server_nonce()) {
-							const std::string &server_nonce = msg.server_nonce();
-							if (server_nonce.size() == AES_BLOCK_SIZE) {
-								crypt.uiResync++;
-								memcpy(crypt.decrypt_iv, server_nonce.data(), AES_BLOCK_SIZE);
-							}
-						} else {
-							MumbleProto::CryptSetup mpcs;
-							mpcs.set_client_nonce(std::string(reinterpret_cast<const char *>(crypt.encrypt_iv), AES_BLOCK_SIZE));
-							sendMessage(mpcs, MessageHandler::CryptSetup);
-						}
-						break;
-					}
-				case MessageHandler::ServerSync: {
-						MumbleProto::ServerSync msg;
-						if (! msg.ParseFromArray(buff, want))
-							qFatal("Failed parse sync");
-						uiSession = msg.session();
-						break;
-					}
-				case MessageHandler::UDPTunnel: {
-						unsigned int msgUDPType = (buff[0] >> 5) & 0x7;
-						if (msgUDPType == MessageHandler::UDPVoiceCELTAlpha)
-							rcvd++;
-						break;
-					}
-			}
-		} else {
-			break;
+	quint64 sent;
+	if (! pds.isValid() || (size < sizeof(sent)) || (pds.left() < sizeof(sent)))
+		return;
+	memcpy(&sent, pds.charPtr(), sizeof(sent));
+
+	b->received(tEpoch.elapsed() - sent, len);
+}
+
+Bench::Bench(const Scenario &scenario, const QHostAddress &host, quint16 port) : s(scenario) {
+	qhaServer = host;
+	usPort = port;
+
+	memset(&ssServer, 0, sizeof(ssServer));
+	if (host.protocol() == QAbstractSocket::IPv6Protocol) {
+		struct sockaddr_in6 *sin6 = reinterpret_cast<struct sockaddr_in6 *>(&ssServer);
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		Q_IPV6ADDR addr = host.toIPv6Address();
+		memcpy(& sin6->sin6_addr, &addr, sizeof(addr));
+		iServerLen = sizeof(struct sockaddr_in6);
+	} else {
+		struct sockaddr_in *sin = reinterpret_cast<struct sockaddr_in *>(&ssServer);
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		sin->sin_addr.s_addr = htonl(host.toIPv4Address());
+		iServerLen = sizeof(struct sockaddr_in);
+	}
+
+	qsPrefix = QString::fromLatin1("bench%1").arg(QCoreApplication::applicationPid());
+
+	pPhase = Setup;
+	bLinked = false;
+	iSpawned = 0;
+	dChurnCredit = 0.0;
+	uiSent = uiExpected = uiReceived = uiBytes = 0;
+	uiIntervalSent = uiIntervalExpected = uiIntervalReceived = uiIntervalBytes = 0;
+	uiJoins = uiLeaves = uiRejects = 0;
+
+	for (int i=0;i<s.qlChannelSizes.count();++i)
+		qlChannels << -1;
+	qvReady.fill(0, s.qlChannelSizes.count());
+
+#ifdef Q_OS_LINUX
+	iEpoll = ::epoll_create(1024);
+	if (iEpoll < 0)
+		qFatal("epoll_create failed: %d", errno);
+	qsnEpoll = new QSocketNotifier(iEpoll, QSocketNotifier::Read, this);
+	connect(qsnEpoll, SIGNAL(activated(int)), this, SLOT(epollReady()));
+#endif
+
+	int index = 0;
+	for (int c=0;c<s.qlChannelSizes.count();++c) {
+		for (int i=0;i<s.qlChannelSizes.at(c);++i) {
+			// Spread TCP only users evenly over all channels.
+			const bool tcponly = (static_cast<int>((index + 1) * s.dTcpOnly) != static_cast<int>(index * s.dTcpOnly));
+			qlClients << new BenchClient(this, index, c, false, tcponly);
+			++index;
 		}
 	}
+
+	qWarning("Scenario: %d users in %d channels, %.0f%% talking, %.0f%% TCP only, %.0f%% whispering to %s%s%s, churn %.1f/s",
+	         s.clients(), s.qlChannelSizes.count(), s.dTalkers * 100.0, s.dTcpOnly * 100.0, s.dWhisper * 100.0,
+	         s.bWhisperUsers ? "users" : "channels", s.bPositional ? ", positional" : "", s.bLinks ? ", linked" : "", s.dChurn);
+
+	bcControl = new BenchClient(this, -1, -1, true, true);
+	bcControl->connectToServer();
+
+	connect(&qtTick, SIGNAL(timeout()), this, SLOT(tick()));
+	qtTick.start(qMin(10, s.iFrame / 2));
 }
 
-void Client::disconnected() {
-	qWarning("SSL Socket disconnected");
-	QCoreApplication::instance()->quit();
+Bench::~Bench() {
+	qDeleteAll(qlClients);
+	qlClients.clear();
+#ifdef Q_OS_LINUX
+	delete qsnEpoll;
+	CLOSESOCKET(iEpoll);
+#endif
 }
 
-class Container : public QObject {
-		Q_OBJECT
-	public:
-		int sent;
-		int numsender, numudplistener, numtcplistener;
-		int isender, iudplistener, itcplistener;
-		bool live, forceping;
-		QHostAddress qha;
-		unsigned short port;
-		QTimer qtTick;
-		Timer tickPing, tickVoice, tickGo, tickSpawn;
-		QList<Client *> speakers;
-		QList<Client *> clients;
-		Container(QHostAddress srvaddr, unsigned short port, int nsend, int nudp, int ntcp);
-	public slots:
-		void tick();
-		void go();
-};
+void Bench::watchUdp(BenchClient *bc) {
+#ifdef Q_OS_LINUX
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = bc;
+	if (::epoll_ctl(iEpoll, EPOLL_CTL_ADD, bc->sUdp, &ev) != 0)
+		qWarning("epoll_ctl failed: %d", errno);
+#else
+	Q_UNUSED(bc);
+#endif
+}
+
+void Bench::unwatchUdp(BenchClient *bc) {
+#ifdef Q_OS_LINUX
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	::epoll_ctl(iEpoll, EPOLL_CTL_DEL, bc->sUdp, &ev);
+#else
+	Q_UNUSED(bc);
+#endif
+}
 
-Container::Container(QHostAddress qha, unsigned short port, int numsend, int numudp, int numtcp) {
-	isender = iudplistener = itcplistener = 0;
-	live = false;
-	forceping = false;
-	sent = 0;
+void Bench::epollReady() {
+#ifdef Q_OS_LINUX
+	struct epoll_event events[256];
+	int n;
+	do {
+		n = ::epoll_wait(iEpoll, events, 256, 0);
+		for (int i=0;i<n;++i)
+			static_cast<BenchClient *>(events[i].data.ptr)->readUdp();
+	} while (n == 256);
+#endif
+}
 
-	Timer t;
+void Bench::controlReady() {
+	qWarning("Control connection up as %s", s.qsPassword.isEmpty() ? "guest" : "SuperUser");
+	checkChannels();
+}
 
-	qWarning("Spawning %d speakers and %d listeners (%d UDP, %d TCP)", numsend, numudp+numtcp, numudp, numtcp);
+void Bench::channelState(const MumbleProto::ChannelState &msg) {
+	if (msg.has_name() && msg.has_channel_id())
+		qhChannelIds.insert(u8(msg.name()), msg.channel_id());
+	if (bcControl->sState == BenchClient::Ready)
+		checkChannels();
+}
 
-	this->qha = qha;
-	this->port = port;
+int Bench::linkedChannel(int ci) const {
+	if (! s.bLinks || ! bLinked)
+		return -1;
+	const int other = ci ^ 1;
+	return (other < qlChannels.count()) ? other : -1;
+}
 
-	numsender = numsend;
-	numudplistener = numudp;
-	numtcplistener = numtcp;
+int Bench::whisperChannel(int ci) const {
+	return (ci + 1) % qlChannels.count();
+}
 
+// Resolves the bench channels, creating missing ones when possible, and
+// starts spawning users once all are known.
+void Bench::checkChannels() {
+	if (pPhase != Setup)
+		return;
 
-	connect(&qtTick, SIGNAL(timeout()), this, SLOT(tick()));
-	qtTick.start(0);
+	bool missing = false;
+	for (int i=0;i<qlChannels.count();++i) {
+		const QString name = QString::fromLatin1("bench-%1").arg(i + 1);
+		if (qhChannelIds.contains(name)) {
+			qlChannels[i] = qhChannelIds.value(name);
+			continue;
+		}
+		missing = true;
+		if ((qlChannels.at(i) == -1) && ! s.qsPassword.isEmpty()) {
+			MumbleProto::ChannelState mpcs;
+			mpcs.set_parent(0);
+			mpcs.set_name(u8(name));
+			bcControl->sendMessage(mpcs, MessageHandler::ChannelState);
+			qlChannels[i] = -2;
+		}
+	}
+
+	if (missing) {
+		if (! s.qsPassword.isEmpty())
+			return;
+		qWarning("Bench channels missing and no SuperUser password given; using the root channel");
+		for (int i=0;i<qlChannels.count();++i)
+			qlChannels[i] = 0;
+	}
+
+	if (s.bLinks && ! s.qsPassword.isEmpty() && (qlChannels.count() > 1)) {
+		for (int i=0;i + 1<qlChannels.count();i += 2) {
+			MumbleProto::ChannelState mpcs;
+			mpcs.set_channel_id(qlChannels.at(i));
+			mpcs.add_links_add(qlChannels.at(i + 1));
+			bcControl->sendMessage(mpcs, MessageHandler::ChannelState);
+		}
+		bLinked = true;
+	} else if (s.bLinks) {
+		qWarning("Linking channels needs a SuperUser password; not linking");
+	}
 
-	tickSpawn.restart();
+	pPhase = Spawning;
+	tSpawn.restart();
+	tPhase.restart();
+	qWarning("Spawning %d users at %d/s", qlClients.count(), s.iSpawnRate);
 }
 
-void Container::tick() {
-	if (forceping || tickPing.isElapsed(5000000ULL)) {
-		forceping = false;
+void Bench::clientReady(BenchClient *bc) {
+	++uiJoins;
+	qhSessions.insert(bc->uiSession, bc);
+	++qvReady[bc->iChannelIndex];
+
+	const int channel = qlChannels.at(bc->iChannelIndex);
+	MumbleProto::UserState mpus;
+	mpus.set_session(bc->uiSession);
+	if (channel != 0)
+		mpus.set_channel_id(channel);
+	if (s.bPositional)
+		mpus.set_plugin_context(std::string("Benchmark"));
+	if (mpus.has_channel_id() || mpus.has_plugin_context())
+		bc->sendMessage(mpus, MessageHandler::UserState);
+
+	if (bc->bWhisper)
+		bc->sendVoiceTarget();
+
+	if ((pPhase == Spawning) && (qhSessions.count() == qlClients.count()))
+		startRunning();
+}
 
-		foreach(Client *c, clients)
-			c->ping();
+void Bench::clientGone(BenchClient *bc) {
+	if (bc == bcControl) {
+		qWarning("Control connection lost");
+		QCoreApplication::instance()->exit(1);
+		return;
+	}
+	if (qhSessions.value(bc->uiSession) == bc) {
+		qhSessions.remove(bc->uiSession);
+		--qvReady[bc->iChannelIndex];
+		++uiLeaves;
+	}
+}
 
-		if (live) {
+void Bench::rejected(BenchClient *bc, const QString &reason) {
+	++uiRejects;
+	qWarning("User %d rejected: %s", bc->iIndex, qPrintable(reason));
+	if (bc == bcControl)
+		QCoreApplication::instance()->exit(1);
+}
 
-			int lost = 0;
-			quint64 totrcv = 0;
-			int nrcv = 0;
-			foreach(Client *c, clients) {
-				if (! c->sender) {
-					totrcv += c->rcvd;
-					lost += sent - c->rcvd;
-					nrcv++;
-				}
+void Bench::startRunning() {
+	qWarning("%d users joined in %.1f s; measuring for %d s", qhSessions.count(), tSpawn.elapsed() / 1000000.0, s.iDuration);
+	pPhase = Running;
+	pickTalkers();
+
+	uiSent = uiExpected = uiReceived = uiBytes = 0;
+	uiIntervalSent = uiIntervalExpected = uiIntervalReceived = uiIntervalBytes = 0;
+	uiJoins = uiLeaves = 0;
+	lhInterval.reset();
+	lhTotal.reset();
+	tPhase.restart();
+	tReport.restart();
+}
+
+// Picks the talkers of every channel for the next talk spurt.
+void Bench::pickTalkers() {
+	tTalkSpurt.restart();
+
+	QVector<QList<BenchClient *> > members(qlChannels.count());
+	foreach(BenchClient *bc, qlClients) {
+		bc->bTalking = bc->bWhisper = false;
+		members[bc->iChannelIndex] << bc;
+	}
+
+	const QList<unsigned int> sessions = qhSessions.keys();
+	const quint64 now = tEpoch.elapsed();
+
+	for (int c=0;c<members.count();++c) {
+		QList<BenchClient *> &ql = members[c];
+		int talkers = static_cast<int>(ql.count() * s.dTalkers + 0.5);
+		if ((talkers == 0) && (s.dTalkers > 0.0) && ! ql.isEmpty())
+			talkers = 1;
+
+		for (int i=0;i<talkers;++i) {
+			BenchClient *bc = ql.takeAt(qrand() % ql.count());
+			bc->bTalking = true;
+			bc->uiNextFrame = now + (qrand() % s.iFrame) * 1000ULL;
+
+			bc->bWhisper = (s.dWhisper > 0.0) && ((qrand() % 1000) < static_cast<int>(s.dWhisper * 1000.0));
+			bc->qlWhisperSessions.clear();
+			if (bc->bWhisper && s.bWhisperUsers) {
+				for (int j=0;(j < s.iWhisperUsers) && ! sessions.isEmpty();++j)
+					bc->qlWhisperSessions << sessions.at(qrand() % sessions.count());
 			}
-			qWarning("Sent: %8d  Rcvd: %8lld  Lost: %8d   BW: %6.1fMbit/s", sent, totrcv / nrcv, (lost + nrcv - 1) / nrcv, (totrcv * 8.0 * 123.0) / (tickGo.elapsed() * 1.0));
-		} else {
-			qWarning("Spawned %3d/%3d", isender + iudplistener + itcplistener, numsender + numudplistener + numtcplistener);
+			if (bc->bWhisper && (bc->sState == BenchClient::Ready))
+				bc->sendVoiceTarget();
 		}
 	}
+}
 
-	if (live && tickVoice.isElapsed(10000ULL)) {
-		foreach(Client *c, speakers) {
-			sent++;
-			c->sendVoice();
+int Bench::expectedReceivers(const BenchClient *bc) const {
+	if (bc->bWhisper && s.bWhisperUsers) {
+		QSet<unsigned int> targets;
+		foreach(unsigned int session, bc->qlWhisperSessions) {
+			if ((session != bc->uiSession) && qhSessions.contains(session))
+				targets.insert(session);
 		}
+		return targets.count();
+	}
+
+	// All users share the root channel when bench channels are missing.
+	if (qlChannels.at(bc->iChannelIndex) == 0)
+		return qhSessions.count() - 1;
+
+	if (bc->bWhisper) {
+		const int wc = whisperChannel(bc->iChannelIndex);
+		return (wc == bc->iChannelIndex) ? qvReady.at(wc) - 1 : qvReady.at(wc);
+	}
+
+	int n = qvReady.at(bc->iChannelIndex) - 1;
+	const int linked = linkedChannel(bc->iChannelIndex);
+	if (linked >= 0)
+		n += qvReady.at(linked);
+	return n;
+}
+
+void Bench::received(quint64 latency, int bytes) {
+	if (pPhase != Running)
+		return;
+	++uiIntervalReceived;
+	uiIntervalBytes += bytes;
+	lhInterval.add(latency);
+}
+
+void Bench::churn(double seconds) {
+	dChurnCredit += s.dChurn * seconds;
+	while (dChurnCredit >= 1.0) {
+		dChurnCredit -= 1.0;
+		BenchClient *bc = qlClients.at(qrand() % qlClients.count());
+		if (bc->sState != BenchClient::Ready)
+			continue;
+		bc->disconnectFromServer();
+		bc->connectToServer();
+	}
+}
+
+void Bench::tick() {
+	static Timer tLastTick;
+	const double seconds = tLastTick.restart() / 1000000.0;
+
+	if ((bcControl->sState == BenchClient::Ready) && (bcControl->tPing.elapsed() > 5000000ULL))
+		bcControl->ping();
+	foreach(BenchClient *bc, qlClients) {
+		if ((bc->sState == BenchClient::Ready) && (bc->tPing.elapsed() > 5000000ULL))
+			bc->ping();
 	}
-	if (! live) {
-		if (isender < numsender) {
-			// Spawn a sender
-			Client *c = new Client(this, qha, port, true, false);
-			speakers << c;
-			c->start();
-			clients << c;
-			isender++;
-		} else if (iudplistener < numudplistener) {
-			// Spawn a listener which uses UDP
-			Client *c = new Client(this, qha, port, false, false);
-			c->start();
-			clients << c;
-			iudplistener++;
-		} else if (itcplistener < numtcplistener) {
-			// Spawn a listener which uses TCP-only
-			Client *c = new Client(this, qha, port, false, true);
-			c->start();
-			clients << c;
-			itcplistener++;
-		} else {
-			live = true;
-			quint64 elapsed = tickSpawn.elapsed();
-			qWarning("Spawning took %lld ms (%lld us per client)", elapsed / 1000ULL, elapsed / (numsender+numudplistener+numtcplistener));
-			foreach(Client *c, clients)
-				c->rcvd = 0;
-			sent = 0;
-			forceping = true;
-			qtTick.start(10);
+
+	if (pPhase == Spawning) {
+		const int due = qMin(qlClients.count(), static_cast<int>(tSpawn.elapsed() * s.iSpawnRate / 1000000ULL) + 1);
+		while (iSpawned < due)
+			qlClients.at(iSpawned++)->connectToServer();
+
+		if (tReport.isElapsed(s.iInterval * 1000000ULL))
+			qWarning("Joined %d/%d", qhSessions.count(), qlClients.count());
+
+		// Do not wait forever for users the server turned away.
+		const quint64 grace = (qlClients.count() / s.iSpawnRate + 10) * 1000000ULL;
+		if ((iSpawned == qlClients.count()) && (tSpawn.elapsed() > grace)) {
+			qWarning("Only %d of %d users joined", qhSessions.count(), qlClients.count());
+			startRunning();
 		}
+		return;
 	}
+
+	if (pPhase != Running)
+		return;
+
+	if (s.dChurn > 0.0)
+		churn(seconds);
+
+	if (tTalkSpurt.isElapsed(s.iTalkSpurt * 1000000ULL))
+		pickTalkers();
+
+	const quint64 now = tEpoch.elapsed();
+	const quint64 frame = s.iFrame * 1000ULL;
+	foreach(BenchClient *bc, qlClients) {
+		if (! bc->bTalking || (bc->sState != BenchClient::Ready) || (now < bc->uiNextFrame))
+			continue;
+
+		// Frames missed by a late tick go out together in one batch.
+		const int frames = static_cast<int>((now - bc->uiNextFrame) / frame) + 1;
+		bc->uiNextFrame += frames * frame;
+		bc->sendFrames(frames);
+
+		uiIntervalSent += frames;
+		uiIntervalExpected += frames * qMax(0, expectedReceivers(bc));
+	}
+
+	if (tReport.isElapsed(s.iInterval * 1000000ULL))
+		report();
+
+	if (tPhase.elapsed() >= s.iDuration * 1000000ULL)
+		finish();
 }
 
-void Container::go() {
-	foreach(Client *c, clients)
-		c->start();
-	qtTick.start(10);
-	tickGo.restart();
+static double lossPercent(quint64 expected, quint64 received) {
+	if (expected == 0 || received >= expected)
+		return 0.0;
+	return 100.0 * static_cast<double>(expected - received) / static_cast<double>(expected);
+}
+
+void Bench::report() {
+	const double secs = s.iInterval;
+
+	qWarning("Users %5d  Sent %8.0f pkt/s  Rcvd %9.0f pkt/s %7.2f Mbit/s  Loss %5.2f%%  Latency ms p50 %6.2f p90 %6.2f p99 %6.2f p99.9 %6.2f max %6.2f",
+	         qhSessions.count(), uiIntervalSent / secs, uiIntervalReceived / secs, uiIntervalBytes * 8.0 / secs / 1000000.0,
+	         lossPercent(uiIntervalExpected, uiIntervalReceived),
+	         lhInterval.percentile(0.5) / 1000.0, lhInterval.percentile(0.9) / 1000.0, lhInterval.percentile(0.99) / 1000.0,
+	         lhInterval.percentile(0.999) / 1000.0, lhInterval.uiMax / 1000.0);
+
+	uiSent += uiIntervalSent;
+	uiExpected += uiIntervalExpected;
+	uiReceived += uiIntervalReceived;
+	uiBytes += uiIntervalBytes;
+	lhTotal.add(lhInterval);
+
+	uiIntervalSent = uiIntervalExpected = uiIntervalReceived = uiIntervalBytes = 0;
+	lhInterval.reset();
+}
+
+void Bench::finish() {
+	report();
+	qtTick.stop();
+
+	const double secs = tPhase.elapsed() / 1000000.0;
+	printf("RESULT users=%d channels=%d seconds=%.1f sent_pps=%.0f recv_pps=%.0f mbit=%.2f loss_pct=%.3f p50_ms=%.3f p90_ms=%.3f p99_ms=%.3f p999_ms=%.3f max_ms=%.3f joins=%llu leaves=%llu rejects=%llu\n",
+	       qlClients.count(), qlChannels.count(), secs, uiSent / secs, uiReceived / secs, uiBytes * 8.0 / secs / 1000000.0,
+	       lossPercent(uiExpected, uiReceived),
+	       lhTotal.percentile(0.5) / 1000.0, lhTotal.percentile(0.9) / 1000.0, lhTotal.percentile(0.99) / 1000.0,
+	       lhTotal.percentile(0.999) / 1000.0, lhTotal.uiMax / 1000.0,
+	       static_cast<unsigned long long>(uiJoins), static_cast<unsigned long long>(uiLeaves), static_cast<unsigned long long>(uiRejects));
+	fflush(stdout);
+
+	foreach(BenchClient *bc, qlClients)
+		bc->disconnectFromServer();
+	QCoreApplication::instance()->quit();
 }
 
 int main(int argc, char **argv) {
 	QCoreApplication a(argc, argv);
 
-	qWarning("Maximum # sockets is %d", FD_SETSIZE);
+	QStringList args = a.arguments();
+	args.removeFirst();
+	if (args.count() < 2)
+		qFatal("Usage: Benchmark <host> <port> [scenarios.ini] [scenario=<name>] [key=value ...]");
+
+	QHostAddress qha(args.takeFirst());
+	const quint16 port = static_cast<quint16>(args.takeFirst().toUInt());
+	if (qha.isNull())
+		qFatal("Invalid host address");
+
+	QMap<QString, QString> keys;
+	QMap<QString, QString> overrides;
+	QString file;
+	foreach(const QString &arg, args) {
+		const int eq = arg.indexOf(QLatin1Char('='));
+		if (eq > 0)
+			overrides.insert(arg.left(eq).toLower(), arg.mid(eq + 1));
+		else
+			file = arg;
+	}
+
+	if (! file.isEmpty()) {
+		QSettings qs(file, QSettings::IniFormat);
+		const QString scenario = overrides.value(QLatin1String("scenario"));
+		if (! scenario.isEmpty()) {
+			if (! qs.childGroups().contains(scenario))
+				qFatal("No scenario %s in %s", qPrintable(scenario), qPrintable(file));
+			qs.beginGroup(scenario);
+		}
+		foreach(const QString &key, qs.childKeys())
+			keys.insert(key.toLower(), qs.value(key).toStringList().join(QLatin1String(",")));
+	}
+	QMap<QString, QString>::const_iterator i;
+	for (i = overrides.constBegin(); i != overrides.constEnd(); ++i)
+		keys.insert(i.key(), i.value());
 
-	if (argc != 6)
-		qFatal("Invalid number of arguments. These need to be passed: <host address> <port> <numsend> <numudp> <numtcp>");
+#ifndef Q_OS_WIN
+	// Every user needs a TCP and a UDP socket.
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+#endif
 
-	QHostAddress qha = QHostAddress(argv[1]);
-	int port = atoi(argv[2]);
-	int numsender = atoi(argv[3]);
-	int numudplistener = atoi(argv[4]);
-	int numtcplistener = atoi(argv[5]);
+	qsrand(static_cast<uint>(QDateTime::currentDateTime().toTime_t()));
 
-	Container c(qha, port, numsender, numudplistener, numtcplistener);
-	c.go();
-	a.exec();
+	Bench b(Scenario(keys), qha, port);
+	return a.exec();
 }
 
 #include "Benchmark.moc"
@@ -0,0 +1,605 @@
+/**
+ * In-process micro-benchmarks of the murmur code on the voice and permission
+ * paths: CryptState, PacketDataStream, the voice packet rewrite done by
+ * Server::processMsg(), BandwidthRecord::addFrame(),
+ * ChanACL::effectivePermissions() and Group::isMember().
+ *
+ * Usage: MicroBench [samples=N] [sample_ms=N] [warmup_ms=N] [filter=text]
+ *
+ * The channel tree, users, ACLs and packets are synthetic and built the same
+ * way on every run, so results can be compared across commits. Each case is
+ * warmed up for warmup_ms, during which the number of iterations per sample
+ * is calibrated so a sample takes about sample_ms; that keeps the microsecond
+ * resolution of Timer out of the numbers. Every case then prints one RESULT
+ * line with the median, mean, standard deviation, min and max in ns/op.
+ *
+ * processMsg() itself needs a Server with its database and sockets, so the
+ * voice.* cases run its parsing and rewriting steps on their own. The full
+ * relay is measured end to end by Benchmark.
+ */
+
+#include <QtCore>
+#include <QtNetwork>
+
+#include <math.h>
+
+#include "ACL.h"
+#include "ACLCache.h"
+#include "Channel.h"
+#include "CryptState.h"
+#include "Group.h"
+#include "Message.h"
+#include "PacketDataStream.h"
+#include "ServerUser.h"
+#include "Timer.h"
+
+class Meta;
+
+// ServerUser drags in Connection, which reports to Metrics, which knows how
+// to list the servers of a Meta. None of that runs here.
+Meta *meta = NULL;
+
+static volatile quint64 uiSink = 0;
+
+static quint32 uiSeed = 0x2545f491;
+
+// Small xorshift generator, so the synthetic data is the same on every
+// platform and every run.
+static quint32 rnd() {
+	uiSeed ^= uiSeed << 13;
+	uiSeed ^= uiSeed >> 17;
+	uiSeed ^= uiSeed << 5;
+	return uiSeed;
+}
+
+class MicroCase {
+	public:
+		QString qsName;
+		MicroCase(const QString &name) : qsName(name) {}
+		virtual ~MicroCase() {}
+		virtual void run(quint64 iterations) = 0;
+};
+
+struct MicroParams {
+	int iSamples;
+	quint64 uiSampleUs;
+	quint64 uiWarmupUs;
+	QString qsFilter;
+};
+
+static quint64 timed(MicroCase *mc, quint64 iterations) {
+	Timer t;
+	mc->run(iterations);
+	return t.elapsed();
+}
+
+static void measure(const MicroParams &mp, MicroCase *mc) {
+	if (! mp.qsFilter.isEmpty() && ! mc->qsName.contains(mp.qsFilter)) {
+		delete mc;
+		return;
+	}
+
+	// Find an iteration count that takes long enough to time, then keep
+	// running it until the warm-up is over. The last warm-up run gives the
+	// count for the samples, after caches and clocks have settled.
+	quint64 iter = 1;
+	quint64 spent = timed(mc, iter);
+	while (spent < 1000) {
+		iter *= 2;
+		spent = timed(mc, iter);
+	}
+
+	Timer tWarm;
+	while (tWarm.elapsed() < mp.uiWarmupUs)
+		spent = timed(mc, iter);
+
+	iter = qMax(1ULL, static_cast<unsigned long long>(iter * mp.uiSampleUs / qMax(spent, 1ULL)));
+
+	QVector<double> qvSamples;
+	for (int i = 0; i < mp.iSamples; ++i)
+		qvSamples << timed(mc, iter) * 1000.0 / static_cast<double>(iter);
+
+	qSort(qvSamples);
+
+	const int n = qvSamples.count();
+	double sum = 0.0;
+	foreach(double d, qvSamples)
+		sum += d;
+	const double mean = sum / n;
+
+	double var = 0.0;
+	foreach(double d, qvSamples)
+		var += (d - mean) * (d - mean);
+	const double stddev = (n > 1) ? sqrt(var / (n - 1)) : 0.0;
+
+	const double median = (n % 2) ? qvSamples.at(n / 2) : (qvSamples.at(n / 2 - 1) + qvSamples.at(n / 2)) / 2.0;
+
+	printf("RESULT name=%s ns_per_op=%.2f mean=%.2f stddev=%.2f min=%.2f max=%.2f samples=%d iterations=%llu\n",
+	       qPrintable(mc->qsName), median, mean, stddev, qvSamples.first(), qvSamples.last(), n,
+	       static_cast<unsigned long long>(iter));
+	fflush(stdout);
+
+	delete mc;
+}
+
+/**
+ * Encrypts voice sized packets with one CryptState.
+ */
+class CryptEncrypt : public MicroCase {
+	public:
+		CryptState cs;
+		unsigned int uiSize;
+		unsigned char plain[1024];
+		unsigned char crypted[1024];
+
+		CryptEncrypt(unsigned int size) : MicroCase(QString::fromLatin1("crypt.encrypt.%1").arg(size)), uiSize(size) {
+			unsigned char rawkey[AES_BLOCK_SIZE];
+			for (int i = 0; i < AES_BLOCK_SIZE; ++i)
+				rawkey[i] = static_cast<unsigned char>(rnd());
+			cs.setKey(rawkey, rawkey, rawkey);
+			for (unsigned int i = 0; i < sizeof(plain); ++i)
+				plain[i] = static_cast<unsigned char>(rnd());
+		}
+
+		void run(quint64 iterations) {
+			quint64 v = 0;
+			for (quint64 i = 0; i < iterations; ++i) {
+				cs.encrypt(plain, crypted, uiSize);
+				v += crypted[0];
+			}
+			uiSink += v;
+		}
+};
+
+/**
+ * Encrypts with one side and decrypts with the other, like a packet that
+ * crosses from client to server. Packets arrive in order, so this is the
+ * common case of decrypt(); subtract crypt.encrypt to get the decrypt half.
+ */
+class CryptRoundtrip : public MicroCase {
+	public:
+		CryptState csEnc, csDec;
+		unsigned int uiSize;
+		unsigned char plain[1024];
+		unsigned char crypted[1024 + 4];
+		unsigned char decrypted[1024];
+
+		CryptRoundtrip(unsigned int size) : MicroCase(QString::fromLatin1("crypt.roundtrip.%1").arg(size)), uiSize(size) {
+			unsigned char rawkey[AES_BLOCK_SIZE];
+			unsigned char eiv[AES_BLOCK_SIZE];
+			unsigned char div[AES_BLOCK_SIZE];
+			for (int i = 0; i < AES_BLOCK_SIZE; ++i) {
+				rawkey[i] = static_cast<unsigned char>(rnd());
+				eiv[i] = static_cast<unsigned char>(rnd());
+				div[i] = static_cast<unsigned char>(rnd());
+			}
+			csEnc.setKey(rawkey, eiv, div);
+			csDec.setKey(rawkey, div, eiv);
+			for (unsigned int i = 0; i < sizeof(plain); ++i)
+				plain[i] = static_cast<unsigned char>(rnd());
+		}
+
+		void run(quint64 iterations) {
+			quint64 v = 0;
+			for (quint64 i = 0; i < iterations; ++i) {
+				csEnc.encrypt(plain, crypted, uiSize);
+				if (! csDec.decrypt(crypted, decrypted, uiSize + 4))
+					qFatal("MicroBench: decrypt failed");
+				v += decrypted[0];
+			}
+			uiSink += v;
+		}
+};
+
+#define VARINT_COUNT 256
+
+/**
+ * Writes and reads back variable length integers with the size spread seen in
+ * the protocol: mostly small (sessions, sequence numbers, frame sizes), a few
+ * large. Reported per value.
+ */
+class Varint : public MicroCase {
+	public:
+		bool bDecode;
+		quint64 uiValues[VARINT_COUNT];
+		char buffer[VARINT_COUNT * 10];
+		int iLength;
+
+		Varint(bool decode) : MicroCase(QLatin1String(decode ? "pds.varint.decode" : "pds.varint.encode")), bDecode(decode) {
+			for (int i = 0; i < VARINT_COUNT; ++i) {
+				const quint32 r = rnd();
+				switch (r % 8) {
+					case 0:
+						uiValues[i] = rnd();
+						break;
+					case 1:
+						uiValues[i] = (static_cast<quint64>(rnd()) << 32) | rnd();
+						break;
+					case 2:
+					case 3:
+						uiValues[i] = rnd() & 0x3fff;
+						break;
+					default:
+						uiValues[i] = rnd() & 0x7f;
+						break;
+				}
+			}
+			PacketDataStream pds(buffer, sizeof(buffer));
+			for (int i = 0; i < VARINT_COUNT; ++i)
+				pds << uiValues[i];
+			iLength = pds.size();
+		}
+
+		void run(quint64 iterations) {
+			quint64 v = 0;
+			for (quint64 i = 0; i < iterations; i += VARINT_COUNT) {
+				if (bDecode) {
+					PacketDataStream pds(buffer, iLength);
+					for (int j = 0; j < VARINT_COUNT; ++j) {
+						quint64 value;
+						pds >> value;
+						v += value;
+					}
+				} else {
+					PacketDataStream pds(buffer, sizeof(buffer));
+					for (int j = 0; j < VARINT_COUNT; ++j)
+						pds << uiValues[j];
+					v += pds.size();
+				}
+			}
+			uiSink += v;
+		}
+};
+
+#define VOICE_BUFFER 1024
+
+/**
+ * The first half of Server::processMsg(): find the end of the voice data,
+ * prefix the payload with the speaker's session and, if the speaker sent a
+ * plain float position, add the copy with a compact position. Kept in step
+ * with processMsg() by hand.
+ */
+static int rewrite(const char *data, int len, unsigned int session, char *buffer, char *altbuffer, int &altlen) {
+	PacketDataStream pdi(data + 1, len - 1);
+	PacketDataStream pds(buffer + 1, VOICE_BUFFER - 1);
+	unsigned int type = data[0] & 0xe0;
+	unsigned int counter;
+	unsigned int poslen;
+
+	const char *payload = pdi.charPtr();
+	const int payloadlen = pdi.left();
+
+	pdi >> counter;
+
+	if ((type >> 5) != MessageHandler::UDPVoiceOpus) {
+		do {
+			counter = pdi.next8();
+			pdi.skip(counter & 0x7f);
+		} while ((counter & 0x80) && pdi.isValid());
+	} else {
+		int size;
+		pdi >> size;
+		pdi.skip(size & 0x1fff);
+	}
+
+	poslen = pdi.left();
+
+	pds << session;
+	pds.append(payload, payloadlen);
+
+	len = pds.size() + 1;
+	altlen = 0;
+
+	if (poslen > 0) {
+		char posbuff[32];
+		PacketDataStream pin(pdi.charPtr(), poslen);
+		PacketDataStream pout(posbuff, sizeof(posbuff));
+		float pos[3];
+
+		pin >> pos[0];
+		pin >> pos[1];
+		pin >> pos[2];
+		if (pin.isValid()) {
+			const int q[3] = { PositionEncoder::quantize(pos[0]), PositionEncoder::quantize(pos[1]), PositionEncoder::quantize(pos[2]) };
+			PositionEncoder::encodeKey(pout, 0, q);
+		}
+
+		if (pout.size() > 0) {
+			altlen = len - poslen;
+			memcpy(altbuffer, buffer, altlen);
+			memcpy(altbuffer + altlen, posbuff, pout.size());
+			altlen += pout.size();
+		}
+	}
+
+	buffer[0] = static_cast<char>(type);
+	return len;
+}
+
+class VoiceRewrite : public MicroCase {
+	public:
+		char packet[VOICE_BUFFER];
+		char buffer[VOICE_BUFFER];
+		char altbuffer[VOICE_BUFFER];
+		int iLength;
+
+		VoiceRewrite(const QString &name, MessageHandler::UDPMessageType type, bool positional) : MicroCase(name) {
+			packet[0] = static_cast<char>(type << 5);
+			PacketDataStream pds(packet + 1, sizeof(packet) - 1);
+			pds << 4711;
+
+			char frame[128];
+			for (unsigned int i = 0; i < sizeof(frame); ++i)
+				frame[i] = static_cast<char>(rnd());
+
+			if (type == MessageHandler::UDPVoiceOpus) {
+				// A 20 ms frame at 40 kbit/s.
+				pds << 100;
+				pds.append(frame, 100);
+			} else {
+				// Two CELT frames of 10 ms.
+				pds.append(0x80 | 50);
+				pds.append(frame, 50);
+				pds.append(50);
+				pds.append(frame + 50, 50);
+			}
+
+			if (positional) {
+				pds << 12.34f;
+				pds << -5.5f;
+				pds << 101.25f;
+			}
+
+			iLength = pds.size() + 1;
+		}
+
+		void run(quint64 iterations) {
+			quint64 v = 0;
+			int altlen;
+			for (quint64 i = 0; i < iterations; ++i) {
+				v += rewrite(packet, iLength, 17, buffer, altbuffer, altlen);
+				v += altlen;
+			}
+			uiSink += v;
+		}
+};
+
+#define BANDWIDTH_USERS 1024
+
+/**
+ * Voice rate checks for a server with many talkers. A record only does the
+ * full check when the slot it is about to reuse is at least a microsecond
+ * old, so going round many records keeps every call on the full path, as it
+ * is on a real server where a user sends a packet every 10 to 60 ms.
+ */
+class BandwidthAddFrame : public MicroCase {
+	public:
+		QVector<BandwidthRecord *> qvRecords;
+		int iNext;
+
+		BandwidthAddFrame() : MicroCase(QLatin1String("bwr.addframe")), iNext(0) {
+			for (int i = 0; i < BANDWIDTH_USERS; ++i)
+				qvRecords << new BandwidthRecord();
+		}
+
+		~BandwidthAddFrame() {
+			qDeleteAll(qvRecords);
+		}
+
+		void run(quint64 iterations) {
+			quint64 v = 0;
+			for (quint64 i = 0; i < iterations; ++i) {
+				// IP + UDP + Crypt + an Opus frame, against the default 72 kbit/s limit.
+				v += qvRecords.at(iNext)->addFrame(20 + 8 + 4 + 110, 72000 / 8) ? 1 : 0;
+				if (++iNext == BANDWIDTH_USERS)
+					iNext = 0;
+			}
+			uiSink += v;
+		}
+};
+
+/**
+ * A channel tree with the shapes that show up on busy servers: a wide part
+ * (many team channels with a few sub channels each, per-team groups and ACLs)
+ * and a deep chain of channels that all inherit from each other.
+ */
+struct World {
+	Channel *cRoot;
+	QList<Channel *> qlChannels;
+	Channel *cTeam;
+	Channel *cDeep;
+	ServerUser *uUser;
+	QSslSocket *qssSocket;
+
+	World();
+	~World();
+};
+
+#define WORLD_TEAMS 32
+#define WORLD_SUBS 8
+#define WORLD_DEPTH 12
+
+static ChanACL *addAcl(Channel *c, const QString &group, ChanACL::Permissions allow, ChanACL::Permissions deny, bool here = true, bool subs = true) {
+	ChanACL *acl = new ChanACL(c);
+	acl->qsGroup = group;
+	acl->pAllow = allow;
+	acl->pDeny = deny;
+	acl->bApplyHere = here;
+	acl->bApplySubs = subs;
+	return acl;
+}
+
+World::World() {
+	cRoot = new Channel(0, QLatin1String("Root"));
+	qlChannels << cRoot;
+
+	// The defaults a new server gets.
+	Group *g = new Group(cRoot, QLatin1String("admin"));
+	for (int i = 1; i < 8; ++i)
+		g->qsAdd << i;
+	addAcl(cRoot, QLatin1String("admin"), ChanACL::Write, 0);
+	addAcl(cRoot, QLatin1String("auth"), ChanACL::MakeTempChannel, 0);
+	addAcl(cRoot, QLatin1String("all"), ChanACL::SelfRegister, 0, true, false);
+
+	int id = 1;
+	for (int t = 0; t < WORLD_TEAMS; ++t) {
+		Channel *team = new Channel(id++, QString::fromLatin1("Team %1").arg(t), cRoot);
+		qlChannels << team;
+
+		g = new Group(team, QLatin1String("members"));
+		for (int i = 0; i < 16; ++i)
+			g->qsAdd << static_cast<int>(100 + (rnd() % 400));
+		if (t % 2)
+			g->qsAdd << 42;
+
+		addAcl(team, QLatin1String("all"), 0, ChanACL::Enter | ChanACL::Speak);
+		addAcl(team, QLatin1String("members"), ChanACL::Enter | ChanACL::Speak, 0);
+		addAcl(team, QString::fromLatin1("#team%1").arg(t), ChanACL::Enter, 0);
+		addAcl(team, QLatin1String("~sub,0,1"), ChanACL::TextMessage, 0, false, true);
+
+		for (int s = 0; s < WORLD_SUBS; ++s) {
+			Channel *sub = new Channel(id++, QString::fromLatin1("Squad %1").arg(s), team);
+			qlChannels << sub;
+			addAcl(sub, QLatin1String("in"), ChanACL::Whisper, 0);
+			addAcl(sub, QLatin1String("!~members"), 0, ChanACL::Speak);
+		}
+	}
+	cTeam = cRoot->qlChannels.at(WORLD_TEAMS / 2 + 1)->qlChannels.first();
+
+	Channel *p = new Channel(id++, QLatin1String("Deep"), cRoot);
+	qlChannels << p;
+	g = new Group(p, QLatin1String("crew"));
+	g->qsAdd << 42;
+	addAcl(p, QLatin1String("crew"), ChanACL::Enter | ChanACL::Speak | ChanACL::MuteDeafen, ChanACL::Whisper);
+	for (int d = 1; d < WORLD_DEPTH; ++d) {
+		p = new Channel(id++, QString::fromLatin1("Level %1").arg(d), p);
+		qlChannels << p;
+		addAcl(p, QLatin1String("auth"), ChanACL::Whisper, 0);
+		if (d % 3 == 0)
+			addAcl(p, QLatin1String("strong"), ChanACL::MakeChannel, 0);
+	}
+	cDeep = p;
+
+	qssSocket = new QSslSocket();
+	uUser = new ServerUser(NULL, qssSocket);
+	uUser->sState = ServerUser::Authenticated;
+	uUser->uiSession = 17;
+	uUser->iId = 42;
+	uUser->qsName = QLatin1String("bench");
+	uUser->qsHash = QLatin1String("2fd4e1c67a2d28fced849ee1bb76e7391b93eb12");
+	uUser->qslAccessTokens << QLatin1String("alpha") << QLatin1String("team17") << QLatin1String("beta");
+	cDeep->addUser(uUser);
+}
+
+World::~World() {
+	cDeep->removeUser(uUser);
+	delete uUser;
+	delete cRoot;
+}
+
+/**
+ * Permission lookups without a cache, as done when the cache was just
+ * flushed. With sweep set every operation checks the next channel of the
+ * whole tree, like a user list refresh.
+ */
+class AclEffective : public MicroCase {
+	public:
+		World &w;
+		QList<Channel *> qlTargets;
+		bool bCached;
+		ACLCache acCache;
+		int iNext;
+
+		AclEffective(const QString &name, World &world, const QList<Channel *> &targets, bool cached) : MicroCase(name), w(world), qlTargets(targets), bCached(cached), iNext(0) {
+			if (bCached)
+				foreach(Channel *c, qlTargets)
+					ChanACL::effectivePermissions(w.uUser, c, &acCache);
+		}
+
+		void run(quint64 iterations) {
+			quint64 v = 0;
+			const int n = qlTargets.count();
+			for (quint64 i = 0; i < iterations; ++i) {
+				v += ChanACL::effectivePermissions(w.uUser, qlTargets.at(iNext), bCached ? &acCache : NULL);
+				if (++iNext == n)
+					iNext = 0;
+			}
+			uiSink += v;
+		}
+};
+
+class GroupIsMember : public MicroCase {
+	public:
+		World &w;
+		Channel *cCurrent;
+		Channel *cAcl;
+		QString qsGroup;
+
+		GroupIsMember(const QString &name, World &world, Channel *cur, Channel *acl, const QString &group) : MicroCase(name), w(world), cCurrent(cur), cAcl(acl), qsGroup(group) {
+		}
+
+		void run(quint64 iterations) {
+			quint64 v = 0;
+			for (quint64 i = 0; i < iterations; ++i)
+				v += Group::isMember(cCurrent, cAcl, qsGroup, w.uUser) ? 1 : 0;
+			uiSink += v;
+		}
+};
+
+int main(int argc, char **argv) {
+	QCoreApplication a(argc, argv);
+
+	MicroParams mp;
+	mp.iSamples = 15;
+	mp.uiSampleUs = 20000;
+	mp.uiWarmupUs = 200000;
+
+	QStringList args = a.arguments();
+	args.removeFirst();
+	foreach(const QString &arg, args) {
+		const QString key = arg.section(QLatin1Char('='), 0, 0).toLower();
+		const QString value = arg.section(QLatin1Char('='), 1);
+		if (key == QLatin1String("samples"))
+			mp.iSamples = qMax(1, value.toInt());
+		else if (key == QLatin1String("sample_ms"))
+			mp.uiSampleUs = qMax(1, value.toInt()) * 1000ULL;
+		else if (key == QLatin1String("warmup_ms"))
+			mp.uiWarmupUs = qMax(0, value.toInt()) * 1000ULL;
+		else if (key == QLatin1String("filter"))
+			mp.qsFilter = value;
+		else
+			qFatal("Usage: MicroBench [samples=N] [sample_ms=N] [warmup_ms=N] [filter=text]");
+	}
+
+	measure(mp, new CryptEncrypt(60));
+	measure(mp, new CryptEncrypt(160));
+	measure(mp, new CryptRoundtrip(60));
+	measure(mp, new CryptRoundtrip(160));
+
+	measure(mp, new Varint(false));
+	measure(mp, new Varint(true));
+	measure(mp, new VoiceRewrite(QLatin1String("voice.rewrite.opus"), MessageHandler::UDPVoiceOpus, false));
+	measure(mp, new VoiceRewrite(QLatin1String("voice.rewrite.opus_pos"), MessageHandler::UDPVoiceOpus, true));
+	measure(mp, new VoiceRewrite(QLatin1String("voice.rewrite.celt"), MessageHandler::UDPVoiceCELTAlpha, false));
+
+	measure(mp, new BandwidthAddFrame());
+
+	World w;
+
+	measure(mp, new AclEffective(QLatin1String("acl.effective.root"), w, QList<Channel *>() << w.cRoot, false));
+	measure(mp, new AclEffective(QLatin1String("acl.effective.team"), w, QList<Channel *>() << w.cTeam, false));
+	measure(mp, new AclEffective(QLatin1String("acl.effective.deep"), w, QList<Channel *>() << w.cDeep, false));
+	measure(mp, new AclEffective(QLatin1String("acl.effective.sweep"), w, w.qlChannels, false));
+	measure(mp, new AclEffective(QLatin1String("acl.effective.sweep_cached"), w, w.qlChannels, true));
+
+	measure(mp, new GroupIsMember(QLatin1String("group.ismember.all"), w, w.cTeam, w.cTeam, QLatin1String("all")));
+	measure(mp, new GroupIsMember(QLatin1String("group.ismember.in"), w, w.cDeep, w.cDeep, QLatin1String("in")));
+	measure(mp, new GroupIsMember(QLatin1String("group.ismember.token"), w, w.cTeam, w.cTeam, QLatin1String("#team17")));
+	measure(mp, new GroupIsMember(QLatin1String("group.ismember.hash"), w, w.cTeam, w.cTeam, QLatin1String("$2fd4e1c67a2d28fced849ee1bb76e7391b93eb12")));
+	measure(mp, new GroupIsMember(QLatin1String("group.ismember.sub"), w, w.cRoot, w.cRoot, QLatin1String("sub,0,1")));
+	measure(mp, new GroupIsMember(QLatin1String("group.ismember.named"), w, w.cTeam, w.cTeam->cParent, QLatin1String("~members")));
+	measure(mp, new GroupIsMember(QLatin1String("group.ismember.named_deep"), w, w.cDeep, w.cDeep, QLatin1String("crew")));
+	measure(mp, new GroupIsMember(QLatin1String("group.ismember.inverted"), w, w.cDeep, w.cDeep, QLatin1String("!admin")));
+
+	return 0;
+}
@@ -0,0 +1,14 @@
+include(../mumble.pri)
+
+TEMPLATE = app
+CONFIG *= qt thread warn_on network release
+CONFIG -= app_bundle
+QT *= network sql xml
+LANGUAGE = C++
+TARGET = MicroBench
+DEFINES *= MURMUR NDEBUG
+HEADERS *= ServerUser.h Metrics.h ACLCache.h
+SOURCES *= MicroBench.cpp ServerUser.cpp Metrics.cpp ACLCache.cpp
+VPATH *= .. ../murmur
+INCLUDEPATH *= .. ../murmur ../mumble
+QMAKE_CXXFLAGS *= -O2
@@ -0,0 +1,250 @@
+/**
+ * Benchmark of the positional audio gain calculation for 64 sources:
+ * the old per source, per speaker scalar path against the batched
+ * Spatializer, and the cost of mixing with and without interaural delay.
+ *
+ * Also checks the batched gains against Spatializer::gain(), the binaural
+ * level and delay for sources to either side, and mixDelayed() against a
+ * delayed copy of the whole signal. Exits with 1 if any check fails.
+ */
+
+#define _USE_MATH_DEFINES
+#include <QtCore>
+#include <cmath>
+
+#include "Timer.h"
+#include "Spatializer.h"
+
+#define NSOURCES 64
+#define NSAMP 480
+#define ITER 10000
+#define EPSILON 1.0e-5f
+
+static int iFailures = 0;
+
+static void check(bool ok, const char *what, float got, float expected) {
+	if (! ok) {
+		qWarning("FAIL: %s: got %g, expected %g", what, got, expected);
+		++iFailures;
+	}
+}
+
+static void checkNear(const char *what, float got, float expected, float epsilon = EPSILON) {
+	check(fabsf(got - expected) <= epsilon, what, got, expected);
+}
+
+static const float fLeftRight[] = { -1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f };
+static const float fSurround[] = { -0.447214f, 0.0f, 0.894427f, 0.447214f, 0.0f, 0.894427f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, -0.447214f, 0.0f, -0.894427f, 0.447214f, 0.0f, -0.894427f };
+
+// What AudioOutput::mix() used to do for every source and speaker.
+static void scalar(const Spatializer &sp, const Spatializer::Params &p, unsigned int channels, const bool *positional, const float *listener, const float *x, const float *y, const float *z, float *gains) {
+	const float *speaker = sp.rotatedSpeakers();
+	for (unsigned int i=0;i<NSOURCES;++i) {
+		float dir[3] = { x[i] - listener[0], y[i] - listener[1], z[i] - listener[2] };
+		float len = sqrtf(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+		if (len > 0.0f) {
+			dir[0] /= len;
+			dir[1] /= len;
+			dir[2] /= len;
+		}
+		for (unsigned int s=0;s<channels;++s) {
+			const float dot = positional[s] ? dir[0] * speaker[s*3+0] + dir[1] * speaker[s*3+1] + dir[2] * speaker[s*3+2] : 1.0f;
+			gains[s * NSOURCES + i] = Spatializer::gain(p, dot, len);
+		}
+	}
+}
+
+static void bench(const char *name, unsigned int channels, const float *speakers) {
+	bool positional[6];
+	for (unsigned int s=0;s<channels;++s)
+		positional[s] = (speakers[s*3+0] != 0.0f) || (speakers[s*3+1] != 0.0f) || (speakers[s*3+2] != 0.0f);
+
+	float x[NSOURCES], y[NSOURCES], z[NSOURCES];
+	qsrand(1);
+	for (int i=0;i<NSOURCES;++i) {
+		x[i] = static_cast<float>(qrand() % 4000) / 100.0f - 20.0f;
+		y[i] = static_cast<float>(qrand() % 400) / 100.0f - 2.0f;
+		z[i] = static_cast<float>(qrand() % 4000) / 100.0f - 20.0f;
+	}
+
+	const float listener[3] = { 1.0f, 0.5f, -2.0f };
+	const float front[3] = { 0.6f, 0.0f, 0.8f };
+	const float top[3] = { 0.0f, 1.0f, 0.0f };
+
+	Spatializer::Params p;
+	Spatializer sp;
+	sp.setSpeakers(channels, speakers, positional, false, 48000);
+	sp.setListener(listener, front, top, p);
+
+	float ref[NSOURCES * 6];
+	float gains[NSOURCES * 6];
+	float delays[NSOURCES];
+
+	Timer t;
+	for (int j=0;j<ITER;++j)
+		scalar(sp, p, channels, positional, listener, x, y, z, ref);
+	quint64 usscalar = t.restart();
+
+	for (int j=0;j<ITER;++j)
+		sp.compute(NSOURCES, x, y, z, gains, delays);
+	quint64 usbatch = t.restart();
+
+	float maxerr = 0.0f;
+	for (unsigned int i=0;i<NSOURCES * channels;++i)
+		maxerr = qMax(maxerr, fabsf(ref[i] - gains[i]));
+
+	qWarning("%s: %.3fus scalar, %.3fus batched per period, max difference %g", name, static_cast<double>(usscalar) / ITER, static_cast<double>(usbatch) / ITER, maxerr);
+	check(maxerr <= EPSILON, name, maxerr, 0.0f);
+}
+
+/**
+ * Headphones with the binaural model, one source to the right, one to the
+ * left and one straight ahead. Without distance attenuation or bloom the
+ * near ear gets full level and the far ear the head shadow, and only the
+ * far ear is delayed, by Woodworth's approximation for a source at 90 degrees.
+ */
+static void binaural() {
+	const bool positional[2] = { true, true };
+	const float listener[3] = { 0.0f, 0.0f, 0.0f };
+	const float front[3] = { 0.0f, 0.0f, 1.0f };
+	const float top[3] = { 0.0f, 1.0f, 0.0f };
+
+	Spatializer::Params p;
+	p.fMaxDistVolume = 1.0f;
+	p.fBloom = 0.0f;
+	p.bBinaural = true;
+
+	Spatializer sp;
+	sp.setSpeakers(2, fLeftRight, positional, true, 48000);
+	sp.setListener(listener, front, top, p);
+	check(sp.binaural(), "Binaural model active", 0.0f, 1.0f);
+
+	const float x[3] = { 2.0f, -2.0f, 0.0f };
+	const float y[3] = { 0.0f, 0.0f, 0.0f };
+	const float z[3] = { 0.0f, 0.0f, 2.0f };
+	float gains[2 * 3];
+	float delays[3];
+	sp.compute(3, x, y, z, gains, delays);
+
+	const float itd = 0.0875f / 343.0f * 48000.0f * (static_cast<float>(M_PI) / 2.0f + 1.0f);
+	// 10 dB down.
+	const float shadow = 0.316228f;
+
+	checkNear("Right source delay", delays[0], itd, 0.01f);
+	checkNear("Right source left ear delay", sp.channelDelay(0, delays[0]), itd, 0.01f);
+	checkNear("Right source right ear delay", sp.channelDelay(1, delays[0]), 0.0f);
+	checkNear("Right source left ear level", gains[0], shadow);
+	checkNear("Right source right ear level", gains[3], 1.0f);
+
+	checkNear("Left source delay", delays[1], -itd, 0.01f);
+	checkNear("Left source left ear delay", sp.channelDelay(0, delays[1]), 0.0f);
+	checkNear("Left source right ear delay", sp.channelDelay(1, delays[1]), itd, 0.01f);
+	checkNear("Left source left ear level", gains[1], 1.0f);
+	checkNear("Left source right ear level", gains[4], shadow);
+
+	checkNear("Front source delay", delays[2], 0.0f);
+	checkNear("Front source left ear level", gains[2], 0.5f);
+	checkNear("Front source right ear level", gains[5], 0.5f);
+}
+
+static float signal(int i) {
+	return (i < 0) ? 0.0f : sinf(static_cast<float>(M_PI) * static_cast<float>(i) / 24.0f + 0.3f);
+}
+
+// The whole signal delayed by a fractional number of samples, interpolated like mixDelayed().
+static float delayed(int i, float delay) {
+	const float pos = static_cast<float>(i) - delay;
+	const float fl = floorf(pos);
+	const int ip = static_cast<int>(fl);
+	const float frac = pos - fl;
+	return signal(ip) + (signal(ip + 1) - signal(ip)) * frac;
+}
+
+/**
+ * Feeds the signal through mixDelayed() period by period, keeping the history
+ * up to date, and compares every period with the delayed signal. Delay and
+ * volume ramp from the first to the second value over each period. Periods
+ * shorter than the history exercise the partial history update, and delays
+ * longer than a period reach back into samples from more than one period ago.
+ */
+static void delayedMix(const char *name, unsigned int nsamp, float delay, float newdelay, float vol, float newvol) {
+	float history[Spatializer::iHistory];
+	float input[NSAMP];
+	float output[NSAMP * 2];
+	float maxerr = 0.0f;
+	bool touched = false;
+
+	memset(history, 0, sizeof(history));
+
+	for (unsigned int start=0;start < 4 * NSAMP;start += nsamp) {
+		for (unsigned int i=0;i<nsamp;++i)
+			input[i] = signal(static_cast<int>(start + i));
+		memset(output, 0, sizeof(output));
+
+		Spatializer::mixDelayed(output + 1, 2, input, history, nsamp, delay, newdelay, vol, newvol);
+		Spatializer::updateHistory(history, input, nsamp);
+
+		for (unsigned int i=0;i<nsamp;++i) {
+			const float t = static_cast<float>(i) / static_cast<float>(nsamp);
+			const float expected = delayed(static_cast<int>(start + i), delay + (newdelay - delay) * t) * (vol + (newvol - vol) * t);
+			maxerr = qMax(maxerr, fabsf(output[i*2+1] - expected));
+			touched = touched || (output[i*2] != 0.0f);
+		}
+	}
+
+	check(maxerr <= 1.0e-4f, name, maxerr, 0.0f);
+	check(! touched, "Delayed mix stays on its channel", 1.0f, 0.0f);
+}
+
+static void mixing() {
+	float input[NSAMP];
+	float history[Spatializer::iHistory];
+	float output[NSAMP * 2];
+
+	for (int i=0;i<NSAMP;++i)
+		input[i] = sinf(static_cast<float>(M_PI) * static_cast<float>(i) / 24.0f);
+	memset(history, 0, sizeof(history));
+	memset(output, 0, sizeof(output));
+
+	Timer t;
+	for (int j=0;j<ITER / 10;++j)
+		for (int k=0;k<NSOURCES;++k)
+			for (unsigned int s=0;s<2;++s) {
+				float *o = output + s;
+				const float inc = 0.1f / NSAMP;
+				for (unsigned int i=0;i<NSAMP;++i)
+					o[i*2] += input[i] * (0.5f + inc*static_cast<float>(i));
+			}
+	quint64 usplain = t.restart();
+
+	for (int j=0;j<ITER / 10;++j)
+		for (int k=0;k<NSOURCES;++k) {
+			Spatializer::mixDelayed(output, 2, input, history, NSAMP, 10.0f, 12.0f, 0.5f, 0.6f);
+			float *o = output + 1;
+			const float inc = 0.1f / NSAMP;
+			for (unsigned int i=0;i<NSAMP;++i)
+				o[i*2] += input[i] * (0.5f + inc*static_cast<float>(i));
+			Spatializer::updateHistory(history, input, NSAMP);
+		}
+	quint64 usdelayed = t.restart();
+
+	qWarning("Mixing %d sources: %.3fus panned, %.3fus with interaural delay per period (%g)", NSOURCES, static_cast<double>(usplain) / (ITER / 10), static_cast<double>(usdelayed) / (ITER / 10), output[0]);
+}
+
+int main(int argc, char **argv) {
+	QCoreApplication a(argc, argv);
+
+	bench("Stereo", 2, fLeftRight);
+	bench("5.1", 6, fSurround);
+	mixing();
+
+	binaural();
+	delayedMix("Delayed mix, fixed delay", NSAMP, 10.25f, 10.25f, 0.5f, 0.5f);
+	delayedMix("Delayed mix, moving delay", NSAMP, 10.0f, 14.0f, 0.4f, 0.8f);
+	delayedMix("Delayed mix, short periods", 32, 40.5f, 40.5f, 0.7f, 0.7f);
+
+	if (iFailures)
+		qWarning("%d checks failed", iFailures);
+
+	return iFailures ? 1 : 0;
+}
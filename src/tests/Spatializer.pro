@@ -0,0 +1,11 @@
+include(../../compiler.pri)
+TEMPLATE = app
+CONFIG += qt thread warn_on release console
+CONFIG -= app_bundle
+QT -= gui
+LANGUAGE = C++
+TARGET = Spatializer
+SOURCES = Spatializer.cpp Timer.cpp ../mumble/Spatializer.cpp
+HEADERS = Timer.h ../mumble/Spatializer.h
+VPATH += ..
+INCLUDEPATH += .. ../mumble
@@ -0,0 +1,95 @@
+#include <QtCore>
+#include <QtTest>
+#include <QObject>
+#include "PositionCodec.h"
+
+class TestPositionCodec : public QObject {
+		Q_OBJECT
+	private slots:
+		void roundtrip();
+		void stationary();
+		void jump();
+		void lostKeyframe();
+		void zigzag();
+};
+
+static bool sendOne(PositionEncoder &pe, PositionDecoder &pd, const float *in, float *out, quint32 *size = NULL) {
+	char buff[64];
+	PacketDataStream pds(buff, sizeof(buff));
+	pe.encode(pds, in);
+	if (size)
+		*size = pds.size();
+	PacketDataStream pdi(buff, pds.size());
+	bool ok = pd.decode(pdi, out);
+	return ok && (pdi.left() == 0);
+}
+
+void TestPositionCodec::roundtrip() {
+	PositionEncoder pe;
+	PositionDecoder pd;
+
+	for (int i=0;i<200;++i) {
+		float in[3] = { 100.0f + 0.37f * i, -3.5f + 0.01f * i, 2000.0f - 1.13f * i };
+		float out[3];
+		QVERIFY(sendOne(pe, pd, in, out));
+		for (int j=0;j<3;++j)
+			QVERIFY(qAbs(in[j] - out[j]) <= 0.005f + in[j] * 1.0e-6f);
+	}
+}
+
+void TestPositionCodec::stationary() {
+	PositionEncoder pe;
+	PositionDecoder pd;
+	float in[3] = { 12.0f, 1.5f, -7.25f };
+	float out[3];
+	quint32 size;
+
+	QVERIFY(sendOne(pe, pd, in, out, &size));
+	QVERIFY(size > 4);
+	QVERIFY(sendOne(pe, pd, in, out, &size));
+	QCOMPARE(size, 4U);
+	QCOMPARE(out[2], -7.25f);
+}
+
+void TestPositionCodec::jump() {
+	PositionEncoder pe;
+	PositionDecoder pd;
+	float in[3] = { 0.0f, 0.0f, 0.0f };
+	float out[3];
+
+	QVERIFY(sendOne(pe, pd, in, out));
+	in[0] = 5000.0f;
+	QVERIFY(sendOne(pe, pd, in, out));
+	QCOMPARE(out[0], 5000.0f);
+}
+
+void TestPositionCodec::lostKeyframe() {
+	PositionEncoder pe;
+	PositionDecoder pd;
+	float in[3] = { 1.0f, 2.0f, 3.0f };
+	float out[3];
+	char buff[64];
+
+	// The keyframe never arrives.
+	PacketDataStream lost(buff, sizeof(buff));
+	pe.encode(lost, in);
+
+	in[0] = 1.5f;
+	QVERIFY(! sendOne(pe, pd, in, out));
+
+	// Until the sender starts over.
+	pe.reset();
+	QVERIFY(sendOne(pe, pd, in, out));
+	QCOMPARE(out[0], 1.5f);
+}
+
+void TestPositionCodec::zigzag() {
+	for (int v=-70000;v<=70000;v+=7)
+		QCOMPARE(PositionDecoder::unzigzag(PositionEncoder::zigzag(v)), v);
+	QCOMPARE(PositionEncoder::zigzag(0), 0U);
+	QCOMPARE(PositionEncoder::zigzag(-1), 1U);
+	QCOMPARE(PositionEncoder::zigzag(1), 2U);
+}
+
+QTEST_MAIN(TestPositionCodec)
+#include "TestPositionCodec.moc"
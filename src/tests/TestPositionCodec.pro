@@ -0,0 +1,7 @@
+TEMPLATE = app
+CONFIG += qt thread warn_on qtestlib
+CONFIG -= app_bundle
+LANGUAGE = C++
+TARGET = TestPositionCodec
+SOURCES = TestPositionCodec.cpp
+INCLUDEPATH += .. ../murmur ../mumble
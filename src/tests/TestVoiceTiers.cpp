@@ -0,0 +1,100 @@
+/**
+ * Tracking of the Opus quality tiers a speaker is sending.
+ */
+
+#include <QtCore>
+#include <QtTest>
+
+#include "ServerUser.h"
+
+class Meta;
+
+// Referenced from ServerUser.cpp, unused here.
+Meta *meta = NULL;
+
+class TestVoiceTiers : public QObject {
+		Q_OBJECT
+	private slots:
+		void none();
+		void sameFrame();
+		void stopped();
+		void firstFrame();
+		void reordered();
+		void restart();
+};
+
+void TestVoiceTiers::none() {
+	VoiceTiers vt;
+	QCOMPARE(vt.mask(), 1U);
+	vt.full(100);
+	QCOMPARE(vt.mask(), 1U);
+}
+
+void TestVoiceTiers::sameFrame() {
+	VoiceTiers vt;
+	for (unsigned int seq = 100; seq < 200; seq += 2) {
+		vt.full(seq);
+		vt.offer(1, seq);
+		vt.offer(2, seq);
+		QCOMPARE(vt.mask(), 7U);
+	}
+}
+
+void TestVoiceTiers::stopped() {
+	VoiceTiers vt;
+	unsigned int seq;
+	for (seq = 100; seq < 120; seq += 2) {
+		vt.full(seq);
+		vt.offer(1, seq);
+		vt.offer(2, seq);
+	}
+
+	// Tier 2 stops, tier 1 goes on.
+	for (; seq < 120 + VOICE_TIER_WINDOW; seq += 2) {
+		vt.full(seq);
+		vt.offer(1, seq);
+		QCOMPARE(vt.mask(), 7U);
+	}
+	vt.full(seq);
+	vt.offer(1, seq);
+	QCOMPARE(vt.mask(), 3U);
+
+	// Back to the full stream only.
+	vt.full(seq + VOICE_TIER_WINDOW + 2);
+	QCOMPARE(vt.mask(), 1U);
+}
+
+void TestVoiceTiers::firstFrame() {
+	VoiceTiers vt;
+	vt.full(100);
+	// Tier listeners got frame 100 from the full stream.
+	QVERIFY(! vt.offer(1, 100));
+	QVERIFY(vt.offered(1));
+	vt.full(102);
+	QVERIFY(vt.offer(1, 102));
+}
+
+void TestVoiceTiers::reordered() {
+	VoiceTiers vt;
+	vt.full(100);
+	// The tier packet of the next frame overtakes its full quality packet,
+	// whose tier listeners will then skip it.
+	QVERIFY(vt.offer(1, 102));
+	QVERIFY(vt.offered(1));
+	vt.full(102);
+	QVERIFY(vt.offered(1));
+}
+
+void TestVoiceTiers::restart() {
+	VoiceTiers vt;
+	vt.full(50000);
+	vt.offer(1, 50000);
+	QVERIFY(vt.offered(1));
+
+	// The speaker's sequence starts over, without tiers.
+	vt.full(0);
+	QCOMPARE(vt.mask(), 1U);
+}
+
+QTEST_MAIN(TestVoiceTiers)
+#include "TestVoiceTiers.moc"
@@ -0,0 +1,13 @@
+include(../mumble.pri)
+
+TEMPLATE = app
+CONFIG *= qt thread warn_on network qtestlib
+CONFIG -= app_bundle
+QT *= network sql xml
+LANGUAGE = C++
+TARGET = TestVoiceTiers
+DEFINES *= MURMUR
+HEADERS *= ServerUser.h Metrics.h ACLCache.h
+SOURCES *= TestVoiceTiers.cpp ServerUser.cpp Metrics.cpp ACLCache.cpp
+VPATH *= .. ../murmur
+INCLUDEPATH *= .. ../murmur ../mumble
@@ -0,0 +1,116 @@
+/**
+ * Benchmark of keeping a server browser sized QTreeWidget sorted by ping:
+ * QTreeWidget's own sorting versus incremental repositioning with TreeSort.
+ * 20000 servers are spread over 100 countries, then every server gets a new
+ * ping and the list is filtered down to the reachable half and back.
+ */
+
+#include <QtCore>
+#if QT_VERSION >= 0x050000
+# include <QtWidgets>
+#else
+# include <QtGui>
+#endif
+
+#include "Timer.h"
+#include "TreeSort.h"
+
+#define NSERVERS 20000
+#define NCOUNTRIES 100
+
+class BenchItem : public QTreeWidgetItem {
+	public:
+		quint32 uiPing;
+
+		BenchItem(const QString &name, quint32 ping) : QTreeWidgetItem(QTreeWidgetItem::UserType), uiPing(ping) {
+			setText(0, name);
+			setText(1, QString::number(ping));
+		}
+
+		bool operator <(const QTreeWidgetItem &o) const {
+			return uiPing < static_cast<const BenchItem &>(o).uiPing;
+		}
+};
+
+static void fill(QTreeWidget *w, QList<BenchItem *> &items, QList<QTreeWidgetItem *> &countries, bool incremental) {
+	qsrand(1);
+	for (int i=0;i<NCOUNTRIES;i++) {
+		QTreeWidgetItem *c = new BenchItem(QString::fromLatin1("Country %1").arg(i), 0);
+		w->addTopLevelItem(c);
+		c->setExpanded(true);
+		countries << c;
+	}
+	for (int i=0;i<NSERVERS;i++) {
+		BenchItem *bi = new BenchItem(QString::fromLatin1("Server %1").arg(i), qrand() % 500);
+		QTreeWidgetItem *c = countries.at(i % NCOUNTRIES);
+		if (incremental)
+			c->insertChild(TreeSort::insertIndex(c, bi, Qt::AscendingOrder), bi);
+		else
+			c->addChild(bi);
+		items << bi;
+	}
+	QCoreApplication::processEvents();
+}
+
+static void update(QList<BenchItem *> &items, bool incremental) {
+	foreach(BenchItem *bi, items) {
+		bi->uiPing = qrand() % 500;
+		bi->setText(1, QString::number(bi->uiPing));
+		if (incremental)
+			TreeSort::reposition(bi, Qt::AscendingOrder);
+	}
+	QCoreApplication::processEvents();
+}
+
+static void filter(QList<BenchItem *> &items, QList<QTreeWidgetItem *> &countries, bool incremental) {
+	for (int i=0;i<items.count();i+=2) {
+		BenchItem *bi = items.at(i);
+		bi->parent()->removeChild(bi);
+	}
+	QCoreApplication::processEvents();
+	for (int i=0;i<items.count();i+=2) {
+		BenchItem *bi = items.at(i);
+		QTreeWidgetItem *c = countries.at(i % NCOUNTRIES);
+		if (incremental)
+			c->insertChild(TreeSort::insertIndex(c, bi, Qt::AscendingOrder), bi);
+		else
+			c->addChild(bi);
+	}
+	QCoreApplication::processEvents();
+}
+
+static bool sorted(const QList<QTreeWidgetItem *> &countries) {
+	foreach(QTreeWidgetItem *c, countries)
+		for (int i=1;i<c->childCount();i++)
+			if (*c->child(i) < *c->child(i-1))
+				return false;
+	return true;
+}
+
+int main(int argc, char **argv) {
+	QApplication a(argc, argv);
+	Timer t;
+
+	for (int pass=0;pass<2;pass++) {
+		const bool incremental = (pass == 1);
+		QTreeWidget w;
+		QList<BenchItem *> items;
+		QList<QTreeWidgetItem *> countries;
+
+		w.setColumnCount(2);
+		w.sortItems(1, Qt::AscendingOrder);
+		w.setSortingEnabled(! incremental);
+
+		t.restart();
+		fill(&w, items, countries, incremental);
+		quint64 usfill = t.restart();
+		update(items, incremental);
+		quint64 usupdate = t.restart();
+		filter(items, countries, incremental);
+		quint64 usfilter = t.restart();
+
+		qWarning("%s: %lldus fill, %lldus update, %lldus filter, %s", incremental ? "TreeSort" : "QTreeWidget", usfill, usupdate, usfilter, sorted(countries) ? "sorted" : "NOT SORTED");
+	}
+
+	return 0;
+}
@@ -0,0 +1,13 @@
+TEMPLATE = app
+CONFIG += qt thread warn_on release
+CONFIG -= app_bundle
+QT += gui
+greaterThan(QT_MAJOR_VERSION, 4) {
+	QT += widgets
+}
+LANGUAGE = C++
+TARGET = TreeSort
+SOURCES = TreeSort.cpp Timer.cpp
+HEADERS = Timer.h ../mumble/TreeSort.h
+VPATH += ..
+INCLUDEPATH += .. ../murmur ../mumble